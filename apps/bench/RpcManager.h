@@ -118,5 +118,6 @@ static inline int StringToAddr(const char *str, netaddr *addr) {
 
   addr->ip = MAKE_IP_ADDR(a, b, c, d);
   addr->port = p;
+  addr->family = NETADDR_IPV4;
   return 0;
 }
@@ -0,0 +1,186 @@
+// conn_churn.cc - measures TCP connection setup rate with many open connections
+//
+// The client first opens [hold] long-lived connections, then [threads] workers
+// repeatedly connect and abort connections for [seconds]. This stresses the
+// transport demux table and ephemeral port selection rather than data
+// transfer. "local" runs the server inside the client's runtime over loopback,
+// in which case every connection occupies two table entries.
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "runtime.h"
+#include "thread.h"
+#include "sync.h"
+#include "net.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+using sec = std::chrono::duration<double>;
+
+// The port that accepts and immediately closes churn connections.
+constexpr uint16_t kChurnPort = 8100;
+// The first of the ports that keep held connections open.
+constexpr uint16_t kHoldPortBase = 8101;
+// Held connections per port (the ephemeral range is 16384 ports).
+constexpr int kHoldsPerPort = 15000;
+
+netaddr raddr;
+int nports;
+int threads;
+int hold;
+int seconds;
+
+rt::TcpQueue *Listen(uint16_t port) {
+  rt::TcpQueue *q = rt::TcpQueue::Listen({0, port}, 4096);
+  if (q == nullptr) panic("couldn't listen on port %d", port);
+  return q;
+}
+
+void AcceptLoop(rt::TcpQueue *q, bool keep) {
+  std::vector<rt::TcpConn *> conns;
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept a connection");
+    if (keep)
+      conns.push_back(c);
+    else
+      delete c;
+  }
+}
+
+void StartListeners() {
+  rt::TcpQueue *q = Listen(kChurnPort);
+  rt::Spawn([q] { AcceptLoop(q, false); });
+  for (int i = 0; i < nports; ++i) {
+    q = Listen(kHoldPortBase + i);
+    rt::Spawn([q] { AcceptLoop(q, true); });
+  }
+}
+
+void ServerHandler(void *arg) {
+  StartListeners();
+  rt::WaitGroup wg(1);
+  wg.Wait();
+}
+
+void ClientHandler(void *arg) {
+  if (raddr.ip == 0 && !netaddr_is_ipv6(&raddr)) {
+    // dial our own address
+    std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Listen({0, 0}));
+    if (c == nullptr) panic("couldn't find the local address");
+    raddr.ip = c->LocalAddr().ip;
+    StartListeners();
+  }
+
+  // Phase 1: open the long-lived connections.
+  std::vector<std::unique_ptr<rt::TcpConn>> held;
+  held.reserve(hold);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < hold; ++i) {
+    netaddr addr = raddr;
+    addr.port = kHoldPortBase + i % nports;
+    rt::TcpConn *c = rt::TcpConn::Dial({0, 0}, addr);
+    if (c == nullptr) panic("couldn't open held connection %d", i);
+    held.emplace_back(c);
+  }
+  auto finish = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration_cast<sec>(finish - start).count();
+  std::cout << "opened " << hold << " connections in " << elapsed
+            << " s (" << hold / elapsed << " conns/s)" << std::endl;
+
+  // Phase 2: connect and abort in a loop with everything held open.
+  std::vector<rt::Thread> th;
+  std::vector<uint64_t> connects(threads), failures(threads);
+  netaddr churn_addr = raddr;
+  churn_addr.port = kChurnPort;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < threads; ++i) {
+    th.emplace_back(rt::Thread([&, i] {
+      while (std::chrono::steady_clock::now() < deadline) {
+        std::unique_ptr<rt::TcpConn> c(rt::TcpConn::Dial({0, 0}, churn_addr));
+        if (c == nullptr) {
+          failures[i]++;
+          continue;
+        }
+        c->Abort();
+        connects[i]++;
+      }
+    }));
+  }
+  for (auto &t : th) t.Join();
+  finish = std::chrono::steady_clock::now();
+  elapsed = std::chrono::duration_cast<sec>(finish - start).count();
+
+  uint64_t total = 0, failed = 0;
+  for (int i = 0; i < threads; ++i) {
+    total += connects[i];
+    failed += failures[i];
+  }
+  std::cout << "held " << hold << " threads " << threads << " connects "
+            << total << " failed " << failed << " rate "
+            << total / elapsed << " conns/s" << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    std::cerr << "usage: [cfg_file] [cmd] ..." << std::endl;
+    return -EINVAL;
+  }
+
+  std::string cmd = argv[2];
+  if (cmd.compare("server") == 0) {
+    if (argc != 4) {
+      std::cerr << "usage: [cfg_file] server [#hold_ports] (at least "
+                   "#hold / " << kHoldsPerPort << " + 1)" << std::endl;
+      return -EINVAL;
+    }
+    nports = std::stoi(argv[3], nullptr, 0);
+    ret = runtime_init(argv[1], ServerHandler, NULL);
+    if (ret) {
+      printf("failed to start runtime\n");
+      return ret;
+    }
+    return 0;
+  } else if (cmd.compare("client") != 0) {
+    std::cerr << "invalid command: " << cmd << std::endl;
+    return -EINVAL;
+  }
+
+  if (argc != 7) {
+    std::cerr << "usage: [cfg_file] client [remote_ip|local] [#threads] "
+                 "[#hold] [seconds]" << std::endl;
+    return -EINVAL;
+  }
+
+  std::string ip = argv[3];
+  if (ip.compare("local") != 0 && str_to_netaddr(argv[3], &raddr)) {
+    std::cerr << "invalid address: " << ip << std::endl;
+    return -EINVAL;
+  }
+  threads = std::stoi(argv[4], nullptr, 0);
+  hold = std::stoi(argv[5], nullptr, 0);
+  seconds = std::stoi(argv[6], nullptr, 0);
+  nports = hold / kHoldsPerPort + 1;
+
+  ret = runtime_init(argv[1], ClientHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
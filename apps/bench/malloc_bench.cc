@@ -0,0 +1,92 @@
+// malloc_bench: an allocation-heavy pthread benchmark.
+//
+// Each thread repeatedly allocates request-sized objects, keeps a window of
+// them alive, and frees them in a random order. A fraction of objects are
+// handed off through a shared exchange array so they are freed by a different
+// thread, as happens when requests are passed between workers.
+//
+// Built twice: malloc_bench runs under the shim with allocations routed to
+// smalloc (it links libshim_smalloc.a), malloc_bench_linux runs on plain
+// pthreads and glibc malloc.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int kWindow = 256;
+constexpr int kExchangeSlots = 4096;
+constexpr int kHandoffPct = 10;
+
+std::atomic<void *> exchange[kExchangeSlots];
+
+// Mimics a mix of small metadata objects, request headers and value buffers.
+size_t PickSize(std::mt19937 &rg) {
+  int r = rg() % 100;
+  if (r < 60) return 16 + rg() % 112;
+  if (r < 90) return 128 + rg() % 896;
+  if (r < 99) return 1024 + rg() % 7168;
+  return 8192 + rg() % 57344;
+}
+
+void Worker(int id, long iters) {
+  std::mt19937 rg(id);
+  std::vector<void *> live(kWindow, nullptr);
+
+  for (long i = 0; i < iters; i++) {
+    int idx = rg() % kWindow;
+    void *old = live[idx];
+
+    if (old && static_cast<int>(rg() % 100) < kHandoffPct)
+      old = exchange[rg() % kExchangeSlots].exchange(old);
+    free(old);
+
+    size_t size = PickSize(rg);
+    char *p = static_cast<char *>(malloc(size));
+    if (!p) {
+      std::cerr << "out of memory" << std::endl;
+      exit(1);
+    }
+    // touch the first and last bytes, as a real request would
+    p[0] = static_cast<char>(i);
+    p[size - 1] = static_cast<char>(i);
+    live[idx] = p;
+  }
+
+  for (void *p : live) free(p);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: [config (shim only)] <threads> <iterations>"
+              << std::endl;
+    return -EINVAL;
+  }
+
+  int threads = std::atoi(argv[1]);
+  long iters = std::atol(argv[2]);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> ths;
+  for (int i = 0; i < threads; i++) ths.emplace_back(Worker, i, iters);
+  for (auto &t : ths) t.join();
+  auto finish = std::chrono::steady_clock::now();
+
+  for (auto &slot : exchange) free(slot.exchange(nullptr));
+
+  double secs = std::chrono::duration<double>(finish - start).count();
+  double ops = static_cast<double>(threads) * iters;
+  std::cout << "threads: " << threads << " ops: " << ops
+            << " time(s): " << secs << " Mops/s: " << ops / secs / 1e6
+            << " ns/op: " << secs * 1e9 * threads / ops << std::endl;
+  return 0;
+}
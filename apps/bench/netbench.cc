@@ -11,32 +11,23 @@ extern "C" {
 #include "timer.h"
 #include "net.h"
 #include "fake_worker.h"
+#include "loadgen.h"
 #include "proto.h"
 
 #include <iostream>
 #include <iomanip>
 #include <utility>
 #include <memory>
-#include <chrono>
 #include <vector>
-#include <algorithm>
-#include <numeric>
 #include <random>
 
 namespace {
 
-using sec = std::chrono::duration<double, std::micro>;
-
-// The number of samples to discard from the start and end.
-constexpr uint64_t kDiscardSamples = 1000;
-// The maximum lateness to tolerate before dropping egress samples.
-constexpr uint64_t kMaxCatchUpUS = 10;
-
 // the number of worker threads to spawn.
 int threads;
 // the remote UDP address of the server.
 netaddr raddr;
-// the number of samples to gather.
+// the number of samples to gather per thread.
 uint64_t n;
 // the mean service time in us.
 double st;
@@ -78,35 +69,13 @@ void ServerHandler(void *arg) {
   }
 }
 
-std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
-                                  double service_time, rt::WaitGroup *starter)
+void ClientWorker(rt::TcpConn *c, loadgen::Worker *w, double service_time)
 {
   constexpr int kBatchSize = 32;
 
   // Seed the random generator.
   std::mt19937 g(microtime());
-
-  // Create a packet transmit schedule.
-  std::vector<double> sched;
-  std::exponential_distribution<double> rd(1.0 / (1000000.0 / req_rate));
-  std::vector<double> tmp(n);
-  std::generate(tmp.begin(), tmp.end(), std::bind(rd, g));
-  sched.push_back(tmp[0]);
-  for (std::vector<double>::size_type j = 1; j < tmp.size(); ++j) {
-    tmp[j] += tmp[j - 1];
-    sched.push_back(static_cast<uint64_t>(tmp[j]));
-  }
-
-  // Create a fake work schedule.
-  std::vector<double> work(n);
   std::exponential_distribution<double> wd(1.0 / service_time);
-  std::generate(work.begin(), work.end(), std::bind(wd, g));
-
-  // Reserve space to record results.
-  auto n = sched.size();
-  std::vector<double> timings;
-  timings.reserve(n);
-  std::vector<uint64_t> start_us(n);
 
   // Start the receiver thread.
   auto th = rt::Thread([&]{
@@ -119,66 +88,34 @@ std::vector<double> PoissonWorker(rt::TcpConn *c, double req_rate,
        panic("read failed, ret = %ld", ret);
      }
 
-     barrier();
-     uint64_t ts = microtime();
-     barrier();
-     timings.push_back(ts - start_us[rp.idx]);
+     w->Complete(rp.idx);
     }
   });
 
-  // Initialize timing measurement data structures.
   payload p[kBatchSize];
   int j = 0;
-
-  // Synchronized start of load generation.
-  starter->Done();
-  starter->Wait();
-
-  barrier();
-  uint64_t expstart = microtime();
-  barrier();
-
-  for (unsigned int i = 0; i < n; ++i) {
-    barrier();
-    uint64_t now = microtime();
-    barrier();
-    if (now - expstart < sched[i]) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-
-      rt::Sleep(sched[i] - (microtime() - expstart));
-      now = microtime();
-    }
-    if (now - expstart - sched[i] > kMaxCatchUpUS)
-      continue;
-
-    barrier();
-    start_us[i] = microtime();
-    barrier();
-
+  auto flush = [&]{
+    if (j == 0) return;
+    ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
+    if (ret != static_cast<ssize_t>(sizeof(payload) * j))
+      panic("write failed, ret = %ld", ret);
+    j = 0;
+  };
+
+  loadgen::Request req;
+  while (w->Next(&req, flush)) {
     // Enqueue a network request.
-    p[j].idx = i;
-    p[j].workn = work[i];
+    p[j].idx = req.id;
+    p[j].workn = wd(g);
     p[j].tag = 0;
-    j++;
-
-    if (j >= kBatchSize || i == n - 1) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-    }
+    if (++j >= kBatchSize) flush();
   }
 
   c->Shutdown(SHUT_RD);
   th.Join();
-
-  return timings;
 }
 
-std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
+void DoExperiment(double req_rate) {
   // Create one TCP connection per thread.
   std::vector<std::unique_ptr<rt::TcpConn>> conns;
   for (int i = 0; i < threads; ++i) {
@@ -187,92 +124,35 @@ std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
     conns.emplace_back(std::move(outc));
   }
 
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<double>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i]{
-      auto v = PoissonWorker(conns[i].get(), req_rate / threads, st,
-                             &starter);
-      samples[i].reset(new std::vector<double>(std::move(v)));
-    }));
-  }
-
-  // Give the workers time to initialize, then start recording.
-  starter.Done();
-  starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
-  auto start = std::chrono::steady_clock::now();
-  barrier();
+  // Measure long enough for each thread to gather n samples.
+  loadgen::Options opts;
+  opts.rps = req_rate;
+  opts.workers = threads;
+  opts.duration_us = n * 1e6 * threads / req_rate;
 
-  // Wait for the workers to finish.
-  for (auto& t: th)
-    t.Join();
-
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = std::chrono::steady_clock::now();
-  barrier();
+  loadgen::Experiment e(opts);
+  loadgen::Result r = e.Run([&](loadgen::Worker *w) {
+    ClientWorker(conns[w->index()].get(), w, st);
+  });
 
   // Close the connections.
   for (auto& c: conns)
     c->Abort();
 
-  // Aggregate all the latency timings together.
-  uint64_t total = 0;
-  std::vector<double> timings;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    total += v.size();
-    if (v.size() <= kDiscardSamples * 2) panic("not enough samples");
-    v.erase(v.begin(), v.begin() + kDiscardSamples);
-    v.erase(v.end() - kDiscardSamples, v.end());
-    timings.insert(timings.end(), v.begin(), v.end());
-  }
-
-  // Report results.
-  double elapsed = std::chrono::duration_cast<sec>(finish - start).count();
-  *reqs_per_sec = static_cast<double>(total) / elapsed * 1000000;
-  return timings;
-}
-
-void DoExperiment(double req_rate) {
-  constexpr int kRounds = 1;
-  std::vector<double> timings;
-  double reqs_per_sec = 0;
-  for (int i = 0; i < kRounds; i++) {
-    double tmp;
-    auto t = RunExperiment(req_rate, &tmp);
-    timings.insert(timings.end(), t.begin(), t.end());
-    reqs_per_sec += tmp;
-    rt::Sleep(500 * rt::kMilliseconds);
-  }
-  reqs_per_sec /= kRounds;
-
-  std::sort(timings.begin(), timings.end());
-  double sum = std::accumulate(timings.begin(), timings.end(), 0.0);
-  double mean = sum / timings.size();
-  double count = static_cast<double>(timings.size());
-  double p9 = timings[count * 0.9];
-  double p99 = timings[count * 0.99];
-  double p999 = timings[count * 0.999];
-  double p9999 = timings[count * 0.9999];
-  double min = timings[0];
-  double max = timings[timings.size() - 1];
+  const loadgen::Histogram &h = r.response;
   std::cout << std::setprecision(2) << std::fixed
             << "t: "       << threads
-            << " rps: "    << reqs_per_sec
-            << " n: "      << timings.size()
-            << " min: "    << min
-            << " mean: "   << mean
-            << " 90%: "    << p9
-            << " 99%: "    << p99
-            << " 99.9%: "  << p999
-            << " 99.99%: " << p9999
-            << " max: "    << max << std::endl;
+            << " rps: "    << r.achieved_rps
+            << " n: "      << r.completed
+            << " min: "    << h.Min() / 1000.0
+            << " mean: "   << h.Mean() / 1000.0
+            << " 90%: "    << h.Percentile(90) / 1000.0
+            << " 99%: "    << h.Percentile(99) / 1000.0
+            << " 99.9%: "  << h.Percentile(99.9) / 1000.0
+            << " 99.99%: " << h.Percentile(99.99) / 1000.0
+            << " max: "    << h.Max() / 1000.0 << std::endl;
+  r.Report("netbench");
+  rt::Sleep(500 * rt::kMilliseconds);
 }
 
 void ClientHandler(void *arg) {
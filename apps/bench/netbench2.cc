@@ -7,18 +7,16 @@ extern "C" {
 #undef max
 
 #include "fake_worker.h"
+#include "loadgen.h"
 #include "net.h"
 #include "sync.h"
 #include "runtime.h"
 #include "thread.h"
 #include "timer.h"
 
-#include <algorithm>
-#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <memory>
-#include <numeric>
 #include <random>
 #include <utility>
 #include <vector>
@@ -28,9 +26,6 @@ extern "C" {
 
 namespace {
 
-using namespace std::chrono;
-using sec = duration<double, std::micro>;
-
 // <- ARGUMENTS FOR EXPERIMENT ->
 // the number of worker threads to spawn.
 int threads;
@@ -40,8 +35,6 @@ netaddr raddr;
 double st;
 // number of iterations required for 1us on target server
 constexpr uint64_t kIterationsPerUS = 65; //83
-// Number of seconds to warmup at rate 0
-constexpr uint64_t kWarmupUpSeconds = 5;
 
 static std::vector<std::pair<double, uint64_t>> rates;
 
@@ -117,6 +110,57 @@ uptime ReadUptime() {
   return uptime{ntoh64(u.idle), ntoh64(u.busy)};
 }
 
+std::vector<std::string> split(const std::string &text, char sep) {
+  std::vector<std::string> tokens;
+  std::string::size_type start = 0, end = 0;
+  while ((end = text.find(sep, start)) != std::string::npos) {
+    tokens.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  tokens.push_back(text.substr(start));
+  return tokens;
+}
+
+// The port of the stat server built into every runtime.
+constexpr uint16_t kStatPort = 40;
+
+// Reads a counter from the stat server of the runtime at @addr.
+uint64_t ReadStat(netaddr addr, const std::string &name) {
+  addr.port = kStatPort;
+  std::unique_ptr<rt::TcpConn> c(rt::TcpConn::Dial({0, 0}, addr));
+  if (c == nullptr) panic("couldn't connect to the stat server");
+  const char cmd[] = "stat";
+  ssize_t ret = c->WriteFull(cmd, sizeof(cmd) - 1);
+  if (ret != static_cast<ssize_t>(sizeof(cmd) - 1))
+    panic("stat request failed, ret = %ld", ret);
+  size_t len;
+  ret = c->ReadFull(&len, sizeof(len));
+  if (ret != static_cast<ssize_t>(sizeof(len)))
+    panic("stat response failed, ret = %ld", ret);
+  std::string buf(len, '\0');
+  ret = c->ReadFull(&buf[0], len);
+  if (ret != static_cast<ssize_t>(len))
+    panic("stat response failed, ret = %ld", ret);
+
+  for (const std::string &kv : split(buf, ',')) {
+    auto pos = kv.find(':');
+    if (pos != std::string::npos && kv.compare(0, pos, name) == 0)
+      return std::stoull(kv.substr(pos + 1));
+  }
+  return 0;
+}
+
+// Pure ACK packets sent by the client and the server.
+struct ack_counts {
+  uint64_t client;
+  uint64_t server;
+};
+
+ack_counts ReadAcks(netaddr laddr) {
+  return ack_counts{ReadStat(laddr, "tx_tcp_acks"),
+                    ReadStat(raddr, "tx_tcp_acks")};
+}
+
 constexpr uint64_t kNetbenchPort = 8001;
 struct payload {
   uint64_t work_iterations;
@@ -125,9 +169,6 @@ struct payload {
   uint32_t cpu;
 };
 
-// The maximum lateness to tolerate before dropping egress samples.
-constexpr uint64_t kMaxCatchUpUS = 5;
-
 void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
   payload p;
   std::unique_ptr<FakeWorker> w(FakeWorkerFactory("stridedmem:3200:64"));
@@ -172,30 +213,12 @@ void ServerHandler(void *arg) {
   }
 }
 
-struct work_unit {
-  double start_us, work_us, duration_us;
-  uint64_t tsc;
-  uint32_t cpu;
-};
-
-template <class Arrival, class Service>
-std::vector<work_unit> GenerateWork(Arrival a, Service s, double cur_us,
-                                    double last_us) {
-  std::vector<work_unit> w;
-  while (cur_us < last_us) {
-    cur_us += a();
-    w.emplace_back(work_unit{cur_us, s(), 0});
-  }
-  return w;
-}
-
-std::vector<work_unit> ClientWorker(
-    rt::TcpConn *c, rt::WaitGroup *starter,
-    std::function<std::vector<work_unit>()> wf) {
+// Sends requests on @c as they come due, while a receiver thread records
+// the replies.
+void ClientWorker(rt::TcpConn *c, loadgen::Worker *w, double service_time) {
   constexpr int kBatchSize = 32;
-  std::vector<work_unit> w(wf());
-  std::vector<time_point<steady_clock>> timings;
-  timings.reserve(w.size());
+  std::mt19937 dg(rand());
+  std::exponential_distribution<double> wd(1.0 / service_time);
 
   // Start the receiver thread.
   auto th = rt::Thread([&] {
@@ -207,72 +230,60 @@ std::vector<work_unit> ClientWorker(
         if (ret == 0 || ret < 0) break;
         panic("read failed, ret = %ld", ret);
       }
-
-      barrier();
-      auto ts = steady_clock::now();
-      barrier();
-      uint64_t idx = ntoh64(rp.index);
-      w[idx].duration_us = duration_cast<sec>(ts - timings[idx]).count();
-      w[idx].tsc = ntoh64(rp.tsc_end);
-      w[idx].cpu = ntoh32(rp.cpu);
+      w->Complete(ntoh64(rp.index));
     }
   });
 
-  // Synchronized start of load generation.
-  starter->Done();
-  starter->Wait();
-
-  barrier();
-  auto expstart = steady_clock::now();
-  barrier();
-
   payload p[kBatchSize];
   int j = 0;
-  auto wsize = w.size();
-
-  for (unsigned int i = 0; i < wsize; ++i) {
-    barrier();
-    auto now = steady_clock::now();
-    barrier();
-    if (duration_cast<sec>(now - expstart).count() < w[i].start_us) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-      now = steady_clock::now();
-      rt::Sleep(w[i].start_us - duration_cast<sec>(now - expstart).count());
-    }
-    if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-        kMaxCatchUpUS)
-      continue;
-
-    barrier();
-    timings[i] = steady_clock::now();
-    barrier();
-
+  auto flush = [&] {
+    if (j == 0) return;
+    ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
+    if (ret != static_cast<ssize_t>(sizeof(payload) * j))
+      panic("write failed, ret = %ld", ret);
+    j = 0;
+  };
+
+  loadgen::Request req;
+  while (w->Next(&req, flush)) {
     // Enqueue a network request.
-    p[j].work_iterations = hton64(w[i].work_us * kIterationsPerUS);
-    p[j].index = hton64(i);
-    j++;
-
-    if (j >= kBatchSize || i == wsize - 1) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-    }
+    p[j].work_iterations = hton64(wd(dg) * kIterationsPerUS);
+    p[j].index = hton64(req.id);
+    if (++j >= kBatchSize) flush();
   }
 
-  //rt::Sleep(1 * rt::kSeconds);
   c->Shutdown(SHUT_RDWR);
   th.Join();
+}
 
-  return w;
+void PrintStatResults(const loadgen::Result &r, double cpu_usage,
+                      ack_counts acks) {
+  const loadgen::Histogram &h = r.response;
+  double count = static_cast<double>(r.completed);
+  std::cout //<< "#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max,client_acks_per_req,server_acks_per_req"
+            //<< std::endl
+            << std::setprecision(4) << std::fixed
+            << threads << ","
+            << r.offered_rps << ","
+            << r.achieved_rps << ","
+            << cpu_usage << ","
+            << r.completed << ","
+            << h.Min() / 1000.0 << ","
+            << h.Mean() / 1000.0 << ","
+            << h.Percentile(90) / 1000.0 << ","
+            << h.Percentile(99) / 1000.0 << ","
+            << h.Percentile(99.9) / 1000.0 << ","
+            << h.Percentile(99.99) / 1000.0 << ","
+            << h.Max() / 1000.0 << ","
+            << acks.client / count << ","
+            << acks.server / count << std::endl;
+  r.Report("netbench2", {{"cpu_usage", cpu_usage},
+                         {"client_acks_per_req", acks.client / count},
+                         {"server_acks_per_req", acks.server / count}});
 }
 
-std::vector<work_unit> RunExperiment(
-    int threads, double *reqs_per_sec, double *cpu_usage,
-    std::function<std::vector<work_unit>()> wf) {
+void SteadyStateExperiment(int threads, double offered_rps,
+                           double service_time, uint64_t duration_us) {
   // Create one TCP connection per thread.
   std::vector<std::unique_ptr<rt::TcpConn>> conns;
   for (int i = 0; i < threads; ++i) {
@@ -280,153 +291,49 @@ std::vector<work_unit> RunExperiment(
     if (unlikely(outc == nullptr)) panic("couldn't connect to raddr.");
     conns.emplace_back(std::move(outc));
   }
-
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<work_unit>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i] {
-      auto v = ClientWorker(conns[i].get(), &starter, wf);
-      samples[i].reset(new std::vector<work_unit>(std::move(v)));
-    }));
-  }
-
-  // Give the workers time to initialize, then start recording.
-  starter.Done();
-  starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
-  auto start = steady_clock::now();
-  barrier();
-  uptime u1 = ReadUptime();
-
-  // Wait for the workers to finish.
-  for (auto &t : th) t.Join();
-
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = steady_clock::now();
-  barrier();
-  uptime u2 = ReadUptime();
+  netaddr laddr = conns[0]->LocalAddr();
+
+  // Sample the server's CPU usage and the ACK counters while measuring.
+  uptime u1, u2;
+  ack_counts a1, a2;
+  loadgen::Options opts;
+  opts.rps = offered_rps;
+  opts.workers = threads;
+  opts.duration_us = duration_us;
+  opts.on_start = [&] {
+    u1 = ReadUptime();
+    a1 = ReadAcks(laddr);
+  };
+  opts.on_finish = [&] {
+    u2 = ReadUptime();
+    a2 = ReadAcks(laddr);
+  };
+
+  loadgen::Experiment e(opts);
+  loadgen::Result r = e.Run([&](loadgen::Worker *w) {
+    ClientWorker(conns[w->index()].get(), w, service_time);
+  });
 
   // Close the connections.
   for (auto &c : conns) c->Abort();
 
-  // Aggregate all the samples together.
-  std::vector<work_unit> w;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    w.insert(w.end(), v.begin(), v.end());
-  }
-
-  // Remove requests that did not complete.
-  w.erase(std::remove_if(w.begin(), w.end(),
-                         [](const work_unit &s) { return s.duration_us == 0; }),
-          w.end());
-
   // Report results.
-  double elapsed = duration_cast<sec>(finish - start).count();
-  if (reqs_per_sec != nullptr)
-    *reqs_per_sec = static_cast<double>(w.size()) / elapsed * 1000000;
   uint64_t idle = u2.idle - u1.idle;
   uint64_t busy = u2.busy - u1.busy;
-  if (cpu_usage != nullptr)
-    *cpu_usage = static_cast<double>(busy) /
-                 static_cast<double>(idle + busy);
-  return w;
-}
-
-void PrintRawResults(std::vector<work_unit> w) {
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.tsc < s2.tsc;
-  });
-  for (const work_unit& u : w) {
-    std::cout << std::setprecision(2) << std::fixed
-              << u.start_us << "," << u.duration_us << "," << u.work_us << ","
-              << u.tsc << "," << u.cpu << std::endl;
-  }
-}
-
-void PrintStatResults(std::vector<work_unit> w,
-                      double offered_rps, double rps, double cpu_usage) {
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.duration_us < s2.duration_us;
-  });
-  double sum = std::accumulate(
-      w.begin(), w.end(), 0.0,
-      [](double s, const work_unit &c) { return s + c.duration_us; });
-  double mean = sum / w.size();
-  double count = static_cast<double>(w.size());
-  double p90 = w[count * 0.9].duration_us;
-  double p99 = w[count * 0.99].duration_us;
-  double p999 = w[count * 0.999].duration_us;
-  double p9999 = w[count * 0.9999].duration_us;
-  double min = w[0].duration_us;
-  double max = w[w.size() - 1].duration_us;
-  std::cout //<< "#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max"
-            //<< std::endl
-            << std::setprecision(4) << std::fixed
-            << threads << ","
-            << offered_rps << ","
-            << rps << ","
-            << cpu_usage << ","
-            << w.size() << ","
-            << min << ","
-            << mean << ","
-            << p90 << ","
-            << p99 << ","
-            << p999 << ","
-            << p9999 << ","
-            << max << std::endl;
-}
-
-void SteadyStateExperiment(int threads, double offered_rps,
-                           double service_time) {
-  double rps, cpu_usage;
-  std::vector<work_unit> w = RunExperiment(threads, &rps, &cpu_usage, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 dg(rand());
-    std::exponential_distribution<double> rd(
-        1.0 / (1000000.0 / (offered_rps / static_cast<double>(threads))));
-    std::exponential_distribution<double> wd(1.0 / service_time);
-    return GenerateWork(std::bind(rd, rg), std::bind(wd, dg), 0, 2000000);
-  });
-
-  // Print the results.
-  PrintStatResults(w, offered_rps, rps, cpu_usage);
-}
-
-void LoadShiftExperiment(int threads,
-                         const std::vector<std::pair<double, uint64_t>> &rates,
-                         double service_time) {
-  auto w = RunExperiment(threads, nullptr, nullptr, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 wg(rand());
-    std::exponential_distribution<double> wd(1.0 / service_time);
-    std::vector<work_unit> w1;
-    uint64_t last_us = 0;
-    for (auto &r : rates) {
-      std::exponential_distribution<double> rd(
-          1.0 / (1000000.0 / (r.first / static_cast<double>(threads))));
-      auto work = GenerateWork(std::bind(rd, rg), std::bind(wd, wg), last_us,
-                               last_us + r.second);
-      last_us = work.back().start_us;
-      w1.insert(w1.end(), work.begin(), work.end());
-    }
-    return w1;
-  });
-  PrintRawResults(w);
+  double cpu_usage = static_cast<double>(busy) /
+                     static_cast<double>(idle + busy);
+  PrintStatResults(r, cpu_usage,
+                   ack_counts{a2.client - a1.client, a2.server - a1.server});
 }
 
 void ClientHandler(void *arg) {
-  //LoadShiftExperiment(threads, rates, st);
-#if 1
+  // Measure each requested rate, or sweep through rates if none were given.
+  for (auto &r : rates) SteadyStateExperiment(threads, r.first, st, r.second);
+  if (!rates.empty()) return;
+
   for (double i = 50000; i <= 8000000; i += 50000) {
-    SteadyStateExperiment(threads, i, st);
+    SteadyStateExperiment(threads, i, st, 2000000);
   }
-#endif
 }
 
 int StringToAddr(const char *str, uint32_t *addr) {
@@ -438,17 +345,6 @@ int StringToAddr(const char *str, uint32_t *addr) {
   return 0;
 }
 
-std::vector<std::string> split(const std::string &text, char sep) {
-  std::vector<std::string> tokens;
-  std::string::size_type start = 0, end = 0;
-  while ((end = text.find(sep, start)) != std::string::npos) {
-    tokens.push_back(text.substr(start, end - start));
-    start = end + 1;
-  }
-  tokens.push_back(text.substr(start));
-  return tokens;
-}
-
 }  // anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -471,7 +367,7 @@ int main(int argc, char *argv[]) {
     return -EINVAL;
   }
 
-  if (argc < 7) {
+  if (argc < 6) {
     std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [service_us] "
                  "[<request_rate>:<us_duration>]..."
               << std::endl;
@@ -491,11 +387,6 @@ int main(int argc, char *argv[]) {
     if (tokens.size() != 2) return -EINVAL;
     double rate = std::stod(tokens[0], nullptr);
     uint64_t duration = std::stoll(tokens[1], nullptr, 0);
-#if 0
-    if (i == 6) {
-      rates.emplace_back(rate, kWarmupUpSeconds * 1e6);
-    }
-#endif
     rates.emplace_back(rate, duration);
   }
 
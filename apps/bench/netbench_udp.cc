@@ -11,35 +11,28 @@ extern "C" {
 #include "timer.h"
 #include "net.h"
 #include "fake_worker.h"
+#include "loadgen.h"
 #include "proto.h"
 
 #include <iostream>
 #include <iomanip>
 #include <utility>
 #include <memory>
-#include <chrono>
 #include <vector>
-#include <algorithm>
-#include <numeric>
 #include <random>
 
 namespace {
 
-using sec = std::chrono::duration<double, std::micro>;
-
-// The number of samples to discard from the start and end.
-constexpr uint64_t kDiscardSamples = 1000;
-// The maximum lateness to tolerate before dropping egress samples.
-constexpr uint64_t kMaxCatchUpUS = 5;
-
 // the number of worker threads to spawn.
 int threads;
 // the remote UDP address of the server.
 netaddr raddr;
-// the number of samples to gather.
+// the number of samples to gather per thread.
 uint64_t n;
 // the mean service time in us.
 double st;
+// the number of datagrams to move per read or write call.
+int batch = 1;
 
 void ServerWorker(rt::UdpConn *c) {
   union {
@@ -75,10 +68,56 @@ void ServerWorker(rt::UdpConn *c) {
   }
 }
 
-void ServerHandler(void *arg) {
-  std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Listen({0, kNetbenchPort}));
-  if (unlikely(c == nullptr)) panic("couldn't listen for control connections");
+// Like ServerWorker(), but moves up to @batch datagrams per call.
+void ServerWorkerBatch(rt::UdpConn *c) {
+  std::vector<unsigned char> bufs(batch * rt::UdpConn::kMaxPayloadSize);
+  udp_msg msgs[UDP_BATCH_MAX];
+  std::unique_ptr<FakeWorker> w(FakeWorkerFactory("stridedmem:3200:64"));
+  if (unlikely(w == nullptr)) panic("couldn't create worker");
 
+  for (int i = 0; i < batch; ++i) {
+    msgs[i].buf = &bufs[i * rt::UdpConn::kMaxPayloadSize];
+    msgs[i].cap = rt::UdpConn::kMaxPayloadSize;
+  }
+
+  bool done = false;
+  while (!done) {
+    // Receive a batch of network requests.
+    ssize_t ret = c->ReadBatch(msgs, batch);
+    if (ret <= 0) {
+      if (ret == 0) break;
+      panic("udp read failed, ret = %ld", ret);
+    }
+
+    int cnt = static_cast<int>(ret);
+    for (int i = 0; i < cnt; ++i) {
+      payload *p = static_cast<payload *>(msgs[i].buf);
+
+      // Determine if the connection is being killed.
+      if (unlikely(p->tag == kKill)) {
+        c->Shutdown();
+        cnt = i;
+        done = true;
+        break;
+      }
+
+      // Perform fake work if requested.
+      if (p->workn != 0) w->Work(p->workn * 82.0);
+    }
+
+    // Send the responses, which may take more than one call.
+    for (int sent = 0; sent < cnt;) {
+      ssize_t sret = c->WriteBatch(&msgs[sent], cnt - sent);
+      if (sret <= 0) {
+        if (sret == -EPIPE) return;
+        panic("udp write failed, ret = %ld", sret);
+      }
+      sent += sret;
+    }
+  }
+}
+
+void ServeControl(std::unique_ptr<rt::UdpConn> c) {
   while (true) {
     nbench_req req;
     netaddr raddr;
@@ -86,8 +125,9 @@ void ServerHandler(void *arg) {
     if (ret != sizeof(req) || req.magic != kMagic) continue;
 
     rt::Spawn([=, &c]{
-      log_info("got connection %x:%d, %d ports", raddr.ip,
-               raddr.port, req.nports);
+      char addr_str[NETADDR_STR_LEN];
+      log_info("got connection %s, %d ports", netaddr_to_str(raddr, addr_str),
+               req.nports);
 
       union {
         nbench_resp resp;
@@ -104,7 +144,8 @@ void ServerHandler(void *arg) {
         std::unique_ptr<rt::UdpConn> cin(rt::UdpConn::Dial({0, 0}, raddr));
 	if (unlikely(cin == nullptr)) panic("couldn't dial data connection");
 	resp.ports[i] = cin->LocalAddr().port;
-        threads.emplace_back(rt::Thread(std::bind(ServerWorker, cin.get())));
+        threads.emplace_back(rt::Thread(std::bind(
+            batch > 1 ? ServerWorkerBatch : ServerWorker, cin.get())));
         conns.emplace_back(std::move(cin));
       }
 
@@ -124,6 +165,21 @@ void ServerHandler(void *arg) {
   }
 }
 
+void ServerHandler(void *arg) {
+  // also accept control messages over IPv6 if the host has an IPv6 address
+  static const uint8_t kAnyAddr6[16] = {};
+  netaddr laddr6 = netaddr_ipv6(kAnyAddr6, kNetbenchPort);
+  std::unique_ptr<rt::UdpConn> c6(rt::UdpConn::Listen(laddr6));
+  if (c6 != nullptr)
+    rt::Spawn([c = c6.release()]{
+      ServeControl(std::unique_ptr<rt::UdpConn>(c));
+    });
+
+  std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Listen({0, kNetbenchPort}));
+  if (unlikely(c == nullptr)) panic("couldn't listen for control connections");
+  ServeControl(std::move(c));
+}
+
 void KillConn(rt::UdpConn *c)
 {
   constexpr int kKillRetries = 10;
@@ -136,87 +192,43 @@ void KillConn(rt::UdpConn *c)
     udp_send(buf, sizeof(buf), c->LocalAddr(), c->RemoteAddr());
 }
 
-std::vector<double> PoissonWorker(rt::UdpConn *c, double req_rate,
-                                  double service_time, rt::WaitGroup *starter)
+void ClientWorker(rt::UdpConn *c, loadgen::Worker *w, double service_time)
 {
   // Seed the random generator with the local port number.
   std::mt19937 g(c->RemoteAddr().port);
-
-  // Create a packet transmit schedule.
-  std::vector<double> sched;
-  std::exponential_distribution<double> rd(1.0 / (1000000.0 / req_rate));
-  std::vector<double> tmp(n);
-  std::generate(tmp.begin(), tmp.end(), std::bind(rd, g));
-  sched.push_back(tmp[0]);
-  for (std::vector<double>::size_type j = 1; j < tmp.size(); ++j) {
-    tmp[j] += tmp[j - 1];
-    sched.push_back(static_cast<uint64_t>(tmp[j]));
-  }
-
-  // Create a fake work schedule.
-  std::vector<double> work(n);
   std::exponential_distribution<double> wd(1.0 / service_time);
-  std::generate(work.begin(), work.end(), std::bind(wd, g));
-
-  // Reserve space to record results.
-  auto n = sched.size();
-  std::vector<double> timings;
-  timings.reserve(n);
-  std::vector<uint64_t> start_us(n);
 
   // Start the receiver thread.
   auto th = rt::Thread([&]{
-    union {
-      unsigned char rbuf[32] = {};
-      payload rp;
-    };
+    payload rps[UDP_BATCH_MAX] = {};
+    udp_msg msgs[UDP_BATCH_MAX];
+    for (int i = 0; i < batch; ++i) {
+      msgs[i].buf = &rps[i];
+      msgs[i].cap = sizeof(payload);
+    }
 
     while (true) {
-     ssize_t ret = c->Read(rbuf, sizeof(rbuf));
-     if (ret != static_cast<ssize_t>(sizeof(rbuf))) {
+     ssize_t ret = c->ReadBatch(msgs, batch);
+     if (ret <= 0) {
        if (ret == 0) break;
        panic("udp read failed, ret = %ld", ret);
      }
 
-     barrier();
-     uint64_t ts = microtime();
-     barrier();
-     timings.push_back(ts - start_us[rp.idx]);
+     for (int i = 0; i < ret; ++i)
+       w->Complete(rps[i].idx);
     }
   });
 
-  // Initialize timing measurement data structures.
   union {
     unsigned char buf[32] = {};
     payload p;
   };
 
-  // Synchronized start of load generation.
-  starter->Done();
-  starter->Wait();
-
-  barrier();
-  uint64_t expstart = microtime();
-  barrier();
-
-  for (unsigned int i = 0; i < n; ++i) {
-    barrier();
-    uint64_t now = microtime();
-    barrier();
-    if (now - expstart < sched[i]) {
-      rt::Sleep(sched[i] - (now - expstart));
-      now = microtime();
-    }
-    if (now - expstart - sched[i] > kMaxCatchUpUS)
-      continue;
-
-    barrier();
-    start_us[i] = microtime();
-    barrier();
-
+  loadgen::Request req;
+  while (w->Next(&req)) {
     // Send a network request.
-    p.idx = i;
-    p.workn = work[i];
+    p.idx = req.id;
+    p.workn = wd(g);
     p.tag = 0;
     ssize_t ret = udp_send(buf, sizeof(buf), c->LocalAddr(), c->RemoteAddr());
     if (ret != static_cast<ssize_t>(sizeof(buf)))
@@ -225,11 +237,9 @@ std::vector<double> PoissonWorker(rt::UdpConn *c, double req_rate,
 
   c->Shutdown();
   th.Join();
-
-  return timings;
 }
 
-std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
+loadgen::Result RunExperiment(double req_rate) {
   std::unique_ptr<rt::UdpConn> c(rt::UdpConn::Dial({0, 0}, raddr));
   if (c == nullptr) panic("couldn't establish control connection");
 
@@ -252,98 +262,49 @@ std::vector<double> RunExperiment(double req_rate, double *reqs_per_sec) {
   // Create one UDP connection per thread.
   std::vector<std::unique_ptr<rt::UdpConn>> conns;
   for (int i = 0; i < threads; ++i) {
-    std::unique_ptr<rt::UdpConn>
-      outc(rt::UdpConn::Dial(c->LocalAddr(), {raddr.ip, resp.ports[i]}));
+    netaddr daddr = raddr;
+    daddr.port = resp.ports[i];
+    std::unique_ptr<rt::UdpConn> outc(rt::UdpConn::Dial(c->LocalAddr(), daddr));
     if (unlikely(outc == nullptr)) panic("couldn't connect to raddr.");
     conns.emplace_back(std::move(outc));
   }
 
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<double>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i]{
-      auto v = PoissonWorker(conns[i].get(), req_rate / threads, st,
-                             &starter);
-      samples[i].reset(new std::vector<double>(std::move(v)));
-    }));
-  }
-
-  // Give the workers time to initialize, then start recording.
-  starter.Done();
-  starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
-  auto start = std::chrono::steady_clock::now();
-  barrier();
-
-  // Wait for the workers to finish.
-  for (auto& t: th)
-    t.Join();
+  // Measure long enough for each thread to gather n samples.
+  loadgen::Options opts;
+  opts.rps = req_rate;
+  opts.workers = threads;
+  opts.duration_us = n * 1e6 * threads / req_rate;
 
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = std::chrono::steady_clock::now();
-  barrier();
+  loadgen::Experiment e(opts);
+  loadgen::Result r = e.Run([&](loadgen::Worker *w) {
+    ClientWorker(conns[w->index()].get(), w, st);
+  });
 
   // Close the connections.
   for (auto& c: conns)
     KillConn(c.get());
 
-  // Aggregate all the latency timings together.
-  uint64_t total = 0;
-  std::vector<double> timings;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    total += v.size();
-    if (v.size() <= kDiscardSamples * 2) panic("not enough samples");
-    v.erase(v.begin(), v.begin() + kDiscardSamples);
-    v.erase(v.end() - kDiscardSamples, v.end());
-    timings.insert(timings.end(), v.begin(), v.end());
-  }
-
-  // Report results.
-  double elapsed = std::chrono::duration_cast<sec>(finish - start).count();
-  *reqs_per_sec = static_cast<double>(total) / elapsed * 1000000;
-  return timings;
+  return r;
 }
 
 void DoExperiment(double req_rate) {
-  constexpr int kRounds = 1;
-  std::vector<double> timings;
-  double reqs_per_sec = 0;
-  for (int i = 0; i < kRounds; i++) {
-    double tmp;
-    auto t = RunExperiment(req_rate, &tmp);
-    timings.insert(timings.end(), t.begin(), t.end());
-    reqs_per_sec += tmp;
-    rt::Sleep(500 * rt::kMilliseconds);
-  }
-  reqs_per_sec /= kRounds;
-
-  std::sort(timings.begin(), timings.end());
-  double sum = std::accumulate(timings.begin(), timings.end(), 0.0);
-  double mean = sum / timings.size();
-  double count = static_cast<double>(timings.size());
-  double p9 = timings[count * 0.9];
-  double p99 = timings[count * 0.99];
-  double p999 = timings[count * 0.999];
-  double p9999 = timings[count * 0.9999];
-  double min = timings[0];
-  double max = timings[timings.size() - 1];
+  loadgen::Result r = RunExperiment(req_rate);
+  const loadgen::Histogram &h = r.response;
   std::cout << std::setprecision(2) << std::fixed
             << "t: "       << threads
-            << " rps: "    << reqs_per_sec
-            << " n: "      << timings.size()
-            << " min: "    << min
-            << " mean: "   << mean
-            << " 90%: "    << p9
-            << " 99%: "    << p99
-            << " 99.9%: "  << p999
-            << " 99.99%: " << p9999
-            << " max: "    << max << std::endl;
+            << " batch: "  << batch
+            << " rps: "    << r.achieved_rps
+            << " n: "      << r.completed
+            << " min: "    << h.Min() / 1000.0
+            << " mean: "   << h.Mean() / 1000.0
+            << " 90%: "    << h.Percentile(90) / 1000.0
+            << " 99%: "    << h.Percentile(99) / 1000.0
+            << " 99.9%: "  << h.Percentile(99.9) / 1000.0
+            << " 99.99%: " << h.Percentile(99.99) / 1000.0
+            << " max: "    << h.Max() / 1000.0
+            << " offered: " << req_rate << std::endl;
+  r.Report("netbench_udp", {{"batch", batch}});
+  rt::Sleep(500 * rt::kMilliseconds);
 }
 
 void ClientHandler(void *arg) {
@@ -351,16 +312,6 @@ void ClientHandler(void *arg) {
     DoExperiment(i);
 }
 
-int StringToAddr(const char *str, uint32_t *addr) {
-  uint8_t a, b, c, d;
-
-  if(sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4)
-    return -EINVAL;
-
-  *addr = MAKE_IP_ADDR(a, b, c, d);
-  return 0;
-}
-
 } // anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -373,6 +324,12 @@ int main(int argc, char *argv[]) {
 
   std::string cmd = argv[2];
   if (cmd.compare("server") == 0) {
+    if (argc > 3) batch = std::stoi(argv[3], nullptr, 0);
+    if (batch < 1 || batch > UDP_BATCH_MAX) {
+      std::cerr << "batch must be between 1 and " << UDP_BATCH_MAX
+                << std::endl;
+      return -EINVAL;
+    }
     ret = runtime_init(argv[1], ServerHandler, NULL);
     if (ret) {
       printf("failed to start runtime\n");
@@ -383,20 +340,26 @@ int main(int argc, char *argv[]) {
     return -EINVAL;
   }
 
-  if (argc != 7) {
-    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [n] [service_us]"
-              << std::endl;
+  if (argc != 7 && argc != 8) {
+    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [n] "
+                 "[service_us] <batch>" << std::endl;
     return -EINVAL;
   }
 
   threads = std::stoi(argv[3], nullptr, 0);
 
-  ret = StringToAddr(argv[4], &raddr.ip);
+  // accepts IPv4 addresses and IPv6 addresses (e.g. "fd00::1")
+  ret = str_to_netaddr(argv[4], &raddr);
   if (ret) return -EINVAL;
   raddr.port = kNetbenchPort;
 
   n = std::stoll(argv[5], nullptr, 0);
   st = std::stod(argv[6], nullptr);
+  if (argc == 8) batch = std::stoi(argv[7], nullptr, 0);
+  if (batch < 1 || batch > UDP_BATCH_MAX) {
+    std::cerr << "batch must be between 1 and " << UDP_BATCH_MAX << std::endl;
+    return -EINVAL;
+  }
 
   ret = runtime_init(argv[1], ClientHandler, NULL);
   if (ret) {
@@ -0,0 +1,442 @@
+/*
+ * park_bench.cc - measures how quickly a parked kthread can be woken or
+ * preempted, with ksched and with the futex fallback used without it
+ */
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <asm/ops.h>
+#include <base/atomic.h>
+#include <base/compiler.h>
+#include <iokernel/control.h>
+#define __user
+#include "../../ksched/ksched.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace {
+
+using sec = std::chrono::duration<double, std::micro>;
+using steady = std::chrono::steady_clock;
+
+/* how long the sleeper is left parked before each wakeup */
+constexpr auto kParkDelay = std::chrono::microseconds(50);
+
+int iterations = 100000;
+int waker_core = 0;
+int sleeper_core = 1;
+
+void Report(std::vector<double> timings)
+{
+	// Report statistics.
+	std::sort(timings.begin(), timings.end());
+	double sum = std::accumulate(timings.begin(), timings.end(), 0.0);
+	double mean = sum / timings.size();
+	double count = static_cast<double>(timings.size());
+	double median = timings[count * 0.5];
+	double p9 = timings[count * 0.9];
+	double p99 = timings[count * 0.99];
+	double p999 = timings[count * 0.999];
+	double min = timings[0];
+	double max = timings[timings.size() - 1];
+	std::cout << std::setprecision(3) << std::fixed
+			<< "n: "		<< timings.size()
+			<< " min: "		<< min
+			<< " mean: "	<< mean
+			<< " median: "	<< median
+			<< " 90%: "		<< p9
+			<< " 99%: "		<< p99
+			<< " 99.9%: "	<< p999
+			<< " max: "		<< max << std::endl;
+}
+
+void Pin(int core)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(core, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask)) {
+		std::cerr << "couldn't pin to core " << core << ": "
+			  << strerror(errno) << std::endl;
+		exit(1);
+	}
+}
+
+/* busy waits, unless both threads share a core and must take turns */
+void Relax()
+{
+	if (waker_core == sleeper_core)
+		sched_yield();
+	else
+		cpu_relax();
+}
+
+void SpinFor(steady::duration d)
+{
+	auto end = steady::now() + d;
+	while (steady::now() < end)
+		Relax();
+}
+
+/*
+ * A way to park a thread and later wake or interrupt it. Park() and Spin()
+ * run on the sleeper; Wake() and Interrupt() run on the waker.
+ */
+class Mechanism {
+ public:
+	virtual ~Mechanism() {}
+	virtual const char *Name() const = 0;
+	virtual void Park() = 0;
+	virtual void Wake() = 0;
+	virtual void Interrupt(int signum) = 0;
+
+	pid_t sleeper_tid;
+};
+
+/* the runtime's fallback when ksched isn't loaded (see runtime/kthread.c) */
+class FutexMechanism : public Mechanism {
+ public:
+	FutexMechanism() { memset(&pf_, 0, sizeof(pf_)); }
+	const char *Name() const { return "futex"; }
+
+	void Park()
+	{
+		uint32_t gen = load_acquire(&pf_.gen);
+
+		store_release(&pf_.parked, 1);
+		while (load_acquire(&pf_.gen) == gen)
+			syscall(SYS_futex, &pf_.gen, FUTEX_WAIT, gen, NULL, NULL,
+				0);
+	}
+
+	void Wake()
+	{
+		store_release(&pf_.parked, 0);
+		store_release(&pf_.gen, pf_.gen + 1);
+		syscall(SYS_futex, &pf_.gen, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+
+	void Interrupt(int signum)
+	{
+		syscall(SYS_tgkill, getpid(), sleeper_tid, signum);
+	}
+
+ private:
+	struct park_futex pf_;
+};
+
+/* for comparison, blocking on an eventfd */
+class EventfdMechanism : public Mechanism {
+ public:
+	EventfdMechanism() : efd_(eventfd(0, 0)) {}
+	~EventfdMechanism() { close(efd_); }
+	const char *Name() const { return "eventfd"; }
+
+	void Park()
+	{
+		uint64_t val;
+
+		if (read(efd_, &val, sizeof(val)) != sizeof(val))
+			std::cerr << "error reading eventfd" << std::endl;
+	}
+
+	void Wake()
+	{
+		uint64_t val = 1;
+
+		if (write(efd_, &val, sizeof(val)) != sizeof(val))
+			std::cerr << "error writing eventfd" << std::endl;
+	}
+
+	void Interrupt(int signum)
+	{
+		syscall(SYS_tgkill, getpid(), sleeper_tid, signum);
+	}
+
+ private:
+	int efd_;
+};
+
+/* what the iokernel does with the ksched module (see iokernel/ksched.h) */
+class KschedMechanism : public Mechanism {
+ public:
+	static std::unique_ptr<Mechanism> Create()
+	{
+		int fd = open("/dev/ksched", O_RDWR);
+		if (fd < 0) {
+			std::cout << "skipping ksched: couldn't open /dev/ksched ("
+				  << strerror(errno) << ")" << std::endl;
+			return nullptr;
+		}
+
+		void *addr = mmap(NULL, sizeof(struct ksched_shm_cpu) * NCPU,
+				  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			std::cout << "skipping ksched: couldn't map shm ("
+				  << strerror(errno) << ")" << std::endl;
+			close(fd);
+			return nullptr;
+		}
+
+		return std::unique_ptr<Mechanism>(new KschedMechanism(fd,
+			static_cast<struct ksched_shm_cpu *>(addr)));
+	}
+
+	~KschedMechanism()
+	{
+		munmap(shm_, sizeof(struct ksched_shm_cpu) * NCPU);
+		close(fd_);
+	}
+
+	const char *Name() const { return "ksched"; }
+
+	void Park()
+	{
+		unsigned long cmd = started_ ? KSCHED_IOC_PARK : KSCHED_IOC_START;
+
+		started_ = true;
+		while (ioctl(fd_, cmd, 0) < 0)
+			cmd = KSCHED_IOC_PARK;
+	}
+
+	void Wake()
+	{
+		struct ksched_shm_cpu *s = &shm_[sleeper_core];
+
+		s->tid = sleeper_tid;
+		store_release(&s->gen, ++gen_);
+	}
+
+	void Interrupt(int signum)
+	{
+		struct ksched_shm_cpu *s = &shm_[sleeper_core];
+		struct ksched_intr_req req;
+		cpu_set_t mask;
+
+		CPU_ZERO(&mask);
+		CPU_SET(sleeper_core, &mask);
+		req.len = sizeof(mask);
+		req.mask = &mask;
+
+		s->signum = signum;
+		store_release(&s->sig, gen_);
+		if (ioctl(fd_, KSCHED_IOC_INTR, &req))
+			std::cerr << "error sending ksched interrupt" << std::endl;
+	}
+
+ private:
+	KschedMechanism(int fd, struct ksched_shm_cpu *shm)
+		: fd_(fd), shm_(shm), gen_(load_acquire(&shm[sleeper_core].last_gen)),
+		  started_(false) {}
+
+	int fd_;
+	struct ksched_shm_cpu *shm_;
+	unsigned int gen_;
+	bool started_;
+};
+
+/* state shared between the waker and the sleeper */
+std::atomic<bool> parked;
+std::atomic<bool> stop;
+std::atomic<unsigned int> woken_seq;
+std::atomic<unsigned int> signal_seq;
+steady::time_point woken_at;
+steady::time_point signal_at;
+std::atomic<pid_t> sleeper_tid;
+
+void *Sleeper(void *arg)
+{
+	Mechanism *m = static_cast<Mechanism *>(arg);
+
+	Pin(sleeper_core);
+	sleeper_tid = syscall(SYS_gettid);
+	while (true) {
+		parked = true;
+		m->Park();
+		woken_at = steady::now();
+		woken_seq++;
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+void *Spinner(void *arg)
+{
+	Mechanism *m = static_cast<Mechanism *>(arg);
+
+	Pin(sleeper_core);
+	sleeper_tid = syscall(SYS_gettid);
+	parked = true;
+	m->Park();
+	woken_seq++;
+	while (!stop)
+		cpu_relax();
+
+	return NULL;
+}
+
+void SignalHandler(int signo)
+{
+	signal_at = steady::now();
+	signal_seq++;
+}
+
+/* starts @fn on the sleeper core, and waits for it to park */
+pthread_t StartSleeper(Mechanism *m, void *(*fn)(void *))
+{
+	pthread_t th;
+
+	parked = false;
+	stop = false;
+	woken_seq = 0;
+	sleeper_tid = 0;
+	if (pthread_create(&th, NULL, fn, m)) {
+		std::cerr << "failed to create pthread" << std::endl;
+		exit(1);
+	}
+	while (!parked)
+		Relax();
+	m->sleeper_tid = sleeper_tid;
+	return th;
+}
+
+/*
+ * Benchmark the time from a waker asking for a parked thread to run until it
+ * is running.
+ */
+void RunWakeBench(Mechanism *m)
+{
+	std::vector<double> timings;
+	pthread_t th;
+
+	std::cout << "running " << m->Name() << " wake bench" << std::endl;
+	th = StartSleeper(m, Sleeper);
+
+	for (int i = 0; i < iterations; i++) {
+		while (!parked)
+			Relax();
+		/* give the sleeper time to really block */
+		SpinFor(kParkDelay);
+		parked = false;
+
+		auto start = steady::now();
+		m->Wake();
+		while (woken_seq != static_cast<unsigned int>(i + 1))
+			Relax();
+
+		timings.push_back(std::chrono::duration_cast<sec>(
+				woken_at - start).count());
+	}
+
+	while (!parked)
+		Relax();
+	SpinFor(kParkDelay);
+	stop = true;
+	m->Wake();
+	pthread_join(th, NULL);
+
+	Report(timings);
+}
+
+/*
+ * Benchmark the time from a waker asking to preempt a running thread until
+ * its signal handler runs.
+ */
+void RunPreemptBench(Mechanism *m)
+{
+	std::vector<double> timings;
+	pthread_t th;
+
+	std::cout << "running " << m->Name() << " preempt bench" << std::endl;
+	signal(SIGUSR1, SignalHandler);
+	signal_seq = 0;
+	th = StartSleeper(m, Spinner);
+	SpinFor(kParkDelay);
+	m->Wake();
+	while (woken_seq != 1)
+		Relax();
+
+	for (int i = 0; i < iterations; i++) {
+		auto start = steady::now();
+		m->Interrupt(SIGUSR1);
+		while (signal_seq != static_cast<unsigned int>(i + 1))
+			Relax();
+
+		timings.push_back(std::chrono::duration_cast<sec>(
+				signal_at - start).count());
+	}
+
+	stop = true;
+	pthread_join(th, NULL);
+	signal(SIGUSR1, SIG_DFL);
+
+	Report(timings);
+}
+
+void Run(Mechanism *m, const std::string &cmd)
+{
+	if (cmd == "wake" || cmd == "all")
+		RunWakeBench(m);
+	if (cmd == "preempt" || cmd == "all")
+		RunPreemptBench(m);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || argc > 5) {
+		std::cerr << "usage: [wake|preempt|all] [waker_core] "
+			  << "[sleeper_core] [iterations]" << std::endl;
+		std::cerr << "\tthe ksched runs need root, ksched loaded, and no "
+			  << "iokernel running" << std::endl;
+		return -EINVAL;
+	}
+
+	std::string cmd = argv[1];
+	if (cmd != "wake" && cmd != "preempt" && cmd != "all") {
+		std::cerr << "invalid command: " << cmd << std::endl;
+		return -EINVAL;
+	}
+	if (argc > 2)
+		waker_core = std::stoi(argv[2]);
+	if (argc > 3)
+		sleeper_core = std::stoi(argv[3]);
+	if (argc > 4)
+		iterations = std::stoi(argv[4]);
+	Pin(waker_core);
+
+	FutexMechanism futex;
+	Run(&futex, cmd);
+	EventfdMechanism efd;
+	Run(&efd, cmd);
+
+	std::unique_ptr<Mechanism> ksched = KschedMechanism::Create();
+	if (ksched)
+		Run(ksched.get(), cmd);
+
+	return 0;
+}
@@ -3,6 +3,7 @@ extern "C" {
 #include <runtime/storage.h>
 }
 
+#include "loadgen.h"
 #include "net.h"
 #include "runtime.h"
 #include "sync.h"
@@ -11,16 +12,19 @@ extern "C" {
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
+#include <vector>
 
 namespace {
 
 using namespace std::chrono;
-using sec = duration<double, std::micro>;
 
 // <- ARGUMENTS FOR EXPERIMENT ->
 // the number of worker threads to spawn.
@@ -30,16 +34,8 @@ size_t pct_set;
 double total_block_count = 547002288.0;
 size_t us_per_sample;
 size_t nsamples;
-
-// The maximum lateness to tolerate before dropping egress samples.
-constexpr uint64_t kMaxCatchUpUS = 5;
-
-struct work_unit {
-  double start_us;
-  size_t lba;
-  bool is_set;
-  double duration_us;
-};
+// The Zipf exponent for choosing blocks, or 0 to choose uniformly.
+double zipf_s;
 
 struct uptime {
   uint64_t idle;
@@ -61,193 +57,144 @@ uptime ReadUptime() {
 }
 
 
-template <class Arrival, class Service>
-std::vector<work_unit> GenerateWork(Arrival a, Service s, double cur_us,
-                                    double last_us) {
-  std::vector<work_unit> w;
-  while (cur_us < last_us) {
-    cur_us += a();
-    auto set = s() % 100 < pct_set;
-    w.emplace_back(work_unit{cur_us, s() & ~0x7, set, 0});
+// Samples ranks in [0, n) with P(k) proportional to 1 / (k + 1)^s, in
+// constant time, using rejection-inversion (Hormann and Derflinger, 1996).
+class ZipfDistribution {
+ public:
+  ZipfDistribution(uint64_t n, double s) : n_(n), s_(s) {
+    h_x1_ = HIntegral(1.5) - 1.0;
+    h_n_ = HIntegral(n + 0.5);
+    threshold_ = 2.0 - HIntegralInverse(HIntegral(2.5) - H(2.0));
   }
-  return w;
-}
 
-
-std::vector<work_unit> ClientWorker(
-    rt::WaitGroup *starter, std::function<std::vector<work_unit>()> wf) {
-  std::vector<work_unit> w(wf());
-  std::vector<time_point<steady_clock>> timings;
-  timings.reserve(w.size());
-
-  // Start the receiver thread.
-  // Synchronized start of load generation.
-  starter->Done();
-  starter->Wait();
-  barrier();
-  auto expstart = steady_clock::now();
-  barrier();
-
-  auto wsize = w.size();
-  rt::WaitGroup wg(wsize);
-  int dropped = 0;
-
-  for (unsigned int i = 0; i < wsize; ++i) {
-    barrier();
-    auto now = steady_clock::now();
-    barrier();
-    if (duration_cast<sec>(now - expstart).count() < w[i].start_us)
-      rt::Sleep(w[i].start_us - duration_cast<sec>(now - expstart).count());
-    now = steady_clock::now();
-    if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-        kMaxCatchUpUS) {
-      dropped++;
-      continue;
+  template <class Generator>
+  uint64_t operator()(Generator &g) {
+    std::uniform_real_distribution<double> ud(0.0, 1.0);
+    while (true) {
+      double u = h_n_ + ud(g) * (h_x1_ - h_n_);
+      double x = HIntegralInverse(u);
+      double k = std::clamp(std::floor(x + 0.5), 1.0, static_cast<double>(n_));
+      if (k - x <= threshold_ || u >= HIntegral(k + 0.5) - H(k))
+        return static_cast<uint64_t>(k) - 1;
     }
+  }
 
-    barrier();
-    timings[i] = steady_clock::now();
-    barrier();
-    rt::Spawn([&, i] {
-      int ret;
-      unsigned char dat[block_count * 512];
+ private:
+  double H(double x) const { return std::exp(-s_ * std::log(x)); }
+  double HIntegral(double x) const {
+    double lx = std::log(x);
+    return Helper2((1.0 - s_) * lx) * lx;
+  }
+  double HIntegralInverse(double x) const {
+    double t = std::max(x * (1.0 - s_), -1.0);
+    return std::exp(Helper1(t) * x);
+  }
+  // log1p(x) / x and expm1(x) / x, accurate near 0.
+  static double Helper1(double x) {
+    if (std::abs(x) > 1e-8) return std::log1p(x) / x;
+    return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+  }
+  static double Helper2(double x) {
+    if (std::abs(x) > 1e-8) return std::expm1(x) / x;
+    return 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+  }
 
-      auto now = steady_clock::now();
+  uint64_t n_;
+  double s_, h_x1_, h_n_, threshold_;
+};
 
-      if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-          kMaxCatchUpUS) {
-        wg.Done();
-        return;
-      }
+// Issues each request in its own thread as it comes due.
+void ClientWorker(loadgen::Worker *w) {
+  std::mt19937 dg(rand());
+  std::uniform_int_distribution<size_t> wd(0.0, total_block_count);
+
+  // Popular blocks are scattered across the device by their rank.
+  uint64_t nkeys = total_block_count / 8;
+  ZipfDistribution zd(nkeys, zipf_s);
+  auto next_lba = [&]() -> size_t {
+    if (zipf_s == 0) return wd(dg) & ~0x7;
+    return (zd(dg) * 0x9e3779b97f4a7c15UL) % nkeys * 8;
+  };
+
+  // All writes store the same data.
+  std::vector<unsigned char> src(block_count * 512);
+
+  rt::WaitGroup wg;
+  loadgen::Request req;
+  while (w->Next(&req)) {
+    size_t lba = next_lba();
+    bool is_set = wd(dg) % 100 < pct_set;
+
+    wg.Add(1);
+    rt::Spawn([&wg, &src, w, id = req.id, lba, is_set] {
+      int ret;
 
-      if (w[i].is_set) {
-        ret = storage_write(dat, w[i].lba, block_count);
+      if (is_set) {
+        ret = storage_cache_write(src.data(), lba, block_count);
       } else {
-        ret = storage_read(dat, w[i].lba, block_count);
+        unsigned char dat[block_count * 512];
+        ret = storage_cache_read(dat, lba, block_count);
       }
 
-      barrier();
-      auto ts = steady_clock::now();
-      barrier();
-      if (ret == 0)
-        w[i].duration_us = duration_cast<sec>(ts - timings[i]).count();
+      // Failed requests are counted as lost.
+      if (ret == 0) w->Complete(id);
       wg.Done();
     });
   }
 
-  wg.Add(-1 * dropped);
   wg.Wait();
-
-  return w;
 }
 
-std::vector<work_unit> RunExperiment(
-    int threads, double *reqs_per_sec, double *cpu_usage, uint64_t *start_wct,
-    std::function<std::vector<work_unit>()> wf) {
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<work_unit>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i] {
-      auto v = ClientWorker(&starter, wf);
-      samples[i].reset(new std::vector<work_unit>(std::move(v)));
-    }));
-  }
-
-  // Give the workers time to initialize, then start recording.
-  starter.Done();
-  starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
-  auto start = steady_clock::now();
-  auto start_sys = system_clock::now();
-  barrier();
-  uptime u1 = ReadUptime();
-
-  // Wait for the workers to finish.
-  for (auto &t : th) t.Join();
-
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = steady_clock::now();
-  barrier();
-  uptime u2 = ReadUptime();
-
-  // Aggregate all the samples together.
-  std::vector<work_unit> w;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    w.insert(w.end(), v.begin(), v.end());
-  }
-
-  // Remove requests that did not complete.
-  w.erase(std::remove_if(w.begin(), w.end(),
-                         [](const work_unit &s) { return s.duration_us == 0; }),
-          w.end());
-
-  // Report results.
-  double elapsed = duration_cast<sec>(finish - start).count();
-  if (reqs_per_sec != nullptr)
-    *reqs_per_sec = static_cast<double>(w.size()) / elapsed * 1000000;
-  uint64_t idle = u2.idle - u1.idle;
-  uint64_t busy = u2.busy - u1.busy;
-  if (cpu_usage != nullptr)
-    *cpu_usage = static_cast<double>(busy) /
-                 static_cast<double>(idle + busy);
-  if (start_wct != nullptr)
-    *start_wct = duration_cast<sec>(start_sys.time_since_epoch()).count() / 1000000;
-  return w;
-}
-
-void PrintStatResults(std::vector<work_unit> w, double offered_rps, double rps,
-                      double cpu_usage, uint64_t start_wct) {
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.duration_us < s2.duration_us;
-  });
-  double sum = std::accumulate(
-      w.begin(), w.end(), 0.0,
-      [](double s, const work_unit &c) { return s + c.duration_us; });
-  double mean = sum / w.size();
-  double count = static_cast<double>(w.size());
-  double p90 = w[count * 0.9].duration_us;
-  double p99 = w[count * 0.99].duration_us;
-  double p999 = w[count * 0.999].duration_us;
-  double p9999 = w[count * 0.9999].duration_us;
-  double min = w[0].duration_us;
-  double max = w[w.size() - 1].duration_us;
+void PrintStatResults(const loadgen::Result &r, double cpu_usage,
+                      uint64_t start_wct) {
+  const loadgen::Histogram &h = r.response;
   std::cout  //<<
              //"#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max"
              //<< std::endl
-      << std::setprecision(4) << std::fixed << threads << "," << offered_rps
-      << "," << rps << "," << cpu_usage << "," << w.size() << "," << min << ","
-      << mean << "," << p90 << "," << p99 << "," << p999 << "," << p9999 << ","
-      << max << "," << start_wct << std::endl;
+      << std::setprecision(4) << std::fixed << threads << "," << r.offered_rps
+      << "," << r.achieved_rps << "," << cpu_usage << "," << r.completed << ","
+      << h.Min() / 1000.0 << "," << h.Mean() / 1000.0 << ","
+      << h.Percentile(90) / 1000.0 << "," << h.Percentile(99) / 1000.0 << ","
+      << h.Percentile(99.9) / 1000.0 << "," << h.Percentile(99.99) / 1000.0
+      << "," << h.Max() / 1000.0 << "," << start_wct << std::endl;
+  r.Report("storage_bench", {{"cpu_usage", cpu_usage},
+                             {"block_count", block_count},
+                             {"pct_set", pct_set},
+                             {"zipf_s", zipf_s}});
 }
 
-void SteadyStateExperiment(int threads, double offered_rps,
-                           double service_time) {
-  double rps, cpu_usage;
+void SteadyStateExperiment(int threads, double offered_rps) {
+  // Sample the CPU usage and the wall clock time while measuring.
+  uptime u1, u2;
   uint64_t start_wct;
-  std::vector<work_unit> w = RunExperiment(threads, &rps, &cpu_usage, &start_wct, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 dg(rand());
-    std::exponential_distribution<double> rd(
-        1.0 / (1000000.0 / (offered_rps / static_cast<double>(threads))));
-    std::uniform_int_distribution<size_t> wd(0.0, total_block_count);
-    return GenerateWork(std::bind(rd, rg), std::bind(wd, dg), 0, us_per_sample);
-  });
+  loadgen::Options opts;
+  opts.rps = offered_rps;
+  opts.workers = threads;
+  opts.duration_us = us_per_sample;
+  opts.on_start = [&] {
+    u1 = ReadUptime();
+    start_wct = duration_cast<seconds>(
+        system_clock::now().time_since_epoch()).count();
+  };
+  opts.on_finish = [&] { u2 = ReadUptime(); };
+
+  loadgen::Experiment e(opts);
+  loadgen::Result r = e.Run(ClientWorker);
+
+  uint64_t idle = u2.idle - u1.idle;
+  uint64_t busy = u2.busy - u1.busy;
+  double cpu_usage = static_cast<double>(busy) /
+                     static_cast<double>(idle + busy);
 
   // Print the results.
-  PrintStatResults(w, offered_rps, rps, cpu_usage, start_wct);
+  PrintStatResults(r, cpu_usage, start_wct);
 }
 
 void ClientHandler(void *arg) {
   double max_pps = 600000;
   double step = max_pps / nsamples;
   for (double i = step; i <= max_pps; i += step) {
-    SteadyStateExperiment(threads, i, 0);
+    SteadyStateExperiment(threads, i);
   }
 }
 
@@ -258,7 +205,7 @@ int main(int argc, char *argv[]) {
 
   if (argc < 7) {
     std::cerr << "usage: [cfg_file] [#threads] [block_count] [pct_set]"
-              << " [us_per_sample] [nsamples]"
+              << " [us_per_sample] [nsamples] <zipf_s>"
               << std::endl;
     return -EINVAL;
   }
@@ -268,6 +215,7 @@ int main(int argc, char *argv[]) {
   pct_set = std::stoi(argv[4], nullptr, 0);
   us_per_sample = std::stoi(argv[5], nullptr, 0);
   nsamples = std::stoi(argv[6], nullptr, 0);
+  if (argc > 7) zipf_s = std::stod(argv[7], nullptr);
 
   ret = runtime_init(argv[1], ClientHandler, NULL);
   if (ret) {
@@ -3,12 +3,20 @@
 #include "sync.h"
 
 #include <chrono>
+#include <functional>
 #include <iostream>
 
 namespace {
 
 using us = std::chrono::duration<double, std::micro>;
 constexpr int kMeasureRounds = 10000000;
+constexpr int kSpawnBatch = 64;
+
+// A capture too large for std::function's small buffer, so it allocates.
+struct SpawnCapture {
+  rt::WaitGroup *wg;
+  unsigned long pad[3];
+};
 
 void BenchSpawnJoin() {
   for (int i = 0; i < kMeasureRounds; ++i) {
@@ -17,6 +25,28 @@ void BenchSpawnJoin() {
   }
 }
 
+// Spawns detached threads in batches, wrapping each closure in @Wrap.
+template <typename Wrap>
+void BenchSpawn(Wrap wrap) {
+  rt::WaitGroup wg;
+  SpawnCapture cap = {&wg, {0}};
+
+  for (int i = 0; i < kMeasureRounds; i += kSpawnBatch) {
+    wg.Add(kSpawnBatch);
+    for (int j = 0; j < kSpawnBatch; ++j)
+      rt::Spawn(wrap([cap] { cap.wg->Done(); }));
+    wg.Wait();
+  }
+}
+
+void BenchSpawnStdFunction() {
+  BenchSpawn([](auto f) { return std::function<void()>(std::move(f)); });
+}
+
+void BenchSpawnCallable() {
+  BenchSpawn([](auto f) { return f; });
+}
+
 void BenchUncontendedMutex() {
   rt::Mutex m;
   volatile unsigned long foo = 0;
@@ -78,6 +108,18 @@ void MainHandler(void *arg) {
   PrintResult("SpawnJoin",
 	std::chrono::duration_cast<us>(finish - start));
 
+  start = std::chrono::steady_clock::now();
+  BenchSpawnStdFunction();
+  finish = std::chrono::steady_clock::now();
+  PrintResult("SpawnStdFunction",
+    std::chrono::duration_cast<us>(finish - start));
+
+  start = std::chrono::steady_clock::now();
+  BenchSpawnCallable();
+  finish = std::chrono::steady_clock::now();
+  PrintResult("SpawnCallable",
+    std::chrono::duration_cast<us>(finish - start));
+
   start = std::chrono::steady_clock::now();
   BenchUncontendedMutex();
   finish = std::chrono::steady_clock::now();
@@ -0,0 +1,103 @@
+// histogram.cc - a high dynamic range histogram of latencies
+
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace loadgen {
+
+namespace {
+
+constexpr uint64_t kNoMin = std::numeric_limits<uint64_t>::max();
+
+void AtomicMin(std::atomic<uint64_t> *a, uint64_t v) {
+  uint64_t cur = a->load(std::memory_order_relaxed);
+  while (v < cur && !a->compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    ;
+}
+
+void AtomicMax(std::atomic<uint64_t> *a, uint64_t v) {
+  uint64_t cur = a->load(std::memory_order_relaxed);
+  while (v > cur && !a->compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    ;
+}
+
+}  // anonymous namespace
+
+Histogram::Histogram()
+    : counts_(new std::atomic<uint64_t>[kBuckets]),
+      count_(0),
+      sum_(0),
+      min_(kNoMin),
+      max_(0) {
+  static_assert(Index(kMaxValue) + 1 == kBuckets,
+                "the last bucket must hold the largest value");
+  for (unsigned int i = 0; i < kBuckets; i++) counts_[i] = 0;
+}
+
+Histogram::Histogram(Histogram &&h)
+    : counts_(std::move(h.counts_)),
+      count_(h.count_.load()),
+      sum_(h.sum_.load()),
+      min_(h.min_.load()),
+      max_(h.max_.load()) {}
+
+void Histogram::Record(uint64_t v) {
+  v = std::min(v, kMaxValue);
+  counts_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(v, std::memory_order_relaxed);
+  AtomicMin(&min_, v);
+  AtomicMax(&max_, v);
+}
+
+void Histogram::Merge(const Histogram &h) {
+  for (unsigned int i = 0; i < kBuckets; i++) {
+    uint64_t c = h.counts_[i].load(std::memory_order_relaxed);
+    if (c) counts_[i].fetch_add(c, std::memory_order_relaxed);
+  }
+  count_.fetch_add(h.count_.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+  sum_.fetch_add(h.sum_.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  AtomicMin(&min_, h.min_.load(std::memory_order_relaxed));
+  AtomicMax(&max_, h.max_.load(std::memory_order_relaxed));
+}
+
+void Histogram::Reset() {
+  for (unsigned int i = 0; i < kBuckets; i++) counts_[i] = 0;
+  count_ = 0;
+  sum_ = 0;
+  min_ = kNoMin;
+  max_ = 0;
+}
+
+uint64_t Histogram::Min() const {
+  uint64_t v = min_.load(std::memory_order_relaxed);
+  return v == kNoMin ? 0 : v;
+}
+
+double Histogram::Mean() const {
+  uint64_t n = Count();
+  if (!n) return 0;
+  return static_cast<double>(sum_.load(std::memory_order_relaxed)) / n;
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  uint64_t n = Count();
+  if (!n) return 0;
+
+  uint64_t target = std::ceil(std::max(p, 0.0) / 100.0 * n);
+  target = std::max<uint64_t>(std::min(target, n), 1);
+
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < kBuckets; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= target) return std::min(HighestEquivalent(i), Max());
+  }
+  return Max();
+}
+
+}  // namespace loadgen
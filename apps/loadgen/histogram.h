@@ -0,0 +1,78 @@
+// histogram.h - a high dynamic range histogram of latencies
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace loadgen {
+
+// Records nanosecond values with a bounded relative error (1 / 2^(kSubBits -
+// 1), under 1%) in a fixed number of buckets, like HdrHistogram. Every
+// operation is lock-free, so any number of uthreads may record into or merge
+// into the same histogram concurrently.
+class Histogram {
+  static constexpr unsigned int kMaxBits = 40;
+  static constexpr unsigned int kSubBits = 8;
+  static constexpr uint64_t kSubCount = 1ULL << kSubBits;
+  static constexpr uint64_t kSubHalf = kSubCount / 2;
+  static constexpr unsigned int kBuckets = (kMaxBits - kSubBits + 2) * kSubHalf;
+
+ public:
+  // Larger values are clamped (about 18 minutes).
+  static constexpr uint64_t kMaxValue = (1ULL << kMaxBits) - 1;
+
+  Histogram();
+  Histogram(Histogram &&h);
+
+  // Adds a value.
+  void Record(uint64_t v);
+  // Adds all the values recorded in @h.
+  void Merge(const Histogram &h);
+  // Removes all values (not safe during concurrent updates).
+  void Reset();
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Min() const;
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const;
+  // Gets the value at percentile @p (0 to 100), rounded up to the largest
+  // value that shares its bucket.
+  uint64_t Percentile(double p) const;
+
+  // Calls @fn(highest value, count) for each non-empty bucket, in order.
+  template <typename F>
+  void ForEachBucket(F fn) const {
+    for (unsigned int i = 0; i < kBuckets; i++) {
+      uint64_t c = counts_[i].load(std::memory_order_relaxed);
+      if (c) fn(HighestEquivalent(i), c);
+    }
+  }
+
+  // Gets the bucket index for a value.
+  static constexpr unsigned int Index(uint64_t v) {
+    if (v < kSubCount) return v;
+    unsigned int shift = 64 - __builtin_clzll(v) - kSubBits;
+    return shift * kSubHalf + (v >> shift);
+  }
+
+  // Gets the largest value that falls into bucket @idx.
+  static constexpr uint64_t HighestEquivalent(unsigned int idx) {
+    if (idx < kSubCount) return idx;
+    unsigned int shift = idx / kSubHalf - 1;
+    return (((idx % kSubHalf + kSubHalf) + 1ULL) << shift) - 1;
+  }
+
+ private:
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+};
+
+}  // namespace loadgen
@@ -0,0 +1,107 @@
+// histogram_test.cc - checks the histogram against exact percentiles
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+
+using loadgen::Histogram;
+
+namespace {
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                   __LINE__, #cond);                                 \
+      std::exit(1);                                                  \
+    }                                                                \
+  } while (0)
+
+// every value must land in a bucket that covers it, within 1%
+void TestBuckets() {
+  unsigned int last = 0;
+  for (uint64_t v = 1; v < Histogram::kMaxValue; v += 1 + v / 97) {
+    unsigned int idx = Histogram::Index(v);
+    uint64_t hi = Histogram::HighestEquivalent(idx);
+    CHECK(idx >= last);
+    CHECK(hi >= v);
+    CHECK(hi - v <= v / 128);
+    CHECK(Histogram::Index(hi) == idx);
+    CHECK(Histogram::Index(hi + 1) == idx + 1);
+    last = idx;
+  }
+}
+
+void TestPercentiles() {
+  std::mt19937_64 rg(1);
+  std::lognormal_distribution<double> d(10, 1.5);
+  std::vector<uint64_t> values;
+  Histogram h;
+
+  for (int i = 0; i < 1000000; i++) {
+    uint64_t v = d(rg);
+    values.push_back(v);
+    h.Record(v);
+  }
+  std::sort(values.begin(), values.end());
+
+  CHECK(h.Count() == values.size());
+  CHECK(h.Min() == values.front());
+  CHECK(h.Max() == values.back());
+  for (double p : {1.0, 50.0, 90.0, 99.0, 99.9, 99.99}) {
+    uint64_t exact = values[std::ceil(p / 100 * values.size()) - 1];
+    uint64_t v = h.Percentile(p);
+    CHECK(v >= exact && v - exact <= exact / 128);
+  }
+  CHECK(h.Percentile(100) == values.back());
+}
+
+// concurrent recording and merging loses nothing
+void TestMerge() {
+  constexpr int kThreads = 8;
+  constexpr int kValues = 100000;
+  std::vector<Histogram> local(kThreads);
+  Histogram shared, merged;
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i] {
+      for (int j = 1; j <= kValues; j++) {
+        local[i].Record(j);
+        shared.Record(j);
+      }
+      merged.Merge(local[i]);
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  for (auto *h : {&shared, &merged}) {
+    CHECK(h->Count() == kThreads * kValues);
+    CHECK(h->Min() == 1);
+    CHECK(h->Max() == kValues);
+    CHECK(h->Mean() == (kValues + 1) / 2.0);
+    uint64_t median = h->Percentile(50);
+    CHECK(median >= kValues / 2 && median <= kValues / 2 * 1.01);
+  }
+
+  Histogram moved(std::move(merged));
+  CHECK(moved.Count() == kThreads * kValues);
+  moved.Reset();
+  CHECK(moved.Count() == 0 && moved.Min() == 0 && moved.Percentile(99) == 0);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  TestBuckets();
+  TestPercentiles();
+  TestMerge();
+  std::printf("histogram tests passed\n");
+  return 0;
+}
@@ -0,0 +1,258 @@
+// loadgen.cc - an open-loop load generator for benchmarks
+
+#include "loadgen.h"
+
+#include "thread.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+
+namespace loadgen {
+
+namespace {
+
+// marks a slot that has no outstanding request
+constexpr uint64_t kNoRequest = std::numeric_limits<uint64_t>::max();
+// the number of consecutive windows that must look steady
+constexpr size_t kSteadyWindows = 3;
+// the most the mean latency may grow across those windows
+constexpr double kLatencyGrowth = 1.25;
+constexpr double kLatencySlackNs = 1000;
+// the measurement starts a little in the future, so all workers see it
+constexpr uint64_t kMeasureDelayUs = 100;
+// how often a worker checks for replies while draining
+constexpr uint64_t kDrainPollUs = 10;
+
+uint64_t TscToNs(uint64_t tsc) { return tsc * 1000 / cycles_per_us; }
+
+double Us(uint64_t ns) { return ns / 1000.0; }
+
+void HistogramJson(std::ostream &os, const Histogram &h) {
+  os << "{\"count\":" << h.Count() << ",\"min\":" << Us(h.Min())
+     << ",\"mean\":" << h.Mean() / 1000.0 << ",\"p50\":" << Us(h.Percentile(50))
+     << ",\"p90\":" << Us(h.Percentile(90))
+     << ",\"p99\":" << Us(h.Percentile(99))
+     << ",\"p999\":" << Us(h.Percentile(99.9))
+     << ",\"p9999\":" << Us(h.Percentile(99.99)) << ",\"max\":" << Us(h.Max())
+     << ",\"buckets_ns\":[";
+  bool first = true;
+  h.ForEachBucket([&](uint64_t v, uint64_t c) {
+    os << (first ? "" : ",") << "[" << v << "," << c << "]";
+    first = false;
+  });
+  os << "]}";
+}
+
+}  // anonymous namespace
+
+ArrivalFactory PoissonArrivals() {
+  return [](unsigned int worker, double rps) -> ArrivalFn {
+    std::mt19937_64 rg(std::random_device{}());
+    std::exponential_distribution<double> d(rps / 1e6);
+    return [rg, d]() mutable { return d(rg); };
+  };
+}
+
+Worker::Worker(Experiment *e, unsigned int index, ArrivalFn arrivals)
+    : e_(e), index_(index), arrivals_(std::move(arrivals)) {
+  uint64_t n = 1;
+  while (n < e->opts_.max_outstanding) n <<= 1;
+  slots_.reset(new Slot[n]);
+  slot_mask_ = n - 1;
+  for (uint64_t i = 0; i < n; i++) slots_[i].id = kNoRequest;
+}
+
+void Worker::Start() {
+  started_ = true;
+  e_->ready_.Done();
+  e_->go_.Wait();
+  // start at a random phase, so workers don't send in lockstep
+  next_us_ = arrivals_();
+}
+
+uint64_t Worker::Send(uint64_t due_tsc, uint64_t now) {
+  uint64_t id = next_id_++;
+  Slot &s = slots_[id & slot_mask_];
+
+  // an unanswered request in this slot is given up on (and counted as lost)
+  s.id.store(kNoRequest);
+  s.due_tsc = due_tsc;
+  s.sent_tsc = now;
+  s.measured = due_tsc >= e_->measure_start_tsc_.load(std::memory_order_relaxed);
+  s.id.store(id, std::memory_order_release);
+
+  if (!s.measured) return id;
+  sent_++;
+  uint64_t late_ns = TscToNs(now - due_tsc);
+  if (late_ns > e_->opts_.late_us * 1000) late_++;
+  max_late_ns_ = std::max(max_late_ns_, late_ns);
+  return id;
+}
+
+void Worker::Complete(uint64_t id) {
+  Slot &s = slots_[id & slot_mask_];
+  uint64_t cur = s.id.load(std::memory_order_acquire);
+  if (cur != id) return;
+
+  uint64_t due_tsc = s.due_tsc;
+  uint64_t sent_tsc = s.sent_tsc;
+  bool measured = s.measured;
+  // the sender may reuse the slot, and replies may be duplicated
+  if (!s.id.compare_exchange_strong(cur, kNoRequest)) return;
+
+  uint64_t now = rdtsc();
+  uint64_t response_ns = TscToNs(now - due_tsc);
+  all_completed_.fetch_add(1, std::memory_order_relaxed);
+  all_latency_ns_.fetch_add(response_ns, std::memory_order_relaxed);
+  if (!measured) return;
+
+  response_.Record(response_ns);
+  service_.Record(TscToNs(now - sent_tsc));
+  completed_.fetch_add(1, std::memory_order_release);
+}
+
+void Worker::Drain() {
+  uint64_t deadline = rdtsc() + e_->opts_.drain_us * cycles_per_us;
+  while (completed_.load(std::memory_order_acquire) < sent_ &&
+         rdtsc() < deadline)
+    rt::Sleep(kDrainPollUs);
+}
+
+Experiment::Experiment(const Options &opts)
+    : opts_(opts),
+      ready_(opts.workers),
+      go_(1),
+      start_tsc_(0),
+      measure_start_tsc_(kNoRequest),
+      measure_end_tsc_(kNoRequest) {
+  for (unsigned int i = 0; i < opts_.workers; i++) {
+    ArrivalFn fn = opts_.arrivals(i, opts_.rps / opts_.workers);
+    workers_.emplace_back(new Worker(this, i, std::move(fn)));
+  }
+}
+
+// @windows holds the throughput and mean latency of each interval so far.
+bool Experiment::Steady(
+    const std::vector<std::pair<double, double>> &windows) const {
+  if (windows.size() < kSteadyWindows) return false;
+
+  // allow for the variance of a Poisson process at low rates
+  double expected = opts_.rps * opts_.window_us / 1e6;
+  double tolerance = std::max(0.05, 3.0 / std::sqrt(expected));
+
+  auto first = windows.end() - kSteadyWindows;
+  for (auto it = first; it != windows.end(); it++) {
+    if (std::abs(it->first - opts_.rps) > tolerance * opts_.rps) return false;
+  }
+
+  return windows.back().second <=
+         first->second * kLatencyGrowth + kLatencySlackNs;
+}
+
+Result Experiment::Run(const std::function<void(Worker *)> &fn) {
+  std::vector<rt::Thread> threads;
+  for (auto &w : workers_) {
+    threads.emplace_back([this, &fn, w = w.get()] {
+      fn(w);
+      // don't hold up the others if this worker never sent anything
+      if (!w->started_) {
+        w->started_ = true;
+        ready_.Done();
+      }
+    });
+  }
+
+  ready_.Wait();
+  start_tsc_ = rdtsc();
+  go_.Done();
+
+  // warm up until the load is steady (a zero max_warmup_us skips this)
+  std::vector<std::pair<double, double>> windows;
+  uint64_t last_tsc = start_tsc_, last_completed = 0, last_latency = 0;
+  uint64_t elapsed_us = 0;
+  bool steady = false;
+  while (elapsed_us < opts_.max_warmup_us) {
+    rt::Sleep(opts_.window_us);
+    uint64_t now = rdtsc();
+    uint64_t completed = 0, latency = 0;
+    for (auto &w : workers_) {
+      completed += w->all_completed_.load(std::memory_order_relaxed);
+      latency += w->all_latency_ns_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t n = completed - last_completed;
+    double secs = (now - last_tsc) / (cycles_per_us * 1e6);
+    windows.emplace_back(n / secs,
+                         n ? static_cast<double>(latency - last_latency) / n : 0);
+    last_tsc = now;
+    last_completed = completed;
+    last_latency = latency;
+
+    elapsed_us = (now - start_tsc_) / cycles_per_us;
+    steady = Steady(windows);
+    if (steady && elapsed_us >= opts_.warmup_us) break;
+  }
+
+  // measure the requests that are due during the interval
+  uint64_t measure_start = rdtsc() + kMeasureDelayUs * cycles_per_us;
+  measure_start_tsc_.store(measure_start);
+  uint64_t measure_end = measure_start + opts_.duration_us * cycles_per_us;
+  measure_end_tsc_.store(measure_end);
+  while (rdtsc() < measure_start) cpu_relax();
+  if (opts_.on_start) opts_.on_start();
+  uint64_t now = rdtsc();
+  if (now < measure_end) rt::Sleep((measure_end - now) / cycles_per_us);
+  if (opts_.on_finish) opts_.on_finish();
+  for (auto &t : threads) t.Join();
+
+  Result r;
+  r.offered_rps = opts_.rps;
+  r.workers = opts_.workers;
+  r.warmup_us = (measure_start - start_tsc_) / cycles_per_us;
+  r.steady = steady;
+  r.duration_us = opts_.duration_us;
+  for (auto &w : workers_) {
+    r.sent += w->sent_;
+    r.completed += w->completed_;
+    r.late += w->late_;
+    r.max_late_ns = std::max(r.max_late_ns, w->max_late_ns_);
+    r.response.Merge(w->response_);
+    r.service.Merge(w->service_);
+  }
+  r.lost = r.sent - r.completed;
+  if (r.duration_us) r.achieved_rps = r.completed * 1e6 / r.duration_us;
+  return r;
+}
+
+std::string Result::Json(const std::string &benchmark,
+                         const Extra &extra) const {
+  std::ostringstream os;
+  os << "{\"benchmark\":\"" << benchmark << "\",\"offered_rps\":" << offered_rps
+     << ",\"achieved_rps\":" << achieved_rps << ",\"workers\":" << workers
+     << ",\"warmup_us\":" << warmup_us
+     << ",\"steady\":" << (steady ? "true" : "false")
+     << ",\"duration_us\":" << duration_us << ",\"sent\":" << sent
+     << ",\"completed\":" << completed << ",\"lost\":" << lost
+     << ",\"late\":" << late << ",\"max_late_us\":" << Us(max_late_ns);
+  for (auto &e : extra) os << ",\"" << e.first << "\":" << e.second;
+  os << ",\"latency_us\":";
+  HistogramJson(os, response);
+  os << ",\"service_us\":";
+  HistogramJson(os, service);
+  os << "}";
+  return os.str();
+}
+
+void Result::Report(const std::string &benchmark, const Extra &extra) const {
+  const char *path = std::getenv("LOADGEN_JSON");
+  if (!path) return;
+  std::ofstream f(path, std::ios::app);
+  f << Json(benchmark, extra) << std::endl;
+}
+
+}  // namespace loadgen
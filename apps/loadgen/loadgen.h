@@ -0,0 +1,205 @@
+// loadgen.h - an open-loop load generator for benchmarks
+//
+// An Experiment offers a fixed request rate, split evenly across workers. Each
+// worker runs in its own uthread and follows its own schedule of arrivals,
+// sending every request when it is due whether or not earlier requests have
+// completed. A worker that falls behind sends late requests immediately
+// instead of skipping them, and latency is measured from when each request
+// was due, so a stalled client can't hide queueing delay (coordinated
+// omission). The load is first run until it is steady, and then only the
+// requests that are due during the measurement interval are recorded.
+//
+// Typical use:
+//
+//   loadgen::Experiment e(opts);
+//   loadgen::Result r = e.Run([&](loadgen::Worker *w) {
+//     // start a receiver that calls w->Complete(id) for each reply
+//     loadgen::Request req;
+//     while (w->Next(&req)) send(req.id);
+//   });
+
+#pragma once
+
+extern "C" {
+#include <asm/ops.h>
+#include <base/compiler.h>
+#include <base/time.h>
+}
+
+#include "sync.h"
+#include "timer.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+
+namespace loadgen {
+
+// Returns the gap until the next arrival, in microseconds.
+using ArrivalFn = std::function<double()>;
+// Creates the arrival process of a worker, given its share of the load.
+using ArrivalFactory = std::function<ArrivalFn(unsigned int worker, double rps)>;
+
+// Exponentially distributed gaps (Poisson arrivals).
+ArrivalFactory PoissonArrivals();
+
+struct Options {
+  double rps = 0;             // offered load, requests per second
+  unsigned int workers = 1;   // uthreads generating the load
+  uint64_t duration_us = 0;   // measurement interval
+  uint64_t warmup_us = 100000;       // minimum warm-up
+  uint64_t max_warmup_us = 2000000;  // give up waiting (0 skips warm-up)
+  uint64_t window_us = 50000;        // interval of steady-state checks
+  uint64_t drain_us = 100000;        // wait for replies after the last send
+  uint64_t spin_us = 5;        // spin instead of sleeping for shorter gaps
+  uint64_t late_us = 5;        // sends later than this are counted as late
+  unsigned int max_outstanding = 16384;  // per worker, older ones are lost
+  ArrivalFactory arrivals = PoissonArrivals();
+  // called when the measurement starts and ends, e.g. to sample counters
+  std::function<void()> on_start;
+  std::function<void()> on_finish;
+};
+
+struct Request {
+  uint64_t id;
+  uint64_t due_ns;  // since the start of the experiment
+};
+
+class Experiment;
+
+class Worker {
+ public:
+  Worker(Experiment *e, unsigned int index, ArrivalFn arrivals);
+
+  unsigned int index() const { return index_; }
+
+  // Waits until the next request is due and fills in @r. Returns false once
+  // every request in the measurement interval has been sent and completed
+  // (or timed out). @flush is called whenever the worker has to wait, so
+  // batched requests can be sent.
+  template <typename F>
+  bool Next(Request *r, F flush);
+  bool Next(Request *r) {
+    return Next(r, [] {});
+  }
+
+  // Records the reply to request @id. May be called from any uthread, but
+  // not after the experiment's function has returned.
+  void Complete(uint64_t id);
+
+ private:
+  friend class Experiment;
+
+  struct Slot {
+    std::atomic<uint64_t> id;
+    uint64_t due_tsc;
+    uint64_t sent_tsc;
+    bool measured;
+  };
+
+  void Start();
+  void Drain();
+  uint64_t Send(uint64_t due_tsc, uint64_t now);
+
+  Experiment *e_;
+  unsigned int index_;
+  ArrivalFn arrivals_;
+  double next_us_ = 0;
+  uint64_t next_id_ = 0;
+  bool started_ = false;
+  std::unique_ptr<Slot[]> slots_;
+  uint64_t slot_mask_;
+
+  // owned by the sending uthread
+  uint64_t sent_ = 0;
+  uint64_t late_ = 0;
+  uint64_t max_late_ns_ = 0;
+
+  // updated by receivers
+  std::atomic<uint64_t> completed_{0};
+  std::atomic<uint64_t> all_completed_{0};
+  std::atomic<uint64_t> all_latency_ns_{0};
+  Histogram response_;
+  Histogram service_;
+};
+
+struct Result {
+  double offered_rps = 0;
+  double achieved_rps = 0;
+  unsigned int workers = 0;
+  uint64_t warmup_us = 0;
+  bool steady = false;  // the load reached a steady state before measuring
+  uint64_t duration_us = 0;
+  uint64_t sent = 0;
+  uint64_t completed = 0;
+  uint64_t lost = 0;
+  uint64_t late = 0;
+  uint64_t max_late_ns = 0;
+  // from when each request was due, correcting for coordinated omission
+  Histogram response;
+  // from when each request was actually sent
+  Histogram service;
+
+  using Extra = std::vector<std::pair<std::string, double>>;
+
+  // Formats the result as a single line of JSON.
+  std::string Json(const std::string &benchmark, const Extra &extra = {}) const;
+  // Appends the JSON line to the file named by $LOADGEN_JSON, if it is set.
+  void Report(const std::string &benchmark, const Extra &extra = {}) const;
+};
+
+class Experiment {
+ public:
+  explicit Experiment(const Options &opts);
+
+  // Runs @fn in a uthread for each worker, and returns once all have exited.
+  // Can only be called once.
+  Result Run(const std::function<void(Worker *)> &fn);
+
+  const Options &options() const { return opts_; }
+
+ private:
+  friend class Worker;
+
+  bool Steady(const std::vector<std::pair<double, double>> &windows) const;
+
+  Options opts_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  rt::WaitGroup ready_;
+  rt::WaitGroup go_;
+  uint64_t start_tsc_;
+  std::atomic<uint64_t> measure_start_tsc_;
+  std::atomic<uint64_t> measure_end_tsc_;
+};
+
+template <typename F>
+bool Worker::Next(Request *r, F flush) {
+  if (unlikely(!started_)) Start();
+
+  uint64_t due = e_->start_tsc_ + static_cast<uint64_t>(next_us_ * cycles_per_us);
+  if (due >= e_->measure_end_tsc_.load(std::memory_order_relaxed)) {
+    flush();
+    Drain();
+    return false;
+  }
+
+  uint64_t now = rdtsc();
+  if (now < due) {
+    flush();
+    uint64_t gap_us = (due - now) / cycles_per_us;
+    if (gap_us > e_->opts_.spin_us) rt::Sleep(gap_us - e_->opts_.spin_us);
+    while ((now = rdtsc()) < due) cpu_relax();
+  }
+
+  r->id = Send(due, now);
+  r->due_ns = next_us_ * 1000;
+  next_us_ += arrivals_();
+  return true;
+}
+
+}  // namespace loadgen
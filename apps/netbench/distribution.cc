@@ -23,6 +23,16 @@ Distribution *DistributionFactory(std::string s) {
     double high = std::stod(tokens[2], nullptr);
     double frac = std::stod(tokens[3], nullptr);
     return new BimodalDistribution(rand(), low, high, frac);
+  } else if (tokens[0] == "lognormal" && cnt == 3) {
+    double mean = std::stod(tokens[1], nullptr);
+    double sigma = std::stod(tokens[2], nullptr);
+    if (mean <= 0 || sigma < 0) return nullptr;
+    return new LognormalDistribution(rand(), mean, sigma);
+  } else if (tokens[0] == "pareto" && cnt == 3) {
+    double mean = std::stod(tokens[1], nullptr);
+    double alpha = std::stod(tokens[2], nullptr);
+    if (mean <= 0 || alpha <= 1) return nullptr;
+    return new ParetoDistribution(rand(), mean, alpha);
   }
 
   // invalid type of worker
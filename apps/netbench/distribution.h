@@ -2,7 +2,9 @@
 
 #pragma once
 
+#include <cmath>
 #include <random>
+#include <string>
 
 class Distribution {
  public:
@@ -56,5 +58,50 @@ class ExponentialDistribution : public Distribution {
   std::exponential_distribution<double> dist_;
 };
 
+// Heavy-tailed, with most samples near the median. @sigma is the standard
+// deviation of log(x), so larger values give a longer tail.
+class LognormalDistribution : public Distribution {
+ public:
+  LognormalDistribution(int seed, double mean, double sigma)
+      : mean_(mean),
+        rand_(seed),
+        dist_(std::log(mean) - sigma * sigma / 2.0, sigma) {}
+  ~LognormalDistribution() {}
+
+  double operator()() { return dist_(rand_); }
+  double Mean() const { return mean_; }
+
+ private:
+  const double mean_;
+  std::mt19937 rand_;
+  std::lognormal_distribution<double> dist_;
+};
+
+// Power-law tail, P(X > x) = (xm / x)^alpha for x >= xm. @alpha must be
+// greater than 1 for the mean to exist, and the tail gets heavier as it
+// approaches 1.
+class ParetoDistribution : public Distribution {
+ public:
+  ParetoDistribution(int seed, double mean, double alpha)
+      : mean_(mean),
+        alpha_(alpha),
+        xm_(mean * (alpha - 1.0) / alpha),
+        rand_(seed),
+        dist_(0.0, 1.0) {}
+  ~ParetoDistribution() {}
+
+  double operator()() {
+    return xm_ / std::pow(1.0 - dist_(rand_), 1.0 / alpha_);
+  }
+  double Mean() const { return mean_; }
+
+ private:
+  const double mean_;
+  const double alpha_;
+  const double xm_;
+  std::mt19937 rand_;
+  std::uniform_real_distribution<double> dist_;
+};
+
 // Parses a string to generate one of the above distributions.
 Distribution *DistributionFactory(std::string s);
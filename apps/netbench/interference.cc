@@ -6,16 +6,15 @@
 #include "timer.h"
 
 #include "distribution.h"
+#include "loadgen.h"
 #include "synthetic_worker.h"
-#include "util.h"
 
-#include <algorithm>
-#include <chrono>
 #include <cstdint>
 #include <iomanip>
 #include <iostream>
-#include <list>
+#include <limits>
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -28,31 +27,37 @@ constexpr uint64_t kQueueSize = 4096;
 // number of measurement steps to take
 constexpr double kSteps = 30.0;
 // measurement duration in us
-constexpr double kDuration = 2000000.0;
+constexpr uint64_t kDuration = 2000000;
+
+// a request waiting for a worker
+struct job {
+  uint64_t id;
+  double work_us;
+};
 
 class Queue {
  public:
   Queue(uint32_t capacity)
       : closed_(false), head_(0), tail_(0), size_(capacity), m_(), cv_() {
-    q_.reserve(capacity);
+    q_.resize(capacity);
   }
   ~Queue(){};
 
-  // Enqueues a work unit into the queue (returns true if queue is nonfull).
-  bool Enqueue(work_unit w) {
+  // Enqueues a job into the queue (returns true if queue is nonfull).
+  bool Enqueue(job j) {
     rt::ScopedLock<rt::Mutex> l(&m_);
     if (head_ - tail_ >= size_) return false;
-    q_[head_++ % size_] = w;
+    q_[head_++ % size_] = j;
     cv_.Signal();
     return true;
   }
 
-  // Dequeues a work unit from the queue (returns true if not closed).
-  bool Dequeue(work_unit *w, bool block) {
+  // Dequeues a job from the queue (returns true if not closed).
+  bool Dequeue(job *j, bool block) {
     rt::ScopedLock<rt::Mutex> l(&m_);
     while (block && head_ == tail_ && !closed_) cv_.Wait(&m_);
     if (head_ == tail_ && (!block || closed_)) return false;
-    *w = q_[tail_++ % size_];
+    *j = q_[tail_++ % size_];
     return true;
   }
 
@@ -70,120 +75,64 @@ class Queue {
   const uint32_t size_;
   rt::Mutex m_;
   rt::CondVar cv_;
-  std::vector<work_unit> q_;
+  std::vector<job> q_;
 };
 
-std::vector<work_unit> RtcWorker(Queue *q, Timer *t, rt::WaitGroup *wg,
-                                 int max_work) {
+void RtcWorker(Queue *q, loadgen::Worker *lw) {
   std::unique_ptr<SyntheticWorker> worker(
       SyntheticWorkerFactory("stridedmem:3200000:64"));
-  std::vector<work_unit> wv;
-  wv.reserve(max_work);
-
-  wg->Done();
-  wg->Wait();
 
-  work_unit w;
-  while (q->Dequeue(&w, true)) {
-    worker->Work(static_cast<uint64_t>(w.work_us * kIterationsPerUS));
-    w.duration_us = t->Elapsed() - w.start_us;
-    wv.emplace_back(w);
+  job j;
+  while (q->Dequeue(&j, true)) {
+    worker->Work(static_cast<uint64_t>(j.work_us * kIterationsPerUS));
+    lw->Complete(j.id);
   }
-
-  return wv;
-}
-
-std::vector<work_unit> GenerateWork(double offered_rps, double duration,
-                                    Distribution *sd, int cpu) {
-  std::mt19937 rg(rand());
-  std::exponential_distribution<double> rd(1.0 / (1000000.0 / offered_rps));
-  return GenerateWork(std::bind(rd, rg), sd, 0, duration, cpu);
 }
 
-std::vector<work_unit> RunExperiment(double offered_rps, Distribution *sd,
-                                     int workers, bool dfcfs) {
-  Timer t;
-  rt::WaitGroup wg(workers + 1);
-  rt::Thread threads[workers];
-  std::vector<work_unit> wq;
-  std::vector<work_unit> samples[workers];
-
+loadgen::Result RunExperiment(double offered_rps, Distribution *sd,
+                              int workers, bool dfcfs) {
   // initialize the queues
   std::vector<std::unique_ptr<Queue>> qs;
   if (!dfcfs) {
     qs.emplace_back(new Queue(kQueueSize * workers));
-    wq = GenerateWork(offered_rps, kDuration, sd, 0);
   } else {
-    for (int i = 0; i < workers; ++i) {
-      qs.emplace_back(new Queue(kQueueSize));
-      auto tmp = GenerateWork(offered_rps / static_cast<double>(workers),
-                              kDuration, sd, i);
-      wq.insert(wq.end(), tmp.begin(), tmp.end());
-    }
-    std::sort(wq.begin(), wq.end(), [](const work_unit &s1, work_unit &s2) {
-      return s1.start_us < s2.start_us;
-    });
-  }
-  int max_work = div_up(wq.size(), workers);
-
-  // create a thread per worker
-  for (int i = 0; i < workers; ++i) {
-    Queue *q = dfcfs ? qs[i].get() : qs[0].get();
-    threads[i] = rt::Thread(
-        [&, q, i]() { samples[i] = RtcWorker(q, &t, &wg, max_work); });
+    for (int i = 0; i < workers; ++i) qs.emplace_back(new Queue(kQueueSize));
   }
 
-  // try to get a clean start time
-  wg.Done();
-  wg.Wait();
-  t.Reset();
-
-  // generate load
-  for (auto w : wq) {
-    t.SpinUntil(w.start_us);
-    qs[dfcfs ? w.cpu : 0]->Enqueue(w);
-  }
-  for (auto &q : qs) q->Close();
-
-  // wait for the workers to finish running
-  for (int i = 0; i < workers; ++i) threads[i].Join();
+  // a single generator, which has a core to itself and never sleeps
+  loadgen::Options opts;
+  opts.rps = offered_rps;
+  opts.workers = 1;
+  opts.duration_us = kDuration;
+  opts.spin_us = std::numeric_limits<uint64_t>::max();
+  loadgen::Experiment e(opts);
+
+  return e.Run([&](loadgen::Worker *lw) {
+    // create a thread per worker
+    std::vector<rt::Thread> threads;
+    for (int i = 0; i < workers; ++i) {
+      Queue *q = dfcfs ? qs[i].get() : qs[0].get();
+      threads.emplace_back([q, lw] { RtcWorker(q, lw); });
+    }
 
-  // aggregate all the samples together
-  std::vector<work_unit> result;
-  for (int i = 0; i < workers; ++i) {
-    auto &v = samples[i];
-    result.insert(result.end(), v.begin(), v.end());
-  }
-  return result;
-}
+    // generate load, spreading it evenly across the queues with dFCFS;
+    // requests that find their queue full are lost
+    std::mt19937 rg(rand());
+    std::uniform_int_distribution<int> qd(0, workers - 1);
+    loadgen::Request req;
+    while (lw->Next(&req)) {
+      Queue *q = qs[dfcfs ? qd(rg) : 0].get();
+      q->Enqueue(job{req.id, (*sd)()});
+    }
+    for (auto &q : qs) q->Close();
 
-void PrintResults(double offered_rps, double duration,
-                  std::vector<work_unit> w) {
-  // remove any request that didn't complete during the duration
-  w.erase(std::remove_if(w.begin(), w.end(),
-                         [duration](const work_unit &s) {
-                           return s.duration_us + s.start_us > duration;
-                         }),
-          w.end());
-
-  // sort all results by completion duration
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.duration_us < s2.duration_us;
+    // wait for the workers to finish running
+    for (auto &t : threads) t.Join();
   });
+}
 
-  // calculate various statistics on the results
-  double count = static_cast<double>(w.size());
-  double achieved_rps = count / (duration / 1000000.0);
-  double sum = std::accumulate(
-      w.begin(), w.end(), 0.0,
-      [](double s, const work_unit &c) { return s + c.duration_us; });
-  double mean = sum / count;
-  double p90 = w[count * 0.9].duration_us;
-  double p99 = w[count * 0.99].duration_us;
-  double p999 = w[count * 0.999].duration_us;
-  double p9999 = w[count * 0.9999].duration_us;
-  double min = w[0].duration_us;
-  double max = w[w.size() - 1].duration_us;
+void PrintResults(const loadgen::Result &r, int workers, bool dfcfs) {
+  const loadgen::Histogram &h = r.response;
 
   static bool first = true;
   if (first) {
@@ -194,10 +143,14 @@ void PrintResults(double offered_rps, double duration,
   }
 
   // print out the results
-  std::cout << std::setprecision(4) << std::fixed << offered_rps << ","
-            << achieved_rps << "," << count << "," << min << "," << mean << ","
-            << p90 << "," << p99 << "," << p999 << "," << p9999 << "," << max
+  std::cout << std::setprecision(4) << std::fixed << r.offered_rps << ","
+            << r.achieved_rps << "," << r.completed << "," << h.Min() / 1000.0
+            << "," << h.Mean() / 1000.0 << "," << h.Percentile(90) / 1000.0
+            << "," << h.Percentile(99) / 1000.0 << ","
+            << h.Percentile(99.9) / 1000.0 << ","
+            << h.Percentile(99.99) / 1000.0 << "," << h.Max() / 1000.0
             << std::endl;
+  r.Report("interference", {{"workers", workers}, {"dfcfs", dfcfs}});
 }
 
 int MainHandler(int argc, char *argv[]) {
@@ -219,8 +172,7 @@ int MainHandler(int argc, char *argv[]) {
   if (max_rps == 0) max_rps = 5000000.0;
 
   for (double rps = max_rps / kSteps; rps <= max_rps; rps += max_rps / kSteps) {
-    auto w = RunExperiment(rps, sd.get(), workers, dfcfs);
-    PrintResults(rps, kDuration, w);
+    PrintResults(RunExperiment(rps, sd.get(), workers, dfcfs), workers, dfcfs);
   }
 
   return 0;
@@ -4,20 +4,22 @@ extern "C" {
 #include <unistd.h>
 }
 
+#include "distribution.h"
+#include "loadgen.h"
 #include "net.h"
 #include "runtime.h"
 #include "sync.h"
 #include "synthetic_worker.h"
 #include "thread.h"
 #include "timer.h"
+#include "trace.h"
 
 #include <algorithm>
-#include <chrono>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
-#include <numeric>
 #include <random>
 #include <sstream>
 #include <string>
@@ -26,20 +28,22 @@ extern "C" {
 
 namespace {
 
-using namespace std::chrono;
-using sec = duration<double, std::micro>;
-
 // <- ARGUMENTS FOR EXPERIMENT ->
 // the number of worker threads to spawn.
 int threads;
 // the remote UDP address of the server.
 netaddr raddr;
-// the mean service time in us.
-double st;
+// the service time distribution, in us.
+std::string service_spec;
+// the trace to replay, how much to stretch its time by, and which of the
+// clients replaying it this is.
+std::unique_ptr<Trace> trace;
+double time_scale;
+unsigned int shard, nshards;
+// how long to replay for, or 0 for one pass through the trace.
+uint64_t replay_us;
 // number of iterations required for 1us on target server
 constexpr uint64_t kIterationsPerUS = 65;  // 83
-// Number of seconds to warmup at rate 0
-constexpr uint64_t kWarmupUpSeconds = 5;
 
 static std::vector<std::pair<double, uint64_t>> rates;
 
@@ -118,10 +122,23 @@ struct payload {
   uint64_t index;
   uint64_t tsc_end;
   uint32_t cpu;
+  uint32_t len;  // bytes of request body that follow
 };
 
-// The maximum lateness to tolerate before dropping egress samples.
-constexpr uint64_t kMaxCatchUpUS = 5;
+// Reads and throws away @len bytes from @c.
+bool Discard(rt::TcpConn *c, size_t len) {
+  char buf[4096];
+  while (len > 0) {
+    size_t n = std::min(len, sizeof(buf));
+    ssize_t ret = c->ReadFull(buf, n);
+    if (ret != static_cast<ssize_t>(n)) {
+      if (ret != 0 && ret != -ECONNRESET) log_err("read failed, ret = %ld", ret);
+      return false;
+    }
+    len -= n;
+  }
+  return true;
+}
 
 void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
   payload p;
@@ -137,12 +154,14 @@ void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
       log_err("read failed, ret = %ld", ret);
       break;
     }
+    if (!Discard(c.get(), ntoh32(p.len))) break;
 
     // Perform fake work if requested.
     uint64_t workn = ntoh64(p.work_iterations);
     if (workn != 0) w->Work(workn);
     p.tsc_end = hton64(rdtscp(&p.cpu));
     p.cpu = hton32(p.cpu);
+    p.len = 0;
 
     // Send a work response.
     ssize_t sret = c->WriteFull(&p, ret);
@@ -168,30 +187,19 @@ void ServerHandler(void *arg) {
   }
 }
 
-struct work_unit {
-  double start_us, work_us, duration_us;
-  uint64_t tsc;
-  uint32_t cpu;
+// The service time and size of a request.
+struct request_spec {
+  double service_us;
+  uint32_t bytes;  // including the header, no less than sizeof(payload)
 };
+// Describes the request with the given id.
+using RequestFn = std::function<request_spec(uint64_t id)>;
 
-template <class Arrival, class Service>
-std::vector<work_unit> GenerateWork(Arrival a, Service s, double cur_us,
-                                    double last_us) {
-  std::vector<work_unit> w;
-  while (cur_us < last_us) {
-    cur_us += a();
-    w.emplace_back(work_unit{cur_us, s(), 0});
-  }
-  return w;
-}
-
-std::vector<work_unit> ClientWorker(
-    rt::TcpConn *c, rt::WaitGroup *starter,
-    std::function<std::vector<work_unit>()> wf) {
+// Sends requests on @c as they come due, while a receiver thread records
+// the replies.
+void ClientWorker(rt::TcpConn *c, loadgen::Worker *w, RequestFn next) {
   constexpr int kBatchSize = 32;
-  std::vector<work_unit> w(wf());
-  std::vector<time_point<steady_clock>> timings;
-  timings.reserve(w.size());
+  constexpr size_t kBatchBytes = 65536;
 
   // Start the receiver thread.
   auto th = rt::Thread([&] {
@@ -203,218 +211,153 @@ std::vector<work_unit> ClientWorker(
         if (ret == 0 || ret < 0) break;
         panic("read failed, ret = %ld", ret);
       }
-
-      barrier();
-      auto ts = steady_clock::now();
-      barrier();
-      uint64_t idx = ntoh64(rp.index);
-      w[idx].duration_us = duration_cast<sec>(ts - timings[idx]).count();
-      w[idx].tsc = ntoh64(rp.tsc_end);
-      w[idx].cpu = ntoh32(rp.cpu);
+      w->Complete(ntoh64(rp.index));
     }
   });
 
-  // Synchronized start of load generation.
-  starter->Done();
-  starter->Wait();
-
-  barrier();
-  auto expstart = steady_clock::now();
-  barrier();
-
-  payload p[kBatchSize];
+  std::vector<char> buf;
+  buf.reserve(kBatchBytes);
   int j = 0;
-  auto wsize = w.size();
-
-  for (unsigned int i = 0; i < wsize; ++i) {
-    barrier();
-    auto now = steady_clock::now();
-    barrier();
-    if (duration_cast<sec>(now - expstart).count() < w[i].start_us) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-      now = steady_clock::now();
-      rt::Sleep(w[i].start_us - duration_cast<sec>(now - expstart).count());
-    }
-    if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-        kMaxCatchUpUS)
-      continue;
-
-    barrier();
-    timings[i] = steady_clock::now();
-    barrier();
-
-    // Enqueue a network request.
-    p[j].work_iterations = hton64(w[i].work_us * kIterationsPerUS);
-    p[j].index = hton64(i);
-    j++;
-
-    if (j >= kBatchSize || i == wsize - 1) {
-      ssize_t ret = c->WriteFull(p, sizeof(payload) * j);
-      if (ret != static_cast<ssize_t>(sizeof(payload) * j))
-        panic("write failed, ret = %ld", ret);
-      j = 0;
-    }
+  auto flush = [&] {
+    if (j == 0) return;
+    ssize_t ret = c->WriteFull(buf.data(), buf.size());
+    if (ret != static_cast<ssize_t>(buf.size()))
+      panic("write failed, ret = %ld", ret);
+    buf.clear();
+    j = 0;
+  };
+
+  loadgen::Request req;
+  while (w->Next(&req, flush)) {
+    // Enqueue a network request, padded out to its size.
+    request_spec s = next(req.id);
+    payload p = {};
+    p.work_iterations = hton64(s.service_us * kIterationsPerUS);
+    p.index = hton64(req.id);
+    uint32_t len = s.bytes > sizeof(p) ? s.bytes - sizeof(p) : 0;
+    p.len = hton32(len);
+    const char *hdr = reinterpret_cast<const char *>(&p);
+    buf.insert(buf.end(), hdr, hdr + sizeof(p));
+    buf.resize(buf.size() + len);
+    if (++j >= kBatchSize || buf.size() >= kBatchBytes) flush();
   }
 
-  // rt::Sleep(1 * rt::kSeconds);
   c->Shutdown(SHUT_RDWR);
   th.Join();
+}
 
-  return w;
+void PrintStatResults(const loadgen::Result &r, double cpu_usage,
+                      const char *benchmark) {
+  const loadgen::Histogram &h = r.response;
+  std::cout  //<<
+             //"#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max"
+             //<< std::endl
+      << std::setprecision(4) << std::fixed << threads << "," << r.offered_rps
+      << "," << r.achieved_rps << "," << cpu_usage << "," << r.completed << ","
+      << h.Min() / 1000.0 << "," << h.Mean() / 1000.0 << ","
+      << h.Percentile(90) / 1000.0 << "," << h.Percentile(99) / 1000.0 << ","
+      << h.Percentile(99.9) / 1000.0 << "," << h.Percentile(99.99) / 1000.0
+      << "," << h.Max() / 1000.0 << std::endl;
+  r.Report(benchmark, {{"cpu_usage", cpu_usage}});
 }
 
-std::vector<work_unit> RunExperiment(
-    int threads, double *reqs_per_sec, double *cpu_usage,
-    std::function<std::vector<work_unit>()> wf) {
-  // Create one TCP connection per thread.
+// Runs an experiment with a TCP connection per worker, where
+// @requests(worker) describes the requests that worker sends.
+void RunExperiment(loadgen::Options opts,
+                   const std::function<RequestFn(unsigned int)> &requests,
+                   const char *benchmark) {
+  // Create one TCP connection per worker.
   std::vector<std::unique_ptr<rt::TcpConn>> conns;
-  for (int i = 0; i < threads; ++i) {
+  for (unsigned int i = 0; i < opts.workers; ++i) {
     std::unique_ptr<rt::TcpConn> outc(rt::TcpConn::Dial({0, 0}, raddr));
     if (unlikely(outc == nullptr)) panic("couldn't connect to raddr.");
     conns.emplace_back(std::move(outc));
   }
 
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
-  std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<work_unit>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
-    th.emplace_back(rt::Thread([&, i] {
-      auto v = ClientWorker(conns[i].get(), &starter, wf);
-      samples[i].reset(new std::vector<work_unit>(std::move(v)));
-    }));
-  }
-
-  // Give the workers time to initialize, then start recording.
-  starter.Done();
-  starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
-  auto start = steady_clock::now();
-  barrier();
-  uptime u1 = ReadUptime();
-
-  // Wait for the workers to finish.
-  for (auto &t : th) t.Join();
+  // Sample the server's CPU usage while measuring.
+  uptime u1, u2;
+  opts.on_start = [&] { u1 = ReadUptime(); };
+  opts.on_finish = [&] { u2 = ReadUptime(); };
 
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = steady_clock::now();
-  barrier();
-  uptime u2 = ReadUptime();
+  loadgen::Experiment e(opts);
+  loadgen::Result r = e.Run([&](loadgen::Worker *w) {
+    ClientWorker(conns[w->index()].get(), w, requests(w->index()));
+  });
 
   // Close the connections.
   for (auto &c : conns) c->Abort();
 
-  // Aggregate all the samples together.
-  std::vector<work_unit> w;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    w.insert(w.end(), v.begin(), v.end());
-  }
-
-  // Remove requests that did not complete.
-  w.erase(std::remove_if(w.begin(), w.end(),
-                         [](const work_unit &s) { return s.duration_us == 0; }),
-          w.end());
-
-  // Report results.
-  double elapsed = duration_cast<sec>(finish - start).count();
-  if (reqs_per_sec != nullptr)
-    *reqs_per_sec = static_cast<double>(w.size()) / elapsed * 1000000;
+  // Print the results.
   uint64_t idle = u2.idle - u1.idle;
   uint64_t busy = u2.busy - u1.busy;
-  if (cpu_usage != nullptr)
-    *cpu_usage = static_cast<double>(busy) / static_cast<double>(idle + busy);
-  return w;
-}
-
-void PrintRawResults(std::vector<work_unit> w) {
-  std::sort(w.begin(), w.end(),
-            [](const work_unit &s1, work_unit &s2) { return s1.tsc < s2.tsc; });
-  for (const work_unit &u : w) {
-    std::cout << std::setprecision(2) << std::fixed << u.start_us << ","
-              << u.duration_us << "," << u.work_us << "," << u.tsc << ","
-              << u.cpu << std::endl;
-  }
-}
-
-void PrintStatResults(std::vector<work_unit> w, double offered_rps, double rps,
-                      double cpu_usage) {
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.duration_us < s2.duration_us;
-  });
-  double sum = std::accumulate(
-      w.begin(), w.end(), 0.0,
-      [](double s, const work_unit &c) { return s + c.duration_us; });
-  double mean = sum / w.size();
-  double count = static_cast<double>(w.size());
-  double p90 = w[count * 0.9].duration_us;
-  double p99 = w[count * 0.99].duration_us;
-  double p999 = w[count * 0.999].duration_us;
-  double p9999 = w[count * 0.9999].duration_us;
-  double min = w[0].duration_us;
-  double max = w[w.size() - 1].duration_us;
-  std::cout  //<<
-             //"#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max"
-             //<< std::endl
-      << std::setprecision(4) << std::fixed << threads << "," << offered_rps
-      << "," << rps << "," << cpu_usage << "," << w.size() << "," << min << ","
-      << mean << "," << p90 << "," << p99 << "," << p999 << "," << p9999 << ","
-      << max << std::endl;
+  PrintStatResults(
+      r, static_cast<double>(busy) / static_cast<double>(idle + busy),
+      benchmark);
 }
 
 void SteadyStateExperiment(int threads, double offered_rps,
-                           double service_time) {
-  double rps, cpu_usage;
-  std::vector<work_unit> w = RunExperiment(threads, &rps, &cpu_usage, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 dg(rand());
-    std::exponential_distribution<double> rd(
-        1.0 / (1000000.0 / (offered_rps / static_cast<double>(threads))));
-    std::exponential_distribution<double> wd(1.0 / service_time);
-    return GenerateWork(std::bind(rd, rg), std::bind(wd, dg), 0, 2000000);
-  });
-
-  // Print the results.
-  PrintStatResults(w, offered_rps, rps, cpu_usage);
+                           uint64_t duration_us) {
+  loadgen::Options opts;
+  opts.rps = offered_rps;
+  opts.workers = threads;
+  opts.duration_us = duration_us;
+
+  RunExperiment(
+      opts,
+      [](unsigned int worker) -> RequestFn {
+        std::shared_ptr<Distribution> d(DistributionFactory(service_spec));
+        return [d](uint64_t id) { return request_spec{(*d)(), 0}; };
+      },
+      "netbench");
 }
 
-void LoadShiftExperiment(int threads,
-                         const std::vector<std::pair<double, uint64_t>> &rates,
-                         double service_time) {
-  auto w = RunExperiment(threads, nullptr, nullptr, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 wg(rand());
-    std::exponential_distribution<double> wd(1.0 / service_time);
-    std::vector<work_unit> w1;
-    uint64_t last_us = 0;
-    for (auto &r : rates) {
-      std::exponential_distribution<double> rd(
-          1.0 / (1000000.0 / (r.first / static_cast<double>(threads))));
-      auto work = GenerateWork(std::bind(rd, rg), std::bind(wd, wg), last_us,
-                               last_us + r.second);
-      last_us = work.back().start_us;
-      w1.insert(w1.end(), work.begin(), work.end());
-    }
-    return w1;
-  });
-  PrintRawResults(w);
+// Replays this client's shard of the trace, once through unless
+// @duration_us is given. Connections in the trace are spread across the
+// threads, and the trace starts over if it runs out.
+void ReplayExperiment(uint64_t duration_us) {
+  std::vector<std::vector<trace_record>> lists =
+      trace->Shard(shard, nshards, threads);
+  if (lists.empty()) panic("no connections in shard %u", shard);
+
+  uint64_t n = 0;
+  for (auto &l : lists) n += l.size();
+  uint64_t origin = trace->OriginNs();
+  uint64_t period = trace->PeriodNs();
+
+  loadgen::Options opts;
+  opts.rps = n * 1e9 / (period * time_scale);
+  opts.workers = lists.size();
+  opts.duration_us = duration_us ? duration_us : period * time_scale / 1000;
+  // the trace's own ramp-up is part of what is being replayed
+  opts.warmup_us = opts.max_warmup_us = 0;
+  opts.arrivals = [&](unsigned int worker, double rps) -> loadgen::ArrivalFn {
+    return TraceArrivals(&lists[worker], origin, period, time_scale);
+  };
+
+  RunExperiment(
+      opts,
+      [&](unsigned int worker) -> RequestFn {
+        const std::vector<trace_record> *l = &lists[worker];
+        return [l](uint64_t id) {
+          const trace_record &r = (*l)[id % l->size()];
+          return request_spec{r.service_ns / 1000.0, r.request_bytes};
+        };
+      },
+      "netbench_replay");
 }
 
 void ClientHandler(void *arg) {
-  // LoadShiftExperiment(threads, rates, st);
-#if 1
+  // Measure each requested rate, or sweep through rates if none were given.
+  for (auto &r : rates) SteadyStateExperiment(threads, r.first, r.second);
+  if (!rates.empty()) return;
+
   for (double i = 50000; i <= 8000000; i += 50000) {
-    SteadyStateExperiment(threads, i, st);
+    SteadyStateExperiment(threads, i, 2000000);
   }
-#endif
 }
 
+void ReplayHandler(void *arg) { ReplayExperiment(replay_us); }
+
 int StringToAddr(const char *str, uint32_t *addr) {
   uint8_t a, b, c, d;
 
@@ -452,14 +395,21 @@ int main(int argc, char *argv[]) {
       printf("failed to start runtime\n");
       return ret;
     }
-  } else if (cmd.compare("client") != 0) {
+  } else if (cmd.compare("client") != 0 && cmd.compare("replay") != 0) {
     std::cerr << "invalid command: " << cmd << std::endl;
     return -EINVAL;
   }
 
-  if (argc < 7) {
-    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [service_us] "
+  if (argc < 6) {
+    std::cerr << "usage: [cfg_file] client [#threads] [remote_ip] [service] "
                  "[<request_rate>:<us_duration>]..."
+              << std::endl
+              << "       [cfg_file] replay [#threads] [remote_ip] [trace_file] "
+                 "[time_scale] [<shard>/<nshards>] [us_duration]"
+              << std::endl
+              << "service is a mean in us (exponential), or fixed:<us>, "
+                 "exponential:<us>, bimodal:<low>:<high>:<frac>, "
+                 "lognormal:<mean>:<sigma> or pareto:<mean>:<alpha>"
               << std::endl;
     return -EINVAL;
   }
@@ -470,18 +420,44 @@ int main(int argc, char *argv[]) {
   if (ret) return -EINVAL;
   raddr.port = kNetbenchPort;
 
-  st = std::stod(argv[5], nullptr);
+  if (cmd.compare("replay") == 0) {
+    trace = Trace::Load(argv[5]);
+    if (!trace) return -EINVAL;
+    time_scale = argc > 6 ? std::stod(argv[6], nullptr) : 1.0;
+    shard = 0;
+    nshards = 1;
+    if (argc > 7 && (sscanf(argv[7], "%u/%u", &shard, &nshards) != 2 ||
+                     shard >= nshards)) {
+      std::cerr << "invalid shard: " << argv[7] << std::endl;
+      return -EINVAL;
+    }
+    replay_us = argc > 8 ? std::stoll(argv[8], nullptr, 0) : 0;
+    if (time_scale <= 0) return -EINVAL;
+
+    ret = runtime_init(argv[1], ReplayHandler, NULL);
+    if (ret) {
+      printf("failed to start runtime\n");
+      return ret;
+    }
+    return 0;
+  }
+
+  // a bare number is the mean of an exponential distribution
+  service_spec = argv[5];
+  char *end;
+  std::strtod(argv[5], &end);
+  if (end != argv[5] && *end == '\0') service_spec = "exponential:" + service_spec;
+  std::unique_ptr<Distribution> d(DistributionFactory(service_spec));
+  if (!d) {
+    std::cerr << "invalid service time distribution: " << argv[5] << std::endl;
+    return -EINVAL;
+  }
 
   for (i = 6; i < argc; i++) {
     std::vector<std::string> tokens = split(argv[i], ':');
     if (tokens.size() != 2) return -EINVAL;
     double rate = std::stod(tokens[0], nullptr);
     uint64_t duration = std::stoll(tokens[1], nullptr, 0);
-#if 0
-    if (i == 6) {
-      rates.emplace_back(rate, kWarmupUpSeconds * 1e6);
-    }
-#endif
     rates.emplace_back(rate, duration);
   }
 
@@ -0,0 +1,143 @@
+// trace.cc - recorded request traces for replay
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+bool LoadBinary(std::ifstream &f, std::vector<trace_record> *records) {
+  trace_header h;
+  if (!f.read(reinterpret_cast<char *>(&h), sizeof(h))) return false;
+  if (std::memcmp(h.magic, kTraceMagic, sizeof(h.magic)) != 0) return false;
+
+  // check the size before allocating anything
+  std::streamoff start = f.tellg();
+  f.seekg(0, std::ios::end);
+  uint64_t len = f.tellg() - start;
+  f.seekg(start);
+  if (len != h.nr_records * sizeof(trace_record)) {
+    std::cerr << "trace: expected " << h.nr_records << " records, found "
+              << len / sizeof(trace_record) << std::endl;
+    return true;
+  }
+
+  records->resize(h.nr_records);
+  if (!f.read(reinterpret_cast<char *>(records->data()), len))
+    records->clear();
+  return true;
+}
+
+bool ParseLine(const std::string &line, trace_record *r) {
+  const char *p = line.c_str();
+  char *end;
+
+  double ts_us = std::strtod(p, &end);
+  if (end == p || *end++ != ',') return false;
+  p = end;
+  unsigned long bytes = std::strtoul(p, &end, 10);
+  if (end == p || *end++ != ',') return false;
+  p = end;
+  double service_us = std::strtod(p, &end);
+  if (end == p || *end++ != ',') return false;
+  p = end;
+  unsigned long conn = std::strtoul(p, &end, 10);
+  if (end == p || ts_us < 0 || service_us < 0) return false;
+
+  r->timestamp_ns = std::llround(ts_us * 1000.0);
+  r->request_bytes = bytes;
+  r->service_ns = std::llround(service_us * 1000.0);
+  r->conn_id = conn;
+  return true;
+}
+
+bool LoadCsv(std::ifstream &f, std::vector<trace_record> *records) {
+  std::string line;
+  unsigned int lineno = 0;
+  while (std::getline(f, line)) {
+    lineno++;
+    if (line.empty() || line[0] == '#' || std::isalpha(line[0])) continue;
+
+    trace_record r;
+    if (!ParseLine(line, &r)) {
+      std::cerr << "trace: bad record on line " << lineno << ": " << line
+                << std::endl;
+      return false;
+    }
+    records->push_back(r);
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+Trace::Trace(std::vector<trace_record> records) : records_(std::move(records)) {
+  std::stable_sort(records_.begin(), records_.end(),
+                   [](const trace_record &a, const trace_record &b) {
+                     return a.timestamp_ns < b.timestamp_ns;
+                   });
+}
+
+std::unique_ptr<Trace> Trace::Load(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f) {
+    std::cerr << "trace: couldn't open " << path << std::endl;
+    return nullptr;
+  }
+
+  std::vector<trace_record> records;
+  if (!LoadBinary(f, &records)) {
+    f.clear();
+    f.seekg(0);
+    if (!LoadCsv(f, &records)) return nullptr;
+  }
+  if (records.empty()) {
+    std::cerr << "trace: no records in " << path << std::endl;
+    return nullptr;
+  }
+
+  return std::unique_ptr<Trace>(new Trace(std::move(records)));
+}
+
+int Trace::Save(const std::string &path) const {
+  std::ofstream f(path, std::ios::binary | std::ios::trunc);
+  trace_header h;
+  std::memcpy(h.magic, kTraceMagic, sizeof(h.magic));
+  h.nr_records = records_.size();
+  f.write(reinterpret_cast<const char *>(&h), sizeof(h));
+  f.write(reinterpret_cast<const char *>(records_.data()),
+          records_.size() * sizeof(trace_record));
+  return f ? 0 : -EIO;
+}
+
+std::vector<std::vector<trace_record>> Trace::Shard(
+    unsigned int shard, unsigned int nshards, unsigned int workers) const {
+  std::vector<std::vector<trace_record>> lists(workers);
+  for (const trace_record &r : records_) {
+    if (r.conn_id % nshards != shard) continue;
+    lists[r.conn_id / nshards % workers].push_back(r);
+  }
+
+  lists.erase(std::remove_if(lists.begin(), lists.end(),
+                             [](const std::vector<trace_record> &l) {
+                               return l.empty();
+                             }),
+              lists.end());
+  return lists;
+}
+
+uint64_t Trace::PeriodNs() const {
+  // a trace whose requests all arrive at once repeats every second
+  constexpr uint64_t kDefaultPeriodNs = 1000000000;
+
+  uint64_t duration = records_.back().timestamp_ns - OriginNs();
+  if (duration == 0) return kDefaultPeriodNs;
+  return duration + duration / (records_.size() - 1);
+}
@@ -0,0 +1,86 @@
+// trace.h - recorded request traces for replay
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One request, as stored in a binary trace (little-endian, 20 bytes).
+struct trace_record {
+  uint64_t timestamp_ns;   // arrival time, from any origin
+  uint32_t request_bytes;  // size of the request on the wire
+  uint32_t service_ns;     // time the server spends on the request
+  uint32_t conn_id;        // requests on a connection are sent in order
+} __attribute__((packed));
+
+// Binary traces start with this header, followed by the records.
+struct trace_header {
+  char magic[8];
+  uint64_t nr_records;
+} __attribute__((packed));
+
+constexpr char kTraceMagic[8] = {'N', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+
+class Trace {
+ public:
+  // Loads a binary trace, or else a CSV trace with one request per line:
+  //   timestamp_us,request_bytes,service_us,conn_id
+  // Blank lines and lines starting with '#' or a letter (a header) are
+  // skipped. Returns nullptr on failure.
+  static std::unique_ptr<Trace> Load(const std::string &path);
+
+  // Writes the trace in the binary format. Returns 0 on success.
+  int Save(const std::string &path) const;
+
+  // Takes the connections assigned to client @shard of @nshards, and spreads
+  // them across @workers, keeping each connection on one worker. Lists for
+  // workers without any connections are left out.
+  std::vector<std::vector<trace_record>> Shard(unsigned int shard,
+                                               unsigned int nshards,
+                                               unsigned int workers) const;
+
+  const std::vector<trace_record> &records() const { return records_; }
+  // Gets the arrival time of the first request.
+  uint64_t OriginNs() const { return records_.front().timestamp_ns; }
+  // Gets the time after which a replay starts over: the time from the first
+  // to the last arrival, plus the mean gap between arrivals.
+  uint64_t PeriodNs() const;
+
+ private:
+  explicit Trace(std::vector<trace_record> records);
+
+  std::vector<trace_record> records_;
+};
+
+// Generates the gaps between the arrivals in @records (part of a trace with
+// origin @origin_ns and period @period_ns), in microseconds. Time is
+// multiplied by @scale, so 0.5 replays twice as fast. Repeats forever.
+class TraceArrivals {
+ public:
+  TraceArrivals(const std::vector<trace_record> *records, uint64_t origin_ns,
+                uint64_t period_ns, double scale)
+      : records_(records),
+        origin_ns_(origin_ns),
+        period_ns_(period_ns),
+        scale_(scale) {}
+
+  double operator()() {
+    const std::vector<trace_record> &r = *records_;
+    uint64_t ns = (next_ / r.size()) * period_ns_ +
+                  r[next_ % r.size()].timestamp_ns - origin_ns_;
+    next_++;
+    double gap_us = (ns - last_ns_) * scale_ / 1000.0;
+    last_ns_ = ns;
+    return gap_us;
+  }
+
+ private:
+  const std::vector<trace_record> *records_;
+  uint64_t origin_ns_;
+  uint64_t period_ns_;
+  double scale_;
+  uint64_t next_ = 0;
+  uint64_t last_ns_ = 0;
+};
@@ -0,0 +1,41 @@
+// trace_convert.cc - converts a trace for netbench replay to the binary format
+
+#include "trace.h"
+
+#include <cerrno>
+#include <iostream>
+#include <set>
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " [input_trace] [output_trace]"
+              << std::endl;
+    return -EINVAL;
+  }
+
+  std::unique_ptr<Trace> t = Trace::Load(argv[1]);
+  if (!t) return -EINVAL;
+
+  // Summarize the trace, so the offered load of a replay is known.
+  const std::vector<trace_record> &records = t->records();
+  std::set<uint32_t> conns;
+  uint64_t bytes = 0, service_ns = 0;
+  for (const trace_record &r : records) {
+    conns.insert(r.conn_id);
+    bytes += r.request_bytes;
+    service_ns += r.service_ns;
+  }
+  double period_us = t->PeriodNs() / 1000.0;
+  std::cout << records.size() << " requests on " << conns.size()
+            << " connections over " << period_us << " us ("
+            << records.size() * 1e6 / period_us << " rps), mean size "
+            << bytes / records.size() << " bytes, mean service time "
+            << service_ns / 1000.0 / records.size() << " us" << std::endl;
+
+  int ret = t->Save(argv[2]);
+  if (ret) {
+    std::cerr << "couldn't write " << argv[2] << std::endl;
+    return ret;
+  }
+  return 0;
+}
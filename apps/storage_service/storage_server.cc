@@ -153,7 +153,8 @@ class RequestContext {
 static void DoRequest(RequestContext *ctx, char *read_buf, char *compress_buf)
 {
   size_t input_length = ctx->header.lba_count * kSectorSize;
-  ssize_t ret = storage_read(read_buf, ctx->header.lba, ctx->header.lba_count);
+  ssize_t ret = storage_cache_read(read_buf, ctx->header.lba,
+                                   ctx->header.lba_count);
   if (unlikely(ret != 0)) {
     log_warn_ratelimited("storage ret: %ld", ret);
     return;
@@ -221,7 +222,8 @@ void HandleGetRequest(RequestContext *ctx) {
 }
 
 void HandleSetRequest(RequestContext *ctx) {
-  ssize_t ret = storage_write(ctx->buf, ctx->header.lba, ctx->header.lba_count);
+  ssize_t ret = storage_cache_write(ctx->buf, ctx->header.lba,
+                                    ctx->header.lba_count);
   if (unlikely(ret != 0)) {
     log_warn("bad set: rc %ld", ret);
   }
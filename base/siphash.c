@@ -0,0 +1,70 @@
+/*
+ * siphash.c - the SipHash-2-4 keyed pseudorandom function
+ *
+ * SipHash was designed by Jean-Philippe Aumasson and Daniel J. Bernstein
+ * (https://131002.net/siphash/). Unlike the hashes in hash.h, its output
+ * can't be predicted or forged without the key, so it is suitable for MACs
+ * sent over the network.
+ */
+
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/hash.h>
+
+static inline uint64_t rotl64(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND(v0, v1, v2, v3)					\
+	do {								\
+		v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0;		\
+		v0 = rotl64(v0, 32);					\
+		v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;		\
+		v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;		\
+		v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2;		\
+		v2 = rotl64(v2, 32);					\
+	} while (0)
+
+/**
+ * siphash24 - computes SipHash-2-4 of a buffer
+ * @key: the 128-bit secret key
+ * @data: the buffer to hash
+ * @len: the length of the buffer
+ *
+ * Returns a 64-bit MAC of the buffer.
+ */
+uint64_t siphash24(const struct siphash_key *key, const void *data, size_t len)
+{
+	const unsigned char *p = data, *end = p + (len & ~7UL);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key->k[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key->k[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key->k[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key->k[1];
+	uint64_t m, b = (uint64_t)len << 56;
+	int i;
+
+	for (; p != end; p += sizeof(m)) {
+		memcpy(&m, p, sizeof(m));
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	/* the last 0-7 bytes, little endian, topped by the length */
+	for (i = len & 7; i > 0; i--)
+		b |= (uint64_t)p[i - 1] << ((i - 1) * 8);
+
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	for (i = 0; i < 4; i++)
+		SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -18,6 +18,7 @@
 #include <base/lock.h>
 #include <base/tcache.h>
 #include <base/thread.h>
+#include <base/time.h>
 
 static DEFINE_SPINLOCK(tcache_lock);
 static LIST_HEAD(tcache_list);
@@ -26,6 +27,7 @@ DEFINE_PERTHREAD(uint64_t, mag_alloc);
 DEFINE_PERTHREAD(uint64_t, mag_free);
 DEFINE_PERTHREAD(uint64_t, pool_alloc);
 DEFINE_PERTHREAD(uint64_t, pool_free);
+DEFINE_PERTHREAD(struct hist, tcache_slow_hist);
 
 static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
 {
@@ -72,6 +74,7 @@ static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
 void *__tcache_alloc(struct tcache_perthread *ltc)
 {
 	struct tcache *tc = ltc->tc;
+	uint64_t start_tsc;
 	void *item;
 
 	/* must be out of rounds */
@@ -86,6 +89,7 @@ void *__tcache_alloc(struct tcache_perthread *ltc)
 	}
 
 	perthread_get(pool_alloc)++;
+	start_tsc = rdtsc();
 
 	/* CASE 2: grab a magazine from the shared pool */
 	spin_lock(&tc->lock);
@@ -94,13 +98,16 @@ void *__tcache_alloc(struct tcache_perthread *ltc)
 		tc->shared_mags = tc->shared_mags->next_mag;
 	spin_unlock(&tc->lock);
 	if (ltc->loaded)
-		goto alloc;
+		goto slow_alloc;
 
 	/* CASE 3: allocate a new magazine */
 	ltc->loaded = tcache_alloc_mag(tc);
 	if (unlikely(!ltc->loaded))
 		return NULL;
 
+slow_alloc:
+	hist_record(&perthread_get(tcache_slow_hist), rdtsc() - start_tsc);
+
 alloc:
 	/* reload the magazine and allocate an item */
 	ltc->rounds = ltc->capacity - 1;
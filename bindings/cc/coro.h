@@ -0,0 +1,479 @@
+// coro.h - stackless C++20 coroutines on top of uthreads
+//
+// A Task<T> is a lazily started coroutine. An Executor runs any number of
+// tasks on the single uthread that calls Executor::Run(), so an in-flight
+// operation costs a coroutine frame rather than a thread and its stack.
+// Operations that would block (AsyncRead(), AsyncSleep(), ...) arm a poll
+// trigger on the executor and suspend the task; the executor resumes it once
+// the trigger fires.
+//
+// Tasks on the same executor never run in parallel, so they can share state
+// without locks. Connections used by tasks must be nonblocking, may only have
+// one pending operation at a time, and can't also be armed on a Poller.
+//
+// Requires -std=gnu++20.
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "coro.h requires C++20"
+#endif
+
+extern "C" {
+#include <base/assert.h>
+#include <runtime/poll.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+}
+
+#include <atomic>
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "net.h"
+#include "poll.h"
+#include "timer.h"
+
+namespace rt {
+
+class Executor;
+template <typename T = void>
+class Task;
+
+namespace coro_internal {
+
+// A task waiting in an executor's run queue.
+struct ReadyNode {
+  std::coroutine_handle<> h;
+  ReadyNode *next;
+};
+
+// What a poll trigger armed by a task points to. When the trigger fires, the
+// executor resumes the task, unless the (optional) retry callback finds that
+// the task still can't make progress.
+struct Waker {
+  std::coroutine_handle<> h;
+  bool (*retry)(Waker *w) = nullptr;  // returns true to resume the task
+};
+
+// Counts down the tasks of a WhenAll(), resuming the waiter after the last.
+struct Latch {
+  size_t count;
+  std::coroutine_handle<> waiter;
+};
+
+struct PromiseBase {
+  Executor *ex = nullptr;
+  std::coroutine_handle<> continuation;  // resumed when the task finishes
+  Latch *latch = nullptr;
+  bool detached = false;
+  ReadyNode node;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { BUG(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  Task<T> get_return_object() noexcept;
+  template <typename U>
+  void return_value(U &&val) {
+    value.emplace(std::forward<U>(val));
+  }
+
+  std::optional<T> value;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+};
+
+template <typename T>
+class WhenAllAwaiter;
+
+}  // namespace coro_internal
+
+// A coroutine that produces a T. It starts running once it is awaited, run
+// by an Executor, or passed to WhenAll().
+template <typename T>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = coro_internal::Promise<T>;
+
+  Task() : h_(nullptr) {}
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  // Move support.
+  Task(Task &&t) noexcept : h_(std::exchange(t.h_, nullptr)) {}
+  Task &operator=(Task &&t) noexcept {
+    if (h_) h_.destroy();
+    h_ = std::exchange(t.h_, nullptr);
+    return *this;
+  }
+
+  // Runs the task on the awaiting task's executor, then resumes the awaiter.
+  auto operator co_await() && noexcept { return Awaiter{h_}; }
+
+ private:
+  friend class Executor;
+  friend struct coro_internal::Promise<T>;
+  friend class coro_internal::WhenAllAwaiter<T>;
+
+  struct Awaiter {
+    std::coroutine_handle<promise_type> h;
+
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> caller) noexcept {
+      h.promise().ex = caller.promise().ex;
+      h.promise().continuation = caller;
+      return h;
+    }
+    T await_resume() { return Task::Result(h); }
+  };
+
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+  // disable copy.
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  static T Result(std::coroutine_handle<promise_type> h) {
+    if constexpr (!std::is_void_v<T>) return std::move(*h.promise().value);
+  }
+
+  std::coroutine_handle<promise_type> h_;
+};
+
+// Runs tasks on the calling uthread.
+class Executor {
+ public:
+  Executor() : ready_head_(nullptr), ready_tail_(&ready_head_),
+               nr_detached_(0) {}
+  ~Executor() {}
+
+  // Runs @task, and every task spawned on this executor, until they have all
+  // finished. Returns the result of @task.
+  template <typename T>
+  T Run(Task<T> task) {
+    task.h_.promise().ex = this;
+    task.h_.resume();
+    Loop(task.h_);
+    return Task<T>::Result(task.h_);
+  }
+
+  // Starts a task that runs independently of the task that spawned it.
+  void Spawn(Task<void> task) {
+    std::coroutine_handle<Task<void>::promise_type> h =
+        std::exchange(task.h_, nullptr);
+    h.promise().ex = this;
+    h.promise().detached = true;
+    nr_detached_++;
+    Schedule(&h.promise().node, h);
+  }
+
+  // The poller that resumes suspended tasks, with a coro_internal::Waker as
+  // the event data.
+  Poller *poller() { return &poller_; }
+
+  // Queues a task to be resumed (only from tasks on this executor).
+  void Schedule(coro_internal::ReadyNode *n, std::coroutine_handle<> h) {
+    n->h = h;
+    n->next = nullptr;
+    *ready_tail_ = n;
+    ready_tail_ = &n->next;
+  }
+
+ private:
+  friend struct coro_internal::PromiseBase;
+
+  static constexpr int kEventBatch = 32;
+
+  // disable move and copy.
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  void Loop(std::coroutine_handle<> root) {
+    poll_event evs[kEventBatch];
+
+    while (true) {
+      // run the tasks queued on this executor (but not ones that requeue
+      // themselves, so they can't starve tasks waiting on events)
+      coro_internal::ReadyNode *n = ready_head_;
+      ready_head_ = nullptr;
+      ready_tail_ = &ready_head_;
+      while (n) {
+        coro_internal::ReadyNode *next = n->next;
+        n->h.resume();
+        n = next;
+      }
+
+      if (root.done() && nr_detached_ == 0) break;
+
+      // resume the tasks whose triggers fired, sleeping if there are none
+      int nr = ready_head_ ? poller_.TryWait(evs, kEventBatch)
+                           : poller_.Wait(evs, kEventBatch);
+      for (int i = 0; i < nr; i++) {
+        auto *w = reinterpret_cast<coro_internal::Waker *>(evs[i].data);
+        if (!w->retry || w->retry(w)) w->h.resume();
+      }
+    }
+  }
+
+  Poller poller_;
+  coro_internal::ReadyNode *ready_head_;
+  coro_internal::ReadyNode **ready_tail_;
+  unsigned int nr_detached_;
+};
+
+namespace coro_internal {
+
+template <typename P>
+std::coroutine_handle<> PromiseBase::FinalAwaiter::await_suspend(
+    std::coroutine_handle<P> h) noexcept {
+  PromiseBase &p = h.promise();
+
+  if (p.detached) {
+    p.ex->nr_detached_--;
+    h.destroy();
+    return std::noop_coroutine();
+  }
+  if (p.latch) {
+    if (--p.latch->count == 0) return p.latch->waiter;
+    return std::noop_coroutine();
+  }
+  if (p.continuation) return p.continuation;
+  return std::noop_coroutine();
+}
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Starts every task, resuming the awaiter once all of them have finished.
+template <typename T>
+class WhenAllAwaiter {
+ public:
+  explicit WhenAllAwaiter(std::vector<Task<T>> &tasks) : tasks_(tasks) {}
+
+  bool await_ready() noexcept { return tasks_.empty(); }
+  template <typename P>
+  bool await_suspend(std::coroutine_handle<P> h) noexcept {
+    // hold an extra count so a task finishing early can't resume us yet
+    latch_.count = tasks_.size() + 1;
+    latch_.waiter = h;
+    for (Task<T> &t : tasks_) {
+      t.h_.promise().ex = h.promise().ex;
+      t.h_.promise().latch = &latch_;
+      t.h_.resume();
+    }
+    return --latch_.count > 0;
+  }
+  void await_resume() noexcept {}
+
+  static T Result(Task<T> &t) { return Task<T>::Result(t.h_); }
+
+ private:
+  std::vector<Task<T>> &tasks_;
+  Latch latch_;
+};
+
+// Retries a nonblocking operation on a connection each time it has events,
+// resuming the task once it completes (spurious wakeups leave it suspended).
+template <typename Conn, typename Op>
+class IoAwaiter : private Waker {
+ public:
+  IoAwaiter(Conn &c, unsigned int mask, Op op)
+      : c_(c), mask_(mask), op_(op), armed_(false) {}
+  ~IoAwaiter() {
+    if (armed_) c_.PollDisarm();
+  }
+
+  bool await_ready() {
+    ret_ = op_();
+    return ret_ != -EAGAIN;
+  }
+  template <typename P>
+  void await_suspend(std::coroutine_handle<P> h) {
+    this->h = h;
+    retry = Retry;
+    armed_ = true;
+    c_.PollArm(h.promise().ex->poller(), mask_ | POLLEV_ERR | POLLEV_HUP,
+               reinterpret_cast<unsigned long>(static_cast<Waker *>(this)));
+  }
+  ssize_t await_resume() {
+    if (armed_) {
+      c_.PollDisarm();
+      armed_ = false;
+    }
+    return ret_;
+  }
+
+ private:
+  // called by the executor when the trigger fires, with the trigger still
+  // armed so that a later edge wakes the task again
+  static bool Retry(Waker *w) {
+    IoAwaiter *a = static_cast<IoAwaiter *>(w);
+    a->ret_ = a->op_();
+    return a->ret_ != -EAGAIN;
+  }
+
+  Conn &c_;
+  unsigned int mask_;
+  Op op_;
+  bool armed_;
+  ssize_t ret_;
+};
+
+// Suspends until a timer deadline passes.
+class SleepAwaiter {
+ public:
+  explicit SleepAwaiter(uint64_t deadline_us)
+      : deadline_us_(deadline_us), w_(nullptr), fired_(false) {}
+  // the task may be destroyed while it sleeps, so the timer must not fire
+  // (or still be firing) once the awaiter is gone
+  ~SleepAwaiter() {
+    if (!w_) return;
+    if (!timer_cancel(&e_)) {
+      while (!fired_.load(std::memory_order_acquire)) thread_yield();
+    }
+    poll_disarm(&t_);
+  }
+
+  bool await_ready() { return MicroTime() >= deadline_us_; }
+  template <typename P>
+  void await_suspend(std::coroutine_handle<P> h) {
+    waker_.h = h;
+    w_ = h.promise().ex->poller()->get();
+    poll_trigger_init(&t_);
+    poll_arm(w_, &t_, reinterpret_cast<unsigned long>(&waker_));
+    timer_init(&e_, Fire, reinterpret_cast<unsigned long>(this));
+    timer_start(&e_, deadline_us_);
+  }
+  void await_resume() {}
+
+ private:
+  // called by the timer softirq
+  static void Fire(unsigned long arg) {
+    SleepAwaiter *a = reinterpret_cast<SleepAwaiter *>(arg);
+    poll_trigger(a->w_, &a->t_);
+    a->fired_.store(true, std::memory_order_release);
+  }
+
+  uint64_t deadline_us_;
+  Waker waker_;
+  poll_waiter_t *w_;
+  poll_trigger_t t_;
+  timer_entry e_;
+  std::atomic<bool> fired_;
+};
+
+// Lets the other tasks queued on the executor run first.
+class YieldAwaiter {
+ public:
+  bool await_ready() noexcept { return false; }
+  template <typename P>
+  void await_suspend(std::coroutine_handle<P> h) noexcept {
+    h.promise().ex->Schedule(&node_, h);
+  }
+  void await_resume() noexcept {}
+
+ private:
+  ReadyNode node_;
+};
+
+}  // namespace coro_internal
+
+// Waits for every task to finish, returning their results in order.
+template <typename T>
+Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks) {
+  co_await coro_internal::WhenAllAwaiter<T>(tasks);
+  std::vector<T> results;
+  results.reserve(tasks.size());
+  for (Task<T> &t : tasks)
+    results.push_back(coro_internal::WhenAllAwaiter<T>::Result(t));
+  co_return results;
+}
+
+// Waits for every task to finish.
+inline Task<void> WhenAll(std::vector<Task<void>> tasks) {
+  co_await coro_internal::WhenAllAwaiter<void>(tasks);
+}
+
+// Sleeps until a microsecond deadline.
+inline coro_internal::SleepAwaiter AsyncSleepUntil(uint64_t deadline_us) {
+  return coro_internal::SleepAwaiter(deadline_us);
+}
+
+// Sleeps for a microsecond duration.
+inline coro_internal::SleepAwaiter AsyncSleep(uint64_t duration_us) {
+  return coro_internal::SleepAwaiter(MicroTime() + duration_us);
+}
+
+// Lets the other ready tasks on the executor run.
+inline coro_internal::YieldAwaiter AsyncYield() { return {}; }
+
+// Reads from a TCP stream, suspending until data arrives.
+inline auto AsyncRead(TcpConn &c, void *buf, size_t len) {
+  return coro_internal::IoAwaiter(
+      c, POLLEV_IN, [&c, buf, len] { return c.Read(buf, len); });
+}
+
+// Writes to a TCP stream, suspending until there is room in the window.
+inline auto AsyncWrite(TcpConn &c, const void *buf, size_t len) {
+  return coro_internal::IoAwaiter(
+      c, POLLEV_OUT, [&c, buf, len] { return c.Write(buf, len); });
+}
+
+// Reads exactly @len bytes from a TCP stream.
+inline Task<ssize_t> AsyncReadFull(TcpConn &c, void *buf, size_t len) {
+  char *pos = reinterpret_cast<char *>(buf);
+  size_t n = 0;
+  while (n < len) {
+    ssize_t ret = co_await AsyncRead(c, pos + n, len - n);
+    if (ret <= 0) co_return ret;
+    n += ret;
+  }
+  co_return n;
+}
+
+// Writes exactly @len bytes to a TCP stream.
+inline Task<ssize_t> AsyncWriteFull(TcpConn &c, const void *buf, size_t len) {
+  const char *pos = reinterpret_cast<const char *>(buf);
+  size_t n = 0;
+  while (n < len) {
+    ssize_t ret = co_await AsyncWrite(c, pos + n, len - n);
+    if (ret < 0) co_return ret;
+    n += ret;
+  }
+  co_return n;
+}
+
+// Reads a datagram from a UDP connection, suspending until one arrives.
+inline auto AsyncRead(UdpConn &c, void *buf, size_t len) {
+  return coro_internal::IoAwaiter(
+      c, POLLEV_IN, [&c, buf, len] { return c.Read(buf, len); });
+}
+
+}  // namespace rt
@@ -0,0 +1,126 @@
+extern "C" {
+#include <base/log.h>
+#include <base/stddef.h>
+}
+
+#include <memory>
+#include <vector>
+
+#include "coro.h"
+#include "net.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+namespace {
+
+constexpr uint16_t kEchoPort = 8800;
+constexpr int kConns = 16;
+constexpr int kRounds = 100;
+
+rt::Task<int> SleepThenReturn(int i) {
+  co_await rt::AsyncSleep((i % 4) * rt::kMilliseconds);
+  co_return i;
+}
+
+rt::Task<void> Count(int *counter, int n) {
+  for (int i = 0; i < n; i++) {
+    (*counter)++;
+    co_await rt::AsyncYield();
+  }
+}
+
+// Sends rounds of requests over one connection, checking each echo.
+rt::Task<int> EchoClient(rt::TcpConn *c, int id) {
+  for (int i = 0; i < kRounds; i++) {
+    uint32_t req = id * kRounds + i, resp;
+    if (co_await rt::AsyncWriteFull(*c, &req, sizeof(req)) != sizeof(req))
+      BUG();
+    if (co_await rt::AsyncReadFull(*c, &resp, sizeof(resp)) != sizeof(resp))
+      BUG();
+    if (resp != req) BUG();
+  }
+  co_return id;
+}
+
+rt::Task<void> MainTask(rt::Executor *ex, netaddr raddr) {
+  // timers and results of concurrent tasks
+  std::vector<rt::Task<int>> sleepers;
+  for (int i = 0; i < 8; i++) sleepers.push_back(SleepThenReturn(i));
+  uint64_t start = rt::MicroTime();
+  std::vector<int> vals = co_await rt::WhenAll(std::move(sleepers));
+  for (int i = 0; i < 8; i++)
+    if (vals[i] != i) BUG();
+  if (rt::MicroTime() - start < 3 * rt::kMilliseconds) BUG();
+  log_info("WhenAll() of sleeping tasks ok");
+
+  // detached tasks interleave through yields
+  int a = 0, b = 0;
+  ex->Spawn(Count(&a, 10));
+  ex->Spawn(Count(&b, 10));
+  co_await rt::AsyncYield();
+  if (a == 0 || b == 0 || a == 10) BUG();
+
+  // many connections served concurrently by one thread
+  std::vector<std::unique_ptr<rt::TcpConn>> conns;
+  std::vector<rt::Task<int>> clients;
+  for (int i = 0; i < kConns; i++) {
+    conns.emplace_back(rt::TcpConn::Dial({0, 0}, raddr));
+    if (!conns.back()) BUG();
+    conns.back()->SetNonblocking(true);
+    clients.push_back(EchoClient(conns.back().get(), i));
+  }
+  vals = co_await rt::WhenAll(std::move(clients));
+  for (int i = 0; i < kConns; i++)
+    if (vals[i] != i) BUG();
+  log_info("%d concurrent echo clients ok", kConns);
+}
+
+void EchoServer(rt::TcpConn *c) {
+  uint32_t val;
+  while (c->ReadFull(&val, sizeof(val)) == sizeof(val))
+    if (c->WriteFull(&val, sizeof(val)) != sizeof(val)) break;
+  delete c;
+}
+
+void MainHandler() {
+  std::unique_ptr<rt::UdpConn> u(rt::UdpConn::Listen({0, 0}));
+  if (!u) BUG();
+  netaddr laddr = u->LocalAddr();
+  laddr.port = kEchoPort;
+  u.reset();
+
+  std::unique_ptr<rt::TcpQueue> q(rt::TcpQueue::Listen(laddr, kConns));
+  if (!q) BUG();
+  rt::Thread acceptor([q = q.get()] {
+    while (rt::TcpConn *c = q->Accept())
+      rt::Spawn([c] { EchoServer(c); });
+  });
+
+  rt::Executor ex;
+  ex.Run(MainTask(&ex, laddr));
+
+  // the acceptor may still be blocked in Accept(); wake it before freeing q
+  q->Shutdown();
+  acceptor.Join();
+  log_info("all tests passed");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 2) {
+    printf("arg must be config file\n");
+    return -EINVAL;
+  }
+
+  ret = rt::RuntimeInit(argv[1], MainHandler);
+  if (ret) {
+    log_err("failed to start runtime");
+    return ret;
+  }
+  return 0;
+}
@@ -8,6 +8,8 @@ extern "C" {
 #include <runtime/udp.h>
 }
 
+#include "poll.h"
+
 namespace rt {
 
 class NetConn {
@@ -24,6 +26,8 @@ class UdpConn : public NetConn {
 
   // The maximum possible payload size (with the maximum MTU).
   static constexpr size_t kMaxPayloadSize = UDP_MAX_PAYLOAD_SIZE;
+  // The maximum datagram size (larger payloads are sent as IP fragments).
+  static constexpr size_t kMaxDatagramSize = UDP_MAX_DATAGRAM_SIZE;
 
   // Creates a UDP connection between a local and remote address.
   static UdpConn *Dial(netaddr laddr, netaddr raddr) {
@@ -72,9 +76,32 @@ class UdpConn : public NetConn {
   // Writes a datagram.
   ssize_t Write(const void *buf, size_t len) { return udp_write(c_, buf, len); }
 
+  // Reads up to @n datagrams (at most UDP_BATCH_MAX) in one call.
+  ssize_t ReadBatch(udp_msg *msgs, int n) {
+    return udp_read_batch(c_, msgs, n);
+  }
+
+  // Writes up to @n datagrams (at most UDP_BATCH_MAX) in one call.
+  ssize_t WriteBatch(const udp_msg *msgs, int n) {
+    return udp_write_batch(c_, msgs, n);
+  }
+
   // Shutdown the socket (no more receives).
   void Shutdown() { udp_shutdown(c_); }
 
+  // Makes reads and writes return -EAGAIN instead of blocking.
+  void SetNonblocking(bool nonblocking) {
+    udp_set_nonblocking(c_, nonblocking);
+  }
+
+  // Registers for events (POLLEV_*) on a poller, reported with @data.
+  void PollArm(Poller *p, unsigned int mask, unsigned long data) {
+    udp_poll_arm(c_, p->get(), mask, data);
+  }
+
+  // Unregisters from the poller.
+  void PollDisarm() { udp_poll_disarm(c_); }
+
  private:
   UdpConn(udpconn_t *c) : c_(c) {}
 
@@ -182,6 +209,22 @@ class TcpConn : public NetConn {
   // Ungracefully force the TCP connection to shutdown.
   void Abort() { tcp_abort(c_); }
 
+  // Makes reads and writes return -EAGAIN instead of blocking.
+  void SetNonblocking(bool nonblocking) {
+    tcp_set_nonblocking(c_, nonblocking);
+  }
+
+  // Probes the peer when idle, failing the connection if it stops answering.
+  void SetKeepalive(bool keepalive) { tcp_set_keepalive(c_, keepalive); }
+
+  // Registers for events (POLLEV_*) on a poller, reported with @data.
+  void PollArm(Poller *p, unsigned int mask, unsigned long data) {
+    tcp_poll_arm(c_, p->get(), mask, data);
+  }
+
+  // Unregisters from the poller.
+  void PollDisarm() { tcp_poll_disarm(c_); }
+
  private:
   TcpConn(tcpconn_t *c) : c_(c) {}
 
@@ -208,6 +251,14 @@ class TcpQueue {
     return new TcpQueue(q);
   }
 
+  // Creates a TCP listener queue that queues connections per core.
+  static TcpQueue *ListenPerCore(netaddr laddr, int backlog) {
+    tcpqueue_t *q;
+    int ret = tcp_listen_percore(laddr, backlog, &q);
+    if (ret) return nullptr;
+    return new TcpQueue(q);
+  }
+
   // Accept a connection from the listener queue.
   TcpConn *Accept() {
     tcpconn_t *c;
@@ -216,9 +267,30 @@ class TcpQueue {
     return new TcpConn(c);
   }
 
+  // Accept a connection steered to core @idx (< runtime_max_cores()).
+  TcpConn *AcceptPerCore(unsigned int idx) {
+    tcpconn_t *c;
+    int ret = tcp_accept_percore(q_, idx, &c);
+    if (ret) return nullptr;
+    return new TcpConn(c);
+  }
+
   // Shutdown the listener queue; any blocked Accept() returns a nullptr.
   void Shutdown() { tcp_qshutdown(q_); }
 
+  // Makes Accept() return a nullptr instead of blocking.
+  void SetNonblocking(bool nonblocking) {
+    tcp_qset_nonblocking(q_, nonblocking);
+  }
+
+  // Registers for events (POLLEV_*) on a poller, reported with @data.
+  void PollArm(Poller *p, unsigned int mask, unsigned long data) {
+    tcp_qpoll_arm(q_, p->get(), mask, data);
+  }
+
+  // Unregisters from the poller.
+  void PollDisarm() { tcp_qpoll_disarm(q_); }
+
  private:
   TcpQueue(tcpqueue_t *q) : q_(q) {}
 
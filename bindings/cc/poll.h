@@ -0,0 +1,39 @@
+// poll.h - support for event polling over many connections
+
+#pragma once
+
+extern "C" {
+#include <runtime/poll.h>
+}
+
+namespace rt {
+
+// Collects edge-triggered events (POLLEV_*) from armed connections, so that a
+// single thread can serve many of them. Armed connections should be set
+// nonblocking and drained after each event.
+class Poller {
+ public:
+  Poller() { poll_init(&w_); }
+  ~Poller() {}
+
+  // Waits until at least one event fires, then stores up to @max events.
+  int Wait(poll_event *evs, int max) {
+    return poll_wait_events(&w_, evs, max, true);
+  }
+
+  // Stores up to @max events without blocking.
+  int TryWait(poll_event *evs, int max) {
+    return poll_wait_events(&w_, evs, max, false);
+  }
+
+  poll_waiter_t *get() { return &w_; }
+
+ private:
+  // disable move and copy.
+  Poller(const Poller&) = delete;
+  Poller& operator=(const Poller&) = delete;
+
+  poll_waiter_t w_;
+};
+
+}  // namespace rt
@@ -9,16 +9,19 @@ extern "C" {
 // TODO: this should be per-device.
 class Storage {
  public:
-  // Write contiguous storage blocks.
+  // Write contiguous storage blocks (through the block cache, if enabled).
   static int Write(const void *src, uint64_t lba, uint32_t lba_count) {
-    return storage_write(src, lba, lba_count);
+    return storage_cache_write(src, lba, lba_count);
   }
 
-  // Read contiguous storage blocks.
+  // Read contiguous storage blocks (through the block cache, if enabled).
   static int Read(void *dst, uint64_t lba, uint32_t lba_count) {
-    return storage_read(dst, lba, lba_count);
+    return storage_cache_read(dst, lba, lba_count);
   }
 
+  // Write any blocks held back by the block cache to the device.
+  static int Flush() { return storage_cache_flush(); }
+
   // Returns the size of each block.
   static uint32_t get_block_size() { return storage_block_size(); }
 
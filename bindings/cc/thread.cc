@@ -8,13 +8,8 @@ void ThreadTrampoline(void *arg) {
   (*static_cast<std::function<void()> *>(arg))();
 }
 
-// A helper to jump from a C function to a C++ std::function. This variant
-// can wait for the thread to be joined.
-void ThreadTrampolineWithJoin(void *arg) {
-  thread_internal::join_data *d =
-      static_cast<thread_internal::join_data *>(arg);
-  d->func_();
-  d->func_.~function<void()>();
+// Marks a joinable thread's function as finished, then waits to be joined.
+void JoinFinish(join_data *d) {
   spin_lock_np(&d->lock_);
   if (d->done_) {
     spin_unlock_np(&d->lock_);
@@ -33,24 +28,20 @@ Thread::~Thread() {
 }
 
 Thread::Thread(const std::function<void()> &func) {
-  thread_internal::join_data *buf;
-  thread_t *th =
-      thread_create_with_buf(thread_internal::ThreadTrampolineWithJoin,
-                             reinterpret_cast<void **>(&buf), sizeof(*buf));
-  if (unlikely(!th)) BUG();
-  new (buf) thread_internal::join_data(func);
-  join_data_ = buf;
+  using Data = thread_internal::join_data_with_func<std::function<void()>>;
+  thread_t *th;
+  join_data_ = thread_internal::CreateWithCallable<Data>(
+      thread_internal::CallableTrampolineWithJoin<std::function<void()>>,
+      func, &th);
   thread_ready(th);
 }
 
 Thread::Thread(std::function<void()> &&func) {
-  thread_internal::join_data *buf;
-  thread_t *th =
-      thread_create_with_buf(thread_internal::ThreadTrampolineWithJoin,
-                             reinterpret_cast<void **>(&buf), sizeof(*buf));
-  if (unlikely(!th)) BUG();
-  new (buf) thread_internal::join_data(std::move(func));
-  join_data_ = buf;
+  using Data = thread_internal::join_data_with_func<std::function<void()>>;
+  thread_t *th;
+  join_data_ = thread_internal::CreateWithCallable<Data>(
+      thread_internal::CallableTrampolineWithJoin<std::function<void()>>,
+      std::move(func), &th);
   thread_ready(th);
 }
 
@@ -8,31 +8,84 @@ extern "C" {
 }
 
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace rt {
 namespace thread_internal {
 
 struct join_data {
-  join_data(std::function<void()>&& func)
-      : done_(false), waiter_(nullptr), func_(std::move(func)) {
-    spin_lock_init(&lock_);
-  }
-  join_data(const std::function<void()>& func)
-      : done_(false), waiter_(nullptr), func_(func) {
-    spin_lock_init(&lock_);
-  }
+  join_data() : done_(false), waiter_(nullptr) { spin_lock_init(&lock_); }
 
   spinlock_t lock_;
   bool done_;
   thread_t* waiter_;
-  std::function<void()> func_;
+};
+
+template <typename F>
+struct join_data_with_func : join_data {
+  template <typename Arg>
+  join_data_with_func(Arg&& func) : func_(std::forward<Arg>(func)) {}
+
+  F func_;
 };
 
 extern void ThreadTrampoline(void* arg);
-extern void ThreadTrampolineWithJoin(void* arg);
+extern void JoinFinish(join_data* d);
+
+// A helper to jump from a C function to a callable stored in the thread's
+// buffer. There is one per callable type, so the call isn't type-erased.
+template <typename F>
+void CallableTrampoline(void* arg) {
+  F* func = static_cast<F*>(arg);
+  (*func)();
+  func->~F();
+}
+
+// Like CallableTrampoline(), but waits for the thread to be joined.
+template <typename F>
+void CallableTrampolineWithJoin(void* arg) {
+  join_data_with_func<F>* d = static_cast<join_data_with_func<F>*>(arg);
+  d->func_();
+  d->func_.~F();
+  JoinFinish(d);
+}
+
+// Creates a thread that runs a copy of @func, stored in the thread's buffer.
+template <typename Data, typename Trampoline, typename F>
+Data* CreateWithCallable(Trampoline trampoline, F&& func, thread_t** th_out) {
+  // the buffer is only aligned to the stack alignment
+  static_assert(alignof(Data) <= 16, "callable is overaligned");
+
+  void* buf;
+  thread_t* th = thread_create_with_buf(trampoline, &buf, sizeof(Data));
+  if (unlikely(!th)) BUG();
+  *th_out = th;
+  return new (buf) Data(std::forward<F>(func));
+}
+
+// Selects the templated overloads for callables other than std::function and
+// rt::Thread, which have their own.
+template <typename F, typename Self = void>
+using enable_if_callable_t = std::enable_if_t<
+    std::is_invocable_r_v<void, std::decay_t<F>&> &&
+    !std::is_same_v<std::decay_t<F>, std::function<void()>> &&
+    !std::is_same_v<std::decay_t<F>, Self>>;
 
 }  // namespace thread_internal
 
+// Spawns a new thread, moving or copying @func directly into its stack
+// buffer. Unlike the std::function overloads, this never allocates memory.
+template <typename F, typename = thread_internal::enable_if_callable_t<F>>
+inline void Spawn(F&& func) {
+  using Fn = std::decay_t<F>;
+  thread_t* th;
+  thread_internal::CreateWithCallable<Fn>(
+      thread_internal::CallableTrampoline<Fn>, std::forward<F>(func), &th);
+  thread_ready(th);
+}
+
 // Spawns a new thread by copying.
 inline void Spawn(const std::function<void()>& func) {
   void* buf;
@@ -84,6 +137,21 @@ class Thread {
   // Spawns a thread by moving a std::function.
   Thread(std::function<void()>&& func);
 
+  // Spawns a thread that runs a callable stored in its stack buffer, avoiding
+  // std::function and any memory allocation.
+  template <typename F,
+            typename = thread_internal::enable_if_callable_t<F, Thread>>
+  Thread(F&& func) {
+    using Fn = std::decay_t<F>;
+    thread_t* th;
+    join_data_ =
+        thread_internal::CreateWithCallable<
+            thread_internal::join_data_with_func<Fn>>(
+            thread_internal::CallableTrampolineWithJoin<Fn>,
+            std::forward<F>(func), &th);
+    thread_ready(th);
+  }
+
   // Waits for the thread to exit.
   void Join();
 
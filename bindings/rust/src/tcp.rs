@@ -1,4 +1,5 @@
 use std::io::{self, Read, Write};
+use std::mem;
 use std::net::SocketAddrV4;
 use std::ptr;
 
@@ -20,6 +21,7 @@ impl TcpQueue {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let mut queue = ptr::null_mut();
         let ret = unsafe { ffi::tcp_listen(laddr, backlog, &mut queue as *mut _) };
@@ -56,10 +58,12 @@ impl TcpConnection {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut conn = ptr::null_mut();
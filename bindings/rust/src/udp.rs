@@ -1,4 +1,5 @@
 use std::io::{self, Read, Write};
+use std::mem;
 use std::net::SocketAddrV4;
 use std::ptr;
 
@@ -20,10 +21,12 @@ impl UdpConnection {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut conn = ptr::null_mut();
@@ -39,6 +42,7 @@ impl UdpConnection {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         let mut conn = ptr::null_mut();
         let ret = unsafe { ffi::udp_listen(laddr, &mut conn as *mut _) };
@@ -56,7 +60,7 @@ impl UdpConnection {
     }
 
     pub fn read_from(&self, buf: &mut [u8]) -> io::Result<(usize, SocketAddrV4)> {
-        let mut raddr = ffi::netaddr { ip: 0, port: 0 };
+        let mut raddr = unsafe { mem::zeroed::<ffi::netaddr>() };
         isize_to_result(unsafe {
             ffi::udp_read_from(
                 self.0,
@@ -72,6 +76,7 @@ impl UdpConnection {
         let mut raddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&remote_addr.ip().octets()),
             port: remote_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
         isize_to_result(unsafe {
             ffi::udp_write_to(
@@ -164,6 +169,7 @@ impl UdpSpawner {
         let laddr = ffi::netaddr {
             ip: NetworkEndian::read_u32(&local_addr.ip().octets()),
             port: local_addr.port(),
+            ..unsafe { mem::zeroed() }
         };
 
         let mut spawner: *mut ffi::udpspawner_t = ptr::null_mut();
@@ -446,6 +446,7 @@ int cbw_open(struct netaddr raddr, struct crpc_session **sout, int id)
 	/* set up ephemeral IP and port */
 	laddr.ip = 0;
 	laddr.port = 0;
+	laddr.family = NETADDR_IPV4;
 
 	if (raddr.port != SRPC_PORT)
 		return -EINVAL;
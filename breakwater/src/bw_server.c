@@ -880,6 +880,7 @@ static void srpc_listener(void *arg)
 
 	laddr.ip = 0;
 	laddr.port = SRPC_PORT;
+	laddr.family = NETADDR_IPV4;
 
 	ret = tcp_listen(laddr, 4096, &q);
 	BUG_ON(ret);
@@ -58,7 +58,10 @@ endif
 ifeq ($(CONFIG_DIRECTPATH),y)
 RUNTIME_LIBS += $(MLX5_LIBS)
 INC += $(MLX5_INC)
-FLAGS += -DDIRECTPATH
+FLAGS += -DDIRECTPATH -DDIRECTPATH_MLX5
+endif
+ifeq ($(CONFIG_DIRECTPATH_XDP),y)
+FLAGS += -DDIRECTPATH -DDIRECTPATH_XDP
 endif
 
 CFLAGS = -std=gnu11 $(FLAGS)
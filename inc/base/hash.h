@@ -6,7 +6,8 @@
  * (e.g. IP source, IP destionation, source port, destination port,
  * etc.)
  *
- * Jenkins hash is provided for arbitrary length inputs.
+ * Jenkins hash is provided for arbitrary length inputs, and SipHash for
+ * when the hash must not be predictable without a secret key.
  */
 
 #pragma once
@@ -124,6 +125,14 @@ static inline uint64_t hash_city_two(uint64_t val_a, uint64_t val_b)
 
 extern uint32_t jenkins_hash(const void *key, size_t length);
 
+/* a 128-bit SipHash key, which must be kept secret */
+struct siphash_key {
+	uint64_t k[2];
+};
+
+extern uint64_t siphash24(const struct siphash_key *key, const void *data,
+			  size_t len);
+
 /**
  * rand_crc32c - generates a very fast pseudorandom value using crc32c
  * @seed: a seed-value for the hash
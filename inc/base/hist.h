@@ -0,0 +1,62 @@
+/*
+ * hist.h - log-bucketed histograms for hot-path measurements
+ *
+ * Each power of two is split into 2^HIST_SUB_BITS linear sub-buckets, giving a
+ * worst-case relative error of 25% over the full 64-bit range. Histograms are
+ * meant to have a single writer (e.g. one per kthread) and are recorded without
+ * atomic operations, so readers may observe slightly stale counts.
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+
+#define HIST_SUB_BITS	2
+#define HIST_SUB_MASK	((1 << HIST_SUB_BITS) - 1)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	uint64_t	buckets[HIST_BUCKETS];
+};
+
+/**
+ * hist_bucket - gets the bucket index for a value
+ * @val: the value to look up
+ */
+static inline unsigned int hist_bucket(uint64_t val)
+{
+	unsigned int msb;
+
+	if (val <= HIST_SUB_MASK)
+		return val;
+
+	msb = 63 - __builtin_clzl(val);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+	       ((val >> (msb - HIST_SUB_BITS)) & HIST_SUB_MASK);
+}
+
+/**
+ * hist_bucket_min - gets the smallest value that maps to a bucket
+ * @idx: the bucket index
+ */
+static inline uint64_t hist_bucket_min(unsigned int idx)
+{
+	unsigned int msb;
+
+	if (idx <= HIST_SUB_MASK)
+		return idx;
+
+	msb = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return (1UL << msb) |
+	       ((uint64_t)(idx & HIST_SUB_MASK) << (msb - HIST_SUB_BITS));
+}
+
+/**
+ * hist_record - adds a sample to a histogram
+ * @h: the histogram
+ * @val: the sample value
+ */
+static inline void hist_record(struct hist *h, uint64_t val)
+{
+	h->buckets[hist_bucket(val)]++;
+}
@@ -9,6 +9,7 @@
 #include <base/list.h>
 #include <base/atomic.h>
 #include <base/thread.h>
+#include <base/hist.h>
 
 #define TCACHE_MAX_MAG_SIZE	64
 #define TCACHE_DEFAULT_MAG_SIZE	8
@@ -58,6 +59,8 @@ DECLARE_PERTHREAD(uint64_t, mag_alloc);
 DECLARE_PERTHREAD(uint64_t, mag_free);
 DECLARE_PERTHREAD(uint64_t, pool_alloc);
 DECLARE_PERTHREAD(uint64_t, pool_free);
+/* cycles spent in allocations that missed both local magazines */
+DECLARE_PERTHREAD(struct hist, tcache_slow_hist);
 
 /**
  * tcache_alloc - allocates an item from the thread cache
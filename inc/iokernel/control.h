@@ -16,7 +16,7 @@
  * struct control_hdr, please increment the version number!
  */
 
-#define CONTROL_HDR_VERSION 5
+#define CONTROL_HDR_VERSION 6
 
 /* The abstract namespace path for the control socket. */
 #define CONTROL_SOCK_PATH	"\0/control/iokernel.sock"
@@ -64,6 +64,18 @@ struct timer_spec {
 	unsigned long		timer_resolution;
 };
 
+/*
+ * Parks a kthread on a futex when the iokernel runs without the ksched
+ * module. The kthread sets @parked and waits for @gen to change; the iokernel
+ * wakes it by clearing @parked, setting @core, and incrementing @gen.
+ */
+struct park_futex {
+	uint32_t		gen;
+	uint32_t		core;
+	uint32_t		parked;
+	uint32_t		intr_gen; /* @gen when a signal was last sent */
+};
+
 
 /* describes a runtime kernel thread */
 struct thread_spec {
@@ -72,7 +84,7 @@ struct thread_spec {
 	struct queue_spec	txcmdq;
 	shmptr_t		q_ptrs;
 	pid_t			tid;
-	int32_t			park_efd;
+	shmptr_t		park_futex;
 
 	struct hardware_queue_spec	direct_rxq;
 	struct hardware_queue_spec	storage_hwq;
@@ -90,6 +102,7 @@ struct sched_spec {
 	unsigned int		max_cores;
 	unsigned int		guaranteed_cores;
 	unsigned int		preferred_socket;
+	unsigned int		park_on_futex; /* the runtime has no ksched */
 	uint64_t		qdelay_us;
 	uint64_t		ht_punish_us;
 };
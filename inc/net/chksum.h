@@ -140,3 +140,46 @@ ipv4_udptcp_cksum(uint8_t proto, uint32_t saddr, uint32_t daddr,
 
 	return (uint16_t)cksum;
 }
+
+/**
+ * Process the pseudo-header checksum of an IPv6 header.
+ *
+ * The checksum field must be set to 0 by the caller.
+ *
+ * @return
+ *   The non-complemented checksum to set in the L4 header.
+ */
+static inline uint16_t
+ipv6_phdr_cksum(uint8_t proto, const uint8_t *saddr, const uint8_t *daddr,
+		uint32_t l4len)
+{
+	uint32_t sum;
+	struct {
+		uint32_t len;   /* L4 length. */
+		uint32_t proto; /* L4 protocol (top 24 bits are zero). */
+	} psd_hdr;
+
+	psd_hdr.len = hton32(l4len);
+	psd_hdr.proto = hton32(proto);
+
+	sum = __raw_cksum(saddr, 16, 0);
+	sum = __raw_cksum(daddr, 16, sum);
+	sum = __raw_cksum(&psd_hdr, sizeof(psd_hdr), sum);
+	return __raw_cksum_reduce(sum);
+}
+
+static inline uint16_t
+ipv6_udptcp_cksum(uint8_t proto, const uint8_t *saddr, const uint8_t *daddr,
+		  uint32_t l4len, const void *l4hdr)
+{
+	uint32_t cksum;
+
+	cksum = raw_cksum(l4hdr, l4len);
+	cksum += ipv6_phdr_cksum(proto, saddr, daddr, l4len);
+	cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+	cksum = (~cksum) & 0xffff;
+	if (cksum == 0)
+		cksum = 0xffff;
+
+	return (uint16_t)cksum;
+}
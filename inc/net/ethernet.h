@@ -47,7 +47,7 @@ static inline void uint64_to_eth_addr(uint64_t val, struct eth_addr *addr)
 		addr->addr[i] = ((val >> (i * 8)) & 0xff);
 }
 
-static inline bool eth_addr_is_multicast(struct eth_addr *addr)
+static inline bool eth_addr_is_multicast(const struct eth_addr *addr)
 {
 	return (addr->addr[0] & ETH_ADDR_GROUP);
 }
@@ -0,0 +1,174 @@
+/*
+ * ipv6.h - IPv6, ICMPv6 and neighbor discovery (NDP) definitions
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <base/types.h>
+#include <base/byteorder.h>
+#include <net/ethernet.h>
+
+#define IP6VERSION	6
+#define IP6_ADDR_LEN	16
+
+/* enough room for a fully expanded address and a terminator */
+#define IP6_ADDR_STR_LEN	46
+
+extern char *ip6_addr_to_str(const uint8_t *addr, char *str);
+extern int str_to_ip6(const char *str, uint8_t *addr);
+
+/*
+ * Structure of an IPv6 header (RFC 8200)
+ */
+struct ip6_hdr {
+	uint32_t vtc_flow;		/* version, traffic class, flow label */
+	uint16_t payload_len;		/* length after this header */
+	uint8_t nexthdr;		/* next header (protocol) */
+	uint8_t hop_limit;		/* hop limit */
+	uint8_t saddr[IP6_ADDR_LEN];	/* source address */
+	uint8_t daddr[IP6_ADDR_LEN];	/* dest address */
+} __packed __aligned(4);
+
+#define IP6_VTC_FLOW(tc, flow) \
+	(((uint32_t)IP6VERSION << 28) | ((uint32_t)(tc) << 20) | (flow))
+
+static inline unsigned int ip6_hdr_version(const struct ip6_hdr *ip6hdr)
+{
+	return ntoh32(ip6hdr->vtc_flow) >> 28;
+}
+
+/* hop limit that NDP packets must carry (RFC 4861 Section 7.1) */
+#define IP6_NDP_HOP_LIMIT	255
+
+/**
+ * ip6_addr_is_unspecified - returns true if the address is ::
+ */
+static inline bool ip6_addr_is_unspecified(const uint8_t *addr)
+{
+	static const uint8_t zero[IP6_ADDR_LEN];
+	return memcmp(addr, zero, IP6_ADDR_LEN) == 0;
+}
+
+/**
+ * ip6_addr_is_multicast - returns true if the address is ff00::/8
+ */
+static inline bool ip6_addr_is_multicast(const uint8_t *addr)
+{
+	return addr[0] == 0xff;
+}
+
+/**
+ * ip6_addr_is_link_local - returns true if the address is fe80::/10
+ */
+static inline bool ip6_addr_is_link_local(const uint8_t *addr)
+{
+	return addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80;
+}
+
+/**
+ * ip6_addr_prefix_equal - returns true if two addresses share a prefix
+ * @a: the first address
+ * @b: the second address
+ * @prefix_len: the prefix length in bits
+ */
+static inline bool ip6_addr_prefix_equal(const uint8_t *a, const uint8_t *b,
+					 unsigned int prefix_len)
+{
+	unsigned int bytes = prefix_len / 8, bits = prefix_len % 8;
+	uint8_t mask;
+
+	if (memcmp(a, b, bytes) != 0)
+		return false;
+	if (bits == 0)
+		return true;
+	mask = 0xff << (8 - bits);
+	return (a[bytes] & mask) == (b[bytes] & mask);
+}
+
+/**
+ * ip6_solicited_node - computes the solicited-node multicast address
+ * @addr: the unicast address
+ * @out: a buffer to store ff02::1:ffXX:XXXX
+ */
+static inline void ip6_solicited_node(const uint8_t *addr, uint8_t *out)
+{
+	static const uint8_t prefix[13] = {
+		0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff,
+	};
+
+	memcpy(out, prefix, sizeof(prefix));
+	memcpy(out + 13, addr + 13, 3);
+}
+
+/**
+ * ip6_multicast_eth_addr - maps an IPv6 multicast address to a MAC address
+ * @addr: the multicast address
+ *
+ * See RFC 2464 Section 7 (33:33 followed by the low 32 bits).
+ */
+static inline struct eth_addr ip6_multicast_eth_addr(const uint8_t *addr)
+{
+	struct eth_addr eth = {{0x33, 0x33, addr[12], addr[13],
+				addr[14], addr[15]}};
+	return eth;
+}
+
+/**
+ * eth_addr_is_ip6_multicast - returns true if the MAC address is 33:33:xx...
+ */
+static inline bool eth_addr_is_ip6_multicast(const struct eth_addr *addr)
+{
+	return addr->addr[0] == 0x33 && addr->addr[1] == 0x33;
+}
+
+
+/*
+ * Structure of an ICMPv6 header (RFC 4443)
+ */
+struct icmp6_hdr {
+	uint8_t type;
+	uint8_t code;
+	uint16_t chksum;
+} __packed;
+
+#define ICMP6_DST_UNREACH	1
+#define ICMP6_PACKET_TOO_BIG	2
+#define ICMP6_TIME_EXCEEDED	3
+#define ICMP6_PARAM_PROB	4
+#define ICMP6_ECHO_REQUEST	128
+#define ICMP6_ECHO_REPLY	129
+
+/*
+ * Neighbor discovery messages (RFC 4861)
+ */
+#define ND_ROUTER_SOLICIT	133
+#define ND_ROUTER_ADVERT	134
+#define ND_NEIGHBOR_SOLICIT	135
+#define ND_NEIGHBOR_ADVERT	136
+#define ND_REDIRECT		137
+
+struct nd_neighbor_msg {
+	struct icmp6_hdr hdr;
+	uint32_t flags;			/* reserved in solicitations */
+	uint8_t target[IP6_ADDR_LEN];
+} __packed;
+
+#define ND_NA_FLAG_ROUTER	0x80000000
+#define ND_NA_FLAG_SOLICITED	0x40000000
+#define ND_NA_FLAG_OVERRIDE	0x20000000
+
+/* options are measured in units of 8 bytes */
+struct nd_opt_hdr {
+	uint8_t type;
+	uint8_t len;
+} __packed;
+
+#define ND_OPT_SOURCE_LINKADDR	1
+#define ND_OPT_TARGET_LINKADDR	2
+
+struct nd_opt_lladdr {
+	struct nd_opt_hdr hdr;
+	struct eth_addr addr;
+} __packed;
@@ -21,6 +21,7 @@
 
 struct mbuf {
 	struct mbuf	*next;	   /* the next mbuf in the mbufq */
+	struct mbuf	*frag_next; /* the next fragment of a reassembled packet */
 	unsigned char	*head;	   /* start of the buffer */
 	unsigned char	*data;	   /* current position within the buffer */
 	unsigned int	head_len;  /* length of the entire buffer from @head */
@@ -254,15 +255,38 @@ static inline void mbuf_init(struct mbuf *m, unsigned char *head,
 	m->head_len = head_len;
 	m->data = m->head + reserve_len;
 	m->len = 0;
+	m->frag_next = NULL;
 }
 
+extern void mbuf_free_frags(struct mbuf *m);
+
 /**
  * mbuf_free - frees an mbuf back to an allocator
  * @m: the mbuf to free
+ *
+ * If @m is the head of a reassembled packet, its fragments are freed too.
  */
 static inline void mbuf_free(struct mbuf *m)
 {
+	struct mbuf *frag = m->frag_next;
+
 	m->release(m);
+	if (unlikely(frag))
+		mbuf_free_frags(frag);
+}
+
+/**
+ * mbuf_chain_length - returns the data length of an mbuf and its fragments
+ * @m: the packet
+ */
+static inline unsigned int mbuf_chain_length(struct mbuf *m)
+{
+	unsigned int len = 0;
+
+	for (; m; m = m->frag_next)
+		len += mbuf_length(m);
+	return len;
 }
 
 extern struct mbuf *mbuf_clone(struct mbuf *dst, struct mbuf *src);
+extern size_t mbuf_chain_copy(struct mbuf *m, void *buf, size_t len);
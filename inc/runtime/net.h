@@ -4,11 +4,77 @@
 
 #pragma once
 
+#include <string.h>
+
 #include <base/types.h>
 
+/* address families of struct netaddr */
+enum {
+	NETADDR_IPV4 = 0,
+	NETADDR_IPV6,
+};
+
+/*
+ * A dual-stack transport address. Zero-initialized addresses (including
+ * "{ip, port}" initializers) are IPv4, so @ip6 is only meaningful when @family
+ * is NETADDR_IPV6.
+ */
 struct netaddr {
-	uint32_t ip;
+	uint32_t ip;		/* IPv4 address (in native byte order) */
 	uint16_t port;
+	uint8_t family;		/* NETADDR_IPV4 or NETADDR_IPV6 */
+	uint8_t pad;
+	uint8_t ip6[16];	/* IPv6 address (in network byte order) */
 };
 
+/* large enough for "[<ipv6 address>]:<port>" */
+#define NETADDR_STR_LEN	56
+
 extern int str_to_netaddr(const char *str, struct netaddr *addr);
+extern char *netaddr_to_str(struct netaddr addr, char *str);
+
+/**
+ * netaddr_ipv6 - makes an IPv6 transport address
+ * @ip6: the IPv6 address (in network byte order)
+ * @port: the port number
+ */
+static inline struct netaddr netaddr_ipv6(const uint8_t *ip6, uint16_t port)
+{
+	struct netaddr addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.family = NETADDR_IPV6;
+	addr.port = port;
+	memcpy(addr.ip6, ip6, sizeof(addr.ip6));
+	return addr;
+}
+
+/**
+ * netaddr_is_ipv6 - returns true if the address is an IPv6 address
+ */
+static inline bool netaddr_is_ipv6(const struct netaddr *addr)
+{
+	return addr->family == NETADDR_IPV6;
+}
+
+/**
+ * netaddr_ip_equal - returns true if two addresses have the same IP address
+ */
+static inline bool netaddr_ip_equal(const struct netaddr *a,
+				    const struct netaddr *b)
+{
+	if (a->family != b->family)
+		return false;
+	if (a->family == NETADDR_IPV4)
+		return a->ip == b->ip;
+	return memcmp(a->ip6, b->ip6, sizeof(a->ip6)) == 0;
+}
+
+/**
+ * netaddr_equal - returns true if two addresses have the same IP and port
+ */
+static inline bool netaddr_equal(const struct netaddr *a,
+				 const struct netaddr *b)
+{
+	return a->port == b->port && netaddr_ip_equal(a, b);
+}
@@ -9,6 +9,13 @@
 #include <runtime/thread.h>
 #include <runtime/sync.h>
 
+/* event flags reported by triggers */
+#define POLLEV_IN	BIT(0) /* readable, or a connection can be accepted */
+#define POLLEV_OUT	BIT(1) /* writable */
+#define POLLEV_ERR	BIT(2) /* an error occurred */
+#define POLLEV_HUP	BIT(3) /* shut down or closed by the peer */
+#define POLLEV_ALL	(POLLEV_IN | POLLEV_OUT | POLLEV_ERR | POLLEV_HUP)
+
 typedef struct poll_waiter {
 	spinlock_t		lock;
 	struct list_head	triggered;
@@ -19,9 +26,16 @@ typedef struct poll_trigger {
 	struct list_node	link;
 	struct poll_waiter	*waiter;
 	bool			triggered;
+	unsigned int		mask;
+	unsigned int		events;
 	unsigned long		data;
 } poll_trigger_t;
 
+struct poll_event {
+	unsigned long		data;
+	unsigned int		events;
+};
+
 
 /*
  * Waiter API
@@ -29,8 +43,12 @@ typedef struct poll_trigger {
 
 extern void poll_init(poll_waiter_t *w);
 extern void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned long data);
+extern void poll_arm_events(poll_waiter_t *w, poll_trigger_t *t,
+			    unsigned int mask, unsigned long data);
 extern void poll_disarm(poll_trigger_t *t);
 extern unsigned long poll_wait(poll_waiter_t *w);
+extern int poll_wait_events(poll_waiter_t *w, struct poll_event *evs,
+			    int max, bool block);
 
 
 /*
@@ -45,6 +63,9 @@ static inline void poll_trigger_init(poll_trigger_t *t)
 {
 	t->waiter = NULL;
 	t->triggered = false;
+	t->mask = 0;
+	t->events = 0;
 }
 
 extern void poll_trigger(poll_waiter_t *w, poll_trigger_t *t);
+extern void poll_trigger_events(poll_trigger_t *t, unsigned int events);
@@ -94,7 +94,8 @@ static inline void assert_preempt_disabled(void)
  */
 static inline void clear_preempt_needed(void)
 {
-	preempt_cnt |= PREEMPT_NOT_PENDING;
+	asm volatile("orl %0, %%fs:preempt_cnt@tpoff"
+		     : : "i" (PREEMPT_NOT_PENDING) : "memory", "cc");
 }
 
 /**
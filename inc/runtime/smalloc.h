@@ -7,12 +7,21 @@
 #include <string.h>
 
 #include <base/stddef.h>
+#include <base/slab.h>
+
+#define SMALLOC_BITS            15
+#define SMALLOC_MIN_SIZE	SLAB_MIN_SIZE
+#define SMALLOC_MAX_SIZE        (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
 
 #define __smalloc_attr __malloc __assume_aligned(16)
 
+/* true once the local kthread can allocate with smalloc() */
+extern __thread bool smalloc_ready;
+
 extern void *smalloc(size_t size) __smalloc_attr;
 extern void *__szalloc(size_t size) __smalloc_attr;
 extern void sfree(void *item);
+extern size_t smalloc_usable_size(void *item);
 
 /**
  * szalloc - allocates zeroed memory
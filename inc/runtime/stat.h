@@ -0,0 +1,46 @@
+/*
+ * stat.h - binary statistics snapshot format
+ *
+ * The stat server (port 40) answers "stat" with comma-separated name:value
+ * pairs. It also answers "statn" with the names of the counters followed by the
+ * names of the histograms, in snapshot order, and "statb" with a binary
+ * snapshot. A runtime can also publish snapshots to a SysV shared memory
+ * segment (the "stat_shm_key" config option) so they can be read without any
+ * network round trip.
+ *
+ * A snapshot starts with a struct stat_snapshot_hdr. Counters follow as an
+ * array of @nr_counters uint64_t values. Histograms follow the counters.
+ *
+ * Over the network, each histogram is encoded as a struct stat_hist_range
+ * followed by @count uint64_t bucket values starting at bucket @first (all
+ * other buckets are zero). In shared memory, each histogram is a dense array
+ * of @nr_buckets uint64_t values, @seq is odd while a snapshot is being
+ * written, and @names_len bytes of names (in "statn" format) follow the
+ * histograms.
+ *
+ * Histogram bucket boundaries are given by hist_bucket_min() in base/hist.h.
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+#define STAT_SNAPSHOT_MAGIC	0x54415453 /* 'STAT' */
+#define STAT_SNAPSHOT_VERSION	1
+
+struct stat_snapshot_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	nr_counters;
+	uint16_t	nr_hists;
+	uint16_t	nr_buckets;
+	uint32_t	names_len;
+	uint64_t	seq;
+	uint64_t	tsc;
+	uint64_t	cycles_per_us;
+};
+
+struct stat_hist_range {
+	uint16_t	first;
+	uint16_t	count;
+};
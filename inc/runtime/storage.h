@@ -4,11 +4,22 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
 #include <base/stddef.h>
+#include <base/list.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
 
 extern int storage_write(const void *payload, uint64_t lba, uint32_t lba_count);
 extern int storage_read(void *dest, uint64_t lba, uint32_t lba_count);
 
+/* through the block cache, if enabled (see "storage_cache_mb") */
+extern int storage_cache_write(const void *src, uint64_t lba,
+			       uint32_t lba_count);
+extern int storage_cache_read(void *dest, uint64_t lba, uint32_t lba_count);
+extern int storage_cache_flush(void);
+
 
 
 /*
@@ -28,3 +39,82 @@ static inline uint64_t storage_num_blocks(void)
 	extern uint64_t num_blocks;
 	return num_blocks;
 }
+
+
+/*
+ * Asynchronous API
+ *
+ * Requests are submitted in batches to a storage queue, and complete in any
+ * order. Completed requests are either collected with storage_poll() and
+ * storage_wait(), or passed to a callback. Unlike storage_read() and
+ * storage_write(), data moves directly between the device and the request's
+ * buffers, so they must come from storage_buf_alloc() (or memory registered
+ * with storage_buf_register()).
+ */
+
+enum {
+	STORAGE_OP_READ = 0,
+	STORAGE_OP_WRITE,
+};
+
+struct storage_req;
+typedef struct storage_queue storage_queue_t;
+
+/*
+ * A completion callback. It runs in softirq context (or from within
+ * storage_submit() if the request completes immediately), so it must not
+ * block or submit requests.
+ */
+typedef void (*storage_cb_t)(struct storage_req *req);
+
+struct storage_req {
+	/* filled in by the caller */
+	int			op;	   /* STORAGE_OP_* */
+	uint64_t		lba;	   /* the first block */
+	uint32_t		lba_count; /* the number of blocks */
+	const struct iovec	*iov;	   /* buffers of lba_count blocks */
+	int			iovcnt;
+	storage_cb_t		cb;	   /* if NULL, use storage_poll() */
+	void			*arg;	   /* for the caller's use */
+
+	/* the result: 0 if successful, otherwise < 0 */
+	int			ret;
+
+	/* private */
+	storage_queue_t		*sq;
+	struct list_node	link;
+	int			sge_idx;
+	uint32_t		sge_off;
+	struct timer_entry	timer;
+};
+
+struct storage_queue {
+	spinlock_t		lock;
+	struct list_head	completed;
+	unsigned int		nr_completed;
+	unsigned int		nr_outstanding;
+	unsigned int		nr_polled; /* outstanding, without a callback */
+	unsigned int		wait_min;
+	thread_t		*waiter;
+};
+
+extern void storage_queue_init(storage_queue_t *sq);
+extern int storage_submit(storage_queue_t *sq, struct storage_req **reqs,
+			  int nr);
+extern int storage_poll(storage_queue_t *sq, struct storage_req **reqs,
+			int max);
+extern int storage_wait(storage_queue_t *sq, struct storage_req **reqs,
+			int min, int max);
+
+extern void *storage_buf_alloc(size_t len);
+extern void storage_buf_free(void *buf);
+extern int storage_buf_register(void *buf, size_t len);
+
+/**
+ * storage_queue_outstanding - the number of requests that haven't completed
+ * @sq: the storage queue
+ */
+static inline unsigned int storage_queue_outstanding(storage_queue_t *sq)
+{
+	return ACCESS_ONCE(sq->nr_outstanding);
+}
@@ -15,10 +15,13 @@
  * Mutex support
  */
 
+#define MUTEX_LOCKED	1
+
 struct mutex {
 	atomic_t		held;
 	spinlock_t		waiter_lock;
 	struct list_head	waiters;
+	thread_t		*owner;
 };
 
 typedef struct mutex mutex_t;
@@ -35,7 +38,15 @@ extern void mutex_init(mutex_t *m);
  */
 static inline bool mutex_try_lock(mutex_t *m)
 {
-	return atomic_cmpxchg(&m->held, 0, 1);
+	int held = atomic_read(&m->held);
+
+	if (held & MUTEX_LOCKED)
+		return false;
+	if (!atomic_cmpxchg(&m->held, held, held | MUTEX_LOCKED))
+		return false;
+
+	m->owner = thread_self();
+	return true;
 }
 
 /**
@@ -44,8 +55,10 @@ static inline bool mutex_try_lock(mutex_t *m)
  */
 static inline void mutex_lock(mutex_t *m)
 {
-	if (likely(atomic_cmpxchg(&m->held, 0, 1)))
+	if (likely(atomic_cmpxchg(&m->held, 0, MUTEX_LOCKED))) {
+		m->owner = thread_self();
 		return;
+	}
 
 	__mutex_lock(m);
 }
@@ -56,18 +69,20 @@ static inline void mutex_lock(mutex_t *m)
  */
 static inline void mutex_unlock(mutex_t *m)
 {
-	if (likely(atomic_cmpxchg(&m->held, 1, 0)))
+	m->owner = NULL;
+	if (likely(atomic_cmpxchg(&m->held, MUTEX_LOCKED, 0)))
 		return;
 
 	__mutex_unlock(m);
 }
+
 /**
  * mutex_held - is the mutex currently held?
  * @m: the mutex to check
  */
 static inline bool mutex_held(mutex_t *m)
 {
-	return atomic_read(&m->held);
+	return atomic_read(&m->held) & MUTEX_LOCKED;
 }
 
 /**
@@ -191,6 +206,7 @@ struct rwmutex {
 	struct list_head	read_waiters;
 	struct list_head	write_waiters;
 	int			read_waiter_count;
+	thread_t		*writer;
 };
 
 typedef struct rwmutex rwmutex_t;
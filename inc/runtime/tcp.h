@@ -5,6 +5,7 @@
 #pragma once
 
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -21,6 +22,10 @@ extern int tcp_dial_conn_affinity(tcpconn_t *in, struct netaddr raddr,
 		    tcpconn_t **c_out);
 extern int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out);
 extern int tcp_accept(tcpqueue_t *q, tcpconn_t **c_out);
+extern int tcp_listen_percore(struct netaddr laddr, int backlog,
+			      tcpqueue_t **q_out);
+extern int tcp_accept_percore(tcpqueue_t *q, unsigned int idx,
+			      tcpconn_t **c_out);
 extern void tcp_qshutdown(tcpqueue_t *q);
 extern void tcp_qclose(tcpqueue_t *q);
 extern struct netaddr tcp_local_addr(tcpconn_t *c);
@@ -32,3 +37,22 @@ extern ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern int tcp_shutdown(tcpconn_t *c, int how);
 extern void tcp_abort(tcpconn_t *c);
 extern void tcp_close(tcpconn_t *c);
+extern void tcp_set_keepalive(tcpconn_t *c, bool keepalive);
+
+/*
+ * Event polling support
+ *
+ * Connections and listen queues can be armed on a poll waiter to receive
+ * edge-triggered POLLEV_* events, so a single thread can serve many of them.
+ * Pollers should set the connection nonblocking and drain it (until -EAGAIN)
+ * after each event.
+ */
+
+extern void tcp_set_nonblocking(tcpconn_t *c, bool nonblocking);
+extern void tcp_poll_arm(tcpconn_t *c, poll_waiter_t *w, unsigned int mask,
+			 unsigned long data);
+extern void tcp_poll_disarm(tcpconn_t *c);
+extern void tcp_qset_nonblocking(tcpqueue_t *q, bool nonblocking);
+extern void tcp_qpoll_arm(tcpqueue_t *q, poll_waiter_t *w, unsigned int mask,
+			  unsigned long data);
+extern void tcp_qpoll_disarm(tcpqueue_t *q);
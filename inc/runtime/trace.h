@@ -0,0 +1,73 @@
+/*
+ * trace.h - scheduler event tracing
+ *
+ * Each kthread records scheduler events into its own ring buffer while tracing
+ * is enabled. The rings are sized by the "runtime_trace_events" config option
+ * (tracing is unavailable if it is not set). Besides the functions below,
+ * tracing can be controlled over TCP through the stat server with the commands
+ * "traceon", "traceoff" and "tracedump", which writes /tmp/sched_trace.<pid>
+ * (remove it before dumping again). A dump file can be converted into a
+ * Chrome/Perfetto trace with scripts/sched_trace.py.
+ *
+ * Dump file format: a struct trace_file_hdr, followed by @nr_rings rings. Each
+ * ring is a struct trace_ring_hdr followed by @nr_events struct trace_event,
+ * oldest first.
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+enum {
+	TRACE_READY = 0,	/* a uthread was made runnable */
+	TRACE_RUN,		/* a uthread started running */
+	TRACE_STEAL,		/* a uthread was stolen (arg: victim kthread) */
+	TRACE_PARK,		/* the kthread parked */
+	TRACE_WAKE,		/* the kthread was woken after parking */
+	TRACE_PREEMPT,		/* the iokernel preempted the kthread */
+	TRACE_SOFTIRQ_START,	/* softirq processing began (arg: softirq) */
+	TRACE_SOFTIRQ_END,	/* softirq processing ended (arg: softirq) */
+	TRACE_NR,
+};
+
+enum {
+	TRACE_SOFTIRQ_IOKERNEL = 0,
+	TRACE_SOFTIRQ_DIRECTPATH,
+	TRACE_SOFTIRQ_TIMER,
+	TRACE_SOFTIRQ_STORAGE,
+	TRACE_SOFTIRQ_LOOPBACK,
+};
+
+#define TRACE_FILE_MAGIC	0x45435254 /* 'TRCE' */
+#define TRACE_FILE_VERSION	1
+
+struct trace_file_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nr_rings;
+	uint32_t	pad;
+	uint64_t	cycles_per_us;
+};
+
+struct trace_ring_hdr {
+	uint32_t	kthread_idx;
+	uint32_t	nr_events;
+	uint64_t	dropped;
+};
+
+/*
+ * @data packs the event type (bits 0-7), the argument (bits 8-15) and the
+ * address of the uthread (bits 16-63), if any.
+ */
+struct trace_event {
+	uint64_t	tsc;
+	uint64_t	data;
+};
+
+#define TRACE_TYPE(data)	((data) & 0xff)
+#define TRACE_ARG(data)		(((data) >> 8) & 0xff)
+#define TRACE_THREAD(data)	((data) >> 16)
+
+extern int sched_trace_start(void);
+extern void sched_trace_stop(void);
+extern int sched_trace_dump(const char *path);
@@ -9,12 +9,20 @@
 #include <net/ip.h>
 #include <net/udp.h>
 #include <runtime/net.h>
+#include <runtime/poll.h>
 #include <sys/uio.h>
 
 /* the maximum possible payload size (for the largest possible MTU) */
 #define UDP_MAX_PAYLOAD_SIZE \
 	(ETH_MAX_MTU - sizeof(struct ip_hdr) - sizeof(struct udp_hdr))
 
+/* the maximum datagram size (larger than the MTU requires IP fragmentation) */
+#define UDP_MAX_DATAGRAM_SIZE \
+	(USHRT_MAX - sizeof(struct ip_hdr) - sizeof(struct udp_hdr))
+
+/* the maximum number of IP fragments per datagram */
+#define UDP_MAX_FRAGS	64
+
 extern unsigned int udp_payload_size;
 
 /**
@@ -48,6 +56,26 @@ extern ssize_t udp_write(udpconn_t *c, const void *buf, size_t len);
 extern void udp_shutdown(udpconn_t *c);
 extern void udp_close(udpconn_t *c);
 
+/* the maximum number of datagrams moved by a batched call */
+#define UDP_BATCH_MAX	64
+
+struct udp_msg {
+	void		*buf;	/* the datagram payload */
+	size_t		len;	/* the payload length (set when reading) */
+	size_t		cap;	/* the size of @buf (only used when reading) */
+	struct netaddr	raddr;	/* the remote address */
+};
+
+extern ssize_t udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int n);
+extern ssize_t udp_write_batch(udpconn_t *c, const struct udp_msg *msgs,
+			       int n);
+
+/* event polling support (see tcp.h) */
+extern void udp_set_nonblocking(udpconn_t *c, bool nonblocking);
+extern void udp_poll_arm(udpconn_t *c, poll_waiter_t *w, unsigned int mask,
+			 unsigned long data);
+extern void udp_poll_disarm(udpconn_t *c);
+
 
 /*
  * UDP Parallel API
@@ -65,32 +93,33 @@ struct udp_spawn_data {
 };
 
 typedef void (*udpspawn_fn_t)(struct udp_spawn_data *d);
+/* returns false to drop a datagram (@inflight are already outstanding) */
+typedef bool (*udpspawn_admit_fn_t)(const struct udp_spawn_data *d,
+				    int inflight);
+
+struct udp_spawner_stats {
+	uint64_t	queued;		/* datagrams accepted for handling */
+	uint64_t	dropped;	/* datagrams rejected on arrival */
+	uint64_t	served;		/* datagrams passed to a handler */
+	uint64_t	backlog;	/* datagrams waiting for a handler */
+	uint64_t	inflight;	/* datagrams queued or being handled */
+};
 
 extern int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
 			      udpspawner_t **s_out);
+extern int udp_create_spawner_pool(struct netaddr laddr, udpspawn_fn_t fn,
+				   int workers, int max_inflight,
+				   udpspawn_admit_fn_t admit,
+				   udpspawner_t **s_out);
+extern void udp_spawner_get_stats(udpspawner_t *s,
+				  struct udp_spawner_stats *stats);
 extern void udp_destroy_spawner(udpspawner_t *s);
 extern ssize_t udp_send(const void *buf, size_t len,
 			struct netaddr laddr, struct netaddr raddr);
 extern ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
 			 struct netaddr laddr, struct netaddr raddr);
 extern void udp_spawn_data_release(void *release_data);
-
-/**
- * udp_respond - sends a response datagram to a spawner datagram
- * @buf: a buffer containing the datagram
- * @len: the length of the datagram
- * @d: the UDP spawner data
- *
- * Returns @len if successful, otherwise fail.
- */
-static inline ssize_t udp_respond(const void *buf, size_t len,
-				  struct udp_spawn_data *d)
-{
-	return udp_send(buf, len, d->laddr, d->raddr);
-}
-
-static inline ssize_t udp_respondv(const struct iovec *iov, int iovcnt,
-				   struct udp_spawn_data *d)
-{
-	return udp_sendv(iov, iovcnt, d->laddr, d->raddr);
-}
+extern ssize_t udp_respond(const void *buf, size_t len,
+			   struct udp_spawn_data *d);
+extern ssize_t udp_respondv(const struct iovec *iov, int iovcnt,
+			    struct udp_spawn_data *d);
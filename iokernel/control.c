@@ -26,6 +26,7 @@
 #include <iokernel/control.h>
 
 #include "defs.h"
+#include "ksched.h"
 #include "sched.h"
 
 static int controlfd;
@@ -126,6 +127,12 @@ static struct proc *control_create_proc(mem_key_t key, size_t len,
 	if (hdr.thread_count > NCPU || hdr.thread_count == 0)
 		goto fail;
 
+	if (!hdr.sched_cfg.park_on_futex != !ksched_fallback) {
+		log_err("control: runtime and IOKernel disagree on using ksched, "
+			"please load ksched or set runtime_park_futex");
+		goto fail;
+	}
+
 	if (hdr.sched_cfg.guaranteed_cores + nr_guaranteed >
 	    bitmap_popcount(sched_allowed_cores, NCPU)) {
 		log_err("guaranteed cores exceeds total core count");
@@ -194,6 +201,12 @@ static struct proc *control_create_proc(mem_key_t key, size_t len,
 		if (!th->q_ptrs)
 			goto fail;
 
+		th->park_futex = (struct park_futex *) shmptr_to_ptr(&reg,
+				s->park_futex, sizeof(struct park_futex));
+		if (!th->park_futex)
+			goto fail;
+		th->park_core = NCPU;
+
 		ret = control_init_hwq(&reg, &s->direct_rxq, &th->directpath_hwq);
 		if (ret)
 			goto fail;
@@ -31,6 +31,8 @@ struct iokernel_cfg {
 	bool	ias_prefer_selfpair; /* prefer self-pairings */
 	float	ias_bw_limit; /* IAS bw limit, (MB/s) */
 	bool	no_hw_qdel; /* Disable use of hardware timestamps for qdelay */
+	bool	vnic; /* loop packets back through software instead of a NIC */
+	bool	noksched; /* park kthreads on futexes even if ksched is loaded */
 };
 
 extern struct iokernel_cfg cfg;
@@ -84,6 +86,8 @@ struct thread {
 	struct lrpc_chan_in	txcmdq;
 	pid_t			tid;
 	struct q_ptrs		*q_ptrs;
+	struct park_futex	*park_futex;
+	unsigned int		park_core; /* last core pinned to (no ksched) */
 	uint32_t		last_rq_head;
 	uint32_t		last_rq_tail;
 	uint32_t		last_rxq_head;
@@ -286,6 +290,7 @@ enum {
 	RX_BROADCAST_FAIL,
 	RX_UNHANDLED,
 	RX_JOIN_FAIL,
+	RX_VNIC_COPY_FAIL,
 
 	TX_COMPLETION_OVERFLOW,
 	TX_COMPLETION_FAIL,
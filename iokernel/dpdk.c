@@ -105,6 +105,13 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 		nb_txd = MLX5_TX_RING_SIZE;
 	}
 
+	/* software devices support few (if any) offloads */
+	port_conf.rxmode.offloads &= dev_info.rx_offload_capa;
+	port_conf.txmode.offloads &= dev_info.tx_offload_capa;
+	port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+	if (!port_conf.rx_adv_conf.rss_conf.rss_hf)
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
@@ -197,8 +204,9 @@ void dpdk_print_eth_stats(void)
  */
 int dpdk_init(void)
 {
-	char *argv[nic_pci_addr_str ? 6 : 5];
+	char *argv[6];
 	char buf[10];
+	int argc = 4;
 
 	/* init args */
 	argv[0] = "./iokerneld";
@@ -207,15 +215,22 @@ int dpdk_init(void)
 	sprintf(buf, "%d", sched_dp_core);
 	argv[2] = buf;
 	argv[3] = "--socket-mem=128";
-	if (nic_pci_addr_str) {
-		argv[4] = "-w";
-		argv[5] = nic_pci_addr_str;
+	if (cfg.vnic) {
+		/*
+		 * a ring device with a single ring per queue, so every transmitted
+		 * packet is received again and switched to its destination runtime
+		 */
+		argv[argc++] = "--no-pci";
+		argv[argc++] = "--vdev=net_ring0";
+	} else if (nic_pci_addr_str) {
+		argv[argc++] = "-w";
+		argv[argc++] = nic_pci_addr_str;
 	} else {
-		argv[4] = "--vdev=net_tap0";
+		argv[argc++] = "--vdev=net_tap0";
 	}
 
 	/* initialize the Environment Abstraction Layer (EAL) */
-	int ret = rte_eal_init(ARRAY_SIZE(argv), argv);
+	int ret = rte_eal_init(argc, argv);
 	if (ret < 0) {
 		log_err("dpdk: error with EAL initialization");
 		return -1;
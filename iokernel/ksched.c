@@ -2,12 +2,15 @@
  * ksched.c - an interface to the ksched kernel module
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/futex.h>
 
 #include <base/log.h>
 
@@ -23,6 +26,133 @@ struct ksched_shm_cpu *ksched_shm;
 cpu_set_t ksched_set;
 /* the generation number for each core */
 unsigned int ksched_gens[NCPU];
+/* true if kthreads park on futexes because ksched isn't loaded */
+bool ksched_fallback;
+/* the kthread requested by the last ksched_run() on each core */
+struct thread *ksched_next_th[NCPU];
+/* the kthread running on each core (when emulating ksched) */
+static struct thread *fallback_th[NCPU];
+
+/* is @th still running on @core, or has it parked (or exited)? */
+static bool fallback_th_running(struct thread *th, unsigned int core)
+{
+	struct park_futex *pf = th->park_futex;
+
+	return !th->p->kill && !load_acquire(&pf->parked) &&
+	       ACCESS_ONCE(pf->core) == core;
+}
+
+static void fallback_wake(struct thread *th, unsigned int core)
+{
+	struct park_futex *pf = th->park_futex;
+	cpu_set_t mask;
+
+	/* ksched migrates the kthread; here the kernel must be told to */
+	if (th->park_core != core) {
+		CPU_ZERO(&mask);
+		CPU_SET(core, &mask);
+		if (sched_setaffinity(th->tid, sizeof(mask), &mask))
+			log_warn_ratelimited("ksched: couldn't pin tid %d to "
+					     "core %d [%s]", th->tid, core,
+					     strerror(errno));
+		th->park_core = core;
+	}
+
+	ACCESS_ONCE(pf->core) = core;
+	store_release(&pf->parked, 0);
+	store_release(&pf->gen, ACCESS_ONCE(pf->gen) + 1);
+	syscall(SYS_futex, &pf->gen, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * ksched_fallback_poll - emulates ksched's context switches on a core
+ * @core: the core to advance
+ *
+ * Switches to the kthread requested by ksched_run() once the kthread already
+ * running on @core parks. Slower than ksched, as the iokernel must notice the
+ * park before waking the next kthread, and wakeups go through the scheduler.
+ */
+void ksched_fallback_poll(unsigned int core)
+{
+	struct ksched_shm_cpu *c = &ksched_shm[core];
+	struct thread *th = fallback_th[core];
+	unsigned int gen;
+
+	/* wait for the running kthread to park */
+	if (th) {
+		if (fallback_th_running(th, core))
+			return;
+		fallback_th[core] = NULL;
+		proc_put(th->p);
+		store_release(&c->busy, false);
+	}
+
+	gen = load_acquire(&c->gen);
+	if (gen == c->last_gen)
+		return;
+
+	th = ksched_next_th[core];
+	if (th && th->p->kill) {
+		th = NULL;
+	} else if (th && !load_acquire(&th->park_futex->parked)) {
+		/* still parking on another core (or not yet started) */
+		return;
+	}
+
+	if (th) {
+		fallback_wake(th, core);
+		proc_get(th->p);
+		fallback_th[core] = th;
+	}
+	store_release(&c->busy, th != NULL);
+	store_release(&c->last_gen, gen);
+}
+
+/**
+ * ksched_fallback_send_intrs - sends pending interrupts with signals
+ */
+void ksched_fallback_send_intrs(void)
+{
+	struct ksched_shm_cpu *c;
+	struct thread *th;
+	int core;
+
+	for (core = 0; core < NCPU; core++) {
+		if (!CPU_ISSET(core, &ksched_set))
+			continue;
+
+		/* like ksched, only interrupt the kthread the request was for */
+		c = &ksched_shm[core];
+		th = fallback_th[core];
+		if (!th || load_acquire(&c->sig) != c->last_gen ||
+		    !fallback_th_running(th, core))
+			continue;
+
+		ACCESS_ONCE(th->park_futex->intr_gen) =
+			ACCESS_ONCE(th->park_futex->gen);
+		syscall(SYS_tgkill, th->p->pid, th->tid, c->signum);
+		store_release(&c->sig, 0);
+	}
+}
+
+/* sets up ksched emulation, for machines without the kernel module */
+static int ksched_fallback_init(void)
+{
+	ksched_shm = aligned_alloc(CACHE_LINE_SIZE,
+				   sizeof(struct ksched_shm_cpu) * NCPU);
+	if (!ksched_shm)
+		return -ENOMEM;
+	memset(ksched_shm, 0, sizeof(struct ksched_shm_cpu) * NCPU);
+
+	/* the bandwidth controller needs ksched to read performance counters */
+	if (!cfg.nobw) {
+		log_warn("ksched: disabling the bandwidth controller");
+		cfg.nobw = true;
+	}
+
+	ksched_fallback = true;
+	return 0;
+}
 
 
 /**
@@ -35,8 +165,20 @@ int ksched_init(void)
 	char *ksched_addr;
 	int i;
 
+	if (cfg.noksched) {
+		log_info("ksched: emulating ksched, runtimes must set "
+			 "runtime_park_futex");
+		return ksched_fallback_init();
+	}
+
 	/* first open the file descriptor */
 	ksched_fd = open("/dev/ksched", O_RDWR);
+	if (ksched_fd < 0 && errno == ENOENT) {
+		log_warn("ksched: kernel module not loaded, parking kthreads on "
+			 "futexes instead (expect slower wakeups and no "
+			 "bandwidth control)");
+		return ksched_fallback_init();
+	}
 	if (ksched_fd < 0) {
 		log_err("Could not find ksched kernel module (%s). Please ensure that "
 			    "ksched is compiled and inserted (see README for more details)",
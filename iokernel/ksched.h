@@ -15,24 +15,45 @@
 #define __user
 #include "../ksched/ksched.h"
 
+#include "defs.h"
+
 extern int ksched_fd, ksched_count;
 extern struct ksched_shm_cpu *ksched_shm;
 extern cpu_set_t ksched_set;
 extern unsigned int ksched_gens[NCPU];
+extern bool ksched_fallback;
+extern struct thread *ksched_next_th[NCPU];
+
+extern void ksched_fallback_poll(unsigned int core);
+extern void ksched_fallback_send_intrs(void);
 
 /**
  * ksched_run - runs a kthread on a specific core
  * @core: the core to run a kthread on
- * @tid: the kthread's TID (or zero to idle the core)
+ * @th: the kthread to run (or NULL to idle the core)
  */
-static inline void ksched_run(unsigned int core, pid_t tid)
+static inline void ksched_run(unsigned int core, struct thread *th)
 {
 	unsigned int gen = ++ksched_gens[core];
 
-	ksched_shm[core].tid = tid;
+	ksched_shm[core].tid = th ? th->tid : 0;
+	ksched_next_th[core] = th;
 	store_release(&ksched_shm[core].gen, gen);
 }
 
+/**
+ * ksched_poll - advances ksched emulation on a core (if ksched isn't loaded)
+ * @core: the core to advance
+ *
+ * Must be called before checking the core with ksched_poll_run_done() or
+ * ksched_poll_idle().
+ */
+static inline void ksched_poll(unsigned int core)
+{
+	if (ksched_fallback)
+		ksched_fallback_poll(core);
+}
+
 /**
  * ksched_poll_run_done - determines if the last ksched_run() call finished
  * @core: the core on which kthread_run() was called
@@ -141,6 +162,12 @@ static inline void ksched_send_intrs(void)
 		return;
 
 	ksched_count = 0;
+	if (ksched_fallback) {
+		ksched_fallback_send_intrs();
+		CPU_ZERO(&ksched_set);
+		return;
+	}
+
 	req.len = sizeof(ksched_set); 
 	req.mask = &ksched_set;
 	ret = ioctl(ksched_fd, KSCHED_IOC_INTR, &req);
@@ -132,10 +132,12 @@ void dataplane_loop(void)
 
 static void print_usage(void)
 {
-	printf("usage: POLICY [noht/core_list/nobw/mutualpair]\n");
+	printf("usage: POLICY [noht/core_list/nobw/mutualpair/vnic/noksched]\n");
 	printf("\tsimple: a simplified scheduler policy intended for testing\n");
 	printf("\tias: the Caladan scheduler policy (manages CPU interference)\n");
 	printf("\tnuma: an incomplete and experimental policy for NUMA architectures\n");
+	printf("\tvnic: switch packets between local runtimes without a NIC\n");
+	printf("\tnoksched: park kthreads on futexes instead of using ksched\n");
 }
 
 int main(int argc, char *argv[])
@@ -189,6 +191,10 @@ int main(int argc, char *argv[])
 				log_err("invalid pci address: %s", nic_pci_addr_str);
 				return -EINVAL;
 			}
+		} else if (!strcmp(argv[i], "vnic")) {
+			cfg.vnic = true;
+		} else if (!strcmp(argv[i], "noksched")) {
+			cfg.noksched = true;
 		} else if (!strcmp(argv[i], "noidlefastwake")) {
 			cfg.noidlefastwake = true;
 		} else if (string_to_bitmap(argv[i], input_allowed_cores, NCPU)) {
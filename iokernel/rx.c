@@ -5,10 +5,12 @@
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_hash.h>
+#include <rte_ip.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
 #include <rte_mempool.h>
 
+#include <base/hash.h>
 #include <base/log.h>
 #include <iokernel/queue.h>
 #include <iokernel/shm.h>
@@ -128,8 +130,13 @@ static void rx_one_pkt(struct rte_mbuf *buf)
 		return;
 	}
 
-	/* handle broadcast destinations (send to all runtimes) */
-	if (rte_is_broadcast_ether_addr(ptr_dst_addr) && dp.nr_clients > 0) {
+	/*
+	 * handle broadcast destinations and IPv6 multicast (used by neighbor
+	 * discovery) by sending to all runtimes
+	 */
+	if ((rte_is_broadcast_ether_addr(ptr_dst_addr) ||
+	     (ptr_dst_addr->addr_bytes[0] == 0x33 &&
+	      ptr_dst_addr->addr_bytes[1] == 0x33)) && dp.nr_clients > 0) {
 		bool success;
 		int n_sent = 0;
 
@@ -162,6 +169,66 @@ static void rx_one_pkt(struct rte_mbuf *buf)
 	STAT_INC(RX_UNHANDLED, 1);
 }
 
+/*
+ * Hash the IPv4 addresses and ports in software, in place of RSS.
+ */
+static uint32_t rx_vnic_hash(struct rte_mbuf *buf)
+{
+	struct rte_ether_hdr *eth_hdr;
+	struct rte_ipv4_hdr *ip_hdr;
+	uint32_t ports, len, off;
+
+	len = rte_pktmbuf_data_len(buf);
+	eth_hdr = rte_pktmbuf_mtod(buf, struct rte_ether_hdr *);
+	if (len < sizeof(*eth_hdr) + sizeof(*ip_hdr) ||
+	    eth_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+		return 0;
+
+	ip_hdr = (struct rte_ipv4_hdr *)(eth_hdr + 1);
+	off = sizeof(*eth_hdr) + (ip_hdr->version_ihl & 0xf) * 4;
+	if (len < off + sizeof(ports))
+		return 0;
+	memcpy(&ports, rte_pktmbuf_mtod_offset(buf, void *, off), sizeof(ports));
+
+	return hash_crc32c_two(0, (uint64_t)ip_hdr->src_addr << 32 |
+			       ip_hdr->dst_addr, ports);
+}
+
+/*
+ * In vnic mode, received packets are the mbufs transmitted by runtimes, still
+ * pointing into the sender's memory. Copy each into an RX mbuf that any
+ * runtime can read, and free the original so the sender gets its completion.
+ */
+static struct rte_mbuf *rx_vnic_copy(struct rte_mbuf *buf)
+{
+	uint16_t len = rte_pktmbuf_data_len(buf);
+	struct rte_mbuf *m;
+	char *data;
+
+	/* runtimes transmit each packet in a single segment */
+	m = rte_pktmbuf_alloc(dp.rx_mbuf_pool);
+	if (unlikely(!m))
+		goto fail;
+	data = rte_pktmbuf_append(m, len);
+	if (unlikely(!data))
+		goto fail_free;
+	memcpy(data, rte_pktmbuf_mtod(buf, void *), len);
+
+	/* the packet never left the host, so its checksums can be trusted */
+	m->ol_flags = PKT_RX_IP_CKSUM_GOOD | PKT_RX_L4_CKSUM_GOOD;
+	m->hash.rss = rx_vnic_hash(m);
+	rte_pktmbuf_free(buf);
+	return m;
+
+fail_free:
+	rte_pktmbuf_free(m);
+fail:
+	STAT_INC(RX_VNIC_COPY_FAIL, 1);
+	log_debug_ratelimited("rx: failed to copy vnic packet");
+	rte_pktmbuf_free(buf);
+	return NULL;
+}
+
 /*
  * Process a batch of incoming packets.
  */
@@ -181,6 +248,11 @@ bool rx_burst(void)
 			prefetch(rte_pktmbuf_mtod(bufs[i + RX_PREFETCH_STRIDE],
 				 char *));
 		}
+		if (cfg.vnic) {
+			bufs[i] = rx_vnic_copy(bufs[i]);
+			if (unlikely(!bufs[i]))
+				continue;
+		}
 		rx_one_pkt(bufs[i]);
 	}
 
@@ -159,7 +159,7 @@ __sched_run(struct core_state *s, struct thread *th, unsigned int core)
 		ksched_enqueue_intr(core, KSCHED_INTR_CEDE);
 
 	/* finally request that the new kthread run on this core */
-	ksched_run(core, th ? th->tid : 0);
+	ksched_run(core, th);
 	if (s->cur_th) {
 		sched_disable_kthread(s->cur_th);
 		proc_put(s->cur_th->p);
@@ -483,7 +483,7 @@ static int sched_try_fast_rewake(struct thread *th)
 	return -EINVAL;
 
 rewake:
-	ksched_run(th->core, th->tid);
+	ksched_run(th->core, th);
 	state[th->core].wait = true;
 	return 0;
 }
@@ -531,6 +531,7 @@ void sched_poll(void)
 	bitmap_init(idle, NCPU, false);
 	sched_for_each_allowed_core(core, i) {
 		s = &state[core];
+		ksched_poll(core);
 
 		/* check if a pending context switch finished */
 		if (s->wait && ksched_poll_run_done(core)) {
@@ -540,7 +541,7 @@ void sched_poll(void)
 				s->pending_th = NULL;
 				s->pending = false;
 				ksched_enqueue_intr(core, KSCHED_INTR_CEDE);
-				ksched_run(core, th ? th->tid : 0);
+				ksched_run(core, th);
 				if (s->cur_th) {
 					sched_disable_kthread(s->cur_th);
 					proc_put(s->cur_th->p);
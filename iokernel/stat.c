@@ -15,6 +15,7 @@ static const char *stat_names[] = {
 	"RX_BROADCAST_FAIL",
 	"RX_UNHANDLED",
 	"RX_JOIN_FAIL",
+	"RX_VNIC_COPY_FAIL",
 	"TX_COMPLETION_OVERFLOW",
 	"TX_COMPLETION_FAIL",
 	"RX_PULLED",
@@ -73,7 +73,10 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 			buf->ol_flags |= PKT_TX_IPV6;
 
 		buf->l4_len = sizeof(struct rte_tcp_hdr);
-		buf->l3_len = sizeof(struct rte_ipv4_hdr);
+		if (net_hdr->olflags & OLFLAG_IPV6)
+			buf->l3_len = sizeof(struct rte_ipv6_hdr);
+		else
+			buf->l3_len = sizeof(struct rte_ipv4_hdr);
 		buf->l2_len = RTE_ETHER_HDR_LEN;
 	}
 
@@ -27,3 +27,40 @@ struct mbuf *mbuf_clone(struct mbuf *dst, struct mbuf *src)
 
 	return dst;
 }
+
+/**
+ * mbuf_free_frags - frees a chain of fragments
+ * @m: the first fragment to free
+ */
+void mbuf_free_frags(struct mbuf *m)
+{
+	struct mbuf *next;
+
+	for (; m; m = next) {
+		next = m->frag_next;
+		m->release(m);
+	}
+}
+
+/**
+ * mbuf_chain_copy - copies the data of an mbuf and its fragments to a buffer
+ * @m: the packet
+ * @buf: the destination buffer
+ * @len: the size of @buf
+ *
+ * Returns the number of bytes copied.
+ */
+size_t mbuf_chain_copy(struct mbuf *m, void *buf, size_t len)
+{
+	unsigned char *pos = buf;
+	size_t n;
+
+	for (; m && len > 0; m = m->frag_next) {
+		n = MIN(len, mbuf_length(m));
+		memcpy(pos, mbuf_data(m), n);
+		pos += n;
+		len -= n;
+	}
+
+	return pos - (unsigned char *)buf;
+}
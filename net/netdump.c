@@ -6,6 +6,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -13,6 +14,7 @@
 #include <net/ethernet.h>
 #include <net/arp.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
 #include <net/udp.h>
 
 /**
@@ -125,3 +127,119 @@ char *ip_addr_to_str(uint32_t addr, char *str)
                  (addr & 0xff));
 	return str;
 }
+
+/**
+ * ip6_addr_to_str - prints an IPv6 address as a human-readable string
+ * @addr: the address (in network byte order)
+ * @str: a buffer to store the string
+ *
+ * Uses the canonical form from RFC 5952 (the longest run of two or more zero
+ * groups is compressed). The buffer must be IP6_ADDR_STR_LEN in size.
+ */
+char *ip6_addr_to_str(const uint8_t *addr, char *str)
+{
+	int i, run, best = -1, best_len = 1, pos = 0;
+	uint16_t grp[8];
+
+	for (i = 0; i < 8; i++)
+		grp[i] = (addr[i * 2] << 8) | addr[i * 2 + 1];
+
+	/* find the longest run of zero groups */
+	for (i = 0; i < 8; i += run ? run : 1) {
+		for (run = 0; i + run < 8 && grp[i + run] == 0; run++);
+		if (run > best_len) {
+			best = i;
+			best_len = run;
+		}
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (i == best) {
+			pos += sprintf(str + pos, "::");
+			i += best_len - 1;
+			continue;
+		}
+		if (i > 0 && i != best + best_len)
+			str[pos++] = ':';
+		pos += sprintf(str + pos, "%x", grp[i]);
+	}
+	str[pos] = '\0';
+
+	return str;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * str_to_ip6 - parses an IPv6 address
+ * @str: the string (e.g. "fd00::1")
+ * @addr: a buffer to store the address (in network byte order)
+ *
+ * Embedded IPv4 notation (e.g. "::ffff:1.2.3.4") is not supported.
+ *
+ * Returns 0 if successful, otherwise -EINVAL.
+ */
+int str_to_ip6(const char *str, uint8_t *addr)
+{
+	uint16_t grp[8];
+	int i, d, ngrp = 0, gap = -1, digits;
+	unsigned int val;
+
+	if (str[0] == ':') {
+		if (str[1] != ':')
+			return -EINVAL;
+		gap = 0;
+		str += 2;
+	}
+
+	while (*str != '\0') {
+		if (ngrp == 8)
+			return -EINVAL;
+
+		val = 0;
+		for (digits = 0; (d = hex_digit(*str)) >= 0; digits++, str++) {
+			if (digits == 4)
+				return -EINVAL;
+			val = (val << 4) | d;
+		}
+		if (digits == 0)
+			return -EINVAL;
+		grp[ngrp++] = val;
+
+		if (*str == '\0')
+			break;
+		if (*str++ != ':')
+			return -EINVAL;
+		if (*str == ':') {
+			if (gap >= 0)
+				return -EINVAL;
+			gap = ngrp;
+			str++;
+		} else if (*str == '\0') {
+			return -EINVAL;
+		}
+	}
+
+	if (gap < 0 && ngrp != 8)
+		return -EINVAL;
+	if (gap >= 0 && ngrp == 8)
+		return -EINVAL;
+
+	memset(addr, 0, IP6_ADDR_LEN);
+	for (i = 0; i < ngrp; i++) {
+		int j = (gap >= 0 && i >= gap) ? i + 8 - ngrp : i;
+		addr[j * 2] = grp[i] >> 8;
+		addr[j * 2 + 1] = grp[i] & 0xff;
+	}
+
+	return 0;
+}
@@ -98,6 +98,48 @@ static int parse_host_ip(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_host_ip6(const char *name, const char *val)
+{
+	char buf[IP6_ADDR_STR_LEN + 4];
+	char *slash;
+	uint8_t *addr;
+	long tmp;
+
+	if (!val || strlen(val) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, val);
+
+	if (!strcmp(name, "host_addr6")) {
+		/* expects "<address>/<prefix length>" */
+		addr = netcfg6.addr;
+		slash = strchr(buf, '/');
+		if (!slash || str_to_long(slash + 1, &tmp) || tmp < 1 || tmp > 128) {
+			log_err("host_addr6 must be <address>/<prefix length>");
+			return -EINVAL;
+		}
+		*slash = '\0';
+		netcfg6.prefix_len = tmp;
+		netcfg6.enabled = true;
+	} else if (!strcmp(name, "host_gateway6")) {
+		addr = netcfg6.gateway;
+		netcfg6.has_gateway = true;
+	} else {
+		return -EINVAL;
+	}
+
+	if (str_to_ip6(buf, addr)) {
+		log_err("invalid IPv6 address %s", buf);
+		return -EINVAL;
+	}
+
+	if (ip6_addr_is_multicast(addr) || ip6_addr_is_unspecified(addr)) {
+		log_err("IPv6 address must be unicast");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int parse_runtime_kthreads(const char *name, const char *val)
 {
 	long tmp;
@@ -205,6 +247,240 @@ static int parse_runtime_qdelay_us(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_runtime_mutex_spin_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_mutex_spin_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_mutex_spin_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_mutex_handoff_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_mutex_handoff_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_mutex_handoff_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_trace_events(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp <= 0 || tmp > (1 << 24)) {
+		log_err("runtime_trace_events must be between 1 and %d",
+			1 << 24);
+		return -EINVAL;
+	}
+
+	/* round up to a power of two so the ring index can be masked */
+	cfg_trace_events = 1;
+	while (cfg_trace_events < tmp)
+		cfg_trace_events <<= 1;
+	return 0;
+}
+
+static int parse_tcp_syncookies(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < TCP_SYNCOOKIES_OFF || tmp > TCP_SYNCOOKIES_ALWAYS) {
+		log_err("tcp_syncookies must be 0 (off), 1 (when the backlog "
+			"is full) or 2 (always)");
+		return -EINVAL;
+	}
+
+	cfg_tcp_syncookies = tmp;
+	return 0;
+}
+
+static int parse_tcp_ack_delay_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp <= 0) {
+		log_err("tcp_ack_delay_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_tcp_ack_delay_us = tmp;
+	return 0;
+}
+
+static int parse_tcp_ack_stretch(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > TCP_ACK_STRETCH_MAX) {
+		log_err("tcp_ack_stretch must be between 1 and %d",
+			TCP_ACK_STRETCH_MAX);
+		return -EINVAL;
+	}
+
+	cfg_tcp_ack_stretch = tmp;
+	return 0;
+}
+
+static int parse_tcp_quickack_idle_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("tcp_quickack_idle_us must not be negative");
+		return -EINVAL;
+	}
+
+	cfg_tcp_quickack_idle_us = tmp;
+	return 0;
+}
+
+static int parse_tcp_ack_flag(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (!strcmp(name, "tcp_ack_piggyback"))
+		cfg_tcp_ack_piggyback = tmp != 0;
+	else
+		cfg_tcp_ack_coalesce = tmp != 0;
+	return 0;
+}
+
+static int parse_tcp_keepalive(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	cfg_tcp_keepalive = tmp != 0;
+	return 0;
+}
+
+static int parse_tcp_keepalive_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp <= 0) {
+		log_err("%s must be positive", name);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "tcp_keepalive_idle_us"))
+		cfg_tcp_keepalive_idle_us = tmp;
+	else
+		cfg_tcp_keepalive_intvl_us = tmp;
+	return 0;
+}
+
+static int parse_tcp_keepalive_probes(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > UINT8_MAX) {
+		log_err("tcp_keepalive_probes must be between 1 and %d",
+			UINT8_MAX);
+		return -EINVAL;
+	}
+
+	cfg_tcp_keepalive_probes = tmp;
+	return 0;
+}
+
+static int parse_tcp_idle_compact_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("tcp_idle_compact_us must not be negative");
+		return -EINVAL;
+	}
+
+	cfg_tcp_idle_compact_us = tmp;
+	return 0;
+}
+
+static int parse_stat_shm_key(const char *name, const char *val)
+{
+	char *endptr;
+	long tmp;
+
+	tmp = strtol(val, &endptr, 0);
+	if (endptr == val || *endptr != '\0' || tmp <= 0 || tmp > UINT_MAX) {
+		log_err("stat_shm_key must be a positive integer");
+		return -EINVAL;
+	}
+
+	cfg_stat_shm_key = tmp;
+	return 0;
+}
+
 static int parse_mac_address(const char *name, const char *val)
 {
 	int ret = str_to_mac(val, &netcfg.mac);
@@ -238,6 +514,12 @@ static int parse_watchdog_flag(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_park_futex_flag(const char *name, const char *val)
+{
+	cfg_park_on_futex = true;
+	return 0;
+}
+
 static int parse_static_arp_entry(const char *name, const char *val)
 {
 	int ret;
@@ -310,6 +592,81 @@ static int parse_enable_storage(const char *name, const char *val)
 #endif
 }
 
+static int parse_storage_ul(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("%s must not be negative", name);
+		return -EINVAL;
+	}
+
+	if (!strcmp(name, "storage_mem_mb"))
+		cfg_storage_mem_mb = tmp;
+	else if (!strcmp(name, "storage_mem_latency_us"))
+		cfg_storage_mem_latency_us = tmp;
+	else if (!strcmp(name, "storage_cache_mb"))
+		cfg_storage_cache_mb = tmp;
+	else
+		cfg_storage_cache_flush_us = tmp;
+	return 0;
+}
+
+static int parse_storage_mem_block_size(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 512 || tmp > PGSIZE_4KB || !is_power_of_two(tmp)) {
+		log_err("storage_mem_block_size must be a power of two between "
+			"512 and %d", PGSIZE_4KB);
+		return -EINVAL;
+	}
+
+	cfg_storage_mem_block_size = tmp;
+	return 0;
+}
+
+static int parse_storage_cache_readahead(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > 4096) {
+		log_err("storage_cache_readahead must be between 0 and 4096");
+		return -EINVAL;
+	}
+
+	cfg_storage_cache_readahead = tmp;
+	return 0;
+}
+
+static int parse_storage_cache_writeback(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	cfg_storage_cache_writeback = tmp != 0;
+	return 0;
+}
+
 static int parse_enable_directpath(const char *name, const char *val)
 {
 #ifdef DIRECTPATH
@@ -353,6 +710,8 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "host_addr", parse_host_ip, true },
 	{ "host_netmask", parse_host_ip, true },
 	{ "host_gateway", parse_host_ip, true },
+	{ "host_addr6", parse_host_ip6, false },
+	{ "host_gateway6", parse_host_ip6, false },
 	{ "host_mac", parse_mac_address, false },
 	{ "host_mtu", parse_mtu, false },
 	{ "runtime_kthreads", parse_runtime_kthreads, true },
@@ -362,13 +721,36 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "runtime_priority", parse_runtime_priority, false },
 	{ "runtime_ht_punish_us", parse_runtime_ht_punish_us, false },
 	{ "runtime_qdelay_us", parse_runtime_qdelay_us, false },
+	{ "runtime_mutex_spin_us", parse_runtime_mutex_spin_us, false },
+	{ "runtime_mutex_handoff_us", parse_runtime_mutex_handoff_us, false },
+	{ "runtime_trace_events", parse_runtime_trace_events, false },
 	{ "static_arp", parse_static_arp_entry, false },
 	{ "log_level", parse_log_level, false },
 	{ "disable_watchdog", parse_watchdog_flag, false },
+	{ "runtime_park_futex", parse_park_futex_flag, false },
 	{ "preferred_socket", parse_preferred_socket, false },
 	{ "enable_storage", parse_enable_storage, false },
+	{ "storage_mem_mb", parse_storage_ul, false },
+	{ "storage_mem_latency_us", parse_storage_ul, false },
+	{ "storage_mem_block_size", parse_storage_mem_block_size, false },
+	{ "storage_cache_mb", parse_storage_ul, false },
+	{ "storage_cache_readahead", parse_storage_cache_readahead, false },
+	{ "storage_cache_writeback", parse_storage_cache_writeback, false },
+	{ "storage_cache_flush_us", parse_storage_ul, false },
 	{ "enable_directpath", parse_enable_directpath, false },
 	{ "enable_gc", parse_enable_gc, false },
+	{ "stat_shm_key", parse_stat_shm_key, false },
+	{ "tcp_syncookies", parse_tcp_syncookies, false },
+	{ "tcp_ack_delay_us", parse_tcp_ack_delay_us, false },
+	{ "tcp_ack_stretch", parse_tcp_ack_stretch, false },
+	{ "tcp_quickack_idle_us", parse_tcp_quickack_idle_us, false },
+	{ "tcp_ack_piggyback", parse_tcp_ack_flag, false },
+	{ "tcp_ack_coalesce", parse_tcp_ack_flag, false },
+	{ "tcp_keepalive", parse_tcp_keepalive, false },
+	{ "tcp_keepalive_idle_us", parse_tcp_keepalive_us, false },
+	{ "tcp_keepalive_intvl_us", parse_tcp_keepalive_us, false },
+	{ "tcp_keepalive_probes", parse_tcp_keepalive_probes, false },
+	{ "tcp_idle_compact_us", parse_tcp_idle_compact_us, false },
 
 };
 
@@ -459,6 +841,14 @@ int cfg_load(const char *path)
 		goto out;
 	}
 
+#ifdef DIRECT_STORAGE
+	if (cfg_storage_enabled && storage_mem_enabled()) {
+		log_err("enable_storage and storage_mem_mb can't both be set");
+		ret = -EINVAL;
+		goto out;
+	}
+#endif
+
 	/* log some relevant config parameters */
 	log_info("cfg: provisioned %d cores "
 		 "(%d guaranteed, %d burstable, %d spinning)",
@@ -469,10 +859,9 @@ int cfg_load(const char *path)
 		 cfg_qdelay_us, cfg_ht_punish_us);
 	log_info("cfg: storage %s, directpath %s",
 #ifdef DIRECT_STORAGE
-		 cfg_storage_enabled ? "enabled" : "disabled",
-#else
-		"disabled",
+		 cfg_storage_enabled ? "enabled" :
 #endif
+		 storage_mem_enabled() ? "in-memory" : "disabled",
 #ifdef DIRECTPATH
 		 cfg_directpath_enabled ? "enabled" : "disabled");
 #else
@@ -9,11 +9,13 @@
 #include <base/mem.h>
 #include <base/tcache.h>
 #include <base/gen.h>
+#include <base/hist.h>
 #include <base/lrpc.h>
 #include <base/thread.h>
 #include <base/time.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
 #include <iokernel/control.h>
 #include <net/mbufq.h>
 #include <runtime/gc.h>
@@ -22,6 +24,7 @@
 #include <runtime/thread.h>
 #include <runtime/rcu.h>
 #include <runtime/preempt.h>
+#include <runtime/trace.h>
 
 
 /*
@@ -242,6 +245,8 @@ struct hardware_q {
 	uint32_t	nr_descriptors;
 	uint32_t	parity_byte_offset;
 	uint32_t	parity_bit_mask;
+	/* set if the queue exposes its producer index (e.g., AF_XDP) */
+	uint32_t	*producer_idx;
 };
 
 static inline bool hardware_q_pending(struct hardware_q *q)
@@ -308,6 +313,35 @@ static inline bool storage_pending_completions(struct storage_q *q)
 
 #endif
 
+extern uint32_t block_size;
+extern uint64_t num_blocks;
+
+struct storage_req;
+extern void storage_complete(struct storage_req *req, int ret);
+
+/* an in-memory stand-in for an NVMe device (see storage_mem.c) */
+extern unsigned long cfg_storage_mem_mb;
+extern unsigned long cfg_storage_mem_latency_us;
+extern unsigned int cfg_storage_mem_block_size;
+extern int storage_mem_init(void);
+extern int storage_mem_submit(struct storage_req **reqs, int nr);
+
+static inline bool storage_mem_enabled(void)
+{
+	return cfg_storage_mem_mb > 0;
+}
+
+/* the block cache (see storage_cache.c) */
+extern unsigned long cfg_storage_cache_mb;
+extern unsigned int cfg_storage_cache_readahead;
+extern bool cfg_storage_cache_writeback;
+extern unsigned long cfg_storage_cache_flush_us;
+
+static inline bool storage_cache_enabled(void)
+{
+	return cfg_storage_cache_mb > 0;
+}
+
 #ifdef GC
 extern bool cfg_gc_enabled;
 #endif
@@ -351,6 +385,24 @@ enum {
 	STAT_RX_TCP_OUT_OF_ORDER,
 	STAT_RX_TCP_TEXT_CYCLES,
 	STAT_TXQ_OVERFLOW,
+	STAT_RX_FRAGS,
+	STAT_RX_REASSEMBLED,
+	STAT_RX_REASSEMBLY_FAILS,
+	STAT_TX_FRAGS,
+	STAT_TCP_SYNCOOKIES_SENT,
+	STAT_TCP_SYNCOOKIES_OK,
+	STAT_TX_TCP_ACKS,
+	STAT_TCP_ACKS_COALESCED,
+	STAT_TCP_KEEPALIVE_PROBES,
+	STAT_TCP_KEEPALIVE_TIMEOUTS,
+	STAT_TCP_IDLE_COMPACTIONS,
+	STAT_TRANS_TBL_RESIZES,
+
+	/* storage counters */
+	STAT_STORAGE_CACHE_HITS,
+	STAT_STORAGE_CACHE_MISSES,
+	STAT_STORAGE_CACHE_READAHEAD,
+	STAT_STORAGE_CACHE_WRITEBACKS,
 
 	/* directpath stats */
 	STAT_FLOW_STEERING_CYCLES,
@@ -360,6 +412,21 @@ enum {
 	STAT_NR,
 };
 
+/*
+ * These are per-kthread histograms for hot-path quantities. Like the stat
+ * counters, they are monotonically increasing.
+ *
+ * Don't use these enums directly. Instead, use the HIST() macro.
+ */
+enum {
+	HIST_RQ_WAIT_CYCLES = 0,	/* time from thread_ready() to running */
+	HIST_SOFTIRQ_RX_BATCH,		/* packets handled per RX softirq */
+	HIST_TCP_RTT_US,		/* TCP round trip times */
+
+	/* total number of histograms */
+	HIST_NR,
+};
+
 struct timer_idx {
 	uint64_t		deadline_us;
 	struct timer_entry	*e;
@@ -382,11 +449,11 @@ struct kthread {
 	struct mbufq		txcmdq_overflow;
 	unsigned int		rcu_gen;
 	unsigned int		curr_cpu;
+	struct park_futex	*park_futex;
 #ifdef GC
 	uint64_t		local_gc_gen;
-	unsigned long		pad1[1];
 #else
-	unsigned long		pad1[2];
+	unsigned long		pad1[1];
 #endif
 
 	/* 3rd cache-line */
@@ -413,13 +480,20 @@ struct kthread {
 	/* 9th cache-line, storage nvme queues */
 	struct storage_q	storage_q;
 
-	/* 10th cache-line, direct path queues */
+	/* 10th cache-line, direct path and loopback queues */
 	struct hardware_q	*directpath_rxq;
 	struct direct_txq	*directpath_txq;
-	unsigned long		pad3[6];
+	spinlock_t		loopback_lock;
+	bool			loopback_busy;
+	struct mbufq		loopbackq;
+	thread_t		*loopback_softirq;
+	unsigned long		pad3[2];
 
 	/* 11th cache-line, statistics counters */
 	uint64_t		stats[STAT_NR];
+
+	/* statistics histograms */
+	struct hist		hists[HIST_NR] __aligned(CACHE_LINE_SIZE);
 };
 
 /* compile-time verification of cache-line alignment */
@@ -467,8 +541,11 @@ extern unsigned int spinks;
 extern unsigned int nrks;
 extern struct kthread *ks[NCPU];
 extern bool cfg_prio_is_lc;
+extern bool cfg_park_on_futex;
 extern uint64_t cfg_ht_punish_us;
 extern uint64_t cfg_qdelay_us;
+extern uint64_t cfg_mutex_spin_us;
+extern uint64_t cfg_mutex_handoff_us;
 
 extern void kthread_park(bool voluntary);
 extern void kthread_wait_to_attach(void);
@@ -493,6 +570,60 @@ extern int preferred_socket;
  */
 #define STAT(counter) (myk()->stats[STAT_ ## counter])
 
+/**
+ * HIST - records a sample in a histogram
+ *
+ * e.g. HIST(TCP_RTT_US, rtt);
+ *
+ * Deliberately could race with preemption.
+ */
+#define HIST(hist, val) hist_record(&myk()->hists[HIST_ ## hist], (val))
+
+
+/*
+ * RCU support
+ */
+
+extern unsigned long rcu_gp_seq;
+extern atomic64_t rcu_gp_req;
+extern void __rcu_sched_poll(struct kthread *k, bool parking);
+
+/**
+ * rcu_sched_poll - advances RCU grace periods from the scheduler
+ * @k: the local kthread
+ * @parking: true if @k is about to park
+ *
+ * Must be called with the kthread lock held, after the RCU generation
+ * number has been made even.
+ */
+static inline void rcu_sched_poll(struct kthread *k, bool parking)
+{
+	if (unlikely(ACCESS_ONCE(rcu_gp_seq) != atomic64_read(&rcu_gp_req)))
+		__rcu_sched_poll(k, parking);
+}
+
+
+/*
+ * Scheduler tracing support
+ */
+
+extern unsigned int cfg_trace_events;
+extern bool trace_enabled;
+extern void __trace_sched(unsigned int type, unsigned int arg, thread_t *th);
+
+/**
+ * trace_sched - records a scheduler event if tracing is enabled
+ * @type: the event type (TRACE_*)
+ * @arg: an event-specific argument
+ * @th: the uthread involved in the event, if any
+ */
+static inline void trace_sched(unsigned int type, unsigned int arg,
+			       thread_t *th)
+{
+	if (unlikely(ACCESS_ONCE(trace_enabled)))
+		__trace_sched(type, arg, th);
+}
+
 
 /*
  * Softirq support
@@ -522,6 +653,18 @@ BUILD_ASSERT(sizeof(struct net_cfg) == CACHE_LINE_SIZE);
 
 extern struct net_cfg netcfg;
 
+/* IPv6 configuration (kept apart from netcfg, which the iokernel shares) */
+struct net6_cfg {
+	bool			enabled;
+	bool			has_gateway;
+	unsigned int		prefix_len;
+	uint8_t			addr[IP6_ADDR_LEN];
+	uint8_t			link_local[IP6_ADDR_LEN];
+	uint8_t			gateway[IP6_ADDR_LEN];
+};
+
+extern struct net6_cfg netcfg6;
+
 #define MAX_ARP_STATIC_ENTRIES 1024
 struct cfg_arp_static_entry {
 	uint32_t ip;
@@ -540,7 +683,10 @@ struct net_driver_ops {
 	int (*steer_flows)(unsigned int *new_fg_assignment);
 	int (*register_flow)(unsigned int affininty, struct trans_entry *e, void **handle_out);
 	int (*deregister_flow)(struct trans_entry *e, void *handle);
-	uint32_t (*get_flow_affinity)(uint8_t ipproto, uint16_t local_port, struct netaddr remote);
+	uint32_t (*get_flow_affinity)(uint8_t ipproto, uint16_t local_port,
+				      const struct netaddr *remote);
+	/* optional, called after a burst of tx_single() */
+	void (*tx_flush)(void);
 };
 
 extern struct net_driver_ops net_ops;
@@ -552,11 +698,32 @@ struct direct_txq {};
 
 static inline bool rx_pending(struct hardware_q *rxq)
 {
-	return cfg_directpath_enabled && hardware_q_pending(rxq);
+	if (!cfg_directpath_enabled)
+		return false;
+	if (rxq->producer_idx) {
+		return ACCESS_ONCE(*rxq->producer_idx) !=
+		       ACCESS_ONCE(*rxq->consumer_idx);
+	}
+	return hardware_q_pending(rxq);
 }
 
 extern size_t directpath_rx_buf_pool_sz(unsigned int nrqs);
 
+#ifdef DIRECTPATH_XDP
+extern char cfg_xdp_ifname[];
+extern size_t xdp_rx_buf_pool_sz(unsigned int nrqs);
+
+static inline bool directpath_xdp_enabled(void)
+{
+	return cfg_directpath_enabled && cfg_xdp_ifname[0] != '\0';
+}
+#else
+static inline bool directpath_xdp_enabled(void)
+{
+	return false;
+}
+#endif
+
 #else
 
 static inline bool rx_pending(struct hardware_q *rxq)
@@ -581,6 +748,32 @@ static inline unsigned int net_get_mtu(void)
 	return eth_mtu;
 }
 
+/* when TCP listeners answer SYNs with SYN cookies (cfg_tcp_syncookies) */
+enum {
+	TCP_SYNCOOKIES_OFF = 0,
+	TCP_SYNCOOKIES_ON_OVERFLOW,	/* only once the backlog is full */
+	TCP_SYNCOOKIES_ALWAYS,		/* never allocate before the final ACK */
+};
+
+extern int cfg_tcp_syncookies;
+
+/* the policy for acknowledging in-order TCP data (see tcp_ack.c) */
+extern uint64_t cfg_tcp_ack_delay_us;
+extern unsigned int cfg_tcp_ack_stretch;
+extern uint64_t cfg_tcp_quickack_idle_us;
+extern bool cfg_tcp_ack_piggyback;
+extern bool cfg_tcp_ack_coalesce;
+
+/* the most segments a single (stretch) ACK may cover */
+#define TCP_ACK_STRETCH_MAX	64
+
+/* keepalive and compaction of idle TCP connections (see tcp_idle.c) */
+extern bool cfg_tcp_keepalive;
+extern uint64_t cfg_tcp_keepalive_idle_us;
+extern uint64_t cfg_tcp_keepalive_intvl_us;
+extern unsigned int cfg_tcp_keepalive_probes;
+extern uint64_t cfg_tcp_idle_compact_us;
+
 
 /*
  * Runtime configuration infrastructure
@@ -628,9 +821,15 @@ extern int preempt_init(void);
 extern int net_init(void);
 extern int udp_init(void);
 extern int arp_init(void);
+extern int ndp_init(void);
+extern int ipfrag_init(void);
 extern int trans_init(void);
+extern int tcp_init(void);
 extern int smalloc_init(void);
+extern int rcu_init(void);
+extern int trace_init(void);
 extern int storage_init(void);
+extern int storage_cache_init(void);
 extern int directpath_init(void);
 #ifdef GC
 extern int gc_init(void);
@@ -639,13 +838,17 @@ extern int gc_init(void);
 /* late initialization */
 extern int ioqueues_register_iokernel(void);
 extern int arp_init_late(void);
+extern int ndp_init_late(void);
+extern int ipfrag_init_late(void);
 extern int stat_init_late(void);
 extern int tcp_init_late(void);
 extern int rcu_init_late(void);
 extern int directpath_init_late(void);
+extern int storage_cache_init_late(void);
 
 /* configuration loading */
 extern int cfg_load(const char *path);
+extern mem_key_t cfg_stat_shm_key;
 
 /* internal runtime scheduling functions */
 extern void sched_start(void) __noreturn;
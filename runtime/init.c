@@ -36,16 +36,22 @@ static const struct init_entry global_init_handlers[] = {
 	GLOBAL_INITIALIZER(sched),
 	GLOBAL_INITIALIZER(preempt),
 	GLOBAL_INITIALIZER(smalloc),
+	GLOBAL_INITIALIZER(rcu),
+	GLOBAL_INITIALIZER(trace),
 
 	/* network stack */
 	GLOBAL_INITIALIZER(net),
 	GLOBAL_INITIALIZER(udp),
 	GLOBAL_INITIALIZER(directpath),
 	GLOBAL_INITIALIZER(arp),
+	GLOBAL_INITIALIZER(ndp),
+	GLOBAL_INITIALIZER(ipfrag),
 	GLOBAL_INITIALIZER(trans),
+	GLOBAL_INITIALIZER(tcp),
 
 	/* storage */
 	GLOBAL_INITIALIZER(storage),
+	GLOBAL_INITIALIZER(storage_cache),
 
 #ifdef GC
 	GLOBAL_INITIALIZER(gc),
@@ -79,10 +85,13 @@ static const struct init_entry thread_init_handlers[] = {
 static const struct init_entry late_init_handlers[] = {
 	/* network stack */
 	LATE_INITIALIZER(arp),
+	LATE_INITIALIZER(ndp),
+	LATE_INITIALIZER(ipfrag),
 	LATE_INITIALIZER(stat),
 	LATE_INITIALIZER(tcp),
 	LATE_INITIALIZER(rcu),
 	LATE_INITIALIZER(directpath),
+	LATE_INITIALIZER(storage_cache),
 };
 
 static int run_init_handlers(const char *phase,
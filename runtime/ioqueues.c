@@ -95,6 +95,10 @@ static size_t estimate_shm_space(void)
 	q = align_up(sizeof(struct q_ptrs), CACHE_LINE_SIZE);
 	ret += q * maxks;
 
+	// Futexes to park on when the iokernel runs without ksched
+	q = align_up(sizeof(struct park_futex), CACHE_LINE_SIZE);
+	ret += q * maxks;
+
 	ret = align_up(ret, PGSIZE_2MB);
 
 	// Egress buffers
@@ -103,9 +107,13 @@ static size_t estimate_shm_space(void)
 	ret = align_up(ret, PGSIZE_2MB);
 
 #ifdef DIRECTPATH
-	// mlx5 directpath
-	if (cfg_directpath_enabled)
+	if (directpath_xdp_enabled()) {
+		// AF_XDP directpath, RX buffers must be in the UMEM
+		ret += xdp_rx_buf_pool_sz(maxks);
+	} else if (cfg_directpath_enabled) {
+		// mlx5 directpath
 		ret += PGSIZE_2MB * 4;
+	}
 #endif
 
 #ifdef DIRECT_STORAGE
@@ -215,6 +223,8 @@ int ioqueues_init(void)
 
 		iok_shm_alloc(sizeof(struct q_ptrs), CACHE_LINE_SIZE, &ts->q_ptrs);
 		ts->rxq.wb = ts->q_ptrs;
+		iok_shm_alloc(sizeof(struct park_futex), CACHE_LINE_SIZE,
+			      &ts->park_futex);
 	}
 
 	iok.tx_len = calculate_egress_pool_size();
@@ -257,6 +267,7 @@ int ioqueues_register_iokernel(void)
 	hdr->sched_cfg.max_cores = maxks;
 	hdr->sched_cfg.guaranteed_cores = guaranteedks;
 	hdr->sched_cfg.preferred_socket = preferred_socket;
+	hdr->sched_cfg.park_on_futex = cfg_park_on_futex;
 
 	hdr->thread_specs = ptr_to_shmptr(r, iok.threads, sizeof(*iok.threads) * maxks);
 
@@ -321,5 +332,9 @@ int ioqueues_init_thread(void)
 			sizeof(uint32_t));
 	BUG_ON(!myk()->q_ptrs);
 
+	myk()->park_futex = (struct park_futex *)shmptr_to_ptr(r,
+			ts->park_futex, sizeof(struct park_futex));
+	BUG_ON(!myk()->park_futex);
+
 	return 0;
 }
@@ -2,11 +2,14 @@
  * kthread.c - support for adding and removing kernel threads
  */
 
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 
 #include <base/atomic.h>
 #include <base/cpu.h>
@@ -40,7 +43,9 @@ __thread unsigned int kthread_idx;
 /* Map of cpu to kthread */
 struct cpu_record cpu_map[NCPU] __attribute__((aligned(CACHE_LINE_SIZE)));
 /* the file descriptor for the ksched module */
-static int ksched_fd;
+static int ksched_fd = -1;
+/* park on futexes instead of ksched (when the module isn't loaded) */
+bool cfg_park_on_futex;
 
 static struct kthread *allock(void)
 {
@@ -57,6 +62,8 @@ static struct kthread *allock(void)
 	mbufq_init(&k->txpktq_overflow);
 	mbufq_init(&k->txcmdq_overflow);
 	spin_lock_init(&k->timer_lock);
+	spin_lock_init(&k->loopback_lock);
+	mbufq_init(&k->loopbackq);
 	return k;
 }
 
@@ -82,6 +89,41 @@ int kthread_init_thread(void)
 	return 0;
 }
 
+/*
+ * futex_park - waits on this kthread's futex until the iokernel wakes it
+ *
+ * The fallback for both KSCHED_IOC_PARK and KSCHED_IOC_START. Returns the core
+ * the iokernel woke this kthread on.
+ */
+static long futex_park(void)
+{
+	struct park_futex *pf = myk()->park_futex;
+	uint32_t gen = load_acquire(&pf->gen);
+	sigset_t mask;
+
+	/* like ksched, unblock signals that a preempted kthread parked with */
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	store_release(&pf->parked, 1);
+	while (load_acquire(&pf->gen) == gen)
+		syscall(SYS_futex, &pf->gen, FUTEX_WAIT, gen, NULL, NULL, 0);
+
+	/* ignore a cede that arrived while parked, it was for the last run */
+	gen = load_acquire(&pf->gen);
+	if (preempt_cede_needed() && ACCESS_ONCE(pf->intr_gen) != gen)
+		clear_preempt_cede_needed();
+
+	return ACCESS_ONCE(pf->core);
+}
+
+static __always_inline long ksched_park(void)
+{
+	if (cfg_park_on_futex)
+		return futex_park();
+	return ioctl(ksched_fd, KSCHED_IOC_PARK, 0);
+}
+
 /*
  * kthread_yield_to_iokernel - block until iokernel wakes us up
  */
@@ -94,11 +136,11 @@ static __always_inline void kthread_yield_to_iokernel(void)
 	clear_preempt_cede_needed();
 
 	/* yield to the iokernel */
-	s = ioctl(ksched_fd, KSCHED_IOC_PARK, 0);
+	s = ksched_park();
 	while (unlikely(s < 0 || preempt_cede_needed())) {
 		/* preempted while yielding, yield again */
 		clear_preempt_cede_needed();
-		s = ioctl(ksched_fd, KSCHED_IOC_PARK, 0);
+		s = ksched_park();
 	}
 
 	k->curr_cpu = s;
@@ -220,12 +262,14 @@ void kthread_park(bool voluntary)
 	flows_notify_parking(voluntary);
 
 	STAT(PARKS)++;
+	trace_sched(TRACE_PARK, voluntary, NULL);
 
 	/* perform the actual parking */
 	kthread_yield_to_iokernel();
 
 	/* iokernel has unparked us */
 	atomic_inc(&runningks);
+	trace_sched(TRACE_WAKE, 0, NULL);
 
 	flows_notify_waking();
 }
@@ -240,7 +284,10 @@ void kthread_wait_to_attach(void)
 	struct kthread *k = myk();
 	int s;
 
-	s = ioctl(ksched_fd, KSCHED_IOC_START, 0);
+	if (cfg_park_on_futex)
+		s = futex_park();
+	else
+		s = ioctl(ksched_fd, KSCHED_IOC_START, 0);
 	BUG_ON(s < 0);
 
 	k->curr_cpu = s;
@@ -259,7 +306,15 @@ void kthread_wait_to_attach(void)
  */
 int kthread_init(void)
 {
+	if (cfg_park_on_futex)
+		return 0;
+
 	ksched_fd = open("/dev/ksched", O_RDWR);
+	if (ksched_fd < 0 && errno == ENOENT) {
+		log_warn("kthread: ksched module not loaded, parking on futexes");
+		cfg_park_on_futex = true;
+		return 0;
+	}
 	if (ksched_fd < 0)
 		return -errno;
 	return 0;
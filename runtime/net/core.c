@@ -3,6 +3,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <base/log.h>
 #include <base/mempool.h>
@@ -12,6 +13,7 @@
 #include <asm/chksum.h>
 #include <runtime/net.h>
 #include <runtime/smalloc.h>
+#include <runtime/sync.h>
 
 #include "defs.h"
 
@@ -42,17 +44,33 @@ static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_buf_pt);
  *
  * copied from dpdk/lib/librte_hash/rte_thash.h
  */
-static uint32_t compute_flow_affinity(uint8_t ipproto, uint16_t local_port, struct netaddr remote)
+static uint32_t compute_flow_affinity(uint8_t ipproto, uint16_t local_port,
+				      const struct netaddr *remote)
 {
 	log_warn_ratelimited("flow affinity not enabled for iokernel datapath");
 	return 0;
 	const uint8_t *rss_key = iok.iok_info->rss_key;
+	uint32_t i, j, map, ret = 0, input_tuple[9], word;
+	unsigned int nr_words;
+
+	if (likely(remote->family == NETADDR_IPV4)) {
+		input_tuple[0] = remote->ip;
+		input_tuple[1] = netcfg.addr;
+		input_tuple[2] = local_port | remote->port << 16;
+		nr_words = 3;
+	} else {
+		/* IPv6 hashes the full source and destination addresses */
+		for (j = 0; j < 4; j++) {
+			memcpy(&word, &remote->ip6[j * 4], sizeof(word));
+			input_tuple[j] = ntoh32(word);
+			memcpy(&word, &netcfg6.addr[j * 4], sizeof(word));
+			input_tuple[j + 4] = ntoh32(word);
+		}
+		input_tuple[8] = local_port | remote->port << 16;
+		nr_words = 9;
+	}
 
-	uint32_t i, j, map, ret = 0, input_tuple[] = {
-		remote.ip, netcfg.addr, local_port | remote.port << 16
-	};
-
-	for (j = 0; j < ARRAY_SIZE(input_tuple); j++) {
+	for (j = 0; j < nr_words; j++) {
 		for (map = input_tuple[j]; map;	map &= (map - 1)) {
 			i = (uint32_t)__builtin_ctz(map);
 			ret ^= hton32(((const uint32_t *)rss_key)[j]) << (31 - i) |
@@ -106,10 +124,9 @@ out:
 
 static inline bool ip_hdr_supported(const struct ip_hdr *iphdr)
 {
-	/* must be IPv4, no IP options, no IP fragments */
+	/* must be IPv4, no IP options */
 	return (iphdr->version == IPVERSION &&
-		iphdr->header_len == sizeof(*iphdr) / sizeof(uint32_t) &&
-		(iphdr->off & IP_MF) == 0);
+		iphdr->header_len == sizeof(*iphdr) / sizeof(uint32_t));
 }
 
 /**
@@ -129,6 +146,10 @@ void net_error(struct mbuf *m, int err)
 	if (unlikely(!ip_hdr_supported(iphdr)))
 		return;
 
+	/* only the first fragment carries the L4 header */
+	if (unlikely(ip_frag_offset(iphdr) != 0))
+		return;
+
 	/* don't check length because ICMP may not provide the full payload */
 
 	/* so far we only support error handling in UDP and TCP */
@@ -159,6 +180,12 @@ static void net_rx_one(struct mbuf *m)
 		return;
 	}
 
+	/* handle IPv6 (which also accepts neighbor discovery multicast) */
+	if (ntoh16(llhdr->type) == ETHTYPE_IPV6) {
+		net_rx_ip6(m, &llhdr->dhost);
+		return;
+	}
+
 	/* filter out requests we can't handle */
 	BUILD_ASSERT(sizeof(llhdr->dhost.addr) == sizeof(netcfg.mac.addr));
 	if (unlikely(ntoh16(llhdr->type) != ETHTYPE_IP ||
@@ -190,6 +217,14 @@ static void net_rx_one(struct mbuf *m)
 	if (len < mbuf_length(m))
 		mbuf_trim(m, mbuf_length(m) - len);
 
+	/* hold fragments until the whole datagram has arrived */
+	if (unlikely(ip_is_fragment(iphdr))) {
+		m = ipfrag_reassemble(m, iphdr);
+		if (!m)
+			return;
+		iphdr = mbuf_network_hdr(m, *iphdr);
+	}
+
 	switch(iphdr->proto) {
 	case IPPROTO_ICMP:
 		net_rx_icmp(m, iphdr, len);
@@ -219,11 +254,13 @@ void net_rx_batch(struct mbuf **ms, unsigned int nr)
 {
 	int i;
 
+	HIST(SOFTIRQ_RX_BATCH, nr);
 	for (i = 0; i < nr; i++) {
 		if (i + RX_PREFETCH_STRIDE < nr)
 			prefetch(ms[i + RX_PREFETCH_STRIDE]->data);
 		net_rx_one(ms[i]);
 	}
+	tcp_ack_flush();
 }
 
 static void iokernel_softirq_poll(struct kthread *k)
@@ -232,6 +269,7 @@ static void iokernel_softirq_poll(struct kthread *k)
 	struct mbuf *m;
 	uint64_t cmd;
 	unsigned long payload;
+	unsigned int nr = 0;
 
 	while (true) {
 		if (!lrpc_recv(&k->rxq, &cmd, &payload))
@@ -248,6 +286,7 @@ static void iokernel_softirq_poll(struct kthread *k)
 				continue;
 			}
 			net_rx_one(m);
+			nr++;
 			break;
 
 		case RX_NET_COMPLETE:
@@ -258,6 +297,50 @@ static void iokernel_softirq_poll(struct kthread *k)
 			panic("net: invalid RXQ cmd '%ld'", cmd);
 		}
 	}
+
+	if (nr) {
+		HIST(SOFTIRQ_RX_BATCH, nr);
+		tcp_ack_flush();
+	}
+}
+
+static void loopback_softirq_poll(struct kthread *k)
+{
+	struct mbufq q;
+	struct mbuf *m;
+	unsigned int nr;
+
+	while (true) {
+		spin_lock_np(&k->loopback_lock);
+		q = k->loopbackq;
+		mbufq_init(&k->loopbackq);
+		spin_unlock_np(&k->loopback_lock);
+		if (mbufq_empty(&q))
+			break;
+
+		/* in order, so a flow's segments arrive as they were sent */
+		nr = 0;
+		while ((m = mbufq_pop_head(&q)) != NULL) {
+			net_rx_one(m);
+			nr++;
+		}
+		HIST(SOFTIRQ_RX_BATCH, nr);
+		tcp_ack_flush();
+	}
+}
+
+static void loopback_softirq(void *arg)
+{
+	struct kthread *k = arg;
+
+	while (true) {
+		trace_sched(TRACE_SOFTIRQ_START, TRACE_SOFTIRQ_LOOPBACK, NULL);
+		loopback_softirq_poll(k);
+		preempt_disable();
+		trace_sched(TRACE_SOFTIRQ_END, TRACE_SOFTIRQ_LOOPBACK, NULL);
+		k->loopback_busy = false;
+		thread_park_and_preempt_enable();
+	}
 }
 
 static void iokernel_softirq(void *arg)
@@ -265,8 +348,10 @@ static void iokernel_softirq(void *arg)
 	struct kthread *k = arg;
 
 	while (true) {
+		trace_sched(TRACE_SOFTIRQ_START, TRACE_SOFTIRQ_IOKERNEL, NULL);
 		iokernel_softirq_poll(k);
 		preempt_disable();
+		trace_sched(TRACE_SOFTIRQ_END, TRACE_SOFTIRQ_IOKERNEL, NULL);
 		k->iokernel_busy = false;
 		thread_park_and_preempt_enable();
 	}
@@ -360,27 +445,50 @@ static int net_tx_iokernel(struct mbuf *m)
 	return 0;
 }
 
-static void net_tx_raw(struct mbuf *m)
+static void net_tx_raw_burst(struct mbuf **ms, int n)
 {
 	struct kthread *k;
-	unsigned int len = mbuf_length(m);
+	int i;
 
 	k = getk();
 	/* drain pending overflow packets first */
 	if (unlikely(!mbufq_empty(&k->txpktq_overflow)))
 		net_tx_drain_overflow();
 
-	STAT(TX_PACKETS)++;
-	STAT(TX_BYTES) += len;
-
-	if (unlikely(net_ops.tx_single(m))) {
-		mbufq_push_tail(&k->txpktq_overflow, m);
-		STAT(TXQ_OVERFLOW)++;
+	for (i = 0; i < n; i++) {
+		STAT(TX_PACKETS)++;
+		STAT(TX_BYTES) += mbuf_length(ms[i]);
+
+		/* preserve ordering once the queue overflows */
+		if (unlikely(!mbufq_empty(&k->txpktq_overflow) ||
+			     net_ops.tx_single(ms[i]))) {
+			mbufq_push_tail(&k->txpktq_overflow, ms[i]);
+			STAT(TXQ_OVERFLOW)++;
+		}
 	}
 
+	if (net_ops.tx_flush)
+		net_ops.tx_flush();
+
 	putk();
 }
 
+static void net_tx_raw(struct mbuf *m)
+{
+	net_tx_raw_burst(&m, 1);
+}
+
+static void net_push_ethhdr(struct mbuf *m, uint16_t type,
+			    struct eth_addr dhost)
+{
+	struct eth_hdr *eth_hdr;
+
+	eth_hdr = mbuf_push_hdr(m, *eth_hdr);
+	eth_hdr->shost = netcfg.mac;
+	eth_hdr->dhost = dhost;
+	eth_hdr->type = hton16(type);
+}
+
 /**
  * net_tx_eth - transmits an ethernet packet
  * @m: the mbuf to transmit
@@ -394,16 +502,12 @@ static void net_tx_raw(struct mbuf *m)
  */
 void net_tx_eth(struct mbuf *m, uint16_t type, struct eth_addr dhost)
 {
-	struct eth_hdr *eth_hdr;
-
-	eth_hdr = mbuf_push_hdr(m, *eth_hdr);
-	eth_hdr->shost = netcfg.mac;
-	eth_hdr->dhost = dhost;
-	eth_hdr->type = hton16(type);
+	net_push_ethhdr(m, type, dhost);
 	net_tx_raw(m);
 }
 
-static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
+static void __net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr,
+			     uint16_t id, uint16_t off)
 {
 	struct ip_hdr *iphdr;
 
@@ -413,8 +517,8 @@ static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	iphdr->header_len = 5;
 	iphdr->tos = IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT;
 	iphdr->len = hton16(mbuf_length(m));
-	iphdr->id = 0; /* see RFC 6864 */
-	iphdr->off = hton16(IP_DF);
+	iphdr->id = hton16(id);
+	iphdr->off = hton16(off);
 	iphdr->ttl = 64;
 	iphdr->proto = proto;
 	iphdr->chksum = 0;
@@ -422,6 +526,52 @@ static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	iphdr->daddr = hton32(daddr);
 }
 
+static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
+{
+	/* atomic datagrams don't need an ID, see RFC 6864 */
+	__net_push_iphdr(m, proto, daddr, 0, IP_DF);
+}
+
+/**
+ * net_tx_loopback - delivers a packet addressed to this host back to RX
+ * @m: the mbuf to deliver (must start with the network (L3) header)
+ * @type: the ethernet type (in native byte order)
+ *
+ * Takes ownership of @m.
+ */
+void net_tx_loopback(struct mbuf *m, uint16_t type)
+{
+	struct kthread *k;
+	struct mbuf *lm;
+	unsigned int len;
+
+	net_push_ethhdr(m, type, netcfg.mac);
+	len = mbuf_length(m);
+
+	/* copy the packet, as a NIC would, so the sender can reuse @m */
+	lm = smalloc(len + MBUF_HEAD_LEN);
+	if (unlikely(!lm)) {
+		mbuf_drop(m);
+		return;
+	}
+	mbuf_init(lm, (unsigned char *)lm + MBUF_HEAD_LEN, len, 0);
+	memcpy(mbuf_put(lm, len), mbuf_data(m), len);
+	lm->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	lm->rss_hash = 0;
+	lm->release = (void (*)(struct mbuf *))sfree;
+	mbuf_free(m);
+
+	/*
+	 * The caller may hold socket locks, so the loopback softirq receives
+	 * the packet later, in order with the others sent from this kthread.
+	 */
+	k = getk();
+	spin_lock(&k->loopback_lock);
+	mbufq_push_tail(&k->loopbackq, lm);
+	spin_unlock(&k->loopback_lock);
+	putk();
+}
+
 static uint32_t net_get_ip_route(uint32_t daddr)
 {
 	/* simple IP routing */
@@ -455,6 +605,11 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	/* ask NIC to calculate IP checksum */
 	m->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 
+	if (unlikely(daddr == netcfg.addr)) {
+		net_tx_loopback(m, ETHTYPE_IP);
+		return 0;
+	}
+
 	/* apply IP routing */
 	daddr = net_get_ip_route(daddr);
 
@@ -475,6 +630,57 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	return 0;
 }
 
+/* sends an mbuf (with an IP header) of a burst that missed in the ARP cache */
+static void net_tx_ip_resolved(struct mbuf *m, uint32_t daddr)
+{
+	struct eth_addr dhost;
+	int ret;
+
+	ret = arp_lookup(daddr, &dhost, m);
+	if (ret == 0)
+		net_tx_eth(m, ETHTYPE_IP, dhost);
+	else if (ret != -EINPROGRESS)
+		mbuf_free(m);
+}
+
+static int __net_tx_ip_burst(struct mbuf **ms, int n, uint32_t daddr)
+{
+	struct eth_addr dhost;
+	int ret, i;
+
+	if (unlikely(daddr == netcfg.addr)) {
+		for (i = 0; i < n; i++)
+			net_tx_loopback(ms[i], ETHTYPE_IP);
+		return 0;
+	}
+
+	/* apply IP routing */
+	daddr = net_get_ip_route(daddr);
+
+	/* use ARP to resolve dhost */
+	ret = arp_lookup(daddr, &dhost, ms[0]);
+	if (unlikely(ret)) {
+		if (ret == -EINPROGRESS) {
+			/* ARP code now owns the first mbuf, queue the rest */
+			for (i = 1; i < n; i++)
+				net_tx_ip_resolved(ms[i], daddr);
+			return 0;
+		} else {
+			/* An unrecoverable error occurred */
+			for (i = 0; i < n; i++)
+				mbuf_pull_hdr(ms[i], struct ip_hdr);
+			return ret;
+		}
+	}
+
+	/* finally, transmit the packets in one burst */
+	for (i = 0; i < n; i++)
+		net_push_ethhdr(ms[i], ETHTYPE_IP, dhost);
+	net_tx_raw_burst(ms, n);
+
+	return 0;
+}
+
 /**
  * net_tx_ip_burst - transmits a burst of IP packets
  * @ms: an array of mbuf pointers to transmit
@@ -489,13 +695,12 @@ int net_tx_ip(struct mbuf *m, uint8_t proto, uint32_t daddr)
  *
  * Returns 0 if successful. If successful, the mbufs will be freed when the
  * transmit completes. Otherwise, the mbufs still belongs to the caller. If
- * ARP doesn't have a cached entry, only the first mbuf will be transmitted
- * when the ARP request resolves.
+ * ARP doesn't have a cached entry, the mbufs are queued until the ARP request
+ * resolves. The packets are handed to the driver in a single burst.
  */
 int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 {
-	struct eth_addr dhost;
-	int ret, i;
+	int i;
 
 	assert(n > 0);
 
@@ -508,36 +713,90 @@ int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
 		ms[i]->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
 	}
 
-	/* apply IP routing */
-	daddr = net_get_ip_route(daddr);
+	return __net_tx_ip_burst(ms, n, daddr);
+}
 
-	/* use ARP to resolve dhost */
-	ret = arp_lookup(daddr, &dhost, ms[0]);
-	if (unlikely(ret)) {
-		if (ret == -EINPROGRESS) {
-			/* ARP code now owns the first mbuf */
-			return 0;
-		} else {
-			/* An unrecoverable error occurred */
-			for (i = 0; i < n; i++)
-				mbuf_pull_hdr(ms[i], struct ip_hdr);
-			return ret;
+/* IDs for fragmented datagrams, which must be unique while in flight */
+static atomic_t net_ip_id;
+
+/**
+ * net_tx_ip_frags - transmits a datagram as a series of IP fragments
+ * @ms: an array of mbufs holding consecutive pieces of the datagram
+ * @n: the number of mbufs in @ms
+ * @proto: the transport protocol
+ * @daddr: the destination IP address (in native byte order)
+ *
+ * The first mbuf must start with the transport (L4) header. Every mbuf but the
+ * last must have a length that is a multiple of 8 bytes. The IPv4 (L3) and
+ * ethernet (L2) headers will be prepended by this function.
+ *
+ * Returns 0 if successful, otherwise the mbufs still belong to the caller (see
+ * net_tx_ip_burst()).
+ */
+int net_tx_ip_frags(struct mbuf **ms, int n, uint8_t proto, uint32_t daddr)
+{
+	unsigned int off = 0;
+	uint16_t id, flags;
+	int i;
+
+	assert(n > 0);
+	id = atomic_fetch_and_add(&net_ip_id, 1);
+
+	for (i = 0; i < n; i++) {
+		assert(i == n - 1 || mbuf_length(ms[i]) % 8 == 0);
+		flags = (i < n - 1) ? IP_MF : 0;
+		__net_push_iphdr(ms[i], proto, daddr, id, flags | (off / 8));
+		off += mbuf_length(ms[i]) - sizeof(struct ip_hdr);
+		ms[i]->txflags |= OLFLAG_IP_CHKSUM | OLFLAG_IPV4;
+	}
+
+	STAT(TX_FRAGS) += n;
+	return __net_tx_ip_burst(ms, n, daddr);
+}
+
+static int str_to_netaddr6(const char *str, struct netaddr *addr)
+{
+	char buf[IP6_ADDR_STR_LEN];
+	uint8_t ip6[IP6_ADDR_LEN];
+	const char *end;
+	uint16_t port = 0;
+	size_t len;
+
+	/* a port requires brackets, as in "[fd00::1]:80" */
+	if (str[0] == '[') {
+		end = strchr(str, ']');
+		if (!end)
+			return -EINVAL;
+		if (end[1] == ':') {
+			if (sscanf(end + 2, "%hu", &port) != 1)
+				return -EINVAL;
+		} else if (end[1] != '\0') {
+			return -EINVAL;
 		}
+		str++;
+		len = end - str;
+	} else {
+		len = strlen(str);
 	}
 
-	/* finally, transmit the packets */
-	for (i = 0; i < n; i++)
-		net_tx_eth(ms[i], ETHTYPE_IP, dhost);
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	if (str_to_ip6(buf, ip6))
+		return -EINVAL;
 
+	*addr = netaddr_ipv6(ip6, port);
 	return 0;
 }
 
 /**
- * str_to_netaddr - converts a string to an IPv4 address and port
+ * str_to_netaddr - converts a string to an IP address and port
  * @str: the string to convert
  * @addr: the location to store the parsed address
  *
  * Takes a string like "192.168.1.1:80" or "192.168.1.1" for an ephemeral port.
+ * IPv6 addresses are written like "[fd00::1]:80", "[fd00::1]" or "fd00::1".
  *
  * Returns 0 if successful, otherwise -EINVAL if the parsing failed.
  */
@@ -546,6 +805,9 @@ int str_to_netaddr(const char *str, struct netaddr *addr)
 	uint8_t a, b, c, d;
 	uint16_t port;
 
+	if (str[0] == '[' || strchr(str, ':') != strrchr(str, ':'))
+		return str_to_netaddr6(str, addr);
+
 	if(sscanf(str, "%hhu.%hhu.%hhu.%hhu:%hu",
 	          &a, &b, &c, &d, &port) != 5) {
 		port = 0; /* try with an ephemeral port */
@@ -553,11 +815,34 @@ int str_to_netaddr(const char *str, struct netaddr *addr)
 			return -EINVAL;
 	}
 
+	memset(addr, 0, sizeof(*addr));
 	addr->ip = MAKE_IP_ADDR(a, b, c, d);
 	addr->port = port;
 	return 0;
 }
 
+/**
+ * netaddr_to_str - prints an IP address and port as a string
+ * @addr: the address to print
+ * @str: a buffer to store the string
+ *
+ * The buffer must be NETADDR_STR_LEN in size.
+ */
+char *netaddr_to_str(struct netaddr addr, char *str)
+{
+	char buf[IP6_ADDR_STR_LEN];
+
+	if (addr.family == NETADDR_IPV6) {
+		snprintf(str, NETADDR_STR_LEN, "[%s]:%hu",
+			 ip6_addr_to_str(addr.ip6, buf), addr.port);
+	} else {
+		snprintf(str, NETADDR_STR_LEN, "%s:%hu",
+			 ip_addr_to_str(addr.ip, buf), addr.port);
+	}
+
+	return str;
+}
+
 /**
  * net_init_thread - initializes per-thread state for the network stack
  *
@@ -573,6 +858,12 @@ int net_init_thread(void)
 		return -ENOMEM;
 
 	k->iokernel_softirq = th;
+
+	th = thread_create(loopback_softirq, k);
+	if (!th)
+		return -ENOMEM;
+
+	k->loopback_softirq = th;
 	tcache_init_perthread(net_tx_buf_tcache, &perthread_get(net_tx_buf_pt));
 	return 0;
 }
@@ -580,6 +871,7 @@ int net_init_thread(void)
 static void net_dump_config(void)
 {
 	char buf[IP_ADDR_STR_LEN];
+	char buf6[IP6_ADDR_STR_LEN];
 
 	log_info("net: using the following configuration:");
 	log_info("  addr:\t%s", ip_addr_to_str(netcfg.addr, buf));
@@ -589,6 +881,32 @@ static void net_dump_config(void)
 		 netcfg.mac.addr[0], netcfg.mac.addr[1], netcfg.mac.addr[2],
 		 netcfg.mac.addr[3], netcfg.mac.addr[4], netcfg.mac.addr[5]);
 	log_info("  mtu:\t\t%d", net_get_mtu());
+	if (!netcfg6.enabled)
+		return;
+	log_info("  addr6:\t%s/%u", ip6_addr_to_str(netcfg6.addr, buf6),
+		 netcfg6.prefix_len);
+	log_info("  link-local:\t%s", ip6_addr_to_str(netcfg6.link_local, buf6));
+	if (netcfg6.has_gateway)
+		log_info("  gateway6:\t%s", ip6_addr_to_str(netcfg6.gateway, buf6));
+}
+
+/* derives the IPv6 link-local address from the MAC address (RFC 4291) */
+static void net_init_link_local(void)
+{
+	uint8_t *ll = netcfg6.link_local;
+	const uint8_t *mac = netcfg.mac.addr;
+
+	memset(ll, 0, IP6_ADDR_LEN);
+	ll[0] = 0xfe;
+	ll[1] = 0x80;
+	ll[8] = mac[0] ^ 0x02;
+	ll[9] = mac[1];
+	ll[10] = mac[2];
+	ll[11] = 0xff;
+	ll[12] = 0xfe;
+	ll[13] = mac[3];
+	ll[14] = mac[4];
+	ll[15] = mac[5];
 }
 
 static int steer_flows_iokernel(unsigned int *new_fg_assignment)
@@ -636,6 +954,8 @@ int net_init(void)
 	if (!net_tx_buf_tcache)
 		return -ENOMEM;
 
+	net_init_link_local();
+
 	log_info("net: started network stack");
 	net_dump_config();
 
@@ -7,6 +7,7 @@
 #include <net/mbuf.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
 #include <runtime/net.h>
 #include <runtime/rculist.h>
 
@@ -32,8 +33,35 @@ extern void net_rx_icmp(struct mbuf *m, const struct ip_hdr *iphdr,
 			uint16_t len);
 extern void net_rx_trans(struct mbuf *m);
 extern void tcp_rx_closed(struct mbuf *m);
+extern void tcp_ack_flush(void);
 void net_rx_batch(struct mbuf **ms, unsigned int nr);
 
+/**
+ * ip_frag_offset - returns the byte offset of an IP fragment
+ * @iphdr: the IP header
+ */
+static inline unsigned int ip_frag_offset(const struct ip_hdr *iphdr)
+{
+	return (ntoh16(iphdr->off) & IP_OFFMASK) * 8;
+}
+
+/**
+ * ip_is_fragment - returns true if an IP packet is part of a larger datagram
+ * @iphdr: the IP header
+ */
+static inline bool ip_is_fragment(const struct ip_hdr *iphdr)
+{
+	return (ntoh16(iphdr->off) & (IP_MF | IP_OFFMASK)) != 0;
+}
+
+extern struct mbuf *ipfrag_reassemble(struct mbuf *m,
+				      const struct ip_hdr *iphdr);
+extern struct mbuf *ipfrag_linearize(struct mbuf *m);
+
+extern void net_rx_ip6(struct mbuf *m, const struct eth_addr *dhost);
+extern void net_rx_ndp(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+		       uint16_t len);
+
 
 /*
  * TX Networking Functions
@@ -52,8 +80,17 @@ extern int net_tx_ip(struct mbuf *m, uint8_t proto,
 		     uint32_t daddr) __must_use_return;
 extern int net_tx_ip_burst(struct mbuf **ms, int n, uint8_t proto,
 		     uint32_t daddr) __must_use_return;
+extern int net_tx_ip_frags(struct mbuf **ms, int n, uint8_t proto,
+		     uint32_t daddr) __must_use_return;
 extern int net_tx_icmp(struct mbuf *m, uint8_t type, uint8_t code,
 		uint32_t daddr, uint16_t id, uint16_t seq) __must_use_return;
+extern int ndp_lookup(const uint8_t *daddr, struct eth_addr *dhost_out,
+		      struct mbuf *m) __must_use_return;
+extern int net_tx_ip6(struct mbuf *m, uint8_t proto,
+		      const uint8_t *daddr) __must_use_return;
+extern int __net_tx_ip6(struct mbuf *m, uint8_t proto, const uint8_t *saddr,
+			const uint8_t *daddr) __must_use_return;
+extern void net_tx_loopback(struct mbuf *m, uint16_t type);
 
 /**
  * net_tx_ip - transmits an IP packet, or frees it on failure
@@ -73,6 +110,122 @@ static inline void net_tx_ip_or_free(struct mbuf *m, uint8_t proto,
 		mbuf_free(m);
 }
 
+/**
+ * net_tx_l3 - transmits a packet over IPv4 or IPv6
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @raddr: the destination address (only the IP address is used)
+ *
+ * Behaves like net_tx_ip() or net_tx_ip6(), depending on the address family.
+ */
+static inline int net_tx_l3(struct mbuf *m, uint8_t proto,
+			    const struct netaddr *raddr)
+{
+	if (likely(raddr->family == NETADDR_IPV4))
+		return net_tx_ip(m, proto, raddr->ip);
+	return net_tx_ip6(m, proto, raddr->ip6);
+}
+
+/**
+ * net_resolve_laddr - fills in and checks the local IP address of an endpoint
+ * @laddr: the local address (the IP address may be unspecified)
+ * @raddr: the remote address, or NULL if there is none
+ *
+ * An unspecified local IP address becomes the host's address, in the family of
+ * @raddr if there is one.
+ *
+ * Returns 0 if successful, or -EINVAL if @laddr isn't this host's address.
+ */
+static inline int net_resolve_laddr(struct netaddr *laddr,
+				    const struct netaddr *raddr)
+{
+	if (laddr->family == NETADDR_IPV4 && laddr->ip == 0 && raddr)
+		laddr->family = raddr->family;
+	if (raddr && laddr->family != raddr->family)
+		return -EINVAL;
+
+	if (likely(laddr->family == NETADDR_IPV4)) {
+		/* only can support one local IP so far */
+		if (laddr->ip == 0)
+			laddr->ip = netcfg.addr;
+		return laddr->ip == netcfg.addr ? 0 : -EINVAL;
+	}
+
+	if (laddr->family != NETADDR_IPV6 || !netcfg6.enabled)
+		return -EINVAL;
+	laddr->ip = 0;
+	if (ip6_addr_is_unspecified(laddr->ip6))
+		memcpy(laddr->ip6, netcfg6.addr, IP6_ADDR_LEN);
+	return memcmp(laddr->ip6, netcfg6.addr, IP6_ADDR_LEN) == 0 ? 0 : -EINVAL;
+}
+
+/**
+ * net_hdr_is_ipv6 - returns true if an mbuf's network header is IPv6
+ * @m: the mbuf (the network offset must be set)
+ */
+static inline bool net_hdr_is_ipv6(struct mbuf *m)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	return iphdr->version != IPVERSION;
+}
+
+/**
+ * net_hdr_get_addrs - parses the IP addresses of an ingress packet
+ * @m: the mbuf (the network offset must be set)
+ * @laddr: a pointer to store the local (destination) address, or NULL
+ * @raddr: a pointer to store the remote (source) address, or NULL
+ *
+ * Ports are left untouched.
+ *
+ * Returns the transport protocol.
+ */
+static inline uint8_t net_hdr_get_addrs(struct mbuf *m, struct netaddr *laddr,
+					struct netaddr *raddr)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	const struct ip6_hdr *ip6hdr;
+
+	if (likely(iphdr->version == IPVERSION)) {
+		if (laddr) {
+			laddr->ip = ntoh32(iphdr->daddr);
+			laddr->family = NETADDR_IPV4;
+		}
+		if (raddr) {
+			raddr->ip = ntoh32(iphdr->saddr);
+			raddr->family = NETADDR_IPV4;
+		}
+		return iphdr->proto;
+	}
+
+	ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+	if (laddr) {
+		laddr->ip = 0;
+		laddr->family = NETADDR_IPV6;
+		memcpy(laddr->ip6, ip6hdr->daddr, IP6_ADDR_LEN);
+	}
+	if (raddr) {
+		raddr->ip = 0;
+		raddr->family = NETADDR_IPV6;
+		memcpy(raddr->ip6, ip6hdr->saddr, IP6_ADDR_LEN);
+	}
+	return ip6hdr->nexthdr;
+}
+
+/**
+ * net_hdr_payload_len - returns the length of an ingress packet's IP payload
+ * @m: the mbuf (the network offset must be set)
+ */
+static inline unsigned int net_hdr_payload_len(struct mbuf *m)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	const struct ip6_hdr *ip6hdr;
+
+	if (likely(iphdr->version == IPVERSION))
+		return ntoh16(iphdr->len) - sizeof(*iphdr);
+	ip6hdr = mbuf_network_hdr(m, *ip6hdr);
+	return ntoh16(ip6hdr->payload_len);
+}
+
 /**
  * mbuf_drop - frees an mbuf, counting it as a drop
  * @m: the mbuf to free
@@ -109,7 +262,8 @@ struct trans_entry {
 	uint8_t			proto;
 	struct netaddr		laddr;
 	struct netaddr		raddr;
-	struct rcu_hlist_node	link;
+	uint32_t		hash;
+	struct rcu_hlist_node	link[2];
 	struct rcu_head		rcu;
 	const struct trans_ops	*ops;
 };
@@ -123,11 +277,11 @@ struct trans_entry {
  */
 static inline void trans_init_3tuple(struct trans_entry *e, uint8_t proto,
 				     const struct trans_ops *ops,
-				     struct netaddr laddr)
+				     const struct netaddr *laddr)
 {
 	e->match = TRANS_MATCH_3TUPLE;
 	e->proto = proto;
-	e->laddr = laddr;
+	e->laddr = *laddr;
 	e->ops = ops;
 }
 
@@ -141,12 +295,13 @@ static inline void trans_init_3tuple(struct trans_entry *e, uint8_t proto,
  */
 static inline void trans_init_5tuple(struct trans_entry *e, uint8_t proto,
 				     const struct trans_ops *ops,
-				     struct netaddr laddr, struct netaddr raddr)
+				     const struct netaddr *laddr,
+				     const struct netaddr *raddr)
 {
 	e->match = TRANS_MATCH_5TUPLE;
 	e->proto = proto;
-	e->laddr = laddr;
-	e->raddr = raddr;
+	e->laddr = *laddr;
+	e->raddr = *raddr;
 	e->ops = ops;
 }
 
@@ -54,19 +54,20 @@ void directpath_rx_completion(struct mbuf *m)
 	preempt_enable();
 }
 
-static int rx_memory_init(void)
+/**
+ * directpath_rx_memory_init - creates the pool of RX buffers
+ * @buf: the memory backing the pool
+ * @len: the length of @buf
+ * @buf_size: the size of each buffer
+ *
+ * Returns 0 if successful.
+ */
+int directpath_rx_memory_init(void *buf, size_t len, unsigned int buf_size)
 {
 	int ret;
-	size_t rx_len;
-	void *rx_buf;
 
-	rx_len = directpath_rx_buf_pool_sz(maxks);
-	rx_buf = mem_map_anom(NULL, rx_len, PGSIZE_2MB, 0);
-	if (rx_buf == MAP_FAILED)
-		return -ENOMEM;
-
-	ret = mempool_create(&directpath_buf_mp, rx_buf, rx_len, PGSIZE_2MB,
-			     directpath_get_buf_size());
+	ret = mempool_create(&directpath_buf_mp, buf, len, PGSIZE_2MB,
+			     buf_size);
 	if (ret)
 		return ret;
 
@@ -78,6 +79,24 @@ static int rx_memory_init(void)
 	return 0;
 }
 
+#ifdef DIRECTPATH_MLX5
+
+static int rx_memory_init(void)
+{
+	size_t rx_len;
+	void *rx_buf;
+
+	rx_len = directpath_rx_buf_pool_sz(maxks);
+	rx_buf = mem_map_anom(NULL, rx_len, PGSIZE_2MB, 0);
+	if (rx_buf == MAP_FAILED)
+		return -ENOMEM;
+
+	return directpath_rx_memory_init(rx_buf, rx_len,
+					 directpath_get_buf_size());
+}
+
+#endif /* DIRECTPATH_MLX5 */
+
 static void directpath_softirq_one(struct kthread *k)
 {
 	struct mbuf *ms[RUNTIME_RX_BATCH_SIZE];
@@ -92,8 +111,10 @@ static void directpath_softirq(void *arg)
 	struct kthread *k = arg;
 
 	while (true) {
+		trace_sched(TRACE_SOFTIRQ_START, TRACE_SOFTIRQ_DIRECTPATH, NULL);
 		directpath_softirq_one(k);
 		preempt_disable();
+		trace_sched(TRACE_SOFTIRQ_END, TRACE_SOFTIRQ_DIRECTPATH, NULL);
 		k->directpath_busy = false;
 		thread_park_and_preempt_enable();
 	}
@@ -106,17 +127,25 @@ int directpath_init(void)
 	if (!cfg_directpath_enabled)
 		return 0;
 
+#ifdef DIRECTPATH_XDP
+	/* AF_XDP allocates its RX buffers in the runtime's UMEM */
+	if (directpath_xdp_enabled())
+		return xdp_init(rxq_out, txq_out, maxks, maxks);
+#endif
+
+#ifdef DIRECTPATH_MLX5
 	ret = rx_memory_init();
 	if (ret)
 		return ret;
 
 	/* initialize mlx5 */
 	ret = mlx5_init(rxq_out, txq_out, maxks, maxks);
-	if (ret)
-		return ret;
-
-	return 0;
+#else
+	log_err("directpath: no NIC driver, please set directpath_xdp_ifname");
+	ret = -EINVAL;
+#endif
 
+	return ret;
 }
 
 int directpath_init_thread(void)
@@ -134,6 +163,15 @@ int directpath_init_thread(void)
 		return -ENOMEM;
 
 	k->directpath_softirq = th;
+	k->directpath_rxq = rxq;
+	k->directpath_txq = txq_out[k->kthread_idx];
+
+	tcache_init_perthread(directpath_buf_tcache, &perthread_get(directpath_buf_pt));
+
+	/* the iokernel can't monitor AF_XDP rings */
+	if (directpath_xdp_enabled())
+		return 0;
+
 	rxq->shadow_tail = &k->q_ptrs->directpath_rx_tail;
 	hs = &iok.threads[k->kthread_idx].direct_rxq;
 
@@ -146,11 +184,6 @@ int directpath_init_thread(void)
 	hs->hwq_type = HWQ_MLX5;
 	hs->consumer_idx = ptr_to_shmptr(&netcfg.tx_region, rxq->shadow_tail, sizeof(uint32_t));
 
-	k->directpath_rxq = rxq;
-	k->directpath_txq = txq_out[k->kthread_idx];
-
-	tcache_init_perthread(directpath_buf_tcache, &perthread_get(directpath_buf_pt));
-
 	return 0;
 }
 
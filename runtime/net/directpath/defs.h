@@ -34,9 +34,14 @@ extern struct mempool directpath_buf_mp;
 extern struct tcache *directpath_buf_tcache;
 extern DEFINE_PERTHREAD(struct tcache_perthread, directpath_buf_pt);
 extern void directpath_rx_completion(struct mbuf *m);
+extern int directpath_rx_memory_init(void *buf, size_t len,
+				     unsigned int buf_size);
 extern int mlx5_init(struct hardware_q **rxq_out,
 	    struct direct_txq **txq_out, unsigned int nr_rxq,
 	    unsigned int nr_txq);
+extern int xdp_init(struct hardware_q **rxq_out,
+	    struct direct_txq **txq_out, unsigned int nr_rxq,
+	    unsigned int nr_txq);
 
 struct ibv_device;
 extern int ibv_device_to_pci_addr(const struct ibv_device *device, struct pci_addr *pci_addr);
@@ -1,7 +1,7 @@
 #include <base/log.h>
 #include <runtime/sync.h>
 
-#ifdef DIRECTPATH
+#ifdef DIRECTPATH_MLX5
 
 #include "mlx5.h"
 #include "mlx5_ifc.h"
@@ -379,13 +379,14 @@ int mlx5_steer_flows(unsigned int *new_fg_assignment)
 
 }
 
-uint32_t mlx5_get_flow_affinity(uint8_t ipproto, uint16_t local_port, struct netaddr remote)
+uint32_t mlx5_get_flow_affinity(uint8_t ipproto, uint16_t local_port,
+				const struct netaddr *remote)
 {
 	bitmap_ptr_t map = ipproto == IPPROTO_TCP ? tcp_listen_ports :
 			  udp_listen_ports;
 
 	if (bitmap_atomic_test(map, local_port))
-		return (remote.port & PORT_MASK) % maxks;
+		return (remote->port & PORT_MASK) % maxks;
 	else
 		return (local_port & PORT_MASK) % maxks;
 }
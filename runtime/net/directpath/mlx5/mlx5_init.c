@@ -13,7 +13,7 @@
 #include <base/log.h>
 #include <base/mempool.h>
 
-#ifdef DIRECTPATH
+#ifdef DIRECTPATH_MLX5
 
 #include <util/mmio.h>
 #include <util/udma_barrier.h>
@@ -0,0 +1,97 @@
+/*
+ * xdp.h - AF_XDP driver for Shenango's network stack
+ */
+
+#pragma once
+
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+
+#include <net/ethernet.h>
+
+#include "../defs.h"
+
+/* the smallest UMEM chunk the kernel allows */
+#define XDP_CHUNK_SIZE_MIN	2048
+
+/* descriptors per ring (the fill and completion rings are shared) */
+#define XDP_RX_DESC		RQ_NUM_DESC
+#define XDP_TX_DESC		SQ_NUM_DESC
+
+/* the steering program sends each group of ports to one kthread */
+#define XDP_PORT_MATCH_BITS	10
+#define XDP_PORT_MASK		((1 << XDP_PORT_MATCH_BITS) - 1)
+
+/* a single-producer, single-consumer ring shared with the kernel */
+struct xdp_ring {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	uint32_t	*flags;
+	void		*ring;
+	uint32_t	mask;
+	uint32_t	size;
+	uint32_t	cached_prod;
+	uint32_t	cached_cons;
+};
+
+struct xdp_rxq {
+	/* handle for runtime */
+	struct hardware_q rxq;
+
+	struct xdp_ring rx;
+	int fd;
+} __aligned(CACHE_LINE_SIZE);
+
+struct xdp_txq {
+	/* handle for runtime */
+	struct direct_txq txq;
+
+	struct xdp_ring tx;
+	int fd;
+} __aligned(CACHE_LINE_SIZE);
+
+extern char cfg_xdp_ifname[IF_NAMESIZE];
+extern int xdp_ifindex;
+
+/* the UMEM, which covers the runtime's shared memory region */
+extern void *xdp_umem_base;
+extern unsigned int xdp_chunk_size;
+
+extern struct xdp_rxq xdp_rxqs[NCPU];
+extern struct xdp_txq xdp_txqs[NCPU];
+
+extern int xdp_transmit_one(struct mbuf *m);
+extern void xdp_transmit_flush(void);
+extern int xdp_gather_rx(struct hardware_q *rxq, struct mbuf **ms,
+			 unsigned int budget);
+extern int xdp_rx_fill_init(unsigned int nr);
+
+extern int xdp_steer_flows(unsigned int *new_fg_assignment);
+extern int xdp_register_flow(unsigned int affinity, struct trans_entry *e,
+			     void **handle_out);
+extern int xdp_deregister_flow(struct trans_entry *e, void *handle);
+extern uint32_t xdp_get_flow_affinity(uint8_t ipproto, uint16_t local_port,
+				      const struct netaddr *remote);
+extern int xdp_init_flows(unsigned int nr_rxq);
+
+extern struct xdp_ring xdp_fq;
+extern struct xdp_ring xdp_cq;
+extern spinlock_t xdp_fq_lock;
+extern spinlock_t xdp_cq_lock;
+
+static inline uint64_t *xdp_ring_addr(struct xdp_ring *r, uint32_t idx)
+{
+	return &((uint64_t *)r->ring)[idx & r->mask];
+}
+
+static inline struct xdp_desc *xdp_ring_desc(struct xdp_ring *r, uint32_t idx)
+{
+	return &((struct xdp_desc *)r->ring)[idx & r->mask];
+}
+
+/* the UMEM offset of a buffer */
+static inline uint64_t xdp_umem_off(const void *p)
+{
+	return (uintptr_t)p - (uintptr_t)xdp_umem_base;
+}
@@ -0,0 +1,325 @@
+/*
+ * xdp_init.c - AF_XDP driver for Shenango's network stack
+ *
+ * Each kthread gets an AF_XDP socket with its own RX and TX rings. All of
+ * the sockets are bound to queue 0 of the interface and share one UMEM, the
+ * runtime's shared memory region, so egress mbufs are sent without copying.
+ * The UMEM's fill and completion rings are shared by all kthreads.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <base/log.h>
+#include <base/mempool.h>
+
+#ifdef DIRECTPATH_XDP
+
+#include "xdp.h"
+
+struct xdp_rxq xdp_rxqs[NCPU];
+struct xdp_txq xdp_txqs[NCPU];
+
+void *xdp_umem_base;
+unsigned int xdp_chunk_size;
+int xdp_ifindex;
+
+/* configuration options */
+char cfg_xdp_ifname[IF_NAMESIZE];
+
+static int parse_directpath_xdp_ifname(const char *name, const char *val)
+{
+	if (strlen(val) >= IF_NAMESIZE)
+		return -EINVAL;
+
+	strcpy(cfg_xdp_ifname, val);
+	log_info("directpath: using AF_XDP on interface %s", val);
+	return 0;
+}
+
+static struct cfg_handler directpath_xdp_ifname_handler = {
+	.name = "directpath_xdp_ifname",
+	.fn = parse_directpath_xdp_ifname,
+	.required = false,
+};
+
+REGISTER_CFG(directpath_xdp_ifname_handler);
+
+/* the UMEM chunk size, which bounds the size of received frames */
+static unsigned int xdp_get_chunk_size(void)
+{
+	unsigned int len = XDP_PACKET_HEADROOM + net_get_mtu() +
+			   sizeof(struct eth_hdr) + RX_BUF_TAIL;
+
+	return len <= XDP_CHUNK_SIZE_MIN ? XDP_CHUNK_SIZE_MIN : PGSIZE_4KB;
+}
+
+/* the fill ring holds RX_DESC buffers for each socket */
+static unsigned int xdp_fill_ring_size(unsigned int nrqs)
+{
+	unsigned int nr = XDP_RX_DESC;
+
+	while (nr < XDP_RX_DESC * nrqs)
+		nr <<= 1;
+	return nr;
+}
+
+/* the completion ring must fit every socket's TX ring */
+static unsigned int xdp_comp_ring_size(unsigned int nrqs)
+{
+	unsigned int nr = XDP_TX_DESC;
+
+	while (nr < XDP_TX_DESC * nrqs)
+		nr <<= 1;
+	return nr;
+}
+
+/**
+ * xdp_rx_buf_pool_sz - the shared memory needed for AF_XDP RX buffers
+ * @nrqs: the number of sockets
+ *
+ * Half of the buffers are posted to the fill ring, the rest are in the RX
+ * rings or held by the network stack.
+ */
+size_t xdp_rx_buf_pool_sz(unsigned int nrqs)
+{
+	size_t len = xdp_get_chunk_size();
+
+	len *= xdp_fill_ring_size(nrqs) * 2UL;
+	return align_up(len, PGSIZE_2MB);
+}
+
+static int xdp_map_ring(int fd, struct xdp_ring_offset *off, off_t pgoff,
+			unsigned int nr, size_t desc_size, struct xdp_ring *r)
+{
+	void *map;
+
+	map = mmap(NULL, off->desc + nr * desc_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	r->producer = map + off->producer;
+	r->consumer = map + off->consumer;
+	r->flags = map + off->flags;
+	r->ring = map + off->desc;
+	r->size = nr;
+	r->mask = nr - 1;
+	r->cached_prod = ACCESS_ONCE(*r->producer);
+	r->cached_cons = ACCESS_ONCE(*r->consumer);
+
+	return 0;
+}
+
+static int xdp_setsockopt(int fd, int opt, const void *val, socklen_t len)
+{
+	if (setsockopt(fd, SOL_XDP, opt, val, len))
+		return -errno;
+	return 0;
+}
+
+/* registers the UMEM, and maps its fill and completion rings */
+static int xdp_umem_init(int fd, unsigned int nrqs)
+{
+	struct shm_region *r = &netcfg.tx_region;
+	struct xdp_umem_reg reg = {
+		.addr = (uintptr_t)r->base,
+		.len = r->len,
+		.chunk_size = xdp_chunk_size,
+		.headroom = 0,
+		.flags = XDP_UMEM_UNALIGNED_CHUNK_FLAG,
+	};
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	unsigned int fq_size = xdp_fill_ring_size(nrqs);
+	unsigned int cq_size = xdp_comp_ring_size(nrqs);
+	int ret;
+
+	ret = xdp_setsockopt(fd, XDP_UMEM_REG, &reg, sizeof(reg));
+	if (ret) {
+		log_err("xdp: failed to register UMEM (%d)", ret);
+		return ret;
+	}
+
+	ret = xdp_setsockopt(fd, XDP_UMEM_FILL_RING, &fq_size, sizeof(fq_size));
+	if (ret)
+		return ret;
+	ret = xdp_setsockopt(fd, XDP_UMEM_COMPLETION_RING, &cq_size,
+			     sizeof(cq_size));
+	if (ret)
+		return ret;
+
+	if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		return -errno;
+
+	ret = xdp_map_ring(fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, fq_size,
+			   sizeof(uint64_t), &xdp_fq);
+	if (ret)
+		return ret;
+
+	return xdp_map_ring(fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING,
+			    cq_size, sizeof(uint64_t), &xdp_cq);
+}
+
+static int xdp_bind(int fd, uint16_t flags, int shared_fd)
+{
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_flags = flags,
+		.sxdp_ifindex = xdp_ifindex,
+		.sxdp_queue_id = 0,
+		.sxdp_shared_umem_fd = shared_fd,
+	};
+
+	if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		return -errno;
+	return 0;
+}
+
+static int xdp_create_socket(int index, unsigned int nrqs)
+{
+	struct xdp_rxq *rxq = &xdp_rxqs[index];
+	struct xdp_txq *txq = &xdp_txqs[index];
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	unsigned int nr;
+	int fd, ret;
+
+	fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (fd < 0) {
+		log_err("xdp: failed to create socket (%d)", errno);
+		return -errno;
+	}
+
+	/* the first socket owns the UMEM, the others share it */
+	if (index == 0) {
+		ret = xdp_umem_init(fd, nrqs);
+		if (ret)
+			return ret;
+	}
+
+	nr = XDP_RX_DESC;
+	ret = xdp_setsockopt(fd, XDP_RX_RING, &nr, sizeof(nr));
+	if (ret)
+		return ret;
+	nr = XDP_TX_DESC;
+	ret = xdp_setsockopt(fd, XDP_TX_RING, &nr, sizeof(nr));
+	if (ret)
+		return ret;
+
+	if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		return -errno;
+
+	ret = xdp_map_ring(fd, &off.rx, XDP_PGOFF_RX_RING, XDP_RX_DESC,
+			   sizeof(struct xdp_desc), &rxq->rx);
+	if (ret)
+		return ret;
+	ret = xdp_map_ring(fd, &off.tx, XDP_PGOFF_TX_RING, XDP_TX_DESC,
+			   sizeof(struct xdp_desc), &txq->tx);
+	if (ret)
+		return ret;
+
+	if (index == 0) {
+		ret = xdp_bind(fd, XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP, 0);
+		if (ret) {
+			log_info("xdp: zero-copy unavailable on %s (%d), "
+				 "copying packets", cfg_xdp_ifname, ret);
+			ret = xdp_bind(fd, XDP_COPY | XDP_USE_NEED_WAKEUP, 0);
+		}
+	} else {
+		ret = xdp_bind(fd, XDP_SHARED_UMEM, xdp_rxqs[0].fd);
+	}
+	if (ret) {
+		log_err("xdp: failed to bind socket %d to %s (%d)", index,
+			cfg_xdp_ifname, ret);
+		return ret;
+	}
+
+	rxq->fd = txq->fd = fd;
+
+	/* the ring's indices stand in for the ownership bits of a NIC queue */
+	rxq->rxq.consumer_idx = rxq->rx.consumer;
+	rxq->rxq.producer_idx = rxq->rx.producer;
+
+	return 0;
+}
+
+static struct net_driver_ops xdp_net_ops = {
+	.rx_batch = xdp_gather_rx,
+	.tx_single = xdp_transmit_one,
+	.tx_flush = xdp_transmit_flush,
+	.steer_flows = xdp_steer_flows,
+	.register_flow = xdp_register_flow,
+	.deregister_flow = xdp_deregister_flow,
+	.get_flow_affinity = xdp_get_flow_affinity,
+};
+
+/*
+ * xdp_init - create a socket for each kthread and start steering packets
+ */
+int xdp_init(struct hardware_q **rxq_out, struct direct_txq **txq_out,
+	     unsigned int nr_rxq, unsigned int nr_txq)
+{
+	size_t rx_len;
+	void *rx_buf;
+	int i, ret;
+
+	if (nr_rxq > NCPU || nr_rxq != nr_txq)
+		return -EINVAL;
+
+	/*
+	 * The iokernel can't see AF_XDP rings, so it can't wake a kthread
+	 * when packets arrive. Instead, a kthread must always be polling.
+	 */
+	if (!spinks) {
+		log_err("xdp: AF_XDP requires runtime_spinning_kthreads >= 1");
+		return -EINVAL;
+	}
+
+	xdp_ifindex = if_nametoindex(cfg_xdp_ifname);
+	if (!xdp_ifindex) {
+		log_err("xdp: interface %s not found", cfg_xdp_ifname);
+		return -ENODEV;
+	}
+
+	xdp_chunk_size = xdp_get_chunk_size();
+	if (XDP_PACKET_HEADROOM + net_get_mtu() + sizeof(struct eth_hdr) >
+	    xdp_chunk_size) {
+		log_err("xdp: MTU %d is too large", net_get_mtu());
+		return -EINVAL;
+	}
+
+	/* RX buffers must be in the UMEM too */
+	rx_len = xdp_rx_buf_pool_sz(nr_rxq);
+	rx_buf = iok_shm_alloc(rx_len, PGSIZE_2MB, NULL);
+	ret = directpath_rx_memory_init(rx_buf, rx_len, xdp_chunk_size);
+	if (ret)
+		return ret;
+
+	xdp_umem_base = netcfg.tx_region.base;
+
+	for (i = 0; i < nr_rxq; i++) {
+		ret = xdp_create_socket(i, nr_rxq);
+		if (ret)
+			return ret;
+
+		rxq_out[i] = &xdp_rxqs[i].rxq;
+		txq_out[i] = &xdp_txqs[i].txq;
+	}
+
+	ret = xdp_rx_fill_init(xdp_fq.size);
+	if (ret)
+		return ret;
+
+	ret = xdp_init_flows(nr_rxq);
+	if (ret)
+		return ret;
+
+	net_ops = xdp_net_ops;
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * xdp_prog.c - steers packets to AF_XDP sockets with an XDP program
+ *
+ * Packets are steered like they are with mlx5: TCP and UDP packets are put
+ * in a flow group by one of their ports, and each flow group is delivered to
+ * one kthread's socket. The program is built here as BPF bytecode, so no BPF
+ * compiler or libbpf is needed.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <base/bitmap.h>
+#include <base/log.h>
+#include <net/ethernet.h>
+#include <net/ip.h>
+
+#ifdef DIRECTPATH_XDP
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include "xdp.h"
+
+static unsigned int nr_rxq;
+static int xsks_map_fd;
+static int fg_map_fd;
+static int ports_map_fd;
+static int prog_fd;
+static int link_fd;
+
+static DEFINE_BITMAP(tcp_listen_ports, 65536);
+static DEFINE_BITMAP(udp_listen_ports, 65536);
+
+/* the maps the program reads, mapped into this process */
+static uint64_t *fg_qp_assignment;	/* flow group -> kthread */
+static uint64_t *listen_ports;		/* (UDP << 16 | port) -> listening */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_create_map(int type, unsigned int value_size,
+			  unsigned int max_entries, unsigned int flags)
+{
+	union bpf_attr attr = {
+		.map_type = type,
+		.key_size = sizeof(uint32_t),
+		.value_size = value_size,
+		.max_entries = max_entries,
+		.map_flags = flags,
+	};
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static void *xdp_mmap_map(int fd, unsigned int max_entries)
+{
+	void *p;
+
+	p = mmap(NULL, align_up(sizeof(uint64_t) * max_entries, PGSIZE_4KB),
+		 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+
+/*
+ * A tiny BPF assembler. Jumps name a label, and are resolved once the
+ * program is complete.
+ */
+
+#define BPF_MAX_INSNS	128
+
+enum {
+	L_PASS = 0,
+	L_NOT_UNICAST,
+	L_UNICAST,
+	L_L4,
+	L_KEY,
+	L_STEER,
+	NR_LABELS,
+};
+
+struct bpf_asm {
+	struct bpf_insn	insns[BPF_MAX_INSNS];
+	int		jmp_label[BPF_MAX_INSNS];
+	int		label[NR_LABELS];
+	unsigned int	nr;
+};
+
+static void emit(struct bpf_asm *p, uint8_t code, uint8_t dst, uint8_t src,
+		 int16_t off, int32_t imm)
+{
+	BUG_ON(p->nr >= BPF_MAX_INSNS);
+	p->jmp_label[p->nr] = -1;
+	p->insns[p->nr++] = (struct bpf_insn) {
+		.code = code,
+		.dst_reg = dst,
+		.src_reg = src,
+		.off = off,
+		.imm = imm,
+	};
+}
+
+static void emit_jmp(struct bpf_asm *p, uint8_t code, uint8_t dst,
+		     uint8_t src, int32_t imm, int label)
+{
+	emit(p, code, dst, src, 0, imm);
+	p->jmp_label[p->nr - 1] = label;
+}
+
+static void emit_ld_map(struct bpf_asm *p, uint8_t dst, int map_fd)
+{
+	emit(p, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	emit(p, 0, 0, 0, 0, 0);
+}
+
+static void set_label(struct bpf_asm *p, int label)
+{
+	p->label[label] = p->nr;
+}
+
+static void resolve_labels(struct bpf_asm *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->nr; i++) {
+		if (p->jmp_label[i] < 0)
+			continue;
+		p->insns[i].off = p->label[p->jmp_label[i]] - (i + 1);
+	}
+}
+
+#define ALU64_IMM(p, op, dst, imm) \
+	emit(p, BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define ALU64_REG(p, op, dst, src) \
+	emit(p, BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0)
+#define LDX(p, size, dst, src, off) \
+	emit(p, BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define STX(p, size, dst, src, off) \
+	emit(p, BPF_STX | (size) | BPF_MEM, dst, src, off, 0)
+#define JMP_IMM(p, op, dst, imm, label) \
+	emit_jmp(p, BPF_JMP | (op) | BPF_K, dst, 0, imm, label)
+#define JMP32_IMM(p, op, dst, imm, label) \
+	emit_jmp(p, BPF_JMP32 | (op) | BPF_K, dst, 0, imm, label)
+#define JMP_REG(p, op, dst, src, label) \
+	emit_jmp(p, BPF_JMP | (op) | BPF_X, dst, src, 0, label)
+#define GOTO(p, label) \
+	emit_jmp(p, BPF_JMP | BPF_JA, 0, 0, 0, label)
+#define CALL(p, fn) \
+	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, fn)
+#define EXIT(p) \
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* loads of network-order fields, as seen by a little-endian host */
+#define LE16(x)		((uint16_t)hton16(x))
+
+static void xdp_build_prog(struct bpf_asm *p)
+{
+	const uint8_t *mac = netcfg.mac.addr;
+	uint32_t mac_lo = mac[0] | mac[1] << 8 | mac[2] << 16 |
+			  (uint32_t)mac[3] << 24;
+	uint16_t mac_hi = mac[4] | mac[5] << 8;
+
+	p->nr = 0;
+
+	/*
+	 * r6 = data, r7 = data_end, r8 = IP protocol, then the source port,
+	 * r9 = the port that picks the flow group (0 if there isn't one)
+	 */
+	LDX(p, BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct xdp_md, data));
+	LDX(p, BPF_W, BPF_REG_7, BPF_REG_1, offsetof(struct xdp_md, data_end));
+	ALU64_IMM(p, BPF_MOV, BPF_REG_9, 0);
+
+	/* the ethernet header */
+	ALU64_REG(p, BPF_MOV, BPF_REG_2, BPF_REG_6);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_2, sizeof(struct eth_hdr));
+	JMP_REG(p, BPF_JGT, BPF_REG_2, BPF_REG_7, L_PASS);
+	LDX(p, BPF_W, BPF_REG_3, BPF_REG_6, 0);
+	JMP32_IMM(p, BPF_JNE, BPF_REG_3, mac_lo, L_NOT_UNICAST);
+	LDX(p, BPF_H, BPF_REG_3, BPF_REG_6, 4);
+	JMP32_IMM(p, BPF_JNE, BPF_REG_3, mac_hi, L_NOT_UNICAST);
+	GOTO(p, L_UNICAST);
+
+	/* broadcasts and multicasts go to flow group 0, other hosts' to Linux */
+	set_label(p, L_NOT_UNICAST);
+	LDX(p, BPF_B, BPF_REG_3, BPF_REG_6, 0);
+	ALU64_IMM(p, BPF_AND, BPF_REG_3, ETH_ADDR_GROUP);
+	JMP_IMM(p, BPF_JEQ, BPF_REG_3, 0, L_PASS);
+	GOTO(p, L_STEER);
+
+	/* unfragmented IPv4 TCP and UDP are steered by port */
+	set_label(p, L_UNICAST);
+	LDX(p, BPF_H, BPF_REG_3, BPF_REG_6, offsetof(struct eth_hdr, type));
+	JMP_IMM(p, BPF_JNE, BPF_REG_3, LE16(ETHTYPE_IP), L_STEER);
+	ALU64_REG(p, BPF_MOV, BPF_REG_2, BPF_REG_6);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_2,
+		  sizeof(struct eth_hdr) + sizeof(struct ip_hdr));
+	JMP_REG(p, BPF_JGT, BPF_REG_2, BPF_REG_7, L_STEER);
+	LDX(p, BPF_H, BPF_REG_3, BPF_REG_6,
+	    sizeof(struct eth_hdr) + offsetof(struct ip_hdr, off));
+	ALU64_IMM(p, BPF_AND, BPF_REG_3, LE16(IP_MF | IP_OFFMASK));
+	JMP_IMM(p, BPF_JNE, BPF_REG_3, 0, L_STEER);
+	LDX(p, BPF_B, BPF_REG_8, BPF_REG_6,
+	    sizeof(struct eth_hdr) + offsetof(struct ip_hdr, proto));
+	JMP_IMM(p, BPF_JEQ, BPF_REG_8, IPPROTO_TCP, L_L4);
+	JMP_IMM(p, BPF_JNE, BPF_REG_8, IPPROTO_UDP, L_STEER);
+
+	set_label(p, L_L4);
+	LDX(p, BPF_B, BPF_REG_3, BPF_REG_6, sizeof(struct eth_hdr));
+	ALU64_IMM(p, BPF_AND, BPF_REG_3, 0xf);
+	ALU64_IMM(p, BPF_LSH, BPF_REG_3, 2);
+	ALU64_REG(p, BPF_MOV, BPF_REG_2, BPF_REG_6);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_2, sizeof(struct eth_hdr));
+	ALU64_REG(p, BPF_ADD, BPF_REG_2, BPF_REG_3);
+	ALU64_REG(p, BPF_MOV, BPF_REG_4, BPF_REG_2);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_4, 2 * sizeof(uint16_t));
+	JMP_REG(p, BPF_JGT, BPF_REG_4, BPF_REG_7, L_STEER);
+	LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 0);
+	emit(p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16);
+	LDX(p, BPF_H, BPF_REG_5, BPF_REG_2, sizeof(uint16_t));
+	emit(p, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16);
+
+	/* by the source port if the destination port is listening */
+	ALU64_REG(p, BPF_MOV, BPF_REG_3, BPF_REG_5);
+	JMP_IMM(p, BPF_JNE, BPF_REG_8, IPPROTO_UDP, L_KEY);
+	ALU64_IMM(p, BPF_OR, BPF_REG_3, 1 << 16);
+	set_label(p, L_KEY);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_3, -4);
+	ALU64_REG(p, BPF_MOV, BPF_REG_8, BPF_REG_4);
+	ALU64_REG(p, BPF_MOV, BPF_REG_9, BPF_REG_5);
+	emit_ld_map(p, BPF_REG_1, ports_map_fd);
+	ALU64_REG(p, BPF_MOV, BPF_REG_2, BPF_REG_10);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_2, -4);
+	CALL(p, BPF_FUNC_map_lookup_elem);
+	JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, L_STEER);
+	LDX(p, BPF_DW, BPF_REG_0, BPF_REG_0, 0);
+	JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, L_STEER);
+	ALU64_REG(p, BPF_MOV, BPF_REG_9, BPF_REG_8);
+
+	/* deliver to the socket of the kthread that has the flow group */
+	set_label(p, L_STEER);
+	ALU64_IMM(p, BPF_AND, BPF_REG_9, XDP_PORT_MASK);
+	ALU64_IMM(p, BPF_MOD, BPF_REG_9, nr_rxq);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_9, -4);
+	emit_ld_map(p, BPF_REG_1, fg_map_fd);
+	ALU64_REG(p, BPF_MOV, BPF_REG_2, BPF_REG_10);
+	ALU64_IMM(p, BPF_ADD, BPF_REG_2, -4);
+	CALL(p, BPF_FUNC_map_lookup_elem);
+	JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, L_PASS);
+	LDX(p, BPF_DW, BPF_REG_2, BPF_REG_0, 0);
+	emit_ld_map(p, BPF_REG_1, xsks_map_fd);
+	ALU64_IMM(p, BPF_MOV, BPF_REG_3, XDP_DROP);
+	CALL(p, BPF_FUNC_redirect_map);
+	EXIT(p);
+
+	set_label(p, L_PASS);
+	ALU64_IMM(p, BPF_MOV, BPF_REG_0, XDP_PASS);
+	EXIT(p);
+
+	resolve_labels(p);
+}
+
+static int xdp_load_prog(void)
+{
+	static char log_buf[65536];
+	struct bpf_asm p;
+	union bpf_attr attr;
+
+	xdp_build_prog(&p);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)p.insns;
+	attr.insn_cnt = p.nr;
+	attr.license = (uintptr_t)"Dual MIT/GPL";
+	attr.log_buf = (uintptr_t)log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+
+	prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd < 0) {
+		log_err("xdp: failed to load the steering program (%d)", errno);
+		log_err("%s", log_buf);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* attaches the program, in the driver if it supports XDP */
+static int xdp_attach_prog(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = xdp_ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (link_fd >= 0)
+		return 0;
+
+	log_warn("xdp: %s has no native XDP support (%d), falling back to "
+		 "generic XDP", cfg_xdp_ifname, errno);
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (link_fd < 0) {
+		log_err("xdp: failed to attach to %s (%d)", cfg_xdp_ifname,
+			errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+int xdp_register_flow(unsigned int affinity, struct trans_entry *e,
+		      void **handle_out)
+{
+	bitmap_ptr_t map;
+	uint32_t key = e->laddr.port;
+
+	if (e->match != TRANS_MATCH_3TUPLE)
+		return -EINVAL;
+
+	switch (e->proto) {
+		case IPPROTO_TCP:
+			map = tcp_listen_ports;
+			break;
+		case IPPROTO_UDP:
+			map = udp_listen_ports;
+			key |= 1 << 16;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (bitmap_atomic_test_and_set(map, e->laddr.port))
+		return -EINVAL;
+
+	ACCESS_ONCE(listen_ports[key]) = 1;
+	*handle_out = NULL;
+
+	return 0;
+}
+
+int xdp_deregister_flow(struct trans_entry *e, void *handle)
+{
+	uint32_t key = e->laddr.port;
+
+	if (e->proto == IPPROTO_TCP) {
+		bitmap_atomic_clear(tcp_listen_ports, e->laddr.port);
+	} else if (e->proto == IPPROTO_UDP) {
+		bitmap_atomic_clear(udp_listen_ports, e->laddr.port);
+		key |= 1 << 16;
+	} else {
+		return -EINVAL;
+	}
+
+	ACCESS_ONCE(listen_ports[key]) = 0;
+	return 0;
+}
+
+int xdp_steer_flows(unsigned int *new_fg_assignment)
+{
+	int i;
+
+	for (i = 0; i < nr_rxq; i++)
+		ACCESS_ONCE(fg_qp_assignment[i]) = new_fg_assignment[i];
+
+	return 0;
+}
+
+uint32_t xdp_get_flow_affinity(uint8_t ipproto, uint16_t local_port,
+			       const struct netaddr *remote)
+{
+	bitmap_ptr_t map = ipproto == IPPROTO_TCP ? tcp_listen_ports :
+			  udp_listen_ports;
+
+	if (bitmap_atomic_test(map, local_port))
+		return (remote->port & XDP_PORT_MASK) % nr_rxq;
+	else
+		return (local_port & XDP_PORT_MASK) % nr_rxq;
+}
+
+/*
+ * xdp_init_flows - creates the maps and attaches the steering program
+ * @rxq_count: the number of sockets, which must already exist
+ */
+int xdp_init_flows(unsigned int rxq_count)
+{
+	union bpf_attr attr;
+	uint32_t i;
+	int ret;
+
+	nr_rxq = rxq_count;
+
+	xsks_map_fd = xdp_create_map(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t),
+				     nr_rxq, 0);
+	fg_map_fd = xdp_create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint64_t),
+				   nr_rxq, BPF_F_MMAPABLE);
+	ports_map_fd = xdp_create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint64_t),
+				      2 * 65536, BPF_F_MMAPABLE);
+	if (xsks_map_fd < 0 || fg_map_fd < 0 || ports_map_fd < 0) {
+		log_err("xdp: failed to create BPF maps (%d)", errno);
+		return -errno;
+	}
+
+	fg_qp_assignment = xdp_mmap_map(fg_map_fd, nr_rxq);
+	listen_ports = xdp_mmap_map(ports_map_fd, 2 * 65536);
+	if (!fg_qp_assignment || !listen_ports)
+		return -errno;
+
+	/* all flow groups start on kthread 0, like mlx5 */
+	for (i = 0; i < nr_rxq; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = xsks_map_fd;
+		attr.key = (uintptr_t)&i;
+		attr.value = (uintptr_t)&xdp_rxqs[i].fd;
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+			log_err("xdp: failed to add socket %d (%d)", i, errno);
+			return -errno;
+		}
+		fg_qp_assignment[i] = 0;
+	}
+
+	ret = xdp_load_prog();
+	if (ret)
+		return ret;
+
+	return xdp_attach_prog();
+}
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * xdp_rxtx.c - AF_XDP datapath for Shenango's network stack
+ */
+
+#include <sys/socket.h>
+
+#include <asm/chksum.h>
+#include <base/log.h>
+#include <base/mempool.h>
+#include <net/chksum.h>
+#include <net/ethernet.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+#include <runtime/preempt.h>
+
+#ifdef DIRECTPATH_XDP
+
+#include "xdp.h"
+
+/* the maximum number of TX completions to collect at once */
+#define XDP_CQ_BATCH		64
+/* the maximum number of syscalls per TX flush */
+#define XDP_TX_KICK_MAX		8
+
+struct xdp_ring xdp_fq;
+struct xdp_ring xdp_cq;
+DEFINE_SPINLOCK(xdp_fq_lock);
+DEFINE_SPINLOCK(xdp_cq_lock);
+
+/* buffers that couldn't be posted to the fill ring yet */
+static unsigned int fq_deficit;
+
+/* the mbuf struct is stored in the headroom */
+BUILD_ASSERT(sizeof(struct mbuf) <= XDP_PACKET_HEADROOM);
+
+static void xdp_fq_post(void *buf)
+{
+	*xdp_ring_addr(&xdp_fq, xdp_fq.cached_prod++) = xdp_umem_off(buf);
+}
+
+/*
+ * xdp_rx_fill_init - posts the initial RX buffers to the fill ring
+ * @nr: the number of buffers
+ *
+ * Must be called during initialization, before any kthreads are running.
+ */
+int xdp_rx_fill_init(unsigned int nr)
+{
+	unsigned int i;
+	void *buf;
+
+	for (i = 0; i < nr; i++) {
+		buf = mempool_alloc(&directpath_buf_mp);
+		if (!buf)
+			return -ENOMEM;
+		xdp_fq_post(buf);
+	}
+
+	store_release(xdp_fq.producer, xdp_fq.cached_prod);
+	return 0;
+}
+
+/*
+ * xdp_refill_fq - replace buffers taken from the fill ring
+ * @nr: the number of buffers to post
+ *
+ * Every buffer the kernel hands back was taken from the fill ring, so there
+ * is always room for its replacement.
+ */
+static void xdp_refill_fq(unsigned int nr)
+{
+	unsigned int i;
+	void *buf;
+
+	preempt_disable();
+	spin_lock(&xdp_fq_lock);
+
+	nr += fq_deficit;
+	for (i = 0; i < nr; i++) {
+		buf = tcache_alloc(&perthread_get(directpath_buf_pt));
+		if (unlikely(!buf))
+			break;
+		xdp_fq_post(buf);
+	}
+
+	fq_deficit = nr - i;
+	if (unlikely(fq_deficit))
+		log_warn_ratelimited("xdp: out of RX buffers");
+
+	store_release(xdp_fq.producer, xdp_fq.cached_prod);
+
+	spin_unlock(&xdp_fq_lock);
+	preempt_enable();
+}
+
+/* finds the egress mbuf that contains a UMEM address */
+static struct mbuf *xdp_tx_mbuf(uint64_t addr)
+{
+	struct mempool *mp = &net_tx_buf_mp;
+	size_t off = (uintptr_t)xdp_umem_base + addr - (uintptr_t)mp->buf;
+	size_t pgoff = off & (mp->pgsize - 1);
+
+	return mp->buf + (off - pgoff) + pgoff / mp->item_len * mp->item_len;
+}
+
+/*
+ * xdp_gather_completions - frees transmitted mbufs
+ *
+ * The completion ring is shared by all kthreads, so whichever gets the lock
+ * collects completions for everyone.
+ */
+static void xdp_gather_completions(void)
+{
+	uint32_t prod;
+	int i, nr;
+
+	assert_preempt_disabled();
+
+	if (load_acquire(xdp_cq.producer) == xdp_cq.cached_cons)
+		return;
+	if (!spin_try_lock(&xdp_cq_lock))
+		return;
+
+	prod = load_acquire(xdp_cq.producer);
+	nr = MIN(prod - xdp_cq.cached_cons, XDP_CQ_BATCH);
+	for (i = 0; i < nr; i++)
+		mbuf_free(xdp_tx_mbuf(*xdp_ring_addr(&xdp_cq,
+						     xdp_cq.cached_cons++)));
+	store_release(xdp_cq.consumer, xdp_cq.cached_cons);
+
+	spin_unlock(&xdp_cq_lock);
+}
+
+/*
+ * xdp_tx_csum - fills in the checksums that a NIC would have offloaded
+ *
+ * AF_XDP has no checksum offloads, and with directpath TCP doesn't seed the
+ * checksum with the pseudo-header, so compute them from scratch.
+ */
+static void xdp_tx_csum(struct mbuf *m)
+{
+	unsigned char *l3 = mbuf_data(m) + sizeof(struct eth_hdr);
+	struct ip_hdr *iphdr;
+	struct ip6_hdr *ip6hdr;
+	struct tcp_hdr *tcphdr;
+	uint16_t l4len;
+
+	if (m->txflags & OLFLAG_IPV6) {
+		if (!(m->txflags & OLFLAG_TCP_CHKSUM))
+			return;
+		ip6hdr = (struct ip6_hdr *)l3;
+		tcphdr = (struct tcp_hdr *)(ip6hdr + 1);
+		l4len = ntoh16(ip6hdr->payload_len);
+		tcphdr->sum = 0;
+		tcphdr->sum = ipv6_udptcp_cksum(IPPROTO_TCP, ip6hdr->saddr,
+						ip6hdr->daddr, l4len, tcphdr);
+		return;
+	}
+
+	iphdr = (struct ip_hdr *)l3;
+	if (m->txflags & OLFLAG_IP_CHKSUM) {
+		iphdr->chksum = 0;
+		iphdr->chksum = chksum_internet(iphdr, iphdr->header_len * 4);
+	}
+
+	if (m->txflags & OLFLAG_TCP_CHKSUM) {
+		tcphdr = (struct tcp_hdr *)(l3 + iphdr->header_len * 4);
+		l4len = ntoh16(iphdr->len) - iphdr->header_len * 4;
+		tcphdr->sum = 0;
+		tcphdr->sum = ipv4_udptcp_cksum(IPPROTO_TCP, ntoh32(iphdr->saddr),
+						ntoh32(iphdr->daddr), l4len,
+						tcphdr);
+	}
+}
+
+/*
+ * xdp_transmit_one - send one mbuf
+ * @m: mbuf to send
+ *
+ * uses local kthread tx queue, the packet is sent by xdp_transmit_flush()
+ * returns 0 on success, -1 on error
+ */
+int xdp_transmit_one(struct mbuf *m)
+{
+	struct kthread *k;
+	struct xdp_txq *v;
+	struct xdp_desc *d;
+
+	k = getk();
+	v = container_of(k->directpath_txq, struct xdp_txq, txq);
+
+	if (v->tx.cached_prod - v->tx.cached_cons >= v->tx.size) {
+		v->tx.cached_cons = load_acquire(v->tx.consumer);
+		if (unlikely(v->tx.cached_prod - v->tx.cached_cons >=
+			     v->tx.size)) {
+			putk();
+			log_warn_ratelimited("txq full");
+			return -1;
+		}
+	}
+
+	if (m->txflags)
+		xdp_tx_csum(m);
+
+	d = xdp_ring_desc(&v->tx, v->tx.cached_prod++);
+	d->addr = xdp_umem_off(mbuf_data(m));
+	d->len = mbuf_length(m);
+	d->options = 0;
+	store_release(v->tx.producer, v->tx.cached_prod);
+	putk();
+
+	return 0;
+}
+
+/*
+ * xdp_transmit_flush - asks the kernel to send the queued packets
+ *
+ * Unless the driver supports zero-copy, the kernel only transmits from within
+ * a syscall, a limited number of packets at a time.
+ */
+void xdp_transmit_flush(void)
+{
+	struct kthread *k = getk();
+	struct xdp_txq *v;
+	int i;
+
+	v = container_of(k->directpath_txq, struct xdp_txq, txq);
+
+	for (i = 0; i < XDP_TX_KICK_MAX; i++) {
+		if (load_acquire(v->tx.consumer) == v->tx.cached_prod)
+			break;
+		if (!(ACCESS_ONCE(*v->tx.flags) & XDP_RING_NEED_WAKEUP))
+			break;
+		if (sendto(v->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == 0)
+			break;
+		if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+			log_warn_ratelimited("xdp: tx wakeup failed (%d)",
+					     errno);
+			break;
+		}
+
+		/* the completion ring may be full */
+		xdp_gather_completions();
+	}
+
+	xdp_gather_completions();
+	putk();
+}
+
+static void mbuf_fill_desc(struct mbuf *m, unsigned int off, uint32_t len)
+{
+	mbuf_init(m, (unsigned char *)m + RX_BUF_HEAD,
+		  xdp_chunk_size - RX_BUF_HEAD, off - RX_BUF_HEAD);
+	m->len = len;
+	m->csum_type = CHECKSUM_TYPE_NEEDED;
+	m->csum = 0;
+	m->rss_hash = 0;
+	m->release = directpath_rx_completion;
+}
+
+int xdp_gather_rx(struct hardware_q *rxq, struct mbuf **ms,
+		  unsigned int budget)
+{
+	struct xdp_rxq *v = container_of(rxq, struct xdp_rxq, rxq);
+	struct xdp_desc *d;
+	uint64_t addr;
+	uint32_t prod;
+	int i, rx_cnt;
+
+	prod = load_acquire(v->rx.producer);
+	rx_cnt = MIN(prod - v->rx.cached_cons, budget);
+
+	for (i = 0; i < rx_cnt; i++) {
+		d = xdp_ring_desc(&v->rx, v->rx.cached_cons++);
+
+		/* unaligned chunks keep the data offset in the upper bits */
+		addr = d->addr & XSK_UNALIGNED_BUF_ADDR_MASK;
+		ms[i] = xdp_umem_base + addr;
+		mbuf_fill_desc(ms[i], d->addr >> XSK_UNALIGNED_BUF_OFFSET_SHIFT,
+			       d->len);
+	}
+
+	if (unlikely(!rx_cnt))
+		return rx_cnt;
+
+	store_release(v->rx.consumer, v->rx.cached_cons);
+	xdp_refill_fq(rx_cnt);
+
+	preempt_disable();
+	xdp_gather_completions();
+	preempt_enable();
+
+	return rx_cnt;
+}
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * ipfrag.c - IPv4 fragment reassembly
+ *
+ * Fragments are held in a table with one shard per kthread. A datagram's shard
+ * is picked by hashing its (source, destination, protocol, ID), not by the
+ * kthread that received it, because RSS can't see L4 ports in fragments and
+ * may spread them across queues. Each shard caps the number of datagrams and
+ * the memory it holds, evicting the oldest datagram when full, and incomplete
+ * datagrams expire after IPFRAG_TIMEOUT.
+ *
+ * A reassembled datagram is delivered as the mbuf of its first fragment, with
+ * the remaining fragments linked in order through @frag_next. No data is
+ * copied. While queued, each fragment's byte range within the datagram is kept
+ * in the (otherwise TCP-only) @seg_seq and @seg_end fields.
+ */
+
+#include <string.h>
+
+#include <base/hash.h>
+#include <base/list.h>
+#include <base/log.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+/* how long to wait for the rest of a datagram */
+#define IPFRAG_TIMEOUT		(100 * ONE_MS)
+/* the maximum number of incomplete datagrams per shard */
+#define IPFRAG_MAX_DATAGRAMS	64
+/* the maximum buffer memory held per shard */
+#define IPFRAG_MAX_MEM		(2 * 1024 * 1024)
+/* the largest possible IP payload */
+#define IPFRAG_MAX_LEN		(USHRT_MAX - sizeof(struct ip_hdr))
+
+struct ipfrag_entry {
+	struct list_node	link;
+	uint64_t		deadline_us;
+
+	/* the datagram's identity */
+	uint32_t		saddr;
+	uint32_t		daddr;
+	uint16_t		id;
+	uint8_t			proto;
+
+	/* reassembly state */
+	unsigned int		total_len; /* 0 until the last fragment arrives */
+	unsigned int		recv_len;
+	unsigned int		mem;
+	struct mbuf		*frags;	   /* sorted by offset */
+};
+
+struct ipfrag_shard {
+	spinlock_t		lock;
+	int			nr_entries;
+	unsigned int		mem;
+	struct list_head	entries;   /* oldest first */
+} __aligned(CACHE_LINE_SIZE);
+
+static struct ipfrag_shard ipfrag_shards[NCPU];
+
+static inline unsigned int ipfrag_mem(struct mbuf *m)
+{
+	return m->head_len + MBUF_HEAD_LEN;
+}
+
+static struct ipfrag_shard *ipfrag_get_shard(const struct ip_hdr *iphdr)
+{
+	uint32_t hash;
+
+	hash = hash_crc32c_two(iphdr->id | ((uint32_t)iphdr->proto << 16),
+			       iphdr->saddr, iphdr->daddr);
+	return &ipfrag_shards[hash % maxks];
+}
+
+static struct ipfrag_entry *ipfrag_lookup(struct ipfrag_shard *sh,
+					  const struct ip_hdr *iphdr)
+{
+	struct ipfrag_entry *e;
+
+	list_for_each(&sh->entries, e, link) {
+		if (e->id == iphdr->id && e->saddr == iphdr->saddr &&
+		    e->daddr == iphdr->daddr && e->proto == iphdr->proto)
+			return e;
+	}
+
+	return NULL;
+}
+
+/* unlinks an entry and adds its fragments to @garbage (to free unlocked) */
+static void ipfrag_discard(struct ipfrag_shard *sh, struct ipfrag_entry *e,
+			   struct mbuf **garbage)
+{
+	struct mbuf *tail;
+
+	assert_spin_lock_held(&sh->lock);
+	list_del_from(&sh->entries, &e->link);
+	sh->nr_entries--;
+	sh->mem -= e->mem;
+
+	if (e->frags) {
+		for (tail = e->frags; tail->frag_next; tail = tail->frag_next)
+			;
+		tail->frag_next = *garbage;
+		*garbage = e->frags;
+	}
+	sfree(e);
+}
+
+/* discards entries that have timed out */
+static void ipfrag_expire(struct ipfrag_shard *sh, uint64_t now_us,
+			  struct mbuf **garbage)
+{
+	struct ipfrag_entry *e;
+
+	while (true) {
+		e = list_top(&sh->entries, struct ipfrag_entry, link);
+		if (!e || e->deadline_us > now_us)
+			break;
+		ipfrag_discard(sh, e, garbage);
+		STAT(RX_REASSEMBLY_FAILS)++;
+	}
+}
+
+/* frees discarded fragments after the shard lock has been dropped */
+static void ipfrag_free_garbage(struct mbuf *garbage)
+{
+	if (garbage)
+		mbuf_drop(garbage);
+}
+
+/* inserts a fragment in order, returns false if it overlaps another */
+static bool ipfrag_insert(struct ipfrag_entry *e, struct mbuf *m)
+{
+	struct mbuf **pos = &e->frags;
+
+	while (*pos && (*pos)->seg_seq < m->seg_seq)
+		pos = &(*pos)->frag_next;
+
+	/* reject overlaps (RFC 5722), including duplicates */
+	if (*pos && (*pos)->seg_seq < m->seg_end)
+		return false;
+	if (pos != &e->frags) {
+		struct mbuf *prev = container_of(pos, struct mbuf, frag_next);
+		if (prev->seg_end > m->seg_seq)
+			return false;
+	}
+
+	m->frag_next = *pos;
+	*pos = m;
+	return true;
+}
+
+/**
+ * ipfrag_reassemble - adds an IP fragment to its datagram
+ * @m: the fragment (the data pointer must be at the end of the IP header)
+ * @iphdr: the fragment's IP header
+ *
+ * Takes ownership of @m.
+ *
+ * Returns the first fragment of the datagram (with the rest linked through
+ * @frag_next) if @m completed it, otherwise NULL.
+ */
+struct mbuf *ipfrag_reassemble(struct mbuf *m, const struct ip_hdr *iphdr)
+{
+	struct ipfrag_shard *sh;
+	struct ipfrag_entry *e;
+	struct mbuf *garbage = NULL;
+	unsigned int off, len;
+	bool last;
+
+	STAT(RX_FRAGS)++;
+
+	/* only UDP datagrams are reassembled */
+	if (iphdr->proto != IPPROTO_UDP)
+		goto drop;
+
+	off = ip_frag_offset(iphdr);
+	len = mbuf_length(m);
+	last = (ntoh16(iphdr->off) & IP_MF) == 0;
+	if (unlikely(len == 0 || off + len > IPFRAG_MAX_LEN))
+		goto drop;
+	if (unlikely(!last && len % 8 != 0))
+		goto drop;
+	m->seg_seq = off;
+	m->seg_end = off + len;
+	m->frag_next = NULL;
+
+	sh = ipfrag_get_shard(iphdr);
+	spin_lock_np(&sh->lock);
+	ipfrag_expire(sh, microtime(), &garbage);
+
+	e = ipfrag_lookup(sh, iphdr);
+	if (!e) {
+		/* make room by evicting the oldest datagrams */
+		while (sh->nr_entries >= IPFRAG_MAX_DATAGRAMS ||
+		       (sh->nr_entries > 0 &&
+			sh->mem + ipfrag_mem(m) > IPFRAG_MAX_MEM)) {
+			ipfrag_discard(sh, list_top(&sh->entries,
+				       struct ipfrag_entry, link), &garbage);
+			STAT(RX_REASSEMBLY_FAILS)++;
+		}
+
+		e = smalloc(sizeof(*e));
+		if (unlikely(!e))
+			goto drop_unlock;
+		e->deadline_us = microtime() + IPFRAG_TIMEOUT;
+		e->saddr = iphdr->saddr;
+		e->daddr = iphdr->daddr;
+		e->id = iphdr->id;
+		e->proto = iphdr->proto;
+		e->total_len = 0;
+		e->recv_len = 0;
+		e->mem = 0;
+		e->frags = NULL;
+		list_add_tail(&sh->entries, &e->link);
+		sh->nr_entries++;
+	} else if (unlikely(sh->mem + ipfrag_mem(m) > IPFRAG_MAX_MEM)) {
+		goto fail;
+	}
+
+	/* the last fragment determines the length */
+	if (last) {
+		if (e->total_len != 0 && e->total_len != m->seg_end)
+			goto fail;
+		e->total_len = m->seg_end;
+	}
+	if (unlikely(e->total_len != 0 && m->seg_end > e->total_len))
+		goto fail;
+	if (unlikely(!ipfrag_insert(e, m)))
+		goto fail;
+
+	e->recv_len += len;
+	e->mem += ipfrag_mem(m);
+	sh->mem += ipfrag_mem(m);
+
+	/* without overlaps, receiving every byte means the datagram is done */
+	if (e->total_len == 0 || e->recv_len != e->total_len) {
+		spin_unlock_np(&sh->lock);
+		ipfrag_free_garbage(garbage);
+		return NULL;
+	}
+
+	m = e->frags;
+	e->frags = NULL;
+	ipfrag_discard(sh, e, &garbage);
+	spin_unlock_np(&sh->lock);
+	ipfrag_free_garbage(garbage);
+
+	STAT(RX_REASSEMBLED)++;
+	return m;
+
+fail:
+	ipfrag_discard(sh, e, &garbage);
+	STAT(RX_REASSEMBLY_FAILS)++;
+drop_unlock:
+	spin_unlock_np(&sh->lock);
+	ipfrag_free_garbage(garbage);
+drop:
+	mbuf_drop(m);
+	return NULL;
+}
+
+/**
+ * ipfrag_linearize - copies a reassembled datagram into a single mbuf
+ * @m: the first fragment of the datagram
+ *
+ * The network and transport headers are preserved. Takes ownership of @m.
+ *
+ * Returns a contiguous mbuf, or NULL if out of memory.
+ */
+struct mbuf *ipfrag_linearize(struct mbuf *m)
+{
+	unsigned char *hdrs = mbuf_network_offset(m);
+	unsigned int hdr_len = mbuf_data(m) - hdrs;
+	unsigned int len = mbuf_chain_length(m);
+	struct mbuf *lm;
+
+	lm = smalloc(MBUF_HEAD_LEN + hdr_len + len);
+	if (unlikely(!lm)) {
+		mbuf_drop(m);
+		return NULL;
+	}
+
+	mbuf_init(lm, (unsigned char *)lm + MBUF_HEAD_LEN, hdr_len + len, 0);
+	memcpy(mbuf_put(lm, hdr_len), hdrs, hdr_len);
+	lm->network_off = 0;
+	lm->transport_off = m->transport_off - m->network_off;
+	mbuf_pull(lm, hdr_len);
+	mbuf_chain_copy(m, mbuf_put(lm, len), len);
+	lm->csum_type = m->csum_type;
+	lm->release = (void (*)(struct mbuf *))sfree;
+
+	mbuf_free(m);
+	return lm;
+}
+
+static void ipfrag_worker(void *arg)
+{
+	struct ipfrag_shard *sh;
+	struct mbuf *garbage;
+	int i;
+
+	/* periodically expire datagrams in shards that have gone quiet */
+	while (true) {
+		timer_sleep(IPFRAG_TIMEOUT);
+
+		for (i = 0; i < maxks; i++) {
+			sh = &ipfrag_shards[i];
+			if (list_empty(&sh->entries))
+				continue;
+
+			garbage = NULL;
+			spin_lock_np(&sh->lock);
+			ipfrag_expire(sh, microtime(), &garbage);
+			spin_unlock_np(&sh->lock);
+			ipfrag_free_garbage(garbage);
+		}
+	}
+}
+
+/**
+ * ipfrag_init - initializes the IP reassembly table
+ *
+ * Always returns 0 for success.
+ */
+int ipfrag_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		spin_lock_init(&ipfrag_shards[i].lock);
+		list_head_init(&ipfrag_shards[i].entries);
+	}
+
+	return 0;
+}
+
+/**
+ * ipfrag_init_late - starts the IP reassembly expiration thread
+ *
+ * Returns 0 if successful.
+ */
+int ipfrag_init_late(void)
+{
+	return thread_spawn(ipfrag_worker, NULL);
+}
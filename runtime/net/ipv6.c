@@ -0,0 +1,293 @@
+/*
+ * ipv6.c - support for Internet Protocol version 6 (IPv6) and ICMPv6
+ *
+ * The host has one global address (host_addr6) and a link-local address
+ * derived from its MAC. Transport endpoints use the global address; the
+ * link-local address is only used for neighbor discovery. Extension headers
+ * (including fragments) are not supported, so such packets are dropped, much
+ * like IPv4 packets with options.
+ */
+
+#include <string.h>
+
+#include <base/log.h>
+#include <net/chksum.h>
+#include <net/udp.h>
+
+#include "defs.h"
+
+struct net6_cfg netcfg6;
+
+/* the all-nodes multicast address (ff02::1) */
+static const uint8_t ip6_all_nodes[IP6_ADDR_LEN] = {
+	0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+};
+
+/* returns true if a destination address belongs to this host */
+static bool ip6_addr_is_ours(const uint8_t *addr)
+{
+	uint8_t snm[IP6_ADDR_LEN];
+
+	if (likely(memcmp(addr, netcfg6.addr, IP6_ADDR_LEN) == 0))
+		return true;
+	if (memcmp(addr, netcfg6.link_local, IP6_ADDR_LEN) == 0)
+		return true;
+	if (!ip6_addr_is_multicast(addr))
+		return false;
+	if (memcmp(addr, ip6_all_nodes, IP6_ADDR_LEN) == 0)
+		return true;
+
+	/* solicited-node addresses of either unicast address */
+	ip6_solicited_node(netcfg6.addr, snm);
+	if (memcmp(addr, snm, IP6_ADDR_LEN) == 0)
+		return true;
+	ip6_solicited_node(netcfg6.link_local, snm);
+	return memcmp(addr, snm, IP6_ADDR_LEN) == 0;
+}
+
+
+/*
+ * ICMPv6
+ */
+
+static void net_rx_icmp6_echo(struct mbuf *m_in, const struct ip6_hdr *in_hdr,
+			      uint16_t len)
+{
+	struct icmp6_hdr *out_icmp6hdr;
+	struct mbuf *m;
+
+	log_debug("icmp6: responding to icmp6 echo request");
+
+	/* don't answer requests sent to multicast groups */
+	if (ip6_addr_is_multicast(in_hdr->daddr))
+		goto out;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		goto out;
+
+	/* copy incoming ICMPv6 hdr and data, the checksum is set on TX */
+	out_icmp6hdr = (struct icmp6_hdr *)mbuf_put(m, len);
+	memcpy(out_icmp6hdr, mbuf_data(m_in), len);
+	out_icmp6hdr->type = ICMP6_ECHO_REPLY;
+
+	if (unlikely(__net_tx_ip6(m, IPPROTO_ICMPV6, in_hdr->daddr,
+				  in_hdr->saddr)))
+		mbuf_free(m);
+
+out:
+	mbuf_free(m_in);
+}
+
+static void net_rx_icmp6(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+			 uint16_t len)
+{
+	const struct icmp6_hdr *icmp6hdr;
+
+	icmp6hdr = (const struct icmp6_hdr *)mbuf_data(m);
+	if (unlikely(len < sizeof(*icmp6hdr)))
+		goto drop;
+
+	/* received packets don't have their ICMPv6 checksum verified by HW */
+	if (m->csum_type != CHECKSUM_TYPE_UNNECESSARY &&
+	    ipv6_udptcp_cksum(IPPROTO_ICMPV6, ip6hdr->saddr, ip6hdr->daddr,
+			      len, icmp6hdr) != 0xffff)
+		goto drop;
+
+	switch (icmp6hdr->type) {
+	case ICMP6_ECHO_REQUEST:
+		net_rx_icmp6_echo(m, ip6hdr, len);
+		break;
+
+	case ND_NEIGHBOR_SOLICIT:
+	case ND_NEIGHBOR_ADVERT:
+		net_rx_ndp(m, ip6hdr, len);
+		break;
+
+	default:
+		log_debug("icmp6: type %d not yet supported", icmp6hdr->type);
+		goto drop;
+	}
+
+	return;
+
+drop:
+	mbuf_drop(m);
+}
+
+
+/*
+ * IPv6 RX and TX
+ */
+
+/**
+ * net_rx_ip6 - receives an IPv6 packet
+ * @m: the mbuf (the ethernet header is stripped)
+ * @dhost: the destination MAC address of the packet
+ */
+void net_rx_ip6(struct mbuf *m, const struct eth_addr *dhost)
+{
+	const struct ip6_hdr *ip6hdr;
+	uint16_t len;
+
+	if (unlikely(!netcfg6.enabled))
+		goto drop;
+
+	/* accept our MAC and IPv6 multicast (used by neighbor discovery) */
+	BUILD_ASSERT(sizeof(dhost->addr) == sizeof(netcfg.mac.addr));
+	if (unlikely(memcmp(dhost->addr, netcfg.mac.addr,
+			    sizeof(dhost->addr)) != 0 &&
+		     !eth_addr_is_ip6_multicast(dhost)))
+		goto drop;
+
+	mbuf_mark_network_offset(m);
+	ip6hdr = mbuf_pull_hdr_or_null(m, *ip6hdr);
+	if (unlikely(!ip6hdr))
+		goto drop;
+	if (unlikely(ip6_hdr_version(ip6hdr) != IP6VERSION))
+		goto drop;
+	if (unlikely(!ip6_addr_is_ours(ip6hdr->daddr)))
+		goto drop;
+
+	len = ntoh16(ip6hdr->payload_len);
+	if (unlikely(mbuf_length(m) < len))
+		goto drop;
+	if (len < mbuf_length(m))
+		mbuf_trim(m, mbuf_length(m) - len);
+
+	switch (ip6hdr->nexthdr) {
+	case IPPROTO_ICMPV6:
+		net_rx_icmp6(m, ip6hdr, len);
+		break;
+
+	case IPPROTO_UDP:
+	case IPPROTO_TCP:
+		if (unlikely(ip6_addr_is_multicast(ip6hdr->daddr)))
+			goto drop;
+		net_rx_trans(m);
+		break;
+
+	default:
+		goto drop;
+	}
+
+	return;
+
+drop:
+	mbuf_drop(m);
+}
+
+/* picks the next hop for a destination, or returns false if unroutable */
+static bool net_get_ip6_route(const uint8_t *daddr, uint8_t *nexthop)
+{
+	if (ip6_addr_is_link_local(daddr) ||
+	    ip6_addr_prefix_equal(daddr, netcfg6.addr, netcfg6.prefix_len)) {
+		memcpy(nexthop, daddr, IP6_ADDR_LEN);
+		return true;
+	}
+
+	if (!netcfg6.has_gateway)
+		return false;
+	memcpy(nexthop, netcfg6.gateway, IP6_ADDR_LEN);
+	return true;
+}
+
+/**
+ * __net_tx_ip6 - transmits an IPv6 packet from a given source address
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @saddr: the source IPv6 address
+ * @daddr: the destination IPv6 address
+ *
+ * Like net_tx_ip6(), but lets neighbor discovery pick the source address.
+ */
+int __net_tx_ip6(struct mbuf *m, uint8_t proto, const uint8_t *saddr,
+		 const uint8_t *daddr)
+{
+	struct ip6_hdr *ip6hdr;
+	struct eth_addr dhost;
+	uint8_t nexthop[IP6_ADDR_LEN];
+	unsigned int len = mbuf_length(m);
+	int ret;
+
+	if (unlikely(!netcfg6.enabled))
+		return -ENETUNREACH;
+
+	/* UDP and ICMPv6 checksums are mandatory and have no TX offload */
+	if (proto == IPPROTO_UDP) {
+		struct udp_hdr *udphdr = (struct udp_hdr *)mbuf_data(m);
+		udphdr->chksum = 0;
+		udphdr->chksum = ipv6_udptcp_cksum(proto, saddr, daddr, len,
+						   udphdr);
+	} else if (proto == IPPROTO_ICMPV6) {
+		struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)mbuf_data(m);
+		icmp6hdr->chksum = 0;
+		icmp6hdr->chksum = ipv6_udptcp_cksum(proto, saddr, daddr, len,
+						     icmp6hdr);
+	}
+
+	/* prepend the IPv6 header */
+	ip6hdr = mbuf_push_hdr(m, *ip6hdr);
+	ip6hdr->vtc_flow = hton32(IP6_VTC_FLOW(0, 0));
+	ip6hdr->payload_len = hton16(len);
+	ip6hdr->nexthdr = proto;
+	ip6hdr->hop_limit = proto == IPPROTO_ICMPV6 ? IP6_NDP_HOP_LIMIT : 64;
+	memcpy(ip6hdr->saddr, saddr, IP6_ADDR_LEN);
+	memcpy(ip6hdr->daddr, daddr, IP6_ADDR_LEN);
+
+	/* there's no IPv6 header checksum, but TCP offload needs the type */
+	m->txflags |= OLFLAG_IPV6;
+
+	if (unlikely(memcmp(daddr, netcfg6.addr, IP6_ADDR_LEN) == 0 ||
+		     memcmp(daddr, netcfg6.link_local, IP6_ADDR_LEN) == 0)) {
+		net_tx_loopback(m, ETHTYPE_IPV6);
+		return 0;
+	}
+
+	if (ip6_addr_is_multicast(daddr)) {
+		net_tx_eth(m, ETHTYPE_IPV6, ip6_multicast_eth_addr(daddr));
+		return 0;
+	}
+
+	/* apply IPv6 routing */
+	if (unlikely(!net_get_ip6_route(daddr, nexthop))) {
+		mbuf_pull_hdr(m, struct ip6_hdr);
+		return -ENETUNREACH;
+	}
+
+	/* need to use NDP to resolve dhost */
+	ret = ndp_lookup(nexthop, &dhost, m);
+	if (unlikely(ret)) {
+		if (ret == -EINPROGRESS) {
+			/* NDP code now owns the mbuf */
+			return 0;
+		} else {
+			/* An unrecoverable error occurred */
+			mbuf_pull_hdr(m, struct ip6_hdr);
+			return ret;
+		}
+	}
+
+	net_tx_eth(m, ETHTYPE_IPV6, dhost);
+	return 0;
+}
+
+/**
+ * net_tx_ip6 - transmits an IPv6 packet
+ * @m: the mbuf to transmit
+ * @proto: the transport protocol
+ * @daddr: the destination IPv6 address
+ *
+ * The payload must start with the transport (L4) header. The IPv6 (L3) and
+ * ethernet (L2) headers will be prepended by this function. UDP and ICMPv6
+ * checksums are filled in, TCP checksums are left to the NIC.
+ *
+ * @m must have been allocated with net_tx_alloc_mbuf().
+ *
+ * Returns 0 if successful. If successful, the mbuf will be freed when the
+ * transmit completes. Otherwise, the mbuf still belongs to the caller.
+ */
+int net_tx_ip6(struct mbuf *m, uint8_t proto, const uint8_t *daddr)
+{
+	return __net_tx_ip6(m, proto, netcfg6.addr, daddr);
+}
@@ -0,0 +1,413 @@
+/*
+ * ndp.c - support for IPv6 neighbor discovery (NDP)
+ *
+ * This is the IPv6 counterpart of arp.c: a neighbor cache that resolves
+ * addresses with neighbor solicitations and answers solicitations for our own
+ * addresses (RFC 4861). Router discovery, redirects and duplicate address
+ * detection are not supported; the address, prefix and gateway come from the
+ * configuration file.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <base/lock.h>
+#include <base/log.h>
+#include <base/hash.h>
+#include <runtime/rculist.h>
+#include <runtime/timer.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+
+#include "defs.h"
+
+#define NDP_SEED		0x5B3E97C1
+#define NDP_TABLE_CAPACITY	1024
+#define NDP_RETRIES		3
+#define NDP_RETRY_TIME		ONE_SECOND
+#define NDP_REPROBE_TIME	(10 * ONE_SECOND)
+
+enum {
+	/* the MAC address is being probed */
+	NDP_STATE_PROBING = 0,
+	/* the MAC address is valid */
+	NDP_STATE_VALID,
+	/* the MAC address is probably valid but is being confirmed */
+	NDP_STATE_VALID_BUT_REPROBING,
+};
+
+/* A single entry in the neighbor cache. */
+struct ndp_entry {
+	/* accessed by RCU sections */
+	uint32_t		state;
+	uint8_t			ip6[IP6_ADDR_LEN];
+	struct eth_addr		eth;
+	struct rcu_hlist_node	link;
+
+	/* accessed only with @ndp_lock */
+	struct mbufq		q;
+	struct rcu_head		rcuh;
+	uint64_t		ts;
+	int			tries_left;
+};
+
+static DEFINE_SPINLOCK(ndp_lock);
+static struct rcu_hlist_head ndp_tbl[NDP_TABLE_CAPACITY];
+
+static inline int hash_ip6(const uint8_t *ip6)
+{
+	uint64_t hi, lo;
+
+	memcpy(&hi, ip6, sizeof(hi));
+	memcpy(&lo, ip6 + sizeof(hi), sizeof(lo));
+	return hash_crc32c_two(NDP_SEED, hi, lo) % NDP_TABLE_CAPACITY;
+}
+
+static struct ndp_entry *lookup_entry(int idx, const uint8_t *daddr)
+{
+	struct ndp_entry *e;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(&ndp_tbl[idx], node, true) {
+		e = rcu_hlist_entry(node, struct ndp_entry, link);
+		if (memcmp(e->ip6, daddr, IP6_ADDR_LEN) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void release_entry(struct rcu_head *h)
+{
+	struct ndp_entry *e = container_of(h, struct ndp_entry, rcuh);
+	sfree(e);
+}
+
+static void delete_entry(struct ndp_entry *e)
+{
+	rcu_hlist_del(&e->link);
+
+	/* free any mbufs waiting for a neighbor advertisement */
+	while (!mbufq_empty(&e->q))
+		mbuf_free(mbufq_pop_head(&e->q));
+
+	rcu_free(&e->rcuh, release_entry);
+}
+
+static struct ndp_entry *create_entry(const uint8_t *daddr)
+{
+	struct ndp_entry *e = smalloc(sizeof(*e));
+	if (!e)
+		return NULL;
+
+	memcpy(e->ip6, daddr, IP6_ADDR_LEN);
+	e->state = NDP_STATE_PROBING;
+	e->ts = microtime();
+	e->tries_left = NDP_RETRIES;
+	mbufq_init(&e->q);
+	return e;
+}
+
+/* our source address when talking to a neighbor */
+static const uint8_t *ndp_source_for(const uint8_t *daddr)
+{
+	if (ip6_addr_is_link_local(daddr))
+		return netcfg6.link_local;
+	return netcfg6.addr;
+}
+
+static void ndp_send(uint8_t type, const uint8_t *saddr, const uint8_t *daddr,
+		     const uint8_t *target, uint32_t flags)
+{
+	struct nd_neighbor_msg *msg;
+	struct nd_opt_lladdr *opt;
+	struct mbuf *m;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely(!m))
+		return;
+
+	msg = mbuf_put_hdr(m, *msg);
+	msg->hdr.type = type;
+	msg->hdr.code = 0;
+	msg->flags = hton32(flags);
+	memcpy(msg->target, target, IP6_ADDR_LEN);
+
+	/* tell the neighbor our MAC address */
+	opt = mbuf_put_hdr(m, *opt);
+	opt->hdr.type = type == ND_NEIGHBOR_SOLICIT ?
+			ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+	opt->hdr.len = 1;
+	opt->addr = netcfg.mac;
+
+	if (unlikely(__net_tx_ip6(m, IPPROTO_ICMPV6, saddr, daddr)))
+		mbuf_free(m);
+}
+
+/* sends a solicitation, to the solicited-node group unless reprobing */
+static void ndp_solicit(const uint8_t *target, bool unicast)
+{
+	uint8_t daddr[IP6_ADDR_LEN];
+
+	if (unicast)
+		memcpy(daddr, target, IP6_ADDR_LEN);
+	else
+		ip6_solicited_node(target, daddr);
+	ndp_send(ND_NEIGHBOR_SOLICIT, ndp_source_for(target), daddr, target, 0);
+}
+
+static void ndp_age_entry(uint64_t now_us, struct ndp_entry *e)
+{
+	/* check if this entry has timed out */
+	if (now_us - e->ts < ((e->state == NDP_STATE_VALID) ?
+			      NDP_REPROBE_TIME : NDP_RETRY_TIME))
+		return;
+
+	switch (e->state) {
+	case NDP_STATE_PROBING:
+	case NDP_STATE_VALID_BUT_REPROBING:
+		if (e->tries_left == 0) {
+			delete_entry(e);
+			return;
+		}
+		e->tries_left--;
+		break;
+
+	case NDP_STATE_VALID:
+		e->state = NDP_STATE_VALID_BUT_REPROBING;
+		e->tries_left = NDP_RETRIES;
+		break;
+
+	default:
+		panic("ndp: invalid entry state %d", e->state);
+	}
+
+	ndp_solicit(e->ip6, e->state != NDP_STATE_PROBING);
+	e->ts = microtime();
+}
+
+static void ndp_worker(void *arg)
+{
+	struct ndp_entry *e;
+	struct rcu_hlist_node *node;
+	uint64_t now_us;
+	int i;
+
+	/* wake up each second and update the neighbor cache */
+	while (true) {
+		now_us = microtime();
+
+		for (i = 0; i < NDP_TABLE_CAPACITY; i++) {
+			spin_lock_np(&ndp_lock);
+			rcu_hlist_for_each(&ndp_tbl[i], node, true) {
+				e = rcu_hlist_entry(node,
+						    struct ndp_entry, link);
+				ndp_age_entry(now_us, e);
+			}
+			spin_unlock_np(&ndp_lock);
+		}
+
+		timer_sleep(ONE_SECOND);
+	}
+}
+
+static void ndp_update(const uint8_t *daddr, struct eth_addr dhost,
+		       bool create)
+{
+	struct mbufq q;
+	int idx = hash_ip6(daddr);
+	struct ndp_entry *e;
+
+	mbufq_init(&q);
+
+	spin_lock_np(&ndp_lock);
+	e = lookup_entry(idx, daddr);
+	if (!e) {
+		if (!create) {
+			spin_unlock_np(&ndp_lock);
+			return;
+		}
+		e = create_entry(daddr);
+		if (unlikely(!e)) {
+			spin_unlock_np(&ndp_lock);
+			return;
+		}
+		rcu_hlist_add_head(&ndp_tbl[idx], &e->link);
+	}
+	e->eth = dhost;
+	e->ts = microtime();
+	store_release(&e->state, NDP_STATE_VALID);
+	mbufq_merge_to_tail(&q, &e->q);
+	spin_unlock_np(&ndp_lock);
+
+	/* drain mbufs waiting for the neighbor advertisement */
+	while (!mbufq_empty(&q)) {
+		struct mbuf *m = mbufq_pop_head(&q);
+		net_tx_eth(m, ETHTYPE_IPV6, dhost);
+	}
+}
+
+/* finds the link-layer address option of a neighbor message */
+static const struct nd_opt_lladdr *ndp_find_lladdr(struct mbuf *m,
+						   uint16_t len, uint8_t type)
+{
+	const struct nd_opt_hdr *opt;
+	unsigned int off = sizeof(struct nd_neighbor_msg);
+
+	while (off + sizeof(*opt) <= len) {
+		opt = (const struct nd_opt_hdr *)(mbuf_data(m) + off);
+		if (opt->len == 0 || off + opt->len * 8 > len)
+			return NULL;
+		if (opt->type == type && opt->len == 1)
+			return (const struct nd_opt_lladdr *)opt;
+		off += opt->len * 8;
+	}
+
+	return NULL;
+}
+
+/**
+ * net_rx_ndp - receives a neighbor solicitation or advertisement
+ * @m: the mbuf (the data pointer is at the ICMPv6 header)
+ * @ip6hdr: the IPv6 header
+ * @len: the length of the ICMPv6 message
+ */
+void net_rx_ndp(struct mbuf *m, const struct ip6_hdr *ip6hdr, uint16_t len)
+{
+	const struct nd_neighbor_msg *msg;
+	const struct nd_opt_lladdr *opt;
+	bool for_us;
+
+	/* RFC 4861 Section 7.1.1: only accept messages from this link */
+	if (len < sizeof(*msg) || ip6hdr->hop_limit != IP6_NDP_HOP_LIMIT)
+		goto out;
+	msg = (const struct nd_neighbor_msg *)mbuf_data(m);
+	if (msg->hdr.code != 0 || ip6_addr_is_multicast(msg->target))
+		goto out;
+
+	for_us = memcmp(msg->target, netcfg6.addr, IP6_ADDR_LEN) == 0 ||
+		 memcmp(msg->target, netcfg6.link_local, IP6_ADDR_LEN) == 0;
+
+	if (msg->hdr.type == ND_NEIGHBOR_SOLICIT) {
+		if (!for_us)
+			goto out;
+
+		/* duplicate address detection probes have no source */
+		if (ip6_addr_is_unspecified(ip6hdr->saddr)) {
+			log_warn_ratelimited("ndp: another host is claiming "
+					     "our address");
+			goto out;
+		}
+
+		opt = ndp_find_lladdr(m, len, ND_OPT_SOURCE_LINKADDR);
+		if (opt && !eth_addr_is_multicast(&opt->addr))
+			ndp_update(ip6hdr->saddr, opt->addr, true);
+
+		log_debug("ndp: responding to neighbor solicitation");
+		ndp_send(ND_NEIGHBOR_ADVERT, msg->target, ip6hdr->saddr,
+			 msg->target,
+			 ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE);
+	} else {
+		/* only update neighbors we were trying to reach */
+		opt = ndp_find_lladdr(m, len, ND_OPT_TARGET_LINKADDR);
+		if (!for_us && opt && !eth_addr_is_multicast(&opt->addr))
+			ndp_update(msg->target, opt->addr, false);
+	}
+
+out:
+	mbuf_free(m);
+}
+
+/**
+ * ndp_lookup - retrieve a MAC address for a given IPv6 address
+ * @daddr: the target IPv6 address
+ * @dhost_out: A buffer to store the MAC address
+ * @m: the mbuf requiring the lookup (can be NULL, otherwise must start with
+ * a network header (L3))
+ *
+ * Returns 0 and writes to @dhost_out if successful. Otherwise returns:
+ * -ENOMEM: If out of memory
+ * -EINPROGRESS: If the solicitation is still resolving. Takes ownership of @m.
+ */
+int ndp_lookup(const uint8_t *daddr, struct eth_addr *dhost_out,
+	       struct mbuf *m)
+{
+	struct ndp_entry *e, *newe = NULL;
+	int idx = hash_ip6(daddr);
+
+	/* hot-path: @daddr hits in the neighbor cache */
+	rcu_read_lock();
+	e = lookup_entry(idx, daddr);
+	if (likely(e && load_acquire(&e->state) != NDP_STATE_PROBING)) {
+		*dhost_out = e->eth;
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
+	/* cold-path: solicit a neighbor advertisement */
+	if (!e) {
+		ndp_solicit(daddr, false);
+		newe = create_entry(daddr);
+		if (!newe)
+			return -ENOMEM;
+	}
+
+	/* check again for @daddr in the cache; we own @m going forward */
+	spin_lock_np(&ndp_lock);
+	e = lookup_entry(idx, daddr);
+	if (e) {
+		/* entry already exists */
+		if (newe)
+			sfree(newe);
+		if (e->state != NDP_STATE_PROBING) {
+			*dhost_out = e->eth;
+			spin_unlock_np(&ndp_lock);
+			return 0;
+		}
+	} else if (newe) {
+		/* insert new entry */
+		e = newe;
+		rcu_hlist_add_head(&ndp_tbl[idx], &e->link);
+	}
+
+	/* enqueue the mbuf for later transmission */
+	if (m && e)
+		mbufq_push_tail(&e->q, m);
+	spin_unlock_np(&ndp_lock);
+
+	/* if the entry was removed, assume unreachable and free */
+	if (m && !e)
+		mbuf_free(m);
+
+	return -EINPROGRESS;
+}
+
+/**
+ * ndp_init - initializes the NDP subsystem
+ *
+ * Always returns 0 for success.
+ */
+int ndp_init(void)
+{
+	int i;
+
+	spin_lock_init(&ndp_lock);
+	for (i = 0; i < NDP_TABLE_CAPACITY; i++)
+		rcu_hlist_init_head(&ndp_tbl[i]);
+
+	return 0;
+}
+
+/**
+ * ndp_init_late - starts the NDP worker thread
+ *
+ * Returns 0 if successful.
+ */
+int ndp_init_late(void)
+{
+	if (!netcfg6.enabled)
+		return 0;
+
+	return thread_spawn(ndp_worker, NULL);
+}
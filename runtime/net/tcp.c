@@ -2,6 +2,7 @@
  * tcp.c - support for Transmission Control Protocol (RFC 793)
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <base/stddef.h>
@@ -34,7 +35,7 @@ void tcp_timer_update(tcpconn_t *c)
 		next_timeout = c->attach_ts + TCP_CONNECT_TIMEOUT;
 
 	if (c->ack_delayed)
-		next_timeout = MIN(next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
+		next_timeout = MIN(next_timeout, c->ack_ts + cfg_tcp_ack_delay_us);
 	if (c->zero_wnd)
 		next_timeout = MIN(next_timeout, c->zero_wnd_ts + TCP_ZERO_WND_TIMEOUT);
 
@@ -47,6 +48,8 @@ void tcp_timer_update(tcpconn_t *c)
 	if (!list_empty(&c->rxq_ooo))
 		next_timeout = MIN(next_timeout, microtime() + TCP_OOQ_ACK_TIMEOUT);
 
+	next_timeout = MIN(next_timeout, tcp_idle_next_timeout(c));
+
 	store_release(&c->next_timeout, next_timeout);
 }
 
@@ -54,6 +57,7 @@ void tcp_timer_update(tcpconn_t *c)
 static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 {
 	bool do_ack = false, do_probe = false, do_retransmit = false;
+	bool do_keepalive;
 
 	spin_lock_np(&c->lock);
 	if (unlikely(c->pcb.state == TCP_STATE_CLOSED)) {
@@ -77,7 +81,14 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		return;
 	}
 
-	if (c->ack_delayed && now - c->ack_ts >= TCP_ACK_TIMEOUT) {
+	do_keepalive = tcp_idle_handle_timeouts(c, now);
+	if (unlikely(c->pcb.state == TCP_STATE_CLOSED)) {
+		/* the peer stopped answering keepalive probes */
+		spin_unlock_np(&c->lock);
+		return;
+	}
+
+	if (c->ack_delayed && now - c->ack_ts >= cfg_tcp_ack_delay_us) {
 		log_debug("tcp: %p delayed ack timeout", c);
 		c->ack_delayed = false;
 		do_ack = true;
@@ -107,7 +118,7 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 
 	if (do_ack)
 		tcp_tx_ack(c);
-	if (do_probe)
+	if (do_probe || do_keepalive)
 		tcp_tx_probe_window(c);
 	if (do_retransmit)
 		thread_spawn(tcp_retransmit, c);
@@ -134,6 +145,9 @@ static void tcp_worker(void *arg)
 		}
 		spin_unlock_np(&tcp_lock);
 
+		/* catch ACK batches left behind by migrated softirqs */
+		tcp_ack_flush_all();
+
 		if (!again)
 			timer_sleep(10 * ONE_MS);
 	}
@@ -149,7 +163,7 @@ static void tcp_worker(void *arg)
  */
 void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 {
-	struct mbuf *m;
+	struct mbuf *m, *last = NULL;
 
 	assert_spin_lock_held(&c->lock);
 
@@ -167,7 +181,12 @@ void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq)
 
 		list_pop(&c->txq, struct mbuf, link);
 		list_add_tail(freeq, &m->link);
+		last = m;
 	}
+
+	/* sample the RTT from the most recent (last transmitted) segment */
+	if (last)
+		HIST(TCP_RTT_US, microtime() - last->timestamp);
 }
 
 /**
@@ -187,6 +206,7 @@ void tcp_conn_set_state(tcpconn_t *c, int new_state)
 	if (c->pcb.state < TCP_STATE_ESTABLISHED &&
 	    new_state >= TCP_STATE_ESTABLISHED) {
 		waitq_release(&c->tx_wq);
+		tcp_conn_poll(c, POLLEV_OUT);
 	}
 
 	tcp_debug_state_change(c, c->pcb.state, new_state);
@@ -232,7 +252,7 @@ static uint32_t tcp_scale_window(uint32_t maxwin)
  *
  * Returns a connection, or NULL if out of memory.
  */
-tcpconn_t *tcp_conn_alloc(void)
+tcpconn_t *tcp_conn_alloc(bool ipv6)
 {
 	tcpconn_t *c;
 
@@ -245,6 +265,8 @@ tcpconn_t *tcp_conn_alloc(void)
 	spin_lock_init(&c->lock);
 	kref_init(&c->ref);
 	c->err = 0;
+	c->nonblocking = false;
+	poll_trigger_init(&c->poll);
 
 	/* ingress fields */
 	c->rx_closed = false;
@@ -271,8 +293,16 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->time_wait_ts = 0;
 	c->rep_acks = 0;
 	c->acks_delayed_cnt = 0;
+	c->ack_queued = false;
+	c->rx_last_ts = 0;
 	c->zero_wnd = false;
 
+	/* idle connections */
+	c->rx_seg_ts = c->rx_data_ts = c->tx_write_ts = microtime();
+	c->keepalive = cfg_tcp_keepalive;
+	c->compacted = false;
+	c->keepalive_probes = 0;
+
 	/* initialize egress PCB */
 	c->pcb.state = TCP_STATE_CLOSED;
 	c->pcb.iss = rand_crc32c(0x12345678); /* TODO: not enough */
@@ -283,7 +313,7 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->winmax = TCP_WIN;
 	c->pcb.rcv_wscale = tcp_scale_window(TCP_WIN);
 	c->pcb.rcv_wnd = TCP_WIN;
-	c->pcb.rcv_mss = tcp_calculate_mss(net_get_mtu());
+	c->pcb.rcv_mss = tcp_calculate_mss(net_get_mtu(), ipv6);
 
 	return c;
 }
@@ -291,23 +321,19 @@ tcpconn_t *tcp_conn_alloc(void)
 /**
  * tcp_conn_attach - attaches a connection to the transport layer
  * @c: the connection to attach
- * @laddr: the local network address
+ * @laddr: the local network address (already resolved)
  * @raddr: the remote network address
  *
  * After calling this function, if successful, ingress packets and errors will
  * be delivered.
  */
-int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr, struct netaddr raddr)
+int tcp_conn_attach(tcpconn_t *c, const struct netaddr *laddr,
+		    const struct netaddr *raddr)
 {
 	int ret;
 
-	if (laddr.ip == 0)
-		 laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
-
 	trans_init_5tuple(&c->e, IPPROTO_TCP, &tcp_conn_ops, laddr, raddr);
-	if (laddr.port == 0)
+	if (laddr->port == 0)
 		ret = trans_table_add_with_ephemeral_port(&c->e);
 	else
 		ret = trans_table_add(&c->e);
@@ -365,48 +391,193 @@ void tcp_conn_release_ref(struct kref *r)
  * Support for accepting new connections
  */
 
+/*
+ * Accepted connections are queued on per-kthread shards, so the softirqs
+ * creating connections on different cores don't contend with each other or
+ * with tcp_accept(), which prefers its own shard and steals from the rest.
+ * @nr_ready counts queued connections across all shards. Sleeping accepters
+ * and poll waiters are tracked under @l. The pusher increments @nr_ready
+ * before checking for waiters, and a waiter registers before rechecking
+ * @nr_ready, so one of them always sees the other.
+ *
+ * Per-core listeners (tcp_listen_percore()) place each connection on the shard
+ * of the kthread its flow is steered to, and tcp_accept_percore() sleeps on a
+ * single shard. Since the softirq of that kthread wakes the accepter, it runs
+ * where the flow's packets arrive.
+ */
+
+struct tcpqueue_shard {
+	spinlock_t		l;
+	struct list_head	conns;
+	waitq_t			wq;
+} __aligned(CACHE_LINE_SIZE);
+
 struct tcpqueue {
 	struct trans_entry	e;
 	spinlock_t		l;
 	waitq_t			wq;
-	struct list_head	conns;
-	int			backlog;
+	atomic_t		backlog;
+	atomic_t		nr_ready;
+	atomic_t		nr_waiters;
 	bool			shutdown;
+	bool			nonblocking;
+	bool			percore;
+	poll_trigger_t		poll;
 
 	struct kref ref;
 	struct flow_registration flow;
+
+	unsigned int		nr_shards;
+	struct tcpqueue_shard	shards[];
 };
 
+/* when listeners answer SYNs with SYN cookies (TCP_SYNCOOKIES_*) */
+int cfg_tcp_syncookies = TCP_SYNCOOKIES_ON_OVERFLOW;
+
+/* reserves a backlog slot for a new connection, returns false if full */
+static bool tcp_queue_reserve(tcpqueue_t *q)
+{
+	if (likely(atomic_sub_and_fetch(&q->backlog, 1) >= 0))
+		return true;
+	atomic_inc(&q->backlog);
+	return false;
+}
+
+/* picks the shard that a new connection is queued on */
+static unsigned int tcp_queue_shard_idx(tcpqueue_t *q, tcpconn_t *c)
+{
+#ifdef DIRECTPATH
+	/* the NIC steers the flow to a fixed kthread */
+	if (q->percore && cfg_directpath_enabled) {
+		return net_ops.get_flow_affinity(IPPROTO_TCP, c->e.laddr.port,
+						 &c->e.raddr) % q->nr_shards;
+	}
+#endif
+
+	/* otherwise the flow is steered to the kthread running this softirq */
+	return get_current_affinity() % q->nr_shards;
+}
+
+/* hands a new connection to tcp_accept() */
+static void tcp_queue_push(tcpqueue_t *q, tcpconn_t *c)
+{
+	struct tcpqueue_shard *s;
+	thread_t *th;
+
+	s = &q->shards[tcp_queue_shard_idx(q, c)];
+	spin_lock_np(&s->l);
+	list_add_tail(&s->conns, &c->queue_link);
+	th = waitq_signal(&s->wq, &s->l);
+	spin_unlock_np(&s->l);
+	atomic_inc(&q->nr_ready);
+
+	/* prefer a thread accepting on this shard */
+	if (th) {
+		waitq_signal_finish(th);
+		if (likely(ACCESS_ONCE(q->poll.waiter) == NULL))
+			return;
+	}
+
+	/* otherwise wake a thread to accept the connection */
+	if (atomic_read(&q->nr_waiters) == 0 &&
+	    likely(ACCESS_ONCE(q->poll.waiter) == NULL))
+		return;
+	spin_lock_np(&q->l);
+	th = waitq_signal(&q->wq, &q->l);
+	if (unlikely(q->poll.waiter != NULL))
+		poll_trigger_events(&q->poll, POLLEV_IN);
+	spin_unlock_np(&q->l);
+	waitq_signal_finish(th);
+}
+
+/* takes a connection off a shard (with its lock held) */
+static tcpconn_t *tcp_queue_pop_shard(tcpqueue_t *q, struct tcpqueue_shard *s)
+{
+	tcpconn_t *c;
+
+	assert_spin_lock_held(&s->l);
+	c = list_pop(&s->conns, tcpconn_t, queue_link);
+	if (c) {
+		atomic_dec(&q->nr_ready);
+		atomic_inc(&q->backlog);
+	}
+	return c;
+}
+
+/* takes a connection off the queue, starting with the caller's own shard */
+static tcpconn_t *tcp_queue_pop(tcpqueue_t *q)
+{
+	struct tcpqueue_shard *s;
+	unsigned int i, idx;
+	tcpconn_t *c;
+
+	if (atomic_read(&q->nr_ready) == 0)
+		return NULL;
+
+	idx = get_current_affinity();
+	for (i = 0; i < q->nr_shards; i++) {
+		s = &q->shards[(idx + i) % q->nr_shards];
+		if (list_empty(&s->conns))
+			continue;
+		spin_lock_np(&s->l);
+		c = tcp_queue_pop_shard(q, s);
+		spin_unlock_np(&s->l);
+		if (c)
+			return c;
+	}
+
+	return NULL;
+}
+
 static void tcp_queue_recv(struct trans_entry *e, struct mbuf *m)
 {
 	tcpqueue_t *q = container_of(e, tcpqueue_t, e);
+	const struct tcp_hdr *tcphdr;
 	tcpconn_t *c;
-	thread_t *th;
+	bool syn;
 
-	/* make sure the connection queue isn't full */
-	spin_lock_np(&q->l);
-	if (unlikely(q->backlog == 0 || q->shutdown)) {
-		spin_unlock_np(&q->l);
+	if (unlikely(ACCESS_ONCE(q->shutdown)))
+		goto done;
+	if (unlikely(mbuf_length(m) < sizeof(*tcphdr)))
+		goto done;
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+	syn = (tcphdr->flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN;
+
+	/* is this the final ACK of a handshake that used a SYN cookie? */
+	if (cfg_tcp_syncookies != TCP_SYNCOOKIES_OFF &&
+	    (tcphdr->flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_ACK) {
+		if (!tcp_queue_reserve(q))
+			goto done;
+		c = tcp_rx_syncookie_ack(&e->laddr, m);
+		if (!c) {
+			atomic_inc(&q->backlog);
+			goto done;
+		}
+
+		/* completes the handshake and takes ownership of @m */
+		tcp_rx_conn(&c->e, m);
+		tcp_queue_push(q, c);
+		return;
+	}
+
+	/* otherwise, answer SYNs with cookies if the queue could overflow */
+	if (syn && cfg_tcp_syncookies == TCP_SYNCOOKIES_ALWAYS) {
+		tcp_rx_listener_syncookie(&e->laddr, m);
+		goto done;
+	}
+	if (!tcp_queue_reserve(q)) {
+		if (syn && cfg_tcp_syncookies != TCP_SYNCOOKIES_OFF)
+			tcp_rx_listener_syncookie(&e->laddr, m);
 		goto done;
 	}
-	q->backlog--;
-	spin_unlock_np(&q->l);
 
 	/* create a new connection */
-	c = tcp_rx_listener(e->laddr, m);
+	c = tcp_rx_listener(&e->laddr, m);
 	if (!c) {
-		spin_lock_np(&q->l);
-		q->backlog++;
-		spin_unlock_np(&q->l);
+		atomic_inc(&q->backlog);
 		goto done;
 	}
-
-	/* wake a thread to accept the connection */
-	spin_lock_np(&q->l);
-	list_add_tail(&q->conns, &c->queue_link);
-	th = waitq_signal(&q->wq, &q->l);
-	spin_unlock_np(&q->l);
-	waitq_signal_finish(th);
+	tcp_queue_push(q, c);
 
 done:
 	mbuf_free(m);
@@ -420,7 +591,7 @@ static const struct trans_ops tcp_queue_ops = {
 static void tcp_queue_release(struct rcu_head *h)
 {
 	tcpqueue_t *q = container_of(h, tcpqueue_t, e.rcu);
-	sfree(q);
+	free(q);
 }
 
 static void tcp_queue_release_ref(struct kref *ref)
@@ -429,43 +600,47 @@ static void tcp_queue_release_ref(struct kref *ref)
 	rcu_free(&q->e.rcu, tcp_queue_release);
 }
 
-/**
- * tcp_listen - creates a TCP listening queue for a local address
- * @laddr: the local address to listen on
- * @backlog: the maximum number of unaccepted sockets to queue
- * @q_out: a pointer to store the newly created listening queue
- *
- * Returns 0 if successful, otherwise fails.
- */
-int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+static int __tcp_listen(struct netaddr laddr, int backlog, bool percore,
+			tcpqueue_t **q_out)
 {
 	tcpqueue_t *q;
+	unsigned int i;
 	int ret;
 
 	if (backlog < 1)
 		return -EINVAL;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	/* only can support one local IP per address family so far */
+	ret = net_resolve_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
-	q = smalloc(sizeof(*q));
+	q = aligned_alloc(CACHE_LINE_SIZE,
+			  sizeof(*q) + maxks * sizeof(struct tcpqueue_shard));
 	if (!q)
 		return -ENOMEM;
 
-	trans_init_3tuple(&q->e, IPPROTO_TCP, &tcp_queue_ops, laddr);
+	trans_init_3tuple(&q->e, IPPROTO_TCP, &tcp_queue_ops, &laddr);
 	spin_lock_init(&q->l);
 	waitq_init(&q->wq);
-	list_head_init(&q->conns);
-	q->backlog = backlog;
+	atomic_write(&q->backlog, backlog);
+	atomic_write(&q->nr_ready, 0);
+	atomic_write(&q->nr_waiters, 0);
 	q->shutdown = false;
+	q->nonblocking = false;
+	q->percore = percore;
+	poll_trigger_init(&q->poll);
 	kref_init(&q->ref);
+	q->nr_shards = maxks;
+	for (i = 0; i < q->nr_shards; i++) {
+		spin_lock_init(&q->shards[i].l);
+		list_head_init(&q->shards[i].conns);
+		waitq_init(&q->shards[i].wq);
+	}
 
 	ret = trans_table_add(&q->e);
 	if (ret) {
-		sfree(q);
+		free(q);
 		return ret;
 	}
 
@@ -480,6 +655,37 @@ int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
 	return 0;
 }
 
+/**
+ * tcp_listen - creates a TCP listening queue for a local address
+ * @laddr: the local address to listen on
+ * @backlog: the maximum number of unaccepted sockets to queue
+ * @q_out: a pointer to store the newly created listening queue
+ *
+ * Returns 0 if successful, otherwise fails.
+ */
+int tcp_listen(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+{
+	return __tcp_listen(laddr, backlog, false, q_out);
+}
+
+/**
+ * tcp_listen_percore - creates a TCP listening queue with per-core accepts
+ * @laddr: the local address to listen on
+ * @backlog: the maximum number of unaccepted sockets to queue
+ * @q_out: a pointer to store the newly created listening queue
+ *
+ * Each connection is queued for the kthread its flow is steered to, and can be
+ * taken with tcp_accept_percore() for that kthread's index (from zero to
+ * runtime_max_cores() - 1). Run one accepter per index so no connection is
+ * left waiting; tcp_accept() still takes connections from any core.
+ *
+ * Returns 0 if successful, otherwise fails.
+ */
+int tcp_listen_percore(struct netaddr laddr, int backlog, tcpqueue_t **q_out)
+{
+	return __tcp_listen(laddr, backlog, true, q_out);
+}
+
 /**
  * tcp_accept - accepts a TCP connection
  * @q: the listen queue to accept the connection on
@@ -491,21 +697,75 @@ int tcp_accept(tcpqueue_t *q, tcpconn_t **c_out)
 {
 	tcpconn_t *c;
 
-	spin_lock_np(&q->l);
-	while (list_empty(&q->conns) && !q->shutdown)
-		waitq_wait(&q->wq, &q->l);
+	while (true) {
+		c = tcp_queue_pop(q);
+		if (c)
+			break;
+
+		spin_lock_np(&q->l);
+		atomic_inc(&q->nr_waiters);
+		if (atomic_read(&q->nr_ready) > 0) {
+			/* lost a race with a new connection, try again */
+			atomic_dec(&q->nr_waiters);
+			spin_unlock_np(&q->l);
+			continue;
+		}
 
-	/* was the queue drained and shutdown? */
-	if (list_empty(&q->conns) && q->shutdown) {
+		/* was the queue drained and shutdown? */
+		if (q->shutdown) {
+			atomic_dec(&q->nr_waiters);
+			spin_unlock_np(&q->l);
+			return -EPIPE;
+		}
+		if (q->nonblocking) {
+			atomic_dec(&q->nr_waiters);
+			spin_unlock_np(&q->l);
+			return -EAGAIN;
+		}
+
+		waitq_wait(&q->wq, &q->l);
+		atomic_dec(&q->nr_waiters);
 		spin_unlock_np(&q->l);
-		return -EPIPE;
 	}
 
-	/* otherwise a new connection is available */
-	q->backlog++;
-	c = list_pop(&q->conns, tcpconn_t, queue_link);
-	assert(c != NULL);
-	spin_unlock_np(&q->l);
+	*c_out = c;
+	return 0;
+}
+
+/**
+ * tcp_accept_percore - accepts a TCP connection steered to a given kthread
+ * @q: the listen queue to accept the connection on
+ * @idx: the kthread index (less than runtime_max_cores())
+ * @c_out: a pointer to store the connection
+ *
+ * Unlike tcp_accept(), only connections queued for kthread @idx are returned.
+ * This is meant for queues created with tcp_listen_percore().
+ *
+ * Returns 0 if successful, otherwise -EPIPE if the listen queue was closed.
+ */
+int tcp_accept_percore(tcpqueue_t *q, unsigned int idx, tcpconn_t **c_out)
+{
+	struct tcpqueue_shard *s;
+	tcpconn_t *c;
+
+	if (idx >= q->nr_shards)
+		return -EINVAL;
+	s = &q->shards[idx];
+
+	spin_lock_np(&s->l);
+	while (!(c = tcp_queue_pop_shard(q, s))) {
+		/* tcp_qshutdown() takes the shard lock after setting the flag */
+		if (ACCESS_ONCE(q->shutdown)) {
+			spin_unlock_np(&s->l);
+			return -EPIPE;
+		}
+		if (ACCESS_ONCE(q->nonblocking)) {
+			spin_unlock_np(&s->l);
+			return -EAGAIN;
+		}
+		waitq_wait(&s->wq, &s->l);
+	}
+	spin_unlock_np(&s->l);
 
 	*c_out = c;
 	return 0;
@@ -517,6 +777,8 @@ static void __tcp_qshutdown(tcpqueue_t *q)
 	spin_lock_np(&q->l);
 	BUG_ON(q->shutdown);
 	q->shutdown = true;
+	if (q->poll.waiter)
+		poll_trigger_events(&q->poll, POLLEV_HUP);
 	spin_unlock_np(&q->l);
 
 	/* prevent ingress receive and error dispatch (after RCU period) */
@@ -533,11 +795,21 @@ static void __tcp_qshutdown(tcpqueue_t *q)
  */
 void tcp_qshutdown(tcpqueue_t *q)
 {
+	struct list_head waiters;
+	unsigned int i;
+
 	/* shutdown the listen queue */
 	__tcp_qshutdown(q);
 
 	/* wake up all pending threads */
 	waitq_release(&q->wq);
+	list_head_init(&waiters);
+	for (i = 0; i < q->nr_shards; i++) {
+		spin_lock_np(&q->shards[i].l);
+		waitq_release_start(&q->shards[i].wq, &waiters);
+		spin_unlock_np(&q->shards[i].l);
+	}
+	waitq_release_finish(&waiters);
 }
 
 /**
@@ -550,16 +822,25 @@ void tcp_qshutdown(tcpqueue_t *q)
 void tcp_qclose(tcpqueue_t *q)
 {
 	tcpconn_t *c, *nextc;
+	unsigned int i;
 
 	if (!q->shutdown)
 		__tcp_qshutdown(q);
 
 	BUG_ON(!waitq_empty(&q->wq));
+	for (i = 0; i < q->nr_shards; i++)
+		BUG_ON(!waitq_empty(&q->shards[i].wq));
+	if (q->poll.waiter)
+		tcp_qpoll_disarm(q);
 
 	/* free all pending connections */
-	list_for_each_safe(&q->conns, c, nextc, queue_link) {
-		list_del_from(&q->conns, &c->queue_link);
-		tcp_conn_destroy(c);
+	for (i = 0; i < q->nr_shards; i++) {
+		struct tcpqueue_shard *s = &q->shards[i];
+
+		list_for_each_safe(&s->conns, c, nextc, queue_link) {
+			list_del_from(&s->conns, &c->queue_link);
+			tcp_conn_destroy(c);
+		}
 	}
 
 	kref_put(&q->ref, tcp_queue_release_ref);
@@ -584,8 +865,12 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 	tcpconn_t *c;
 	int ret;
 
+	ret = net_resolve_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
+
 	/* create and initialize a connection */
-	c = tcp_conn_alloc();
+	c = tcp_conn_alloc(netaddr_is_ipv6(&raddr));
 	if (unlikely(!c))
 		return -ENOMEM;
 
@@ -593,7 +878,7 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 	 * Attach the connection to the transport layer. From this point onward
 	 * ingress packets can be dispatched to the connection.
 	 */
-	ret = tcp_conn_attach(c, laddr, raddr);
+	ret = tcp_conn_attach(c, &laddr, &raddr);
 	if (unlikely(ret)) {
 		sfree(c);
 		return ret;
@@ -646,7 +931,7 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 int tcp_dial_conn_affinity(tcpconn_t *in, struct netaddr raddr, tcpconn_t **c_out)
 {
 	uint32_t in_aff = net_ops.get_flow_affinity(
-			  IPPROTO_TCP, in->e.laddr.port, in->e.raddr);
+			  IPPROTO_TCP, in->e.laddr.port, &in->e.raddr);
 	return tcp_dial_affinity(in_aff, raddr, c_out);
 }
 
@@ -674,7 +959,7 @@ int tcp_dial_affinity(uint32_t in_aff, struct netaddr raddr, tcpconn_t **c_out)
 
 	while (true) {
 		do {
-			out_aff = net_ops.get_flow_affinity(IPPROTO_TCP, ++base_port, raddr);
+			out_aff = net_ops.get_flow_affinity(IPPROTO_TCP, ++base_port, &raddr);
 			if (base_port == start_port)
 				return -EAGAIN;
 		} while (out_aff != in_aff || base_port == 0);
@@ -719,8 +1004,13 @@ static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 	spin_lock_np(&c->lock);
 
 	/* block until there is an actionable event */
-	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq)))
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->rx_wq, &c->lock);
+	}
 
 	/* is the socket closed? */
 	if (c->rx_closed) {
@@ -775,6 +1065,8 @@ static void tcp_read_finish(tcpconn_t *c, struct mbuf *m)
 	spin_lock_np(&c->lock);
 	c->rx_exclusive = false;
 	waitq_release_start(&c->rx_wq, &waiters);
+	if (!list_empty(&c->rxq))
+		tcp_conn_poll(c, POLLEV_IN);
 	spin_unlock_np(&c->lock);
 	waitq_release_finish(&waiters);
 }
@@ -930,6 +1222,10 @@ static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 			c->zero_wnd_ts = microtime();
 			tcp_timer_update(c);
 		}
+		if (c->nonblocking) {
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->tx_wq, &c->lock);
 	}
 	c->zero_wnd = false;
@@ -963,11 +1259,13 @@ static void tcp_write_finish(tcpconn_t *c)
 
 	spin_lock_np(&c->lock);
 	c->tx_exclusive = false;
+	c->tx_write_ts = microtime();
+	c->compacted = false;
 	tcp_conn_ack(c, &q);
 	if (c->pcb.rcv_nxt == c->tx_last_ack) /* race condition check */
 		c->ack_delayed = false;
 	else
-		c->ack_ts = microtime();
+		c->ack_ts = c->tx_write_ts;
 	if (c->pcb.state == TCP_STATE_CLOSED) {
 		list_append_list(&q, &c->txq);
 		if (c->tx_pending) {
@@ -1097,6 +1395,7 @@ void tcp_conn_fail(tcpconn_t *c, int err)
 		c->tx_closed = true;
 		waitq_release(&c->tx_wq);
 	}
+	tcp_conn_poll(c, POLLEV_ERR | POLLEV_HUP);
 
 	/* will be freed by the writer if one is busy */
 	if (!c->tx_exclusive) {
@@ -1129,6 +1428,7 @@ void tcp_conn_shutdown_rx(tcpconn_t *c)
 
 	c->rx_closed = true;
 	waitq_release(&c->rx_wq);
+	tcp_conn_poll(c, POLLEV_IN | POLLEV_HUP);
 }
 
 static int tcp_conn_shutdown_tx(tcpconn_t *c)
@@ -1216,7 +1516,7 @@ void tcp_abort(tcpconn_t *c)
 
 	snd_nxt = c->pcb.snd_nxt;
 	spin_unlock_np(&c->lock);
-	tcp_tx_raw_rst(l, r, snd_nxt);
+	tcp_tx_raw_rst(&l, &r, snd_nxt);
 }
 
 /**
@@ -1233,6 +1533,8 @@ void tcp_close(tcpconn_t *c)
 
 	spin_lock_np(&c->lock);
 	BUG_ON(!waitq_empty(&c->rx_wq));
+	if (c->poll.waiter)
+		poll_disarm(&c->poll);
 	ret = tcp_conn_shutdown_tx(c);
 	if (ret)
 		tcp_conn_fail(c, -ret);
@@ -1242,6 +1544,136 @@ void tcp_close(tcpconn_t *c)
 	tcp_conn_put(c);
 }
 
+/**
+ * tcp_set_nonblocking - makes reads and writes fail instead of blocking
+ * @c: the TCP connection
+ * @nonblocking: if true, tcp_read(), tcp_write() and friends return -EAGAIN
+ * instead of waiting
+ */
+void tcp_set_nonblocking(tcpconn_t *c, bool nonblocking)
+{
+	spin_lock_np(&c->lock);
+	c->nonblocking = nonblocking;
+	spin_unlock_np(&c->lock);
+}
+
+static unsigned int tcp_conn_poll_ready(tcpconn_t *c)
+{
+	unsigned int events = 0;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (c->rx_closed || !list_empty(&c->rxq))
+		events |= POLLEV_IN;
+	if (c->rx_closed)
+		events |= POLLEV_HUP;
+	if (c->err)
+		events |= POLLEV_ERR;
+	if (c->tx_closed ||
+	    (c->pcb.state >= TCP_STATE_ESTABLISHED && !tcp_is_snd_full(c)))
+		events |= POLLEV_OUT;
+
+	return events;
+}
+
+/**
+ * tcp_poll_arm - registers a TCP connection with a poll waiter
+ * @c: the TCP connection
+ * @w: the poll waiter
+ * @mask: the events of interest (POLLEV_*)
+ * @data: the data to report with events
+ *
+ * Events that are already pending are reported immediately. Afterwards, events
+ * are only reported on transitions (edge-triggered).
+ */
+void tcp_poll_arm(tcpconn_t *c, poll_waiter_t *w, unsigned int mask,
+		  unsigned long data)
+{
+	spin_lock_np(&c->lock);
+	poll_arm_events(w, &c->poll, mask, data);
+	tcp_conn_poll(c, tcp_conn_poll_ready(c));
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * tcp_poll_disarm - unregisters a TCP connection from its poll waiter
+ * @c: the TCP connection
+ */
+void tcp_poll_disarm(tcpconn_t *c)
+{
+	spin_lock_np(&c->lock);
+	poll_disarm(&c->poll);
+	spin_unlock_np(&c->lock);
+}
+
+/**
+ * tcp_qset_nonblocking - makes accepts fail instead of blocking
+ * @q: the TCP listener queue
+ * @nonblocking: if true, tcp_accept() returns -EAGAIN instead of waiting
+ */
+void tcp_qset_nonblocking(tcpqueue_t *q, bool nonblocking)
+{
+	spin_lock_np(&q->l);
+	q->nonblocking = nonblocking;
+	spin_unlock_np(&q->l);
+}
+
+/**
+ * tcp_qpoll_arm - registers a TCP listener queue with a poll waiter
+ * @q: the TCP listener queue
+ * @w: the poll waiter
+ * @mask: the events of interest (POLLEV_*)
+ * @data: the data to report with events
+ *
+ * POLLEV_IN is reported when connections are ready to be accepted, and
+ * POLLEV_HUP when the queue is shut down.
+ */
+void tcp_qpoll_arm(tcpqueue_t *q, poll_waiter_t *w, unsigned int mask,
+		   unsigned long data)
+{
+	unsigned int events = 0;
+
+	spin_lock_np(&q->l);
+	poll_arm_events(w, &q->poll, mask, data);
+	/* pairs with tcp_queue_push(), which checks for waiters unlocked */
+	mb();
+	if (atomic_read(&q->nr_ready) > 0)
+		events |= POLLEV_IN;
+	if (q->shutdown)
+		events |= POLLEV_HUP;
+	if (events)
+		poll_trigger_events(&q->poll, events);
+	spin_unlock_np(&q->l);
+}
+
+/**
+ * tcp_qpoll_disarm - unregisters a TCP listener queue from its poll waiter
+ * @q: the TCP listener queue
+ */
+void tcp_qpoll_disarm(tcpqueue_t *q)
+{
+	spin_lock_np(&q->l);
+	poll_disarm(&q->poll);
+	spin_unlock_np(&q->l);
+}
+
+/**
+ * tcp_init - initializes SYN cookies and ACK batching
+ *
+ * Returns 0 if successful.
+ */
+int tcp_init(void)
+{
+	int ret;
+
+	ret = tcp_syncookie_init();
+	if (ret)
+		return ret;
+
+	tcp_ack_init();
+	return 0;
+}
+
 /**
  * tcp_init_late - starts the TCP worker thread
  *
@@ -18,12 +18,16 @@
 /* adjustable constants */
 #define TCP_MIN_MSS		88
 #define TCP_WIN			0x1FFFF
-#define TCP_ACK_TIMEOUT		(10 * ONE_MS)
+#define TCP_ACK_TIMEOUT		(10 * ONE_MS) /* default, see tcp_ack_delay_us */
 #define TCP_CONNECT_TIMEOUT	(5 * ONE_SECOND) /* FIXME */
 #define TCP_OOQ_ACK_TIMEOUT	(300 * ONE_MS)
 #define TCP_TIME_WAIT_TIMEOUT	(1 * ONE_SECOND) /* FIXME: should be 8 minutes */
 #define TCP_ZERO_WND_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
 #define TCP_RETRANSMIT_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
+#define TCP_KEEPALIVE_IDLE	(7200UL * ONE_SECOND) /* default, see tcp_keepalive_idle_us */
+#define TCP_KEEPALIVE_INTVL	(75 * ONE_SECOND) /* default, see tcp_keepalive_intvl_us */
+#define TCP_KEEPALIVE_PROBES	9 /* default, see tcp_keepalive_probes */
+#define TCP_IDLE_COMPACT_TIMEOUT (1 * ONE_SECOND) /* default, see tcp_idle_compact_us */
 #define TCP_FAST_RETRANSMIT_THRESH 3
 #define TCP_OOO_MAX_SIZE	2048
 #define TCP_RETRANSMIT_BATCH	16
@@ -31,9 +35,12 @@
 /**
  * tcp_calculate_mss - given an ethernet MTU, returns the TCP MSS
  * @mtu: the ethernet mtu
+ * @ipv6: true if the connection runs over IPv6
  */
-static inline unsigned int tcp_calculate_mss(unsigned int mtu)
+static inline unsigned int tcp_calculate_mss(unsigned int mtu, bool ipv6)
 {
+	if (ipv6)
+		return mtu - sizeof(struct ip6_hdr) - sizeof(struct tcp_hdr);
 	return mtu - sizeof(struct ip_hdr) - sizeof(struct tcp_hdr);
 }
 
@@ -90,6 +97,8 @@ struct tcpconn {
 	struct kref		ref;
 	int			err; /* error code for read(), write(), etc. */
 	uint32_t		winmax; /* initial receive window size */
+	bool			nonblocking;
+	poll_trigger_t		poll;
 
 	/* ingress path */
 	unsigned int		rx_closed:1;
@@ -120,13 +129,24 @@ struct tcpconn {
 	};
 	bool			zero_wnd;
 	bool			ack_delayed;
+	bool			ack_queued;
 	int			rep_acks;
 	int			acks_delayed_cnt;
+	uint64_t		rx_last_ts;
+	struct list_node	ack_link;
+
+	/* idle connections */
+	uint64_t		rx_seg_ts; /* when the last segment arrived */
+	uint64_t		rx_data_ts; /* when the last data or FIN arrived */
+	uint64_t		tx_write_ts; /* when the app last wrote */
+	bool			keepalive;
+	bool			compacted;
+	unsigned int		keepalive_probes;
 };
 
-extern tcpconn_t *tcp_conn_alloc(void);
-extern int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr,
-			   struct netaddr raddr);
+extern tcpconn_t *tcp_conn_alloc(bool ipv6);
+extern int tcp_conn_attach(tcpconn_t *c, const struct netaddr *laddr,
+			   const struct netaddr *raddr);
 extern void tcp_conn_ack(tcpconn_t *c, struct list_head *freeq);
 extern void tcp_conn_set_state(tcpconn_t *c, int new_state);
 extern void tcp_conn_fail(tcpconn_t *c, int err);
@@ -172,23 +192,70 @@ struct tcp_options {
  */
 
 extern void tcp_rx_conn(struct trans_entry *e, struct mbuf *m);
-extern tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m);
+extern tcpconn_t *tcp_rx_listener(const struct netaddr *laddr,
+				  struct mbuf *m);
+extern void tcp_rx_listener_syncookie(const struct netaddr *laddr,
+				      struct mbuf *m);
+extern tcpconn_t *tcp_rx_syncookie_ack(const struct netaddr *laddr,
+				       struct mbuf *m);
+
+
+/*
+ * ACK policy
+ */
+
+enum {
+	TCP_ACK_DELAY = 0,	/* wait for data or the delayed ACK timer */
+	TCP_ACK_BATCH,		/* ACK at the end of the RX batch */
+	TCP_ACK_NOW,		/* ACK immediately */
+};
+
+extern int tcp_rx_ack_policy(tcpconn_t *c);
+extern void tcp_ack_batch_add(tcpconn_t *c);
+extern void tcp_ack_flush_all(void);
+extern void tcp_ack_init(void);
+
+
+/*
+ * Idle connections
+ */
+
+extern uint64_t tcp_idle_next_timeout(tcpconn_t *c);
+extern bool tcp_idle_handle_timeouts(tcpconn_t *c, uint64_t now);
+
+
+/*
+ * SYN cookies
+ */
+
+extern tcp_seq tcp_syncookie_make(const struct netaddr *laddr,
+				  const struct netaddr *raddr, tcp_seq seq,
+				  uint16_t *mss);
+extern uint16_t tcp_syncookie_check(const struct netaddr *laddr,
+				    const struct netaddr *raddr, tcp_seq seq,
+				    tcp_seq cookie);
+extern int tcp_syncookie_init(void);
 
 
 /*
  * egress path
  */
 
-extern int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr,
-			  tcp_seq seq);
-extern int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
-			      tcp_seq seq, tcp_seq ack);
+extern int tcp_tx_raw_rst(const struct netaddr *laddr,
+			  const struct netaddr *raddr, tcp_seq seq);
+extern int tcp_tx_raw_rst_ack(const struct netaddr *laddr,
+			      const struct netaddr *raddr, tcp_seq seq,
+			      tcp_seq ack);
+extern int tcp_tx_raw_synack(const struct netaddr *laddr,
+			     const struct netaddr *raddr, tcp_seq seq,
+			     tcp_seq ack, uint16_t mss);
 extern int tcp_tx_ack(tcpconn_t *c);
 extern int tcp_tx_probe_window(tcpconn_t *c);
 extern int tcp_tx_ctl(tcpconn_t *c, uint8_t flags,
 		      const struct tcp_options *opts);
 extern ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len,
 			   bool push);
+extern void tcp_tx_flush_pending(tcpconn_t *c);
 extern void tcp_tx_retransmit(tcpconn_t *c);
 extern struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c);
 extern void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m);
@@ -219,6 +286,21 @@ static inline bool tcp_is_snd_full(tcpconn_t *c)
 	return wraps_lte(c->pcb.snd_una + c->pcb.snd_wnd, c->pcb.snd_nxt);
 }
 
+/**
+ * tcp_conn_poll - notifies a poll waiter (if armed) of connection events
+ * @c: the TCP connection
+ * @events: the events that occurred (POLLEV_*)
+ *
+ * The caller must hold @c's lock.
+ */
+static inline void tcp_conn_poll(tcpconn_t *c, unsigned int events)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (unlikely(ACCESS_ONCE(c->poll.waiter) != NULL))
+		poll_trigger_events(&c->poll, events);
+}
+
 
 /*
  * debugging
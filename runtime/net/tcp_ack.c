@@ -0,0 +1,179 @@
+/*
+ * tcp_ack.c - the policy for acknowledging in-order TCP data
+ *
+ * In-order segments are acknowledged according to a configurable policy:
+ * - the first segment after an idle period can be ACKed immediately
+ *   ("tcp_quickack_idle_us"), so the sender's congestion window opens quickly.
+ * - otherwise one ACK is sent every "tcp_ack_stretch" segments, or once a
+ *   quarter of the receive window is unacknowledged, whichever comes first.
+ * - no ACK is sent while the application is writing to the connection, since
+ *   its segments will carry the acknowledgement ("tcp_ack_piggyback").
+ * - ACKs that are due are held until the end of the RX softirq batch, so a
+ *   burst of segments for one connection produces a single ACK
+ *   ("tcp_ack_coalesce").
+ * Anything left unacknowledged is ACKed after "tcp_ack_delay_us".
+ *
+ * Out-of-order segments, window updates and control segments still trigger
+ * immediate ACKs, as the sender's loss recovery depends on them.
+ */
+
+#include <base/stddef.h>
+#include <runtime/thread.h>
+
+#include "tcp.h"
+#include "defs.h"
+
+uint64_t cfg_tcp_ack_delay_us = TCP_ACK_TIMEOUT;
+unsigned int cfg_tcp_ack_stretch = 2;
+uint64_t cfg_tcp_quickack_idle_us;
+bool cfg_tcp_ack_piggyback = true;
+bool cfg_tcp_ack_coalesce = true;
+
+/* connections with an ACK due at the end of a kthread's RX batch */
+struct tcp_ack_batch {
+	spinlock_t		lock;
+	struct list_head	conns;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct tcp_ack_batch ack_batches[NCPU];
+
+/**
+ * tcp_rx_ack_policy - decides how to acknowledge in-order data
+ * @c: the connection that received the data (its lock must be held)
+ *
+ * Call after advancing rcv_nxt. If TCP_ACK_DELAY is returned, the delayed ACK
+ * timer has been armed.
+ *
+ * Returns TCP_ACK_NOW, TCP_ACK_BATCH (see tcp_ack_batch_add()) or
+ * TCP_ACK_DELAY.
+ */
+int tcp_rx_ack_policy(tcpconn_t *c)
+{
+	uint64_t now = microtime();
+	bool idle;
+
+	assert_spin_lock_held(&c->lock);
+
+	/* quick-ACK the first segment after an idle period */
+	idle = cfg_tcp_quickack_idle_us &&
+	       now - c->rx_last_ts >= cfg_tcp_quickack_idle_us;
+	c->rx_last_ts = now;
+	if (idle)
+		return TCP_ACK_NOW;
+
+	if (++c->acks_delayed_cnt >= cfg_tcp_ack_stretch ||
+	    wraps_gte(c->pcb.rcv_nxt, c->tx_last_ack + c->winmax / 4)) {
+		/* a response being sent right now will carry the ACK */
+		if (!cfg_tcp_ack_piggyback || !c->tx_exclusive)
+			return cfg_tcp_ack_coalesce ? TCP_ACK_BATCH : TCP_ACK_NOW;
+	}
+
+	if (!c->ack_delayed) {
+		c->ack_delayed = true;
+		c->ack_ts = now;
+	}
+	return TCP_ACK_DELAY;
+}
+
+/**
+ * tcp_ack_batch_add - sends an ACK at the end of the current RX batch
+ * @c: the connection to acknowledge (its lock must be held)
+ */
+void tcp_ack_batch_add(tcpconn_t *c)
+{
+	struct tcp_ack_batch *b;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (c->ack_queued) {
+		STAT(TCP_ACKS_COALESCED)++;
+		return;
+	}
+
+	/* the delayed ACK timer covers a batch that is flushed late */
+	if (!c->ack_delayed) {
+		c->ack_delayed = true;
+		c->ack_ts = microtime();
+	}
+
+	c->ack_queued = true;
+	tcp_conn_get(c);
+	b = &ack_batches[get_current_affinity()];
+	spin_lock(&b->lock);
+	list_add_tail(&b->conns, &c->ack_link);
+	spin_unlock(&b->lock);
+}
+
+static void tcp_ack_batch_flush(struct tcp_ack_batch *b)
+{
+	struct list_head conns;
+	tcpconn_t *c;
+	bool do_ack;
+
+	if (list_empty(&b->conns))
+		return;
+
+	list_head_init(&conns);
+	spin_lock_np(&b->lock);
+	list_append_list(&conns, &b->conns);
+	spin_unlock_np(&b->lock);
+
+	while ((c = list_pop(&conns, tcpconn_t, ack_link)) != NULL) {
+		spin_lock_np(&c->lock);
+		c->ack_queued = false;
+
+		/* the ACK may have already gone out with data */
+		do_ack = c->pcb.state != TCP_STATE_CLOSED &&
+			 c->pcb.rcv_nxt != c->tx_last_ack;
+		if (do_ack) {
+			c->ack_delayed = false;
+			c->acks_delayed_cnt = 0;
+		} else {
+			STAT(TCP_ACKS_COALESCED)++;
+		}
+		spin_unlock_np(&c->lock);
+
+		if (do_ack)
+			tcp_tx_ack(c);
+		tcp_conn_put(c);
+	}
+}
+
+/**
+ * tcp_ack_flush - sends the ACKs held for the end of an RX batch
+ *
+ * Called by the RX softirq after each batch of packets.
+ */
+void tcp_ack_flush(void)
+{
+	unsigned int idx;
+
+	/* the batch may move if the softirq was migrated, then it's caught
+	 * by the TCP worker */
+	idx = get_current_affinity();
+	tcp_ack_batch_flush(&ack_batches[idx]);
+}
+
+/**
+ * tcp_ack_flush_all - sends the ACKs held by every kthread
+ */
+void tcp_ack_flush_all(void)
+{
+	int i;
+
+	for (i = 0; i < maxks; i++)
+		tcp_ack_batch_flush(&ack_batches[i]);
+}
+
+/**
+ * tcp_ack_init - initializes the ACK batches
+ */
+void tcp_ack_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		spin_lock_init(&ack_batches[i].lock);
+		list_head_init(&ack_batches[i].conns);
+	}
+}
@@ -62,37 +62,31 @@ static void tcp_flags_to_str(uint8_t flags, char *str)
 static void tcp_dump_pkt(tcpconn_t *c, const struct tcp_hdr *tcphdr,
 			 uint32_t len, bool egress)
 {
-	char in_ip[IP_ADDR_STR_LEN];
-	char out_ip[IP_ADDR_STR_LEN];
+	char in_addr[NETADDR_STR_LEN];
+	char out_addr[NETADDR_STR_LEN];
 	char flags[TCP_FLAG_STR_LEN];
 	uint32_t ack, seq;
-	uint16_t in_port, out_port;
 	uint16_t wnd;
 
 	wnd = ntoh16(tcphdr->win);
 
 	if (egress) {
-		ip_addr_to_str(c->e.laddr.ip, in_ip);
-		ip_addr_to_str(c->e.raddr.ip, out_ip);
+		netaddr_to_str(c->e.laddr, in_addr);
+		netaddr_to_str(c->e.raddr, out_addr);
 		ack = ntoh32(tcphdr->ack) - c->pcb.irs;
 		seq = ntoh32(tcphdr->seq) - c->pcb.iss;
-		in_port = c->e.laddr.port;
-		out_port = c->e.raddr.port;
 	} else {
-		ip_addr_to_str(c->e.laddr.ip, out_ip);
-		ip_addr_to_str(c->e.raddr.ip, in_ip);
+		netaddr_to_str(c->e.laddr, out_addr);
+		netaddr_to_str(c->e.raddr, in_addr);
 		ack = ntoh32(tcphdr->ack) - c->pcb.iss;
 		seq = ntoh32(tcphdr->seq) - c->pcb.irs;
-		out_port = c->e.laddr.port;
-		in_port = c->e.raddr.port;
 	}
 
 	tcp_flags_to_str(tcphdr->flags, flags);
 
-	log_debug("tcp: %p %s:%hu -> %s:%hu "
+	log_debug("tcp: %p %s -> %s "
 		  "FLAGS=%s SEQ=ISS+%u ACK=IRS+%u WND=%u LEN=%u",
-		  c, in_ip, in_port, out_ip, out_port,
-		  flags, seq, ack, wnd, len); 
+		  c, in_addr, out_addr, flags, seq, ack, wnd, len); 
 
 }
 
@@ -0,0 +1,177 @@
+/*
+ * tcp_idle.c - keepalive probes and memory compaction for idle TCP connections
+ *
+ * A connection is idle when no data has been received and the application
+ * hasn't written anything (keepalive probes and bare ACKs don't count). After
+ * "tcp_idle_compact_us" of idleness, it gives back buffer memory that it no
+ * longer needs to hold on to:
+ * - a partially filled segment kept back for coalescing small writes
+ *   (@tx_pending) is transmitted, instead of holding sequence space that the
+ *   peer will never see.
+ * - in-order data not yet read by the application is copied out of its
+ *   per-packet buffers into a single buffer sized to fit.
+ * Unacknowledged segments stay queued, as they are needed for retransmission.
+ *
+ * Connections with keepalive enabled (see tcp_set_keepalive() and
+ * "tcp_keepalive") probe the peer once nothing has been received for
+ * "tcp_keepalive_idle_us", and then every "tcp_keepalive_intvl_us". The
+ * connection fails with ETIMEDOUT after "tcp_keepalive_probes" unanswered
+ * probes.
+ */
+
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/smalloc.h>
+
+#include "tcp.h"
+#include "defs.h"
+
+bool cfg_tcp_keepalive;
+uint64_t cfg_tcp_keepalive_idle_us = TCP_KEEPALIVE_IDLE;
+uint64_t cfg_tcp_keepalive_intvl_us = TCP_KEEPALIVE_INTVL;
+unsigned int cfg_tcp_keepalive_probes = TCP_KEEPALIVE_PROBES;
+uint64_t cfg_tcp_idle_compact_us = TCP_IDLE_COMPACT_TIMEOUT;
+
+static bool tcp_keepalive_active(tcpconn_t *c)
+{
+	return c->keepalive && c->pcb.state >= TCP_STATE_ESTABLISHED &&
+	       c->pcb.state <= TCP_STATE_CLOSE_WAIT;
+}
+
+static uint64_t tcp_keepalive_deadline(tcpconn_t *c)
+{
+	return c->rx_seg_ts + cfg_tcp_keepalive_idle_us +
+	       c->keepalive_probes * cfg_tcp_keepalive_intvl_us;
+}
+
+static uint64_t tcp_compact_deadline(tcpconn_t *c)
+{
+	return MAX(c->rx_data_ts, c->tx_write_ts) + cfg_tcp_idle_compact_us;
+}
+
+static bool tcp_compact_active(tcpconn_t *c)
+{
+	return cfg_tcp_idle_compact_us && !c->compacted &&
+	       c->pcb.state >= TCP_STATE_ESTABLISHED;
+}
+
+/* copies the unread in-order data into a single buffer */
+static void tcp_rxq_compact(tcpconn_t *c)
+{
+	struct mbuf *m, *cm;
+	unsigned int len = 0;
+	int nr = 0;
+
+	list_for_each(&c->rxq, m, link) {
+		/* leave the FIN in place for the reader */
+		if (m->flags & TCP_FIN)
+			break;
+		len += mbuf_length(m);
+		nr++;
+	}
+	if (nr < 2)
+		return;
+
+	cm = smalloc(len + MBUF_HEAD_LEN);
+	if (unlikely(!cm))
+		return;
+	mbuf_init(cm, (unsigned char *)cm + MBUF_HEAD_LEN, len, 0);
+	cm->release = (void (*)(struct mbuf *))sfree;
+	cm->seg_seq = list_top(&c->rxq, struct mbuf, link)->seg_seq;
+	cm->flags = 0;
+
+	while (nr--) {
+		m = list_pop(&c->rxq, struct mbuf, link);
+		memcpy(mbuf_put(cm, mbuf_length(m)), mbuf_data(m),
+		       mbuf_length(m));
+		cm->seg_end = m->seg_end;
+		cm->flags |= m->flags;
+		mbuf_free(m);
+	}
+
+	list_add(&c->rxq, &cm->link);
+}
+
+/* releases the buffers an idle connection doesn't need */
+static void tcp_conn_compact(tcpconn_t *c)
+{
+	log_debug("tcp: %p idle compaction", c);
+	c->compacted = true;
+	STAT(TCP_IDLE_COMPACTIONS)++;
+
+	/* skip anything a reader or writer currently owns */
+	if (!c->tx_exclusive)
+		tcp_tx_flush_pending(c);
+	if (!c->rx_exclusive)
+		tcp_rxq_compact(c);
+}
+
+/**
+ * tcp_idle_next_timeout - returns when the next idle timeout is due
+ * @c: the connection (its lock must be held)
+ */
+uint64_t tcp_idle_next_timeout(tcpconn_t *c)
+{
+	uint64_t next_timeout = -1L;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (tcp_compact_active(c))
+		next_timeout = tcp_compact_deadline(c);
+	if (tcp_keepalive_active(c))
+		next_timeout = MIN(next_timeout, tcp_keepalive_deadline(c));
+
+	return next_timeout;
+}
+
+/**
+ * tcp_idle_handle_timeouts - compacts idle connections and checks keepalives
+ * @c: the connection (its lock must be held)
+ * @now: the current time
+ *
+ * The connection is failed with ETIMEDOUT once every keepalive probe has gone
+ * unanswered, so callers must check whether it was closed.
+ *
+ * Returns true if a keepalive probe should be sent (after dropping the lock).
+ */
+bool tcp_idle_handle_timeouts(tcpconn_t *c, uint64_t now)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (tcp_compact_active(c) && now >= tcp_compact_deadline(c))
+		tcp_conn_compact(c);
+
+	if (!tcp_keepalive_active(c) || now < tcp_keepalive_deadline(c))
+		return false;
+
+	if (c->keepalive_probes >= cfg_tcp_keepalive_probes) {
+		log_debug("tcp: %p keepalive timeout", c);
+		STAT(TCP_KEEPALIVE_TIMEOUTS)++;
+		tcp_conn_fail(c, ETIMEDOUT);
+		return false;
+	}
+
+	log_debug("tcp: %p keepalive probe %d", c, c->keepalive_probes);
+	c->keepalive_probes++;
+	STAT(TCP_KEEPALIVE_PROBES)++;
+	return true;
+}
+
+/**
+ * tcp_set_keepalive - enables or disables keepalive probes
+ * @c: the TCP connection
+ * @keepalive: if true, the connection fails with ETIMEDOUT once the peer stops
+ * answering probes
+ *
+ * The timing is set with the "tcp_keepalive_*" config options.
+ */
+void tcp_set_keepalive(tcpconn_t *c, bool keepalive)
+{
+	spin_lock_np(&c->lock);
+	c->keepalive = keepalive;
+	c->keepalive_probes = 0;
+	tcp_timer_update(c);
+	spin_unlock_np(&c->lock);
+}
@@ -47,10 +47,10 @@ static void send_rst(tcpconn_t *c, bool acked, uint32_t seq, uint32_t ack,
 		     uint32_t len)
 {
 	if (acked) {
-		tcp_tx_raw_rst(c->e.laddr, c->e.raddr, ack);
+		tcp_tx_raw_rst(&c->e.laddr, &c->e.raddr, ack);
 		return;
 	}
-	tcp_tx_raw_rst_ack(c->e.laddr, c->e.raddr, 0, seq + len);
+	tcp_tx_raw_rst_ack(&c->e.laddr, &c->e.raddr, 0, seq + len);
 }
 
 static void tcp_rx_append_text(tcpconn_t *c, struct mbuf *m)
@@ -166,7 +166,6 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	tcpconn_t *c = container_of(e, tcpconn_t, e);
 	struct list_head q;
 	thread_t *rx_th = NULL;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
 	const unsigned char *optp;
 	int optlen;
@@ -178,7 +177,6 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	snd_nxt = load_acquire(&c->pcb.snd_nxt);
 
 	/* find header offsets */
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	mbuf_mark_transport_offset(m);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (unlikely(!tcphdr)) {
@@ -195,7 +193,7 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		mbuf_free(m);
 		return;
 	}
-	len = ntoh16(iphdr->len) - sizeof(*iphdr) - hdr_len;
+	len = net_hdr_payload_len(m) - hdr_len;
 	if (unlikely(len > mbuf_length(m) || len > c->pcb.rcv_mss)) {
 		mbuf_free(m);
 		return;
@@ -215,6 +213,16 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 
 	spin_lock_np(&c->lock);
 
+	/* any segment shows the connection is alive */
+	c->rx_seg_ts = microtime();
+	c->keepalive_probes = 0;
+
+	/* but only data makes it busy (keepalives and their ACKs don't) */
+	if (len > 0 || (tcphdr->flags & (TCP_SYN | TCP_FIN)) != 0) {
+		c->rx_data_ts = c->rx_seg_ts;
+		c->compacted = false;
+	}
+
 	/* Is the connection in the established state? */
 	slow_path |= (c->pcb.state != TCP_STATE_ESTABLISHED);
 
@@ -260,18 +268,24 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	store_release(&c->pcb.rcv_nxt_wnd, nxt_wnd);
 
 	/* should we wake a thread */
-	if (!list_empty(&c->rxq) || (tcphdr->flags & TCP_PUSH) > 0)
+	if (!list_empty(&c->rxq) || (tcphdr->flags & TCP_PUSH) > 0) {
 		rx_th = waitq_signal(&c->rx_wq, &c->lock);
+		tcp_conn_poll(c, POLLEV_IN);
+	}
 
 	/* handle delayed acks */
-	if (++c->acks_delayed_cnt >= 2) {
+	switch (tcp_rx_ack_policy(c)) {
+	case TCP_ACK_NOW:
 		c->ack_delayed = false;
-		do_ack = true;
 		c->acks_delayed_cnt = 0;
-	} else if (!c->ack_delayed) {
-		c->ack_ts = microtime();
-		c->ack_delayed = true;
-		c->next_timeout = MIN(c->next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
+		do_ack = true;
+		break;
+	case TCP_ACK_BATCH:
+		tcp_ack_batch_add(c);
+		/* fallthrough */
+	default:
+		c->next_timeout = MIN(c->next_timeout,
+				      c->ack_ts + cfg_tcp_ack_delay_us);
 	}
 
 	list_add_tail(&c->rxq, &m->link);
@@ -285,7 +299,9 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		tcp_tx_ack(c);
 }
 
-static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
+/* scans the options of a SYN, returning which ones were present */
+static int tcp_scan_options(const unsigned char *ptr, int len, uint16_t *mss_out,
+			    uint8_t *wscale_out)
 {
 	int opt_en = 0;
 	uint16_t mss = 0;
@@ -325,6 +341,19 @@ static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
 	}
 
 done:
+	*mss_out = mss;
+	*wscale_out = wscale;
+	return opt_en;
+}
+
+static int tcp_parse_options(tcpconn_t *c, bool ipv6, const unsigned char *ptr,
+			     int len)
+{
+	uint16_t mss;
+	uint8_t wscale;
+	int opt_en;
+
+	opt_en = tcp_scan_options(ptr, len, &mss, &wscale);
 	c->pcb.snd_mss = MIN(MAX(mss, TCP_MIN_MSS), c->pcb.rcv_mss);
 	c->pcb.snd_wscale = wscale;
 	if (!(opt_en & TCP_OPTION_WSCALE)) {
@@ -332,7 +361,7 @@ done:
 		c->pcb.rcv_wscale = 0;
 	}
 	if (!(opt_en & TCP_OPTION_MSS)) {
-		c->pcb.snd_mss = tcp_calculate_mss(ETH_DEFAULT_MTU);
+		c->pcb.snd_mss = tcp_calculate_mss(ETH_DEFAULT_MTU, ipv6);
 	}
 	return opt_en;
 }
@@ -389,7 +418,8 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			c->pcb.irs = seq;
 
 			/* set up options */
-			opts.opt_en = tcp_parse_options(c, optp, optlen);
+			opts.opt_en = tcp_parse_options(c,
+				netaddr_is_ipv6(&c->e.raddr), optp, optlen);
 			opts.mss = c->pcb.rcv_mss;
 			opts.wscale = c->pcb.rcv_wscale;
 
@@ -484,8 +514,10 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 		do_ack = true;
 		goto done;
 	}
-	if (snd_was_full && !tcp_is_snd_full(c))
+	if (snd_was_full && !tcp_is_snd_full(c)) {
 		waitq_release_start(&c->tx_wq, &waiters);
+		tcp_conn_poll(c, POLLEV_OUT);
+	}
 
 	/*
 	 * Fast retransmit -> detect a duplicate ACK if:
@@ -546,14 +578,21 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			assert(!list_empty(&c->rxq));
 			assert(do_drop == false);
 			rx_th = waitq_signal(&c->rx_wq, &c->lock);
+			tcp_conn_poll(c, POLLEV_IN);
 		}
-		if (++c->acks_delayed_cnt >= 2) {
+		if (!list_empty(&c->rxq_ooo)) {
+			/* duplicate ACKs drive the sender's fast retransmit */
 			do_ack = true;
-		} else if (!c->ack_delayed) {
-			c->ack_delayed = true;
-			c->ack_ts = microtime();
+		} else {
+			switch (tcp_rx_ack_policy(c)) {
+			case TCP_ACK_NOW:
+				do_ack = true;
+				break;
+			case TCP_ACK_BATCH:
+				tcp_ack_batch_add(c);
+				break;
+			}
 		}
-		do_ack |= !list_empty(&c->rxq_ooo);
 	}
 
 	/* step 8 - FIN */
@@ -593,10 +632,9 @@ done:
 }
 
 /* handles ingress packets for TCP listener queues */
-tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
+tcpconn_t *tcp_rx_listener(const struct netaddr *laddr, struct mbuf *m)
 {
 	struct netaddr raddr;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
 	const unsigned char *optp;
 	tcpconn_t *c;
@@ -605,20 +643,19 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	int optlen, ret;
 
 	/* find header offsets */
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (unlikely(!tcphdr))
 		return NULL;
 
 	/* calculate local and remote network addresses */
-	raddr.ip = ntoh32(iphdr->saddr);
+	net_hdr_get_addrs(m, NULL, &raddr);
 	raddr.port = ntoh16(tcphdr->sport);
 
 	/* do exactly what RFC 793 says */
 	if ((tcphdr->flags & TCP_RST) > 0)
 		return NULL;
 	if ((tcphdr->flags & TCP_ACK) > 0) {
-		tcp_tx_raw_rst(laddr, raddr, ntoh32(tcphdr->ack));
+		tcp_tx_raw_rst(laddr, &raddr, ntoh32(tcphdr->ack));
 		return NULL;
 	}
 	if ((tcphdr->flags & TCP_SYN) == 0)
@@ -626,7 +663,7 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 
 	/* TODO: the spec requires us to enqueue but not post any data */
 	hdr_len = tcphdr->off * sizeof(uint32_t);
-	if (ntoh16(iphdr->len) - sizeof(*iphdr) != hdr_len)
+	if (net_hdr_payload_len(m) != hdr_len)
 		return NULL;
 
 	/* parse options */
@@ -636,14 +673,15 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 		return NULL;
 
 	/* we have a valid SYN packet, initialize a new connection */
-	c = tcp_conn_alloc();
+	c = tcp_conn_alloc(netaddr_is_ipv6(&raddr));
 	if (unlikely(!c))
 		return NULL;
 	c->pcb.irs = ntoh32(tcphdr->seq);
 	c->pcb.rcv_nxt = c->pcb.irs + 1;
 
 	/* set up options */
-	opts.opt_en = tcp_parse_options(c, optp, optlen);
+	opts.opt_en = tcp_parse_options(c, netaddr_is_ipv6(&raddr), optp,
+				       optlen);
 	opts.mss = c->pcb.rcv_mss;
 	opts.wscale = c->pcb.rcv_wscale;
 
@@ -651,7 +689,7 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	 * attach the connection to the transport layer. From this point onward
 	 * ingress packets can be dispatched to the connection.
 	 */
-	ret = tcp_conn_attach(c, laddr, raddr);
+	ret = tcp_conn_attach(c, laddr, &raddr);
 	if (unlikely(ret)) {
 		sfree(c);
 		return NULL;
@@ -673,14 +711,128 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 	return c;
 }
 
+/**
+ * tcp_rx_listener_syncookie - answers a SYN with a SYN cookie
+ * @laddr: the local address of the listener
+ * @m: the SYN packet
+ *
+ * Unlike tcp_rx_listener(), no connection is allocated. The SYN/ACK carries
+ * all the state needed to create one when the final ACK arrives.
+ */
+void tcp_rx_listener_syncookie(const struct netaddr *laddr, struct mbuf *m)
+{
+	struct netaddr raddr;
+	const struct tcp_hdr *tcphdr;
+	const unsigned char *optp;
+	uint32_t hdr_len;
+	uint16_t mss, max_mss;
+	uint8_t wscale;
+	tcp_seq seq, iss;
+	bool ipv6;
+	int optlen;
+
+	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
+	if (unlikely(!tcphdr))
+		return;
+
+	net_hdr_get_addrs(m, NULL, &raddr);
+	raddr.port = ntoh16(tcphdr->sport);
+	ipv6 = netaddr_is_ipv6(&raddr);
+
+	/* the caller only hands us SYNs without ACK or RST */
+	hdr_len = tcphdr->off * sizeof(uint32_t);
+	if (net_hdr_payload_len(m) != hdr_len)
+		return;
+	optlen = hdr_len - sizeof(struct tcp_hdr);
+	optp = mbuf_pull_or_null(m, optlen);
+	if (!optp)
+		return;
+
+	/* the cookie can only encode an MSS that works in both directions */
+	if (!(tcp_scan_options(optp, optlen, &mss, &wscale) & TCP_OPTION_MSS))
+		mss = tcp_calculate_mss(ETH_DEFAULT_MTU, ipv6);
+	max_mss = tcp_calculate_mss(net_get_mtu(), ipv6);
+	mss = MIN(mss, max_mss);
+
+	seq = ntoh32(tcphdr->seq);
+	iss = tcp_syncookie_make(laddr, &raddr, seq, &mss);
+	if (likely(!tcp_tx_raw_synack(laddr, &raddr, iss, seq + 1, mss)))
+		STAT(TCP_SYNCOOKIES_SENT)++;
+}
+
+/**
+ * tcp_rx_syncookie_ack - creates a connection from a SYN cookie
+ * @laddr: the local address of the listener
+ * @m: an ACK (without SYN or RST) that didn't match any connection
+ *
+ * If the ACK acknowledges a valid cookie, a connection is created in the
+ * SYN_RECEIVED state, as if it had sent the SYN/ACK itself. The caller should
+ * then pass @m to tcp_rx_conn() to complete the handshake. Otherwise the ACK
+ * is answered with a RST, as RFC 793 requires of a listener.
+ *
+ * Returns the new connection, or NULL if the ACK should be dropped.
+ */
+tcpconn_t *tcp_rx_syncookie_ack(const struct netaddr *laddr, struct mbuf *m)
+{
+	struct netaddr raddr;
+	const struct tcp_hdr *tcphdr;
+	tcp_seq seq, ack;
+	uint16_t mss;
+	tcpconn_t *c;
+	int ret;
+
+	/* peek at the header, tcp_rx_conn() will parse it again */
+	if (unlikely(mbuf_length(m) < sizeof(*tcphdr)))
+		return NULL;
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+
+	net_hdr_get_addrs(m, NULL, &raddr);
+	raddr.port = ntoh16(tcphdr->sport);
+	seq = ntoh32(tcphdr->seq);
+	ack = ntoh32(tcphdr->ack);
+
+	mss = tcp_syncookie_check(laddr, &raddr, seq - 1, ack - 1);
+	if (!mss) {
+		tcp_tx_raw_rst(laddr, &raddr, ack);
+		return NULL;
+	}
+
+	c = tcp_conn_alloc(netaddr_is_ipv6(&raddr));
+	if (unlikely(!c))
+		return NULL;
+
+	/* recreate the state of the handshake the cookie stands for */
+	c->pcb.iss = ack - 1;
+	c->pcb.snd_una = c->pcb.iss;
+	c->pcb.snd_nxt = ack;
+	c->pcb.irs = seq - 1;
+	c->pcb.rcv_nxt = seq;
+	c->pcb.snd_mss = MIN(mss, c->pcb.rcv_mss);
+	c->pcb.snd_wscale = 0;
+	c->pcb.rcv_wscale = 0;
+	c->pcb.rcv_wnd = c->winmax = MIN(c->winmax, UINT16_MAX);
+
+	ret = tcp_conn_attach(c, laddr, &raddr);
+	if (unlikely(ret)) {
+		sfree(c);
+		return NULL;
+	}
+
+	spin_lock_np(&c->lock);
+	tcp_conn_get(c); /* take a ref for the state machine */
+	tcp_conn_set_state(c, TCP_STATE_SYN_RECEIVED);
+	spin_unlock_np(&c->lock);
+
+	STAT(TCP_SYNCOOKIES_OK)++;
+	return c;
+}
+
 void tcp_rx_closed(struct mbuf *m)
 {
 	struct netaddr l, r;
 	uint32_t len;
-	const struct ip_hdr *iphdr;
 	const struct tcp_hdr *tcphdr;
 
-	iphdr = mbuf_network_hdr(m, *iphdr);
 	tcphdr = mbuf_pull_hdr_or_null(m, *tcphdr);
 	if (!tcphdr)
 		return;
@@ -688,16 +840,14 @@ void tcp_rx_closed(struct mbuf *m)
 	if ((tcphdr->flags & TCP_RST) > 0)
 		return;
 
-	l.ip = ntoh32(iphdr->daddr);
+	net_hdr_get_addrs(m, &l, &r);
 	l.port = ntoh16(tcphdr->dport);
-
-	r.ip = ntoh32(iphdr->saddr);
 	r.port = ntoh16(tcphdr->sport);
 
 	if ((tcphdr->flags & TCP_ACK) > 0) {
-		tcp_tx_raw_rst(l, r, ntoh32(tcphdr->ack));
+		tcp_tx_raw_rst(&l, &r, ntoh32(tcphdr->ack));
 	} else {
-		len = ntoh16(iphdr->len) - sizeof(*iphdr) - tcphdr->off * 4;
-		tcp_tx_raw_rst_ack(l, r, 0, ntoh32(tcphdr->seq) + len);
+		len = net_hdr_payload_len(m) - tcphdr->off * 4;
+		tcp_tx_raw_rst_ack(&l, &r, 0, ntoh32(tcphdr->seq) + len);
 	}
 }
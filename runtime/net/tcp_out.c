@@ -18,8 +18,8 @@ static void tcp_tx_release_mbuf(struct mbuf *m)
 		net_tx_release_mbuf(m);
 }
 
-static uint16_t tcp_hdr_chksum(uint32_t local_ip, uint32_t remote_ip,
-			       uint16_t len)
+static uint16_t tcp_hdr_chksum(const struct netaddr *laddr,
+			       const struct netaddr *raddr, uint16_t len)
 {
 
 #ifdef DIRECTPATH
@@ -27,7 +27,9 @@ static uint16_t tcp_hdr_chksum(uint32_t local_ip, uint32_t remote_ip,
 		return 0;
 #endif
 
-	return ipv4_phdr_cksum(IPPROTO_TCP, local_ip, remote_ip, len);
+	if (unlikely(netaddr_is_ipv6(raddr)))
+		return ipv6_phdr_cksum(IPPROTO_TCP, laddr->ip6, raddr->ip6, len);
+	return ipv4_phdr_cksum(IPPROTO_TCP, laddr->ip, raddr->ip, len);
 }
 
 static __always_inline struct tcp_hdr *
@@ -49,7 +51,7 @@ tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
 	tcphdr->flags = flags;
 	tcphdr->win = hton16(win >> c->pcb.rcv_wscale);
 	tcphdr->seq = hton32(m->seg_seq);
-	tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip,
+	tcphdr->sum = tcp_hdr_chksum(&c->e.laddr, &c->e.raddr,
 				     off * sizeof(uint32_t) + l4len);
 	return tcphdr;
 }
@@ -62,7 +64,8 @@ tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
  *
  * Returns 0 if successful, otherwise fail.
  */
-int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr, tcp_seq seq)
+int tcp_tx_raw_rst(const struct netaddr *laddr, const struct netaddr *raddr,
+		   tcp_seq seq)
 {
 	struct tcp_hdr *tcphdr;
 	struct mbuf *m;
@@ -76,17 +79,17 @@ int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr, tcp_seq seq)
 
 	/* write the tcp header */
 	tcphdr = mbuf_push_hdr(m, *tcphdr);
-	tcphdr->sport = hton16(laddr.port);
-	tcphdr->dport = hton16(raddr.port);
+	tcphdr->sport = hton16(laddr->port);
+	tcphdr->dport = hton16(raddr->port);
 	tcphdr->seq = hton32(seq);
 	tcphdr->ack = hton32(0);
 	tcphdr->off = 5;
 	tcphdr->flags = TCP_RST;
 	tcphdr->win = hton16(0);
-	tcphdr->sum = tcp_hdr_chksum(laddr.ip, raddr.ip, 0);
+	tcphdr->sum = tcp_hdr_chksum(laddr, raddr, 0);
 
 	/* transmit packet */
-	ret = net_tx_ip(m, IPPROTO_TCP, raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, raddr);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
@@ -101,8 +104,8 @@ int tcp_tx_raw_rst(struct netaddr laddr, struct netaddr raddr, tcp_seq seq)
  *
  * Returns 0 if successful, otherwise fail.
  */
-int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
-		       tcp_seq seq, tcp_seq ack)
+int tcp_tx_raw_rst_ack(const struct netaddr *laddr,
+		       const struct netaddr *raddr, tcp_seq seq, tcp_seq ack)
 {
 	struct tcp_hdr *tcphdr;
 	struct mbuf *m;
@@ -116,17 +119,17 @@ int tcp_tx_raw_rst_ack(struct netaddr laddr, struct netaddr raddr,
 
 	/* write the tcp header */
 	tcphdr = mbuf_push_hdr(m, *tcphdr);
-	tcphdr->sport = hton16(laddr.port);
-	tcphdr->dport = hton16(raddr.port);
+	tcphdr->sport = hton16(laddr->port);
+	tcphdr->dport = hton16(raddr->port);
 	tcphdr->seq = hton32(seq);
 	tcphdr->ack = hton32(ack);
 	tcphdr->off = 5;
 	tcphdr->flags = TCP_RST | TCP_ACK;
 	tcphdr->win = hton16(0);
-	tcphdr->sum = tcp_hdr_chksum(laddr.ip, raddr.ip, 0);
+	tcphdr->sum = tcp_hdr_chksum(laddr, raddr, 0);
 
 	/* transmit packet */
-	ret = net_tx_ip(m, IPPROTO_TCP, raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, raddr);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
@@ -153,9 +156,11 @@ int tcp_tx_ack(tcpconn_t *c)
 
 	/* transmit packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, &c->e.raddr);
 	if (unlikely(ret))
 		mbuf_free(m);
+	else
+		STAT(TX_TCP_ACKS)++;
 	return ret;
 }
 
@@ -184,7 +189,7 @@ int tcp_tx_probe_window(tcpconn_t *c)
 
 	/* transmit packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, &c->e.raddr);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
@@ -213,6 +218,55 @@ static int tcp_push_options(struct mbuf *m, const struct tcp_options *opts)
 	return len;
 }
 
+/**
+ * tcp_tx_raw_synack - send a SYN/ACK without a connection (for SYN cookies)
+ * @laddr: the local address
+ * @raddr: the remote address
+ * @seq: the segment's sequence number (the cookie)
+ * @ack: the segment's acknowledgement number
+ * @mss: the MSS option to advertise
+ *
+ * No window scale option is sent, since it couldn't be recovered later.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int tcp_tx_raw_synack(const struct netaddr *laddr,
+		      const struct netaddr *raddr, tcp_seq seq, tcp_seq ack,
+		      uint16_t mss)
+{
+	struct tcp_hdr *tcphdr;
+	struct tcp_options opts;
+	struct mbuf *m;
+	int ret;
+
+	m = net_tx_alloc_mbuf();
+	if (unlikely((!m)))
+		return -ENOMEM;
+
+	m->txflags = OLFLAG_TCP_CHKSUM;
+
+	/* write the options and tcp header */
+	opts.opt_en = TCP_OPTION_MSS;
+	opts.mss = mss;
+	ret = tcp_push_options(m, &opts);
+	tcphdr = mbuf_push_hdr(m, *tcphdr);
+	tcphdr->sport = hton16(laddr->port);
+	tcphdr->dport = hton16(raddr->port);
+	tcphdr->seq = hton32(seq);
+	tcphdr->ack = hton32(ack);
+	tcphdr->off = 5 + ret;
+	tcphdr->flags = TCP_SYN | TCP_ACK;
+	tcphdr->win = hton16(MIN(TCP_WIN, UINT16_MAX));
+	tcphdr->sum = tcp_hdr_chksum(laddr, raddr,
+				     tcphdr->off * sizeof(uint32_t));
+
+	/* transmit packet */
+	ret = net_tx_l3(m, IPPROTO_TCP, raddr);
+	if (unlikely(ret))
+		mbuf_free(m);
+	return ret;
+}
+
 /**
  * tcp_tx_ctl - sends a control message without data
  * @c: the TCP connection
@@ -249,11 +303,35 @@ int tcp_tx_ctl(tcpconn_t *c, uint8_t flags, const struct tcp_options *opts)
 	atomic_write(&m->ref, 2);
 	m->release = tcp_tx_release_mbuf;
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, &c->e.raddr);
+	if (unlikely(ret)) {
+		/* pretend the packet was sent */
+		atomic_write(&m->ref, 1);
+	}
+	return ret;
+}
+
+/* queues a data segment for retransmission and transmits it */
+static int tcp_tx_segment(tcpconn_t *c, struct mbuf *m, bool push)
+{
+	int ret;
+
+	/* initialize TCP header */
+	if (push)
+		m->flags |= TCP_PUSH;
+	tcp_push_tcphdr(m, c, m->flags, 5, m->seg_end - m->seg_seq);
+
+	/* transmit the packet */
+	list_add_tail(&c->txq, &m->link);
+	tcp_debug_egress_pkt(c, m);
+	m->timestamp = microtime();
+	m->txflags = OLFLAG_TCP_CHKSUM;
+	ret = net_tx_l3(m, IPPROTO_TCP, &c->e.raddr);
 	if (unlikely(ret)) {
 		/* pretend the packet was sent */
 		atomic_write(&m->ref, 1);
 	}
+
 	return ret;
 }
 
@@ -321,21 +399,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 			break;
 		}
 
-		/* initialize TCP header */
-		if (push && pos == end)
-			m->flags |= TCP_PUSH;
-		tcp_push_tcphdr(m, c, m->flags, 5, m->seg_end - m->seg_seq);
-
-		/* transmit the packet */
-		list_add_tail(&c->txq, &m->link);
-		tcp_debug_egress_pkt(c, m);
-		m->timestamp = microtime();
-		m->txflags = OLFLAG_TCP_CHKSUM;
-		ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
-		if (unlikely(ret)) {
-			/* pretend the packet was sent */
-			atomic_write(&m->ref, 1);
-		}
+		ret = tcp_tx_segment(c, m, push && pos == end);
 	} while (pos < end);
 
 	/* if we sent anything return the length we sent instead of an error */
@@ -344,6 +408,27 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	return ret;
 }
 
+/**
+ * tcp_tx_flush_pending - transmits a partially filled segment held back by
+ * tcp_tx_send()
+ * @c: the TCP connection
+ *
+ * The caller must hold @c's lock, and no writer may be active.
+ */
+void tcp_tx_flush_pending(tcpconn_t *c)
+{
+	struct mbuf *m = c->tx_pending;
+
+	assert_spin_lock_held(&c->lock);
+	assert(!c->tx_exclusive);
+
+	if (!m)
+		return;
+
+	c->tx_pending = NULL;
+	tcp_tx_segment(c, m, true);
+}
+
 static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 {
 	int ret;
@@ -395,7 +480,7 @@ static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 
 	/* transmit the packet */
 	tcp_debug_egress_pkt(c, m);
-	ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+	ret = net_tx_l3(m, IPPROTO_TCP, &c->e.raddr);
 	if (unlikely(ret))
 		mbuf_free(m);
 	return ret;
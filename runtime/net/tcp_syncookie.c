@@ -0,0 +1,147 @@
+/*
+ * tcp_syncookie.c - stateless SYN handling for TCP listeners
+ *
+ * A SYN cookie encodes everything a listener needs to remember about a SYN in
+ * the initial sequence number of its SYN/ACK, so no connection is allocated
+ * until the final ACK of the handshake arrives. The layout follows the classic
+ * scheme: the top 8 bits are a coarse time counter, and the bottom 24 bits
+ * carry an index into a table of MSS values, offset by a keyed hash of the
+ * 4-tuple and counter. The whole value is offset by another keyed hash and the
+ * client's ISN. Both hashes are SipHash-2-4 with random 128-bit secrets, so
+ * cookies seen for one 4-tuple don't help forge cookies for another. Window
+ * scaling can't be recovered from a cookie, so such connections run without
+ * it.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include <base/hash.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "tcp.h"
+#include "defs.h"
+
+#define COOKIE_BITS		24
+#define COOKIE_MASK		((1U << COOKIE_BITS) - 1)
+/* the time counter advances once a minute */
+#define COOKIE_PERIOD		(60 * ONE_SECOND)
+/* cookies are accepted for up to this many counter periods */
+#define COOKIE_MAX_AGE		2
+
+/* the MSS values a cookie can encode, in ascending order */
+static const uint16_t syncookie_msstab[] = {
+	536, 1220, 1300, 1440, 1460, 4312, 8960,
+};
+
+/* two independent keys, one for each hash in a cookie */
+static struct siphash_key syncookie_secret[2];
+
+/* hashes the 4-tuple and time counter with one of the two secrets */
+static uint32_t syncookie_hash(const struct netaddr *laddr,
+			       const struct netaddr *raddr, uint32_t count,
+			       int idx)
+{
+	struct {
+		uint8_t		laddr[IP6_ADDR_LEN];
+		uint8_t		raddr[IP6_ADDR_LEN];
+		uint16_t	lport;
+		uint16_t	rport;
+		uint32_t	count;
+	} __packed msg;
+
+	memset(&msg, 0, sizeof(msg));
+	if (unlikely(netaddr_is_ipv6(raddr))) {
+		memcpy(msg.laddr, laddr->ip6, IP6_ADDR_LEN);
+		memcpy(msg.raddr, raddr->ip6, IP6_ADDR_LEN);
+	} else {
+		memcpy(msg.laddr, &laddr->ip, sizeof(laddr->ip));
+		memcpy(msg.raddr, &raddr->ip, sizeof(raddr->ip));
+	}
+	msg.lport = laddr->port;
+	msg.rport = raddr->port;
+	msg.count = count;
+
+	return siphash24(&syncookie_secret[idx], &msg, sizeof(msg));
+}
+
+static uint32_t syncookie_count(void)
+{
+	return microtime() / COOKIE_PERIOD;
+}
+
+/**
+ * tcp_syncookie_make - computes the ISN of a SYN/ACK sent as a SYN cookie
+ * @laddr: the local address
+ * @raddr: the remote address
+ * @seq: the sequence number of the SYN
+ * @mss: the MSS requested by the remote host, lowered to a value that can be
+ *       encoded
+ *
+ * Returns the ISN to use.
+ */
+tcp_seq tcp_syncookie_make(const struct netaddr *laddr,
+			   const struct netaddr *raddr, tcp_seq seq,
+			   uint16_t *mss)
+{
+	uint32_t count = syncookie_count();
+	int i;
+
+	for (i = ARRAY_SIZE(syncookie_msstab) - 1; i > 0; i--) {
+		if (syncookie_msstab[i] <= *mss)
+			break;
+	}
+	*mss = syncookie_msstab[i];
+
+	return syncookie_hash(laddr, raddr, 0, 0) + seq +
+	       (count << COOKIE_BITS) +
+	       ((syncookie_hash(laddr, raddr, count, 1) + i) & COOKIE_MASK);
+}
+
+/**
+ * tcp_syncookie_check - validates the final ACK of a SYN cookie handshake
+ * @laddr: the local address
+ * @raddr: the remote address
+ * @seq: the sequence number of the original SYN (the ACK's sequence - 1)
+ * @cookie: the ISN of the SYN/ACK (the ACK's acknowledgement - 1)
+ *
+ * Returns the encoded MSS if the cookie is valid, otherwise 0.
+ */
+uint16_t tcp_syncookie_check(const struct netaddr *laddr,
+			     const struct netaddr *raddr, tcp_seq seq,
+			     tcp_seq cookie)
+{
+	uint32_t count = syncookie_count(), diff, idx;
+
+	cookie -= syncookie_hash(laddr, raddr, 0, 0) + seq;
+	diff = (count - (cookie >> COOKIE_BITS)) & ((uint32_t)-1 >> COOKIE_BITS);
+	if (diff >= COOKIE_MAX_AGE)
+		return 0;
+
+	idx = (cookie - syncookie_hash(laddr, raddr, count - diff, 1)) &
+	      COOKIE_MASK;
+	if (idx >= ARRAY_SIZE(syncookie_msstab))
+		return 0;
+
+	return syncookie_msstab[idx];
+}
+
+/**
+ * tcp_syncookie_init - picks the secrets used to sign cookies
+ *
+ * Returns 0 if successful.
+ */
+int tcp_syncookie_init(void)
+{
+	ssize_t ret;
+
+	ret = getrandom(syncookie_secret, sizeof(syncookie_secret), 0);
+	if (ret != sizeof(syncookie_secret)) {
+		log_err("tcp: couldn't generate SYN cookie secrets");
+		return ret < 0 ? -errno : -EIO;
+	}
+
+	return 0;
+}
@@ -2,45 +2,214 @@
  * transport.c - handles transport protocol packets (UDP and TCP)
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <base/stddef.h>
 #include <base/hash.h>
+#include <base/log.h>
 #include <runtime/rculist.h>
 #include <runtime/sync.h>
+#include <runtime/thread.h>
 #include <runtime/net.h>
 #include <net/ip.h>
 
 #include "defs.h"
 
-#define TRANS_TBL_SIZE	16384
+/* the initial and maximum number of hash buckets (powers of two) */
+#define TRANS_TBL_MIN_SIZE	16384
+#define TRANS_TBL_MAX_SIZE	(1 << 22)
+/* grow the table when there are more entries than this per bucket */
+#define TRANS_TBL_LOAD_FACTOR	2
+/* the number of striped locks, must not exceed TRANS_TBL_MIN_SIZE */
+#define TRANS_LOCK_STRIPES	256
 
 /* ephemeral port definitions (IANA suggested range) */
 #define MIN_EPHEMERAL		49152
 #define MAX_EPHEMERAL		65535
+/* the number of next-port counters used for ephemeral port selection */
+#define EPHEMERAL_TBL_SIZE	4096
 
 /* a seed value for transport handler table hashing calculations */
 static uint32_t trans_seed;
 
-/* a simple counter used to further randomize ephemeral ports */
-static uint32_t ephemeral_offset;
+/* per-destination hints of the next ephemeral port to try (RFC 6056) */
+static uint16_t ephemeral_tbl[EPHEMERAL_TBL_SIZE];
 
-static inline uint32_t trans_hash_3tuple(uint8_t proto, struct netaddr laddr)
+/* folds an IP address into 32 bits (IPv4 addresses are used as is) */
+static inline uint32_t trans_hash_ip(const struct netaddr *addr)
+{
+	uint64_t hi, lo;
+
+	if (likely(addr->family == NETADDR_IPV4))
+		return addr->ip;
+
+	memcpy(&hi, addr->ip6, sizeof(hi));
+	memcpy(&lo, addr->ip6 + sizeof(hi), sizeof(lo));
+	return hash_crc32c_two(trans_seed, hi, lo);
+}
+
+static inline uint32_t trans_hash_3tuple(uint8_t proto,
+					  const struct netaddr *laddr)
 {
 	return hash_crc32c_one(trans_seed,
-		(uint64_t)laddr.ip | ((uint64_t)laddr.port << 32) |
+		(uint64_t)trans_hash_ip(laddr) | ((uint64_t)laddr->port << 32) |
 		((uint64_t)proto << 48));
 }
 
-static inline uint32_t trans_hash_5tuple(uint8_t proto, struct netaddr laddr,
-				         struct netaddr raddr)
+static inline uint32_t trans_hash_5tuple(uint8_t proto,
+					  const struct netaddr *laddr,
+					  const struct netaddr *raddr)
 {
 	return hash_crc32c_two(trans_seed,
-		(uint64_t)laddr.ip | ((uint64_t)laddr.port << 32),
-		(uint64_t)raddr.ip | ((uint64_t)raddr.port << 32) |
+		(uint64_t)trans_hash_ip(laddr) | ((uint64_t)laddr->port << 32),
+		(uint64_t)trans_hash_ip(raddr) | ((uint64_t)raddr->port << 32) |
 		((uint64_t)proto << 48));
 }
 
-static DEFINE_SPINLOCK(trans_lock);
-static struct rcu_hlist_head trans_tbl[TRANS_TBL_SIZE];
+static inline uint32_t trans_hash_entry(struct trans_entry *e)
+{
+	assert(e->match == TRANS_MATCH_3TUPLE ||
+	       e->match == TRANS_MATCH_5TUPLE);
+	if (e->match == TRANS_MATCH_3TUPLE)
+		return trans_hash_3tuple(e->proto, &e->laddr);
+	return trans_hash_5tuple(e->proto, &e->laddr, &e->raddr);
+}
+
+/*
+ * The match table is an RCU hash table that doubles in size as it fills up.
+ * Each entry has two links so that it can sit in the current table and in the
+ * next (larger) one at the same time. Readers never observe a partially moved
+ * chain; they keep walking the old table until it is retired after a grace
+ * period.
+ *
+ * Updates are serialized by striped locks. A bucket's stripe is selected by the
+ * low bits of its hash, so it stays the same across resizes.
+ */
+struct trans_tbl {
+	unsigned int		mask;	/* the number of buckets - 1 */
+	int			slot;	/* the entry link used by this table */
+	struct rcu_hlist_head	buckets[];
+};
+
+struct trans_stripe {
+	spinlock_t		lock;
+	unsigned int		count;	  /* entries in this stripe */
+	bool			migrated; /* copied to the next table yet? */
+} __aligned(CACHE_LINE_SIZE);
+
+static struct trans_tbl __rcu *trans_tbl;
+/* the table being filled in by a resize, or NULL (protected by stripes) */
+static struct trans_tbl *trans_tbl_next;
+static struct trans_stripe trans_stripes[TRANS_LOCK_STRIPES];
+static atomic_t trans_resizing;
+
+static inline struct trans_entry *
+trans_entry_from_node(struct rcu_hlist_node *node, int slot)
+{
+	return container_of(node - slot, struct trans_entry, link[0]);
+}
+
+static inline struct trans_stripe *trans_stripe(uint32_t hash)
+{
+	return &trans_stripes[hash % TRANS_LOCK_STRIPES];
+}
+
+static struct trans_tbl *trans_tbl_alloc(unsigned int size, int slot)
+{
+	struct trans_tbl *tbl;
+	unsigned int i;
+
+	tbl = aligned_alloc(CACHE_LINE_SIZE, sizeof(*tbl) +
+			    size * sizeof(struct rcu_hlist_head));
+	if (!tbl)
+		return NULL;
+
+	tbl->mask = size - 1;
+	tbl->slot = slot;
+	for (i = 0; i < size; i++)
+		rcu_hlist_init_head(&tbl->buckets[i]);
+	return tbl;
+}
+
+static inline void trans_tbl_insert(struct trans_tbl *tbl,
+				    struct trans_entry *e)
+{
+	rcu_hlist_add_head(&tbl->buckets[e->hash & tbl->mask],
+			   &e->link[tbl->slot]);
+}
+
+/* copies every entry to a table twice the size, then retires the old one */
+static void trans_tbl_grow(void *arg)
+{
+	struct trans_tbl *old, *new;
+	struct rcu_hlist_node *node;
+	struct trans_entry *e;
+	unsigned int i, b;
+
+	/* only this thread modifies the table pointer */
+	old = rcu_dereference_protected(trans_tbl, true);
+	if (old->mask + 1 >= TRANS_TBL_MAX_SIZE)
+		goto out;
+	new = trans_tbl_alloc((old->mask + 1) * 2, !old->slot);
+	if (!new) {
+		log_warn("trans: couldn't grow the match table");
+		goto out;
+	}
+
+	/* from now on, updates to migrated stripes go to both tables */
+	store_release(&trans_tbl_next, new);
+	for (i = 0; i < TRANS_LOCK_STRIPES; i++) {
+		spin_lock_np(&trans_stripes[i].lock);
+		for (b = i; b <= old->mask; b += TRANS_LOCK_STRIPES) {
+			rcu_hlist_for_each(&old->buckets[b], node, true) {
+				e = trans_entry_from_node(node, old->slot);
+				trans_tbl_insert(new, e);
+			}
+		}
+		trans_stripes[i].migrated = true;
+		spin_unlock_np(&trans_stripes[i].lock);
+	}
+
+	/* publish the new table */
+	for (i = 0; i < TRANS_LOCK_STRIPES; i++)
+		spin_lock_np(&trans_stripes[i].lock);
+	rcu_assign_pointer(trans_tbl, new);
+	trans_tbl_next = NULL;
+	STAT(TRANS_TBL_RESIZES)++;
+	for (i = 0; i < TRANS_LOCK_STRIPES; i++) {
+		trans_stripes[i].migrated = false;
+		spin_unlock_np(&trans_stripes[i].lock);
+	}
+
+	/* wait for readers (and their links into @old) to drain */
+	synchronize_rcu();
+	free(old);
+	log_debug("trans: grew the match table to %d buckets", new->mask + 1);
+
+out:
+	atomic_write(&trans_resizing, 0);
+}
+
+/* must be called with the entry's stripe lock held */
+static bool trans_tbl_conflict(struct trans_tbl *tbl, struct trans_entry *e)
+{
+	struct trans_entry *pos;
+	struct rcu_hlist_node *node;
+
+	rcu_hlist_for_each(&tbl->buckets[e->hash & tbl->mask], node, true) {
+		pos = trans_entry_from_node(node, tbl->slot);
+		if (pos->match != e->match || pos->proto != e->proto)
+			continue;
+		if (!netaddr_equal(&e->laddr, &pos->laddr))
+			continue;
+		if (e->match == TRANS_MATCH_3TUPLE ||
+		    netaddr_equal(&e->raddr, &pos->raddr))
+			return true;
+	}
+
+	return false;
+}
 
 /**
  * trans_table_add - adds an entry to the match table
@@ -51,45 +220,35 @@ static struct rcu_hlist_head trans_tbl[TRANS_TBL_SIZE];
  */
 int trans_table_add(struct trans_entry *e)
 {
-	struct trans_entry *pos;
-	struct rcu_hlist_node *node;
-	uint32_t idx;
+	struct trans_stripe *st;
+	struct trans_tbl *tbl;
+	unsigned int count, limit;
 
 	/* port zero is reserved for ephemeral port auto-assign */
 	if (e->laddr.port == 0)
 		return -EINVAL;
 
-	assert(e->match == TRANS_MATCH_3TUPLE ||
-	       e->match == TRANS_MATCH_5TUPLE);
-	if (e->match == TRANS_MATCH_3TUPLE)
-		idx = trans_hash_3tuple(e->proto, e->laddr);
-	else
-		idx = trans_hash_5tuple(e->proto, e->laddr, e->raddr);
-	idx %= TRANS_TBL_SIZE;
-
-	spin_lock_np(&trans_lock);
-	rcu_hlist_for_each(&trans_tbl[idx], node, true) {
-		pos = rcu_hlist_entry(node, struct trans_entry, link);
-		if (pos->match != e->match)
-			continue;
-		if (e->match == TRANS_MATCH_3TUPLE &&
-		    e->proto == pos->proto &&
-		    e->laddr.ip == pos->laddr.ip &&
-		    e->laddr.port == pos->laddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
-		} else if (e->proto == pos->proto &&
-			   e->laddr.ip == pos->laddr.ip &&
-			   e->laddr.port == pos->laddr.port &&
-			   e->raddr.ip == pos->raddr.ip &&
-			   e->raddr.port == pos->raddr.port) {
-			spin_unlock_np(&trans_lock);
-			return -EADDRINUSE;
-		}
+	e->hash = trans_hash_entry(e);
+	st = trans_stripe(e->hash);
+
+	spin_lock_np(&st->lock);
+	tbl = rcu_dereference_protected(trans_tbl, true);
+	if (trans_tbl_conflict(tbl, e)) {
+		spin_unlock_np(&st->lock);
+		return -EADDRINUSE;
+	}
+	trans_tbl_insert(tbl, e);
+	if (st->migrated)
+		trans_tbl_insert(trans_tbl_next, e);
+	count = ++st->count;
+	limit = (tbl->mask + 1) / TRANS_LOCK_STRIPES * TRANS_TBL_LOAD_FACTOR;
+	spin_unlock_np(&st->lock);
+
+	/* grow the table in the background when a stripe gets too full */
+	if (unlikely(count > limit) && atomic_cmpxchg(&trans_resizing, 0, 1)) {
+		if (thread_spawn(trans_tbl_grow, NULL))
+			atomic_write(&trans_resizing, 0);
 	}
-	rcu_hlist_add_head(&trans_tbl[idx], &e->link);
-	store_release(&ephemeral_offset, ephemeral_offset + 1);
-	spin_unlock_np(&trans_lock);
 
 	return 0;
 }
@@ -99,34 +258,32 @@ int trans_table_add(struct trans_entry *e)
  * while automatically selecting the local port number
  * @e: the entry to add
  *
- * We use algorithm 3 from RFC 6056.
+ * We use algorithm 4 from RFC 6056. A table of counters, indexed by a hash of
+ * the endpoint without the local port, remembers where the last search ended.
+ * Connections to the same destination therefore usually find a free port on
+ * the first try instead of rescanning the ports that are already in use.
  *
  * Returns 0 if successful or -EADDRNOTAVAIL if all ports are taken.
  */
 int trans_table_add_with_ephemeral_port(struct trans_entry *e)
 {
-	uint16_t offset, next_ephemeral = 0;
 	uint16_t num_ephemeral = MAX_EPHEMERAL - MIN_EPHEMERAL + 1;
+	uint32_t offset, idx, i;
+	uint16_t next;
 	int ret;
 
-	assert(e->match == TRANS_MATCH_3TUPLE ||
-	       e->match == TRANS_MATCH_5TUPLE);
 	e->laddr.port = 0;
-	if (e->match == TRANS_MATCH_3TUPLE) {
-		offset = trans_hash_3tuple(e->proto, e->laddr) +
-			 load_acquire(&ephemeral_offset);
-	} else {
-		offset = trans_hash_5tuple(e->proto, e->laddr, e->raddr) +
-			 load_acquire(&ephemeral_offset);
-	}
+	offset = trans_hash_entry(e);
+	idx = hash_crc32c_one(trans_seed, offset) % EPHEMERAL_TBL_SIZE;
+	next = load_acquire(&ephemeral_tbl[idx]);
 
-	while (next_ephemeral < num_ephemeral) {
-		uint32_t port = MIN_EPHEMERAL +
-				(next_ephemeral++ + offset) % num_ephemeral;
-		e->laddr.port = port;
+	for (i = 0; i < num_ephemeral; i++) {
+		e->laddr.port = MIN_EPHEMERAL + (offset + next++) % num_ephemeral;
 		ret = trans_table_add(e);
-		if (!ret)
+		if (!ret) {
+			store_release(&ephemeral_tbl[idx], next);
 			return 0;
+		}
 	}
 
 	return -EADDRNOTAVAIL;
@@ -140,9 +297,16 @@ int trans_table_add_with_ephemeral_port(struct trans_entry *e)
  */
 void trans_table_remove(struct trans_entry *e)
 {
-	spin_lock_np(&trans_lock);
-	rcu_hlist_del(&e->link);
-	spin_unlock_np(&trans_lock);
+	struct trans_stripe *st = trans_stripe(e->hash);
+	struct trans_tbl *tbl;
+
+	spin_lock_np(&st->lock);
+	tbl = rcu_dereference_protected(trans_tbl, true);
+	rcu_hlist_del(&e->link[tbl->slot]);
+	if (st->migrated)
+		rcu_hlist_del(&e->link[trans_tbl_next->slot]);
+	st->count--;
+	spin_unlock_np(&st->lock);
 }
 
 /* the first 4 bytes are identical for TCP and UDP */
@@ -152,54 +316,51 @@ struct l4_hdr {
 
 static struct trans_entry *trans_lookup(struct mbuf *m)
 {
-	const struct ip_hdr *iphdr;
 	const struct l4_hdr *l4hdr;
 	struct trans_entry *e;
+	struct trans_tbl *tbl;
 	struct rcu_hlist_node *node;
 	struct netaddr laddr, raddr;
 	uint32_t hash;
+	uint8_t proto;
 
 	assert(rcu_read_lock_held());
 
 	/* set up the network header pointers */
 	mbuf_mark_transport_offset(m);
-	iphdr = mbuf_network_hdr(m, *iphdr);
-	if (unlikely(iphdr->proto != IPPROTO_UDP &&
-		     iphdr->proto != IPPROTO_TCP))
+	proto = net_hdr_get_addrs(m, &laddr, &raddr);
+	if (unlikely(proto != IPPROTO_UDP && proto != IPPROTO_TCP))
 		return NULL;
 	l4hdr = (struct l4_hdr *)mbuf_data(m);
 	if (unlikely(mbuf_length(m) < sizeof(*l4hdr)))
 		return NULL;
 
-	/* parse the source and destination network address */
-	laddr.ip = ntoh32(iphdr->daddr);
+	/* parse the source and destination ports */
 	laddr.port = ntoh16(l4hdr->dport);
-	raddr.ip = ntoh32(iphdr->saddr);
 	raddr.port = ntoh16(l4hdr->sport);
 
 	/* attempt to find a 5-tuple match */
-	hash = trans_hash_5tuple(iphdr->proto, laddr, raddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
-		e = rcu_hlist_entry(node, struct trans_entry, link);
+	tbl = rcu_dereference(trans_tbl);
+	hash = trans_hash_5tuple(proto, &laddr, &raddr);
+	rcu_hlist_for_each(&tbl->buckets[hash & tbl->mask], node, false) {
+		e = trans_entry_from_node(node, tbl->slot);
 		if (e->match != TRANS_MATCH_5TUPLE)
 			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port &&
-		    e->raddr.ip == raddr.ip && e->raddr.port == raddr.port) {
+		if (e->proto == proto &&
+		    netaddr_equal(&e->laddr, &laddr) &&
+		    netaddr_equal(&e->raddr, &raddr)) {
 			return e;
 		}
 	}
 
 	/* attempt to find a 3-tuple match */
-	hash = trans_hash_3tuple(iphdr->proto, laddr);
-	rcu_hlist_for_each(&trans_tbl[hash % TRANS_TBL_SIZE], node, false) {
-		e = rcu_hlist_entry(node, struct trans_entry, link);
+	hash = trans_hash_3tuple(proto, &laddr);
+	rcu_hlist_for_each(&tbl->buckets[hash & tbl->mask], node, false) {
+		e = trans_entry_from_node(node, tbl->slot);
 		if (e->match != TRANS_MATCH_3TUPLE)
 			continue;
-		if (e->proto == iphdr->proto &&
-		    e->laddr.ip == laddr.ip && e->laddr.port == laddr.port) {
+		if (e->proto == proto && netaddr_equal(&e->laddr, &laddr))
 			return e;
-		}
 	}
 
 	return NULL;
@@ -211,15 +372,13 @@ static struct trans_entry *trans_lookup(struct mbuf *m)
  */
 void net_rx_trans(struct mbuf *m)
 {
-	const struct ip_hdr *iphdr;
 	struct trans_entry *e;
 
 	rcu_read_lock();
 	e = trans_lookup(m);
 	if (unlikely(!e)) {
 		rcu_read_unlock();
-		iphdr = mbuf_network_hdr(m, *iphdr);
-		if (iphdr->proto == IPPROTO_TCP)
+		if (net_hdr_get_addrs(m, NULL, NULL) == IPPROTO_TCP)
 			tcp_rx_closed(m);
 		mbuf_free(m);
 		return;
@@ -248,16 +407,21 @@ void trans_error(struct mbuf *m, int err)
 /**
  * trans_init - initializes transport protocol infrastructure
  *
- * Returns 0 (always successful).
+ * Returns 0 if successful, otherwise fail.
  */
 int trans_init(void)
 {
+	struct trans_tbl *tbl;
 	int i;
 
-	spin_lock_init(&trans_lock);
+	BUILD_ASSERT(TRANS_LOCK_STRIPES <= TRANS_TBL_MIN_SIZE);
+	for (i = 0; i < TRANS_LOCK_STRIPES; i++)
+		spin_lock_init(&trans_stripes[i].lock);
 
-	for (i = 0; i < TRANS_TBL_SIZE; i++)
-		rcu_hlist_init_head(&trans_tbl[i]);
+	tbl = trans_tbl_alloc(TRANS_TBL_MIN_SIZE, 0);
+	if (!tbl)
+		return -ENOMEM;
+	RCU_INIT_POINTER(trans_tbl, tbl);
 
 	trans_seed = rand_crc32c(0x48FA8BC1 ^ iok.key);
 	return 0;
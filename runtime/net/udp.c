@@ -2,6 +2,7 @@
  * udp.c - support for User Datagram Protocol (UDP)
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <base/hash.h>
@@ -20,20 +21,37 @@
 
 unsigned int udp_payload_size;
 
-static int udp_send_raw(struct mbuf *m, size_t len,
-			struct netaddr laddr, struct netaddr raddr)
+static void udp_push_hdr(struct mbuf *m, size_t len,
+			 const struct netaddr *laddr,
+			 const struct netaddr *raddr)
 {
 	struct udp_hdr *udphdr;
 
 	/* write UDP header */
 	udphdr = mbuf_push_hdr(m, *udphdr);
-	udphdr->src_port = hton16(laddr.port);
-	udphdr->dst_port = hton16(raddr.port);
+	udphdr->src_port = hton16(laddr->port);
+	udphdr->dst_port = hton16(raddr->port);
 	udphdr->len = hton16(len + sizeof(*udphdr));
 	udphdr->chksum = 0;
+}
+
+static int udp_send_raw(struct mbuf *m, size_t len,
+			const struct netaddr *laddr,
+			const struct netaddr *raddr)
+{
+	udp_push_hdr(m, len, laddr, raddr);
 
 	/* send the IP packet */
-	return net_tx_ip(m, IPPROTO_UDP, raddr.ip);
+	return net_tx_l3(m, IPPROTO_UDP, raddr);
+}
+
+/* the largest datagram that can be sent to @raddr without IP fragments */
+static inline size_t udp_max_payload(const struct netaddr *raddr)
+{
+	if (likely(raddr->family == NETADDR_IPV4))
+		return udp_get_payload_size();
+	return udp_get_payload_size() -
+	       (sizeof(struct ip6_hdr) - sizeof(struct ip_hdr));
 }
 
 
@@ -44,6 +62,8 @@ static int udp_send_raw(struct mbuf *m, size_t len,
 struct udpconn {
 	struct trans_entry	e;
 	bool			shutdown;
+	bool			nonblocking;
+	poll_trigger_t		poll;
 
 	/* ingress support */
 	spinlock_t		inq_lock;
@@ -85,10 +105,16 @@ static void udp_conn_recv(struct trans_entry *e, struct mbuf *m)
 
 	/* enqueue the packet on the ingress queue */
 	mbufq_push_tail(&c->inq, m);
-	c->inq_len++;
 
-	/* wake up a waiter */
-	th = waitq_signal(&c->inq_wq, &c->inq_lock);
+	/*
+	 * Only wake a waiter when the queue becomes non-empty; readers that
+	 * leave packets behind pass the wakeup on (see udp_read_chain()).
+	 */
+	th = NULL;
+	if (c->inq_len++ == 0)
+		th = waitq_signal(&c->inq_wq, &c->inq_lock);
+	if (unlikely(ACCESS_ONCE(c->poll.waiter) != NULL))
+		poll_trigger_events(&c->poll, POLLEV_IN);
 	spin_unlock_np(&c->inq_lock);
 
 	waitq_signal_finish(th);
@@ -104,6 +130,8 @@ static void udp_conn_err(struct trans_entry *e, int err)
 	spin_lock_np(&c->inq_lock);
 	do_release = !c->inq_err && !c->shutdown;
 	c->inq_err = err;
+	if (c->poll.waiter)
+		poll_trigger_events(&c->poll, POLLEV_ERR);
 	spin_unlock_np(&c->inq_lock);
 
 	if (do_release)
@@ -119,6 +147,8 @@ static const struct trans_ops udp_conn_ops = {
 static void udp_init_conn(udpconn_t *c)
 {
 	c->shutdown = false;
+	c->nonblocking = false;
+	poll_trigger_init(&c->poll);
 
 	/* initialize ingress fields */
 	spin_lock_init(&c->inq_lock);
@@ -170,18 +200,16 @@ int udp_dial(struct netaddr laddr, struct netaddr raddr, udpconn_t **c_out)
 	udpconn_t *c;
 	int ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_resolve_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
 
 	c = smalloc(sizeof(*c));
 	if (!c)
 		return -ENOMEM;
 
 	udp_init_conn(c);
-	trans_init_5tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, laddr, raddr);
+	trans_init_5tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, &laddr, &raddr);
 
 	if (laddr.port == 0)
 		ret = trans_table_add_with_ephemeral_port(&c->e);
@@ -208,18 +236,16 @@ int udp_listen(struct netaddr laddr, udpconn_t **c_out)
 	udpconn_t *c;
 	int ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_resolve_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
 	c = smalloc(sizeof(*c));
 	if (!c)
 		return -ENOMEM;
 
 	udp_init_conn(c);
-	trans_init_3tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, laddr);
+	trans_init_3tuple(&c->e, IPPROTO_UDP, &udp_conn_ops, &laddr);
 
 	if (laddr.port == 0)
 		ret = trans_table_add_with_ephemeral_port(&c->e);
@@ -278,6 +304,51 @@ int udp_set_buffers(udpconn_t *c, int read_mbufs, int write_mbufs)
 	return 0;
 }
 
+/* releases the ingress lock, waking another reader if packets remain */
+static void udp_read_chain(udpconn_t *c)
+{
+	thread_t *th = NULL;
+
+	assert_spin_lock_held(&c->inq_lock);
+	if (c->inq_len > 0)
+		th = waitq_signal(&c->inq_wq, &c->inq_lock);
+	spin_unlock_np(&c->inq_lock);
+	waitq_signal_finish(th);
+}
+
+/* waits for ingress packets, returns 1 if any can be popped */
+static ssize_t udp_read_wait(udpconn_t *c)
+{
+	assert_spin_lock_held(&c->inq_lock);
+
+	/* block until there is an actionable event */
+	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown) {
+		if (c->nonblocking)
+			return -EAGAIN;
+		waitq_wait(&c->inq_wq, &c->inq_lock);
+	}
+
+	/* is the socket drained and shutdown? */
+	if (mbufq_empty(&c->inq) && c->shutdown)
+		return 0;
+
+	/* propagate error status code if an error was detected */
+	if (c->inq_err)
+		return -c->inq_err;
+
+	return 1;
+}
+
+static void udp_get_raddr(udpconn_t *c, struct mbuf *m, struct netaddr *raddr)
+{
+	struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
+
+	net_hdr_get_addrs(m, NULL, raddr);
+	raddr->port = ntoh16(udphdr->src_port);
+	if (c->e.match == TRANS_MATCH_5TUPLE)
+		assert(netaddr_equal(&c->e.raddr, raddr));
+}
+
 /**
  * udp_read_from - reads from a UDP socket
  * @c: the UDP socket
@@ -298,40 +369,20 @@ ssize_t udp_read_from(udpconn_t *c, void *buf, size_t len,
 	struct mbuf *m;
 
 	spin_lock_np(&c->inq_lock);
-
-	/* block until there is an actionable event */
-	while (mbufq_empty(&c->inq) && !c->inq_err && !c->shutdown)
-		waitq_wait(&c->inq_wq, &c->inq_lock);
-
-	/* is the socket drained and shutdown? */
-	if (mbufq_empty(&c->inq) && c->shutdown) {
+	ret = udp_read_wait(c);
+	if (ret <= 0) {
 		spin_unlock_np(&c->inq_lock);
-		return 0;
-	}
-
-	/* propagate error status code if an error was detected */
-	if (c->inq_err) {
-		spin_unlock_np(&c->inq_lock);
-		return -c->inq_err;
+		return ret;
 	}
 
 	/* pop an mbuf and deliver the payload */
 	m = mbufq_pop_head(&c->inq);
 	c->inq_len--;
-	spin_unlock_np(&c->inq_lock);
+	udp_read_chain(c);
 
-	ret = MIN(len, mbuf_length(m));
-	memcpy(buf, mbuf_data(m), ret);
-	if (raddr) {
-		struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
-		struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
-		raddr->ip = ntoh32(iphdr->saddr);
-		raddr->port = ntoh16(udphdr->src_port);
-		if (c->e.match == TRANS_MATCH_5TUPLE) {
-			assert(c->e.raddr.ip == raddr->ip &&
-			       c->e.raddr.port == raddr->port);
-		}
-	}
+	ret = mbuf_chain_copy(m, buf, len);
+	if (raddr)
+		udp_get_raddr(c, m, raddr);
 	mbuf_free(m);
 	return ret;
 }
@@ -345,8 +396,12 @@ static void udp_tx_release_mbuf(struct mbuf *m)
 	spin_lock_np(&c->outq_lock);
 	c->outq_len--;
 	free_conn = (c->outq_free && c->outq_len == 0);
-	if (!c->shutdown)
+	if (!c->shutdown) {
 		th = waitq_signal(&c->outq_wq, &c->outq_lock);
+		if (unlikely(ACCESS_ONCE(c->poll.waiter) != NULL) &&
+		    c->outq_len == c->outq_cap - 1)
+			poll_trigger_events(&c->poll, POLLEV_OUT);
+	}
 	spin_unlock_np(&c->outq_lock);
 	waitq_signal_finish(th);
 
@@ -355,6 +410,99 @@ static void udp_tx_release_mbuf(struct mbuf *m)
 		udp_conn_put(c);
 }
 
+/* gives back egress slots that were reserved but not used */
+static void udp_tx_unreserve(udpconn_t *c, int cnt)
+{
+	struct list_head waiters;
+	bool free_conn;
+
+	list_head_init(&waiters);
+	spin_lock_np(&c->outq_lock);
+	c->outq_len -= cnt;
+	free_conn = (c->outq_free && c->outq_len == 0);
+	if (!c->shutdown)
+		waitq_release_start(&c->outq_wq, &waiters);
+	spin_unlock_np(&c->outq_lock);
+
+	waitq_release_finish(&waiters);
+	if (free_conn)
+		udp_conn_put(c);
+}
+
+/* the number of payload bytes carried by each IP fragment */
+static inline size_t udp_frag_size(void)
+{
+	return (net_get_mtu() - sizeof(struct ip_hdr)) & ~7;
+}
+
+/* the number of IP fragments needed for a datagram */
+static inline int udp_nr_frags(size_t len)
+{
+	return div_up(len + sizeof(struct udp_hdr), udp_frag_size());
+}
+
+/*
+ * Sends a datagram that doesn't fit in the MTU as a series of IP fragments. If
+ * @c is not NULL, each fragment must have reserved one of its egress slots.
+ */
+static int udp_send_frags(const struct iovec *iov, int iovcnt, size_t len,
+			  const struct netaddr *laddr,
+			  const struct netaddr *raddr, udpconn_t *c)
+{
+	struct mbuf *ms[UDP_MAX_FRAGS];
+	struct udp_hdr *udphdr;
+	size_t room, n, iov_off = 0;
+	int i, nr = udp_nr_frags(len), ret = -ENOBUFS;
+
+	assert(nr <= UDP_MAX_FRAGS);
+
+	for (i = 0; i < nr; i++) {
+		ms[i] = net_tx_alloc_mbuf();
+		if (unlikely(!ms[i]))
+			goto fail;
+		if (c) {
+			ms[i]->release = udp_tx_release_mbuf;
+			ms[i]->release_data = (unsigned long)c;
+		}
+
+		room = udp_frag_size();
+		if (i == 0) {
+			/* only the first fragment has a UDP header */
+			udphdr = mbuf_put_hdr(ms[0], *udphdr);
+			udphdr->src_port = hton16(laddr->port);
+			udphdr->dst_port = hton16(raddr->port);
+			udphdr->len = hton16(len + sizeof(*udphdr));
+			udphdr->chksum = 0;
+			room -= sizeof(*udphdr);
+		}
+
+		/* copy the next part of the payload */
+		while (room > 0 && iovcnt > 0) {
+			n = MIN(room, iov->iov_len - iov_off);
+			memcpy(mbuf_put(ms[i], n),
+			       (const char *)iov->iov_base + iov_off, n);
+			room -= n;
+			iov_off += n;
+			if (iov_off == iov->iov_len) {
+				iov++;
+				iovcnt--;
+				iov_off = 0;
+			}
+		}
+	}
+
+	ret = net_tx_ip_frags(ms, nr, IPPROTO_UDP, raddr->ip);
+	if (likely(!ret))
+		return 0;
+
+fail:
+	if (c && i < nr)
+		udp_tx_unreserve(c, nr - i);
+	while (i-- > 0)
+		mbuf_free(ms[i]);
+	return ret;
+}
+
 /**
  * udp_write_to - writes to a UDP socket
  * @c: the UDP socket
@@ -365,32 +513,50 @@ static void udp_tx_release_mbuf(struct mbuf *m)
  * WARNING: This a blocking function. It will wait until space in the transmit
  * buffer is available or the socket is shutdown.
  *
+ * Datagrams larger than the MTU (up to UDP_MAX_DATAGRAM_SIZE) are sent as IP
+ * fragments, using one slot of the transmit buffer per fragment.
+ *
  * Returns the number of payload bytes sent in the datagram. If an error
  * occurs, returns < 0 to indicate the error code.
  */
 ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
                      const struct netaddr *raddr)
 {
-	struct netaddr addr;
+	const struct netaddr *addr;
 	ssize_t ret;
 	struct mbuf *m;
 	void *payload;
+	int nr = 1;
 
-	if (len > udp_get_payload_size())
-		return -EMSGSIZE;
 	if (!raddr) {
 		if (c->e.match == TRANS_MATCH_3TUPLE)
 			return -EDESTADDRREQ;
-		addr = c->e.raddr;
+		addr = &c->e.raddr;
 	} else {
-		addr = *raddr;
+		addr = raddr;
+		if (unlikely(addr->family != c->e.laddr.family))
+			return -EINVAL;
+	}
+
+	/* larger datagrams are sent as IP fragments (IPv4 only) */
+	if (len > udp_max_payload(addr)) {
+		if (len > UDP_MAX_DATAGRAM_SIZE || netaddr_is_ipv6(addr))
+			return -EMSGSIZE;
+		nr = udp_nr_frags(len);
+		if (nr > UDP_MAX_FRAGS || nr > c->outq_cap)
+			return -EMSGSIZE;
 	}
 
 	spin_lock_np(&c->outq_lock);
 
 	/* block until there is an actionable event */
-	while (c->outq_len >= c->outq_cap && !c->shutdown)
+	while (c->outq_len + nr > c->outq_cap && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
 
 	/* is the socket shutdown? */
 	if (c->shutdown) {
@@ -398,12 +564,21 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 		return -EPIPE;
 	}
 
-	c->outq_len++;
+	c->outq_len += nr;
 	spin_unlock_np(&c->outq_lock);
 
+	if (nr > 1) {
+		struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+
+		ret = udp_send_frags(&iov, 1, len, &c->e.laddr, addr, c);
+		return ret ? ret : len;
+	}
+
 	m = net_tx_alloc_mbuf();
-	if (unlikely(!m))
+	if (unlikely(!m)) {
+		udp_tx_unreserve(c, 1);
 		return -ENOBUFS;
+	}
 
 	/* write datagram payload */
 	payload = mbuf_put(m, len);
@@ -413,9 +588,9 @@ ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 	m->release = udp_tx_release_mbuf;
 	m->release_data = (unsigned long)c;
 
-	ret = udp_send_raw(m, len, c->e.laddr, addr);
+	ret = udp_send_raw(m, len, &c->e.laddr, addr);
 	if (unlikely(ret)) {
-		net_tx_release_mbuf(m);
+		mbuf_free(m);
 		return ret;
 	}
 
@@ -456,12 +631,252 @@ ssize_t udp_write(udpconn_t *c, const void *buf, size_t len)
 	return udp_write_to(c, buf, len, NULL);
 }
 
+/**
+ * udp_read_batch - reads several datagrams from a UDP socket
+ * @c: the UDP socket
+ * @msgs: an array of messages to fill
+ * @n: the number of messages in @msgs
+ *
+ * Each message's @buf (of size @cap) receives a datagram, and its @len and
+ * @raddr are set to the datagram's (possibly truncated) length and source.
+ * The ingress queue is locked only once per call.
+ *
+ * WARNING: This a blocking function. It will wait until at least one datagram
+ * is available, an error occurs, or the socket is shutdown.
+ *
+ * Returns the number of messages filled. If the socket has been shutdown,
+ * returns 0. If an error occurs, returns < 0 to indicate the error code.
+ */
+ssize_t udp_read_batch(udpconn_t *c, struct udp_msg *msgs, int n)
+{
+	struct mbuf *ms[UDP_BATCH_MAX];
+	ssize_t ret;
+	int i, cnt;
+
+	if (unlikely(n <= 0))
+		return -EINVAL;
+	n = MIN(n, UDP_BATCH_MAX);
+
+	spin_lock_np(&c->inq_lock);
+	ret = udp_read_wait(c);
+	if (ret <= 0) {
+		spin_unlock_np(&c->inq_lock);
+		return ret;
+	}
+
+	/* pop as many mbufs as are available */
+	cnt = MIN(n, c->inq_len);
+	for (i = 0; i < cnt; i++)
+		ms[i] = mbufq_pop_head(&c->inq);
+	c->inq_len -= cnt;
+	udp_read_chain(c);
+
+	/* deliver the payloads */
+	for (i = 0; i < cnt; i++) {
+		msgs[i].len = mbuf_chain_copy(ms[i], msgs[i].buf, msgs[i].cap);
+		udp_get_raddr(c, ms[i], &msgs[i].raddr);
+		mbuf_free(ms[i]);
+	}
+
+	return cnt;
+}
+
+/*
+ * Sends a run of datagrams with the same destination IP. Returns the number
+ * sent, or an error if none were. Unsent mbufs are freed.
+ */
+static int udp_tx_burst(udpconn_t *c, struct mbuf **ms,
+			const struct netaddr **raddrs, int n)
+{
+	int i, ret;
+
+	for (i = 0; i < n; i++)
+		udp_push_hdr(ms[i], mbuf_length(ms[i]), &c->e.laddr, raddrs[i]);
+
+	/* there's no IPv6 burst path, so send the datagrams one by one */
+	if (unlikely(netaddr_is_ipv6(raddrs[0]))) {
+		for (i = 0; i < n; i++) {
+			ret = net_tx_ip6(ms[i], IPPROTO_UDP, raddrs[i]->ip6);
+			if (unlikely(ret))
+				break;
+		}
+		if (i == n)
+			return n;
+	} else {
+		ret = net_tx_ip_burst(ms, n, IPPROTO_UDP, raddrs[0]->ip);
+		if (likely(!ret))
+			return n;
+		i = 0;
+	}
+
+	ret = i > 0 ? i : ret;
+	while (i < n)
+		mbuf_free(ms[i++]);
+	return ret;
+}
+
+/**
+ * udp_write_batch - writes several datagrams to a UDP socket
+ * @c: the UDP socket
+ * @msgs: an array of messages to send (@buf, @len and @raddr are used)
+ * @n: the number of messages in @msgs
+ *
+ * If the socket was created with udp_dial(), the @raddr of each message is
+ * ignored. The egress queue is locked only once per call, and consecutive
+ * datagrams to the same IP are handed to the driver in one burst. Unlike
+ * udp_write(), datagrams are not fragmented, so each must fit in the MTU.
+ *
+ * WARNING: This a blocking function. It will wait until space in the transmit
+ * buffer is available or the socket is shutdown. It may send fewer datagrams
+ * than requested if the transmit buffer fills up.
+ *
+ * Returns the number of datagrams sent. If an error occurs before any were
+ * sent, returns < 0 to indicate the error code.
+ */
+ssize_t udp_write_batch(udpconn_t *c, const struct udp_msg *msgs, int n)
+{
+	struct mbuf *ms[UDP_BATCH_MAX];
+	const struct netaddr *raddrs[UDP_BATCH_MAX];
+	int i, start, cnt, ret;
+
+	if (unlikely(n <= 0))
+		return -EINVAL;
+	n = MIN(n, UDP_BATCH_MAX);
+
+	for (i = 0; i < n; i++) {
+		if (c->e.match == TRANS_MATCH_5TUPLE)
+			raddrs[i] = &c->e.raddr;
+		else if (!netaddr_is_ipv6(&msgs[i].raddr) &&
+			 msgs[i].raddr.ip == 0)
+			return -EDESTADDRREQ;
+		else if (msgs[i].raddr.family != c->e.laddr.family)
+			return -EINVAL;
+		else
+			raddrs[i] = &msgs[i].raddr;
+		if (msgs[i].len > udp_max_payload(raddrs[i]))
+			return -EMSGSIZE;
+	}
+
+	spin_lock_np(&c->outq_lock);
+
+	/* block until there is an actionable event */
+	while (c->outq_len >= c->outq_cap && !c->shutdown) {
+		if (c->nonblocking) {
+			spin_unlock_np(&c->outq_lock);
+			return -EAGAIN;
+		}
+		waitq_wait(&c->outq_wq, &c->outq_lock);
+	}
+
+	/* is the socket shutdown? */
+	if (c->shutdown) {
+		spin_unlock_np(&c->outq_lock);
+		return -EPIPE;
+	}
+
+	/* reserve as many slots as are available */
+	cnt = MIN(n, c->outq_cap - c->outq_len);
+	c->outq_len += cnt;
+	spin_unlock_np(&c->outq_lock);
+
+	for (i = 0; i < cnt; i++) {
+		ms[i] = net_tx_alloc_mbuf();
+		if (unlikely(!ms[i]))
+			break;
+
+		memcpy(mbuf_put(ms[i], msgs[i].len), msgs[i].buf, msgs[i].len);
+		ms[i]->release = udp_tx_release_mbuf;
+		ms[i]->release_data = (unsigned long)c;
+	}
+	if (unlikely(i < cnt)) {
+		udp_tx_unreserve(c, cnt - i);
+		cnt = i;
+		if (cnt == 0)
+			return -ENOBUFS;
+	}
+
+	/* transmit runs of datagrams that share a destination IP */
+	for (start = 0, i = 1; i <= cnt; i++) {
+		if (i < cnt && netaddr_ip_equal(raddrs[i], raddrs[start]))
+			continue;
+		ret = udp_tx_burst(c, &ms[start], &raddrs[start], i - start);
+		if (unlikely(ret < i - start)) {
+			/* the rest of the batch was never sent */
+			while (i < cnt)
+				mbuf_free(ms[i++]);
+			if (ret > 0)
+				start += ret;
+			return start > 0 ? start : ret;
+		}
+		start = i;
+	}
+
+	return cnt;
+}
+
+/**
+ * udp_set_nonblocking - makes reads and writes fail instead of blocking
+ * @c: the UDP socket
+ * @nonblocking: if true, reads and writes return -EAGAIN instead of waiting
+ */
+void udp_set_nonblocking(udpconn_t *c, bool nonblocking)
+{
+	c->nonblocking = nonblocking;
+}
+
+/**
+ * udp_poll_arm - registers a UDP socket with a poll waiter
+ * @c: the UDP socket
+ * @w: the poll waiter
+ * @mask: the events of interest (POLLEV_*)
+ * @data: the data to report with events
+ *
+ * Events that are already pending are reported immediately. Afterwards, events
+ * are only reported on transitions (edge-triggered).
+ */
+void udp_poll_arm(udpconn_t *c, poll_waiter_t *w, unsigned int mask,
+		  unsigned long data)
+{
+	unsigned int events = 0;
+
+	spin_lock_np(&c->inq_lock);
+	spin_lock_np(&c->outq_lock);
+	poll_arm_events(w, &c->poll, mask, data);
+	if (!mbufq_empty(&c->inq))
+		events |= POLLEV_IN;
+	if (c->outq_len < c->outq_cap)
+		events |= POLLEV_OUT;
+	if (c->inq_err)
+		events |= POLLEV_ERR;
+	if (c->shutdown)
+		events |= POLLEV_HUP;
+	if (events)
+		poll_trigger_events(&c->poll, events);
+	spin_unlock_np(&c->outq_lock);
+	spin_unlock_np(&c->inq_lock);
+}
+
+/**
+ * udp_poll_disarm - unregisters a UDP socket from its poll waiter
+ * @c: the UDP socket
+ */
+void udp_poll_disarm(udpconn_t *c)
+{
+	spin_lock_np(&c->inq_lock);
+	spin_lock_np(&c->outq_lock);
+	poll_disarm(&c->poll);
+	spin_unlock_np(&c->outq_lock);
+	spin_unlock_np(&c->inq_lock);
+}
+
 static void __udp_shutdown(udpconn_t *c)
 {
 	spin_lock_np(&c->inq_lock);
 	spin_lock_np(&c->outq_lock);
 	BUG_ON(c->shutdown);
 	c->shutdown = true;
+	if (c->poll.waiter)
+		poll_trigger_events(&c->poll, POLLEV_HUP);
 	spin_unlock_np(&c->outq_lock);
 	spin_unlock_np(&c->inq_lock);
 
@@ -502,6 +917,8 @@ void udp_close(udpconn_t *c)
 
 	BUG_ON(!waitq_empty(&c->inq_wq));
 	BUG_ON(!waitq_empty(&c->outq_wq));
+	if (c->poll.waiter)
+		udp_poll_disarm(c);
 
 	/* free all in-flight mbufs */
 	while (true) {
@@ -528,30 +945,114 @@ void udp_close(udpconn_t *c)
  * Parallel API
  */
 
+/* a per-kthread queue of datagrams for a pooled spawner */
+struct udpspawn_shard {
+	spinlock_t		lock;
+	bool			shutdown;
+	int			qlen;
+	struct mbufq		q;
+	waitq_t			wq;
+
+	/* counters */
+	uint64_t		queued;
+	uint64_t		dropped;
+	uint64_t		served;
+} __aligned(CACHE_LINE_SIZE);
+
 struct udpspawner {
 	struct trans_entry	e;
 	udpspawn_fn_t		fn;
 
+	/* pooled mode only (see udp_create_spawner_pool()) */
+	udpspawn_admit_fn_t	admit;
+	int			max_inflight;
+	atomic_t		inflight;
+	waitgroup_t		workers;
+	struct udpspawn_shard	*shards;
+
 	struct kref ref;
 	struct flow_registration flow;
 };
 
+static void udp_fill_spawn_data(struct udp_spawn_data *d,
+				struct trans_entry *e, struct mbuf *m)
+{
+	const struct udp_hdr *udphdr = mbuf_transport_hdr(m, *udphdr);
+
+	d->buf = mbuf_data(m);
+	d->len = mbuf_length(m);
+	d->laddr = e->laddr;
+	net_hdr_get_addrs(m, NULL, &d->raddr);
+	d->raddr.port = ntoh16(udphdr->src_port);
+	d->release_data = m;
+}
+
+/* queues an ingress packet for the handler pool of the local kthread */
+static void udp_par_recv_pool(udpspawner_t *s, struct mbuf *m)
+{
+	struct udpspawn_shard *sh;
+	struct udp_spawn_data d;
+	thread_t *th;
+	int inflight;
+
+	sh = &s->shards[getk()->kthread_idx];
+	spin_lock(&sh->lock);
+	if (unlikely(sh->shutdown))
+		goto drop;
+
+	/* admission control happens before any work is done */
+	inflight = atomic_fetch_and_add(&s->inflight, 1);
+	if (inflight >= s->max_inflight)
+		goto drop_inflight;
+	if (s->admit) {
+		udp_fill_spawn_data(&d, &s->e, m);
+		if (!s->admit(&d, inflight))
+			goto drop_inflight;
+	}
+
+	mbufq_push_tail(&sh->q, m);
+	sh->qlen++;
+	sh->queued++;
+	th = waitq_signal(&sh->wq, &sh->lock);
+	spin_unlock(&sh->lock);
+	putk();
+
+	waitq_signal_finish(th);
+	return;
+
+drop_inflight:
+	atomic_dec(&s->inflight);
+drop:
+	sh->dropped++;
+	spin_unlock(&sh->lock);
+	putk();
+	mbuf_drop(m);
+}
+
 /* handles ingress packets with parallel threads */
 static void udp_par_recv(struct trans_entry *e, struct mbuf *m)
 {
 	udpspawner_t *s = container_of(e, udpspawner_t, e);
-	const struct ip_hdr *iphdr;
-	const struct udp_hdr *udphdr;
 	struct udp_spawn_data *d;
 	thread_t *th;
 
-	iphdr = mbuf_network_hdr(m, *iphdr);
-	udphdr = mbuf_pull_hdr_or_null(m, *udphdr);
-	if (unlikely(!udphdr)) {
+	if (unlikely(!mbuf_pull_hdr_or_null(m, struct udp_hdr))) {
 		mbuf_free(m);
 		return;
 	}
 
+	/* handlers expect a contiguous buffer */
+	if (unlikely(m->frag_next)) {
+		m = ipfrag_linearize(m);
+		if (!m)
+			return;
+	}
+
+	if (s->shards) {
+		udp_par_recv_pool(s, m);
+		return;
+	}
+
 	th = thread_create_with_buf((thread_fn_t)s->fn,
 				    (void **)&d, sizeof(*d));
 	if (unlikely(!th)) {
@@ -559,12 +1060,7 @@ static void udp_par_recv(struct trans_entry *e, struct mbuf *m)
 		return;
 	}
 
-	d->buf = mbuf_data(m);
-	d->len = mbuf_length(m);
-	d->laddr = e->laddr;
-	d->raddr.ip = ntoh32(iphdr->saddr);
-	d->raddr.port = ntoh16(udphdr->src_port);
-	d->release_data = m;
+	udp_fill_spawn_data(d, e, m);
 	thread_ready(th);
 }
 
@@ -573,9 +1069,80 @@ static const struct trans_ops udp_par_ops = {
 	.recv = udp_par_recv,
 };
 
+/* pops a queued packet, preferring the local shard */
+static struct mbuf *udp_pool_steal(udpspawner_t *s, int home)
+{
+	struct udpspawn_shard *sh;
+	struct mbuf *m = NULL;
+	int i, idx;
+
+	for (i = 1; i < maxks; i++) {
+		idx = (home + i) % maxks;
+		sh = &s->shards[idx];
+		if (ACCESS_ONCE(sh->qlen) == 0 || !spin_try_lock_np(&sh->lock))
+			continue;
+		m = mbufq_pop_head(&sh->q);
+		if (m) {
+			sh->qlen--;
+			sh->served++;
+		}
+		spin_unlock_np(&sh->lock);
+		if (m)
+			break;
+	}
+
+	return m;
+}
+
+struct udpspawn_worker_arg {
+	udpspawner_t	*s;
+	int		home;
+};
+
+/* a long-lived handler thread of a pooled spawner */
+static void udp_pool_worker(void *arg)
+{
+	struct udpspawn_worker_arg *a = arg;
+	udpspawner_t *s = a->s;
+	struct udpspawn_shard *sh = &s->shards[a->home];
+	struct udp_spawn_data d;
+	struct mbuf *m;
+
+	while (true) {
+		spin_lock_np(&sh->lock);
+		while (!(m = mbufq_pop_head(&sh->q)) && !sh->shutdown) {
+			/* look for packets queued on other kthreads first */
+			spin_unlock_np(&sh->lock);
+			m = udp_pool_steal(s, a->home);
+			if (m)
+				goto handle;
+			spin_lock_np(&sh->lock);
+			if (mbufq_empty(&sh->q) && !sh->shutdown)
+				waitq_wait(&sh->wq, &sh->lock);
+		}
+		if (!m) {
+			spin_unlock_np(&sh->lock);
+			break;
+		}
+		sh->qlen--;
+		sh->served++;
+		spin_unlock_np(&sh->lock);
+
+handle:
+		udp_fill_spawn_data(&d, &s->e, m);
+		s->fn(&d);
+		atomic_dec(&s->inflight);
+	}
+
+	waitgroup_done(&s->workers);
+}
+
 static void udp_release_spawner(struct rcu_head *h)
 {
 	udpspawner_t *s = container_of(h, udpspawner_t, e.rcu);
+
+	/* the handlers drained the queues before exiting */
+	free(s->shards);
 	sfree(s);
 }
 
@@ -586,6 +1153,41 @@ static void udp_release_spawner_ref(struct kref *ref)
 }
 
 
+static udpspawner_t *udp_alloc_spawner(const struct netaddr *laddr,
+					udpspawn_fn_t fn)
+{
+	udpspawner_t *s;
+
+	s = smalloc(sizeof(*s));
+	if (!s)
+		return NULL;
+
+	kref_init(&s->ref);
+	trans_init_3tuple(&s->e, IPPROTO_UDP, &udp_par_ops, laddr);
+	s->fn = fn;
+	s->admit = NULL;
+	s->max_inflight = 0;
+	atomic_write(&s->inflight, 0);
+	s->shards = NULL;
+	return s;
+}
+
+static int udp_register_spawner(udpspawner_t *s)
+{
+	int ret;
+
+	ret = trans_table_add(&s->e);
+	if (ret)
+		return ret;
+
+	s->flow.kthread_affinity = 0;
+	s->flow.e = &s->e;
+	s->flow.ref = &s->ref;
+	s->flow.release = udp_release_spawner_ref;
+	register_flow(&s->flow);
+	return 0;
+}
+
 /**
  * udp_create_spawner - creates a UDP spawner for ingress datagrams
  * @laddr: the local address to bind to
@@ -600,79 +1202,201 @@ int udp_create_spawner(struct netaddr laddr, udpspawn_fn_t fn,
 	udpspawner_t *s;
 	int ret;
 
-	/* only can support one local IP so far */
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_resolve_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
 
-	s = smalloc(sizeof(*s));
+	s = udp_alloc_spawner(&laddr, fn);
 	if (!s)
 		return -ENOMEM;
 
-	kref_init(&s->ref);
-	trans_init_3tuple(&s->e, IPPROTO_UDP, &udp_par_ops, laddr);
-	s->fn = fn;
-	ret = trans_table_add(&s->e);
+	ret = udp_register_spawner(s);
 	if (ret) {
 		sfree(s);
 		return ret;
 	}
 
-	s->flow.kthread_affinity = 0;
-	s->flow.e = &s->e;
-	s->flow.ref = &s->ref;
-	s->flow.release = udp_release_spawner_ref;
-	register_flow(&s->flow);
+	*s_out = s;
+	return 0;
+}
+
+static void udp_pool_shutdown(udpspawner_t *s)
+{
+	struct udpspawn_shard *sh;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		sh = &s->shards[i];
+		spin_lock_np(&sh->lock);
+		sh->shutdown = true;
+		spin_unlock_np(&sh->lock);
+		waitq_release(&sh->wq);
+	}
+
+	waitgroup_wait(&s->workers);
+}
+
+/**
+ * udp_create_spawner_pool - creates a UDP spawner backed by a handler pool
+ * @laddr: the local address to bind to
+ * @fn: a handler function for each datagram
+ * @workers: the number of handler threads per kthread
+ * @max_inflight: the maximum number of queued and running datagrams
+ * @admit: an optional admission hook (can be NULL)
+ * @s_out: if successful, set to a pointer to the spawner
+ *
+ * Unlike udp_create_spawner(), datagrams are queued on the kthread that
+ * received them and handled by long-lived threads, so no thread is created per
+ * datagram. Idle handlers take datagrams from other kthreads' queues. Once
+ * @max_inflight datagrams are outstanding, or @admit returns false, further
+ * datagrams are dropped on arrival. @admit runs in softirq context with the
+ * queue lock held, so it must not block.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int udp_create_spawner_pool(struct netaddr laddr, udpspawn_fn_t fn,
+			    int workers, int max_inflight,
+			    udpspawn_admit_fn_t admit, udpspawner_t **s_out)
+{
+	struct udpspawn_worker_arg *a;
+	udpspawner_t *s;
+	thread_t *th;
+	int i, j, ret;
+
+	if (workers <= 0 || max_inflight <= 0)
+		return -EINVAL;
+
+	ret = net_resolve_laddr(&laddr, NULL);
+	if (ret)
+		return ret;
+
+	s = udp_alloc_spawner(&laddr, fn);
+	if (!s)
+		return -ENOMEM;
+
+	s->admit = admit;
+	s->max_inflight = max_inflight;
+	waitgroup_init(&s->workers);
+	s->shards = aligned_alloc(CACHE_LINE_SIZE,
+				  sizeof(struct udpspawn_shard) * maxks);
+	if (!s->shards) {
+		sfree(s);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < maxks; i++) {
+		struct udpspawn_shard *sh = &s->shards[i];
+
+		memset(sh, 0, sizeof(*sh));
+		spin_lock_init(&sh->lock);
+		mbufq_init(&sh->q);
+		waitq_init(&sh->wq);
+	}
+
+	/* start the handlers before any datagrams can arrive */
+	for (i = 0; i < maxks; i++) {
+		for (j = 0; j < workers; j++) {
+			th = thread_create_with_buf(udp_pool_worker,
+						    (void **)&a, sizeof(*a));
+			if (unlikely(!th)) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+
+			a->s = s;
+			a->home = i;
+			waitgroup_add(&s->workers, 1);
+			thread_ready(th);
+		}
+	}
+
+	ret = udp_register_spawner(s);
+	if (ret)
+		goto fail;
 
 	*s_out = s;
 	return 0;
+
+fail:
+	udp_pool_shutdown(s);
+	free(s->shards);
+	sfree(s);
+	return ret;
+}
+
+/**
+ * udp_spawner_get_stats - gets the counters of a pooled UDP spawner
+ * @s: the spawner
+ * @stats: a pointer to store the counters
+ *
+ * The counters are summed over all kthreads, and are zero for spawners not
+ * created with udp_create_spawner_pool().
+ */
+void udp_spawner_get_stats(udpspawner_t *s, struct udp_spawner_stats *stats)
+{
+	struct udpspawn_shard *sh;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!s->shards)
+		return;
+
+	for (i = 0; i < maxks; i++) {
+		sh = &s->shards[i];
+		spin_lock_np(&sh->lock);
+		stats->queued += sh->queued;
+		stats->dropped += sh->dropped;
+		stats->served += sh->served;
+		stats->backlog += sh->qlen;
+		spin_unlock_np(&sh->lock);
+	}
+	stats->inflight = atomic_read(&s->inflight);
 }
 
 /**
  * udp_destroy_spawner - unregisters and frees a UDP spawner
  * @s: the spawner to free
+ *
+ * For pooled spawners, datagrams that were already queued are handled before
+ * this returns.
  */
 void udp_destroy_spawner(udpspawner_t *s)
 {
 	trans_table_remove(&s->e);
 	deregister_flow(&s->flow);
+	if (s->shards)
+		udp_pool_shutdown(s);
 	kref_put(&s->ref, udp_release_spawner_ref);
 }
 
-/**
- * udp_send - sends a UDP datagram
- * @buf: the payload to send
- * @len: the length of the payload
- * @laddr: the local UDP address
- * @raddr: the remote UDP address
- *
- * Returns the number of payload bytes sent in the datagram. If an error
- * occurs, returns < 0 to indicate the error code.
- */
-ssize_t udp_send(const void *buf, size_t len,
-		 struct netaddr laddr, struct netaddr raddr)
+/* sends a datagram between resolved addresses */
+static ssize_t __udp_sendv(const struct iovec *iov, int iovcnt, size_t len,
+			   const struct netaddr *laddr,
+			   const struct netaddr *raddr)
 {
-	void *payload;
 	struct mbuf *m;
-	int ret;
+	int i, ret;
 
-	if (len > udp_get_payload_size())
+	if (len > UDP_MAX_DATAGRAM_SIZE)
 		return -EMSGSIZE;
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
-	if (laddr.port == 0)
-		return -EINVAL;
+
+	/* larger datagrams are sent as IP fragments (IPv4 only) */
+	if (len > udp_max_payload(raddr)) {
+		if (udp_nr_frags(len) > UDP_MAX_FRAGS || netaddr_is_ipv6(raddr))
+			return -EMSGSIZE;
+		ret = udp_send_frags(iov, iovcnt, len, laddr, raddr, NULL);
+		return ret ? ret : len;
+	}
 
 	m = net_tx_alloc_mbuf();
 	if (unlikely(!m))
 		return -ENOBUFS;
 
 	/* write datagram payload */
-	payload = mbuf_put(m, len);
-	memcpy(payload, buf, len);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(mbuf_put(m, iov[i].iov_len),
+		       iov[i].iov_base, iov[i].iov_len);
+	}
 
 	ret = udp_send_raw(m, len, laddr, raddr);
 	if (unlikely(ret)) {
@@ -683,42 +1407,79 @@ ssize_t udp_send(const void *buf, size_t len,
 	return len;
 }
 
+/**
+ * udp_send - sends a UDP datagram
+ * @buf: the payload to send
+ * @len: the length of the payload
+ * @laddr: the local UDP address
+ * @raddr: the remote UDP address
+ *
+ * Returns the number of payload bytes sent in the datagram. If an error
+ * occurs, returns < 0 to indicate the error code.
+ */
+ssize_t udp_send(const void *buf, size_t len,
+		 struct netaddr laddr, struct netaddr raddr)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+	int ret;
+
+	ret = net_resolve_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
+	if (laddr.port == 0)
+		return -EINVAL;
+
+	return __udp_sendv(&iov, 1, len, &laddr, &raddr);
+}
+
 ssize_t udp_sendv(const struct iovec *iov, int iovcnt,
 		  struct netaddr laddr, struct netaddr raddr)
 {
-	struct mbuf *m;
 	int i, ret;
-	ssize_t len = 0;
+	size_t len = 0;
 
-	if (laddr.ip == 0)
-		laddr.ip = netcfg.addr;
-	else if (laddr.ip != netcfg.addr)
-		return -EINVAL;
+	ret = net_resolve_laddr(&laddr, &raddr);
+	if (ret)
+		return ret;
 	if (laddr.port == 0)
 		return -EINVAL;
 
-	m = net_tx_alloc_mbuf();
-	if (unlikely(!m))
-		return -ENOBUFS;
-
-	/* write datagram payload */
-	for (i = 0; i < iovcnt; i++) {
+	for (i = 0; i < iovcnt; i++)
 		len += iov[i].iov_len;
-		if (unlikely(len > udp_get_payload_size())) {
-			mbuf_free(m);
-			return -EMSGSIZE;
-		}
-		memcpy(mbuf_put(m, iov[i].iov_len),
-		       iov[i].iov_base, iov[i].iov_len);
-	}
+	return __udp_sendv(iov, iovcnt, len, &laddr, &raddr);
+}
 
-	ret = udp_send_raw(m, len, laddr, raddr);
-	if (unlikely(ret)) {
-		mbuf_free(m);
-		return ret;
-	}
+/**
+ * udp_respond - sends a response datagram to a spawner datagram
+ * @buf: a buffer containing the datagram
+ * @len: the length of the datagram
+ * @d: the UDP spawner data
+ *
+ * The addresses came from a received datagram, so unlike udp_send(), they
+ * don't need to be resolved or copied.
+ *
+ * Returns @len if successful, otherwise fail.
+ */
+ssize_t udp_respond(const void *buf, size_t len, struct udp_spawn_data *d)
+{
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
 
-	return len;
+	if (unlikely(d->laddr.family != d->raddr.family))
+		return -EINVAL;
+	return __udp_sendv(&iov, 1, len, &d->laddr, &d->raddr);
+}
+
+ssize_t udp_respondv(const struct iovec *iov, int iovcnt,
+		     struct udp_spawn_data *d)
+{
+	size_t len = 0;
+	int i;
+
+	if (unlikely(d->laddr.family != d->raddr.family))
+		return -EINVAL;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return __udp_sendv(iov, iovcnt, len, &d->laddr, &d->raddr);
 }
 
 /**
@@ -1,5 +1,8 @@
 /*
- * poll.h - support for event polling (similar to select/epoll/poll, etc.)
+ * poll.c - support for event polling (similar to select/epoll/poll, etc.)
+ *
+ * Triggers are edge-triggered: each trigger is queued on its waiter at most
+ * once, accumulating event flags until the waiter consumes it.
  */
 
 #include <runtime/poll.h>
@@ -22,13 +25,28 @@ void poll_init(poll_waiter_t *w)
  * @data: data to provide when the trigger fires
  */
 void poll_arm(poll_waiter_t *w, poll_trigger_t *t, unsigned long data)
+{
+	poll_arm_events(w, t, POLLEV_ALL, data);
+}
+
+/**
+ * poll_arm_events - registers a trigger with a waiter for a set of events
+ * @w: the waiter to register with
+ * @t: the trigger to register
+ * @mask: the events (POLLEV_*) of interest
+ * @data: data to provide when the trigger fires
+ */
+void poll_arm_events(poll_waiter_t *w, poll_trigger_t *t, unsigned int mask,
+		     unsigned long data)
 {
 	if (WARN_ON(t->waiter != NULL))
 		return;
 
-	t->waiter = w;
 	t->triggered = false;
+	t->mask = mask;
+	t->events = 0;
 	t->data = data;
+	store_release(&t->waiter, w);
 }
 
 /**
@@ -47,9 +65,9 @@ void poll_disarm(poll_trigger_t *t)
 		list_del(&t->link);
 		t->triggered = false;
 	}
-	spin_unlock_np(&w->lock);
-
+	t->events = 0;
 	t->waiter = NULL;
+	spin_unlock_np(&w->lock);
 }
 
 /**
@@ -67,6 +85,8 @@ unsigned long poll_wait(poll_waiter_t *w)
 		spin_lock_np(&w->lock);
 		t = list_pop(&w->triggered, poll_trigger_t, link);
 		if (t) {
+			t->triggered = false;
+			t->events = 0;
 			spin_unlock_np(&w->lock);
 			return t->data;
 		}
@@ -76,21 +96,64 @@ unsigned long poll_wait(poll_waiter_t *w)
 }
 
 /**
- * poll_trigger - fires a trigger
- * @w: the waiter to wake up (if it is waiting)
- * @t: the trigger that fired
+ * poll_wait_events - collects the events of triggers that have fired
+ * @w: the waiter to wait on
+ * @evs: an array to store the events
+ * @max: the capacity of @evs
+ * @block: if true, waits until at least one trigger has fired
+ *
+ * Each trigger is reported at most once per call, with all of the events
+ * that accumulated since it was last reported.
+ *
+ * Returns the number of events stored in @evs.
  */
-void poll_trigger(poll_waiter_t *w, poll_trigger_t *t)
+int poll_wait_events(poll_waiter_t *w, struct poll_event *evs, int max,
+		     bool block)
+{
+	thread_t *th = thread_self();
+	poll_trigger_t *t;
+	int n = 0;
+
+	spin_lock_np(&w->lock);
+	while (block && list_empty(&w->triggered)) {
+		w->waiting_th = th;
+		thread_park_and_unlock_np(&w->lock);
+		spin_lock_np(&w->lock);
+	}
+
+	while (n < max) {
+		t = list_pop(&w->triggered, poll_trigger_t, link);
+		if (!t)
+			break;
+		evs[n].data = t->data;
+		evs[n].events = t->events;
+		t->triggered = false;
+		t->events = 0;
+		n++;
+	}
+	spin_unlock_np(&w->lock);
+
+	return n;
+}
+
+static void __poll_trigger(poll_waiter_t *w, poll_trigger_t *t,
+			   unsigned int events)
 {
 	thread_t *wth = NULL;
 
 	spin_lock_np(&w->lock);
+	/* the trigger may have been disarmed concurrently */
+	if (unlikely(t->waiter != w)) {
+		spin_unlock_np(&w->lock);
+		return;
+	}
+	t->events |= events;
 	if (t->triggered) {
 		spin_unlock_np(&w->lock);
 		return;
 	}
 	t->triggered = true;
-	list_add(&w->triggered, &t->link);
+	list_add_tail(&w->triggered, &t->link);
 	if (w->waiting_th) {
 		wth = w->waiting_th;
 		w->waiting_th = NULL;
@@ -100,3 +163,28 @@ void poll_trigger(poll_waiter_t *w, poll_trigger_t *t)
 	if (wth)
 		thread_ready(wth);
 }
+
+/**
+ * poll_trigger - fires a trigger
+ * @w: the waiter to wake up (if it is waiting)
+ * @t: the trigger that fired
+ */
+void poll_trigger(poll_waiter_t *w, poll_trigger_t *t)
+{
+	__poll_trigger(w, t, 0);
+}
+
+/**
+ * poll_trigger_events - fires a trigger if it is armed for any of @events
+ * @t: the trigger that fired
+ * @events: the events (POLLEV_*) that occurred
+ */
+void poll_trigger_events(poll_trigger_t *t, unsigned int events)
+{
+	poll_waiter_t *w = load_acquire(&t->waiter);
+
+	if (!w || !(events & t->mask))
+		return;
+
+	__poll_trigger(w, t, events & t->mask);
+}
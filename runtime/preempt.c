@@ -25,6 +25,7 @@ static void set_preempt_needed(void)
 static void handle_sigusr1(int s, siginfo_t *si, void *c)
 {
 	STAT(PREEMPTIONS)++;
+	trace_sched(TRACE_PREEMPT, 0, thread_self());
 	set_preempt_needed();
 	preempt_cede = true;
 
@@ -39,6 +40,7 @@ static void handle_sigusr1(int s, siginfo_t *si, void *c)
 static void handle_sigusr2(int s, siginfo_t *si, void *c)
 {
 	STAT(PREEMPTIONS)++;
+	trace_sched(TRACE_PREEMPT, 1, thread_self());
 
 	/*
 	 * handle the case when SIGUSR1 is delivered while preemption is
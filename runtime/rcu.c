@@ -10,9 +10,16 @@
  * each kthread count is either even & >= the previous value (to detect parking)
  * or odd & > the previous value (to detect rescheduling).
  *
- * FIXME: Freeing objects is expensive with this minimal implementation. This
- * should be fine as long as RCU updates are rare. The Linux Kernel uses several
- * more optimized strategies that we may want to consider in the future.
+ * Grace periods are numbered by @rcu_gp_seq, which is odd while a grace period
+ * is in progress. Each kthread queues freed objects on its own callback lists,
+ * tagged with the sequence number that must be reached before they can be
+ * released, so rcu_free() never touches shared state in the common case.
+ * Whenever a kthread enters the scheduler (and has therefore passed through a
+ * quiescent state), it checks whether the current grace period has ended or a
+ * new one needs to start. A kthread about to park also waits its turn to poll,
+ * so grace periods still finish once every kthread has gone idle. When a grace
+ * period ends, the per-kthread RCU worker threads with expired callbacks are
+ * made runnable to release them.
  */
 
 #include <base/stddef.h>
@@ -20,74 +27,208 @@
 #include <runtime/rcu.h>
 #include <runtime/sync.h>
 #include <runtime/thread.h>
-#include <runtime/timer.h>
 
 #include "defs.h"
 
-/* the time RCU waits before checking if it can free objects */
-#define RCU_SLEEP_PERIOD (10 * ONE_MS)
+struct rcu_kthread {
+	spinlock_t		lock;
+	bool			worker_parked;
+	thread_t		*worker;
 
-/* Protects @rcu_head. */
-static DEFINE_SPINLOCK(rcu_lock);
-/* The head of the list of objects waiting to be freed */
-static struct rcu_head *rcu_head;
+	/* callbacks waiting for @wait_seq to complete */
+	struct rcu_head		*wait_head;
+	struct rcu_head		**wait_tail;
+	unsigned long		wait_seq;
+
+	/* callbacks queued after the current grace period began */
+	struct rcu_head		*next_head;
+	struct rcu_head		**next_tail;
+	unsigned long		next_seq;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct rcu_kthread rcu_ks[NCPU];
+
+/* the grace period sequence number (odd while in progress) */
+unsigned long rcu_gp_seq;
+/* the highest sequence number any queued callback is waiting for */
+atomic64_t rcu_gp_req;
+
+/* serializes grace period state transitions */
+static DEFINE_SPINLOCK(rcu_gp_lock);
+/* the RCU generation of each kthread when the grace period started */
+static unsigned int rcu_gp_snap[NCPU];
+/* kthreads below this index have passed through a quiescent state */
+static unsigned int rcu_gp_scan_idx;
 
 #ifdef DEBUG
 __thread int rcu_read_count;
 #endif /* DEBUG */
 
+/* returns the sequence number after which a full grace period has elapsed */
+static inline unsigned long rcu_seq_snap(void)
+{
+	mb();
+	return (load_acquire(&rcu_gp_seq) + 3) & ~0x1UL;
+}
+
+static inline bool rcu_seq_done(unsigned long seq)
+{
+	return (long)(load_acquire(&rcu_gp_seq) - seq) >= 0;
+}
+
+static void rcu_request_seq(unsigned long seq)
+{
+	long req = atomic64_read(&rcu_gp_req);
+
+	while ((long)(seq - req) > 0) {
+		if (atomic64_cmpxchg(&rcu_gp_req, req, seq))
+			break;
+		req = atomic64_read(&rcu_gp_req);
+	}
+}
+
+static bool rcu_gen_quiescent(unsigned int idx, unsigned int snap)
+{
+	unsigned int gen = load_acquire(&ks[idx]->rcu_gen);
+
+	return (gen & 0x1) == 0x0 || gen != snap;
+}
+
+static void rcu_wake_workers(void)
+{
+	struct rcu_kthread *r;
+	thread_t *th;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		r = &rcu_ks[i];
+		if (!ACCESS_ONCE(r->wait_head) ||
+		    !rcu_seq_done(ACCESS_ONCE(r->wait_seq)))
+			continue;
+
+		spin_lock(&r->lock);
+		th = NULL;
+		if (r->worker_parked && r->wait_head &&
+		    rcu_seq_done(r->wait_seq)) {
+			r->worker_parked = false;
+			th = r->worker;
+		}
+		spin_unlock(&r->lock);
+
+		if (th)
+			thread_ready_locked(th);
+	}
+}
+
+/**
+ * __rcu_sched_poll - advances grace period processing
+ * @k: the local kthread (must be in the scheduler)
+ * @parking: true if @k is about to park
+ *
+ * Called by the scheduler with the kthread lock held, right after the local
+ * kthread has passed through a quiescent state.
+ *
+ * Normally gives up if another kthread is already polling. A kthread that is
+ * about to park may be the last one left to poll though, so it waits for the
+ * lock instead, and keeps going for as long as grace periods can complete.
+ */
+void __rcu_sched_poll(struct kthread *k, bool parking)
+{
+	unsigned long seq;
+	int i;
+
+	assert_spin_lock_held(&k->lock);
+
+	if (parking)
+		spin_lock(&rcu_gp_lock);
+	else if (!spin_try_lock(&rcu_gp_lock))
+		return;
+
+again:
+	seq = rcu_gp_seq;
+	if (seq & 0x1) {
+		/* check if the current grace period has ended */
+		for (i = rcu_gp_scan_idx; i < nrks; i++) {
+			if (!rcu_gen_quiescent(i, rcu_gp_snap[i]))
+				break;
+		}
+		rcu_gp_scan_idx = i;
+		if (i != nrks) {
+			spin_unlock(&rcu_gp_lock);
+			return;
+		}
+
+		store_release(&rcu_gp_seq, ++seq);
+		rcu_wake_workers();
+	}
+
+	/* start the next grace period if callbacks are waiting for it */
+	if ((long)(atomic64_read(&rcu_gp_req) - seq) > 0) {
+		store_release(&rcu_gp_seq, seq + 1);
+		mb();
+		for (i = 0; i < nrks; i++)
+			rcu_gp_snap[i] = load_acquire(&ks[i]->rcu_gen);
+		rcu_gp_scan_idx = 0;
+
+		/* parked kthreads won't poll, so it may already be over */
+		if (parking)
+			goto again;
+	}
+
+	spin_unlock(&rcu_gp_lock);
+}
+
 static void rcu_worker(void *arg)
 {
+	struct rcu_kthread *r = (struct rcu_kthread *)arg;
 	struct rcu_head *head, *next;
-	unsigned int last_rcu_gen[NCPU];
-	unsigned int gen;
-	int i;
 
 	while (true) {
-		/* check if any RCU objects are waiting to be freed */
-		spin_lock_np(&rcu_lock);
-		if (!rcu_head) {
-			spin_unlock_np(&rcu_lock);
-			timer_sleep(RCU_SLEEP_PERIOD);
+		spin_lock_np(&r->lock);
+		if (!r->wait_head || !rcu_seq_done(r->wait_seq)) {
+			r->worker_parked = true;
+			thread_park_and_unlock_np(&r->lock);
 			continue;
 		}
-		head = rcu_head;
-		rcu_head = NULL;
-		spin_unlock_np(&rcu_lock);
 
-		/* read the RCU generation counters */
-		for (i = 0; i < nrks; i++)
-			last_rcu_gen[i] = load_acquire(&ks[i]->rcu_gen);
-
-		while (true) {
-			/* wait for RCU generation counters to increase */
-			timer_sleep(RCU_SLEEP_PERIOD);
-
-			/* read the RCU generation counters again */
-			for (i = 0; i < nrks; i++) {
-				gen = load_acquire(&ks[i]->rcu_gen);
-				if ((gen & 0x1) == 0x1 &&
-				    gen == last_rcu_gen[i]) {
-					break;
-				}
-			}
-
-			/* did any of the RCU generation checks fail? */
-			if (i != maxks)
-				continue;
-
-			/* actually free the RCU objects */
-			while (head) {
-				next = head->next;
-				head->func(head);
-				head = next;
-			}
+		/* detach the expired callbacks and advance the next batch */
+		head = r->wait_head;
+		r->wait_head = r->next_head;
+		r->wait_tail = r->next_head ? r->next_tail : &r->wait_head;
+		r->wait_seq = r->next_seq;
+		r->next_head = NULL;
+		r->next_tail = &r->next_head;
+		spin_unlock_np(&r->lock);
 
-			break;
+		/* actually free the RCU objects */
+		while (head) {
+			next = head->next;
+			head->func(head);
+			head = next;
 		}
 	}
 }
 
+static void rcu_enqueue(struct rcu_kthread *r, struct rcu_head *head)
+{
+	unsigned long seq = rcu_seq_snap();
+
+	assert_spin_lock_held(&r->lock);
+
+	head->next = NULL;
+	if (!r->wait_head || r->wait_seq == seq) {
+		r->wait_seq = seq;
+		*r->wait_tail = head;
+		r->wait_tail = &head->next;
+	} else {
+		r->next_seq = seq;
+		*r->next_tail = head;
+		r->next_tail = &head->next;
+	}
+
+	rcu_request_seq(seq);
+}
+
 /**
  * rcu_free - frees an RCU object after the quiescent period
  * @head: the RCU head structure embedded within the object
@@ -95,12 +236,15 @@ static void rcu_worker(void *arg)
  */
 void rcu_free(struct rcu_head *head, rcu_callback_t func)
 {
+	struct rcu_kthread *r;
+
 	head->func = func;
 
-	spin_lock_np(&rcu_lock);
-	head->next = rcu_head;
-	rcu_head = head;
-	spin_unlock_np(&rcu_lock);
+	r = &rcu_ks[getk()->kthread_idx];
+	spin_lock(&r->lock);
+	rcu_enqueue(r, head);
+	spin_unlock(&r->lock);
+	putk();
 }
 
 struct sync_arg {
@@ -121,23 +265,88 @@ static void synchronize_rcu_finish(struct rcu_head *head)
  */
 void synchronize_rcu(void)
 {
+	struct rcu_kthread *r;
 	struct sync_arg tmp;
 
 	tmp.rcu.func = synchronize_rcu_finish;
 	tmp.th = thread_self();
 
-	spin_lock_np(&rcu_lock);
-	tmp.rcu.next = rcu_head;
-	rcu_head = &tmp.rcu;
-	thread_park_and_unlock_np(&rcu_lock);
+	r = &rcu_ks[getk()->kthread_idx];
+	spin_lock(&r->lock);
+	rcu_enqueue(r, &tmp.rcu);
+	thread_park_and_unlock_np(&r->lock);
+}
+
+/**
+ * synchronize_rcu_expedited - blocks until it is safe to free an RCU object,
+ * without waiting for other callbacks to be batched into a grace period
+ *
+ * Polls the RCU generation of every kthread directly, so it completes as soon
+ * as each kthread has passed through a quiescent state. This is more expensive
+ * than synchronize_rcu() and should only be used on latency-sensitive paths.
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void synchronize_rcu_expedited(void)
+{
+	unsigned int snap[NCPU];
+	int i, n = load_acquire(&nrks);
+
+	mb();
+	for (i = 0; i < n; i++)
+		snap[i] = load_acquire(&ks[i]->rcu_gen);
+
+	i = 0;
+	while (true) {
+		for (; i < n; i++) {
+			if (!rcu_gen_quiescent(i, snap[i]))
+				break;
+		}
+		if (i == n)
+			break;
+
+		/* passes the local kthread through a quiescent state */
+		thread_yield();
+	}
 }
 
 /**
- * rcu_init_late - starts the RCU reclaim thread
+ * rcu_init - initializes the per-kthread RCU callback lists
+ *
+ * Returns 0 if succesful.
+ */
+int rcu_init(void)
+{
+	struct rcu_kthread *r;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		r = &rcu_ks[i];
+		spin_lock_init(&r->lock);
+		r->wait_tail = &r->wait_head;
+		r->next_tail = &r->next_head;
+	}
+
+	return 0;
+}
+
+/**
+ * rcu_init_late - starts the RCU reclaim threads
  *
  * Returns 0 if succesful.
  */
 int rcu_init_late(void)
 {
-	return thread_spawn(rcu_worker, NULL);
+	struct rcu_kthread *r;
+	int i;
+
+	for (i = 0; i < maxks; i++) {
+		r = &rcu_ks[i];
+		r->worker = thread_create(rcu_worker, r);
+		if (!r->worker)
+			return -ENOMEM;
+		r->worker_parked = true;
+	}
+
+	return 0;
 }
@@ -82,6 +82,7 @@ static __noreturn void jmp_thread(thread_t *th)
 	assert_preempt_disabled();
 	assert(th->thread_ready);
 
+	trace_sched(TRACE_RUN, 0, th);
 	__self = th;
 	th->thread_ready = false;
 	if (unlikely(load_acquire(&th->thread_running))) {
@@ -106,6 +107,7 @@ static void jmp_thread_direct(thread_t *oldth, thread_t *newth)
 	assert_preempt_disabled();
 	assert(newth->thread_ready);
 
+	trace_sched(TRACE_RUN, 0, newth);
 	__self = newth;
 	newth->thread_ready = false;
 	if (unlikely(load_acquire(&newth->thread_running))) {
@@ -217,8 +219,10 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 		/* steal half the tasks */
 		avail = div_up(avail, 2);
 		rq_tail = r->rq_tail;
-		for (i = 0; i < avail; i++)
+		for (i = 0; i < avail; i++) {
 			l->rq[i] = r->rq[rq_tail++ % RUNTIME_RQ_SIZE];
+			trace_sched(TRACE_STEAL, r->kthread_idx, l->rq[i]);
+		}
 		store_release(&r->rq_tail, rq_tail);
 
 		/*
@@ -231,6 +235,7 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 				break;
 
 			list_add_tail(&l->rq_overflow, &th->link);
+			trace_sched(TRACE_STEAL, r->kthread_idx, th);
 			overflow++;
 		}
 
@@ -251,6 +256,7 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 		ACCESS_ONCE(r->q_ptrs->rq_tail)++;
 		update_oldest_tsc(r);
 		spin_unlock(&r->lock);
+		trace_sched(TRACE_STEAL, r->kthread_idx, th);
 		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
 		ACCESS_ONCE(l->q_ptrs->oldest_tsc) = th->ready_tsc;
 		ACCESS_ONCE(l->q_ptrs->rq_head)++;
@@ -315,6 +321,7 @@ static __noreturn __noinline void schedule(void)
 	store_release(&l->rcu_gen, l->rcu_gen + 1);
 	ACCESS_ONCE(l->q_ptrs->rcu_gen) += 1;
 	assert((l->rcu_gen & 0x1) == 0x0);
+	rcu_sched_poll(l, false);
 
 #ifdef GC
 	if (unlikely(get_gc_gen() != l->local_gc_gen))
@@ -381,6 +388,11 @@ again:
 		goto again;
 	}
 
+	/* make sure parking doesn't stall an RCU grace period */
+	rcu_sched_poll(l, true);
+	if (l->rq_head != l->rq_tail)
+		goto done;
+
 	l->parked = true;
 	spin_unlock(&l->lock);
 
@@ -411,6 +423,7 @@ done:
 	/* update exit stat counters */
 	end_tsc = rdtsc();
 	STAT(SCHED_CYCLES) += end_tsc - start_tsc;
+	HIST(RQ_WAIT_CYCLES, end_tsc - th->ready_tsc);
 	last_tsc = end_tsc;
 	if (cores_have_affinity(th->last_cpu, l->curr_cpu))
 		STAT(LOCAL_RUNS)++;
@@ -464,6 +477,7 @@ static __always_inline void enter_schedule(thread_t *curth)
 	/* pop the next runnable thread from the queue */
 	th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
 	ACCESS_ONCE(k->q_ptrs->rq_tail)++;
+	HIST(RQ_WAIT_CYCLES, now - th->ready_tsc);
 
 	/* move overflow tasks into the runqueue */
 	if (unlikely(!list_empty(&k->rq_overflow)))
@@ -553,6 +567,7 @@ static void thread_ready_prepare(struct kthread *k, thread_t *th)
 	/* prepare thread to be runnable */
 	th->thread_ready = true;
 	th->ready_tsc = rdtsc();
+	trace_sched(TRACE_READY, 0, th);
 	if (cores_have_affinity(th->last_cpu, k->curr_cpu))
 		STAT(LOCAL_WAKES)++;
 	else
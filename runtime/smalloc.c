@@ -12,15 +12,14 @@
 #include "defs.h"
 
 #define SMALLOC_MAG_SIZE	8
-#define SMALLOC_BITS            15
-#define SMALLOC_MIN_SIZE	SLAB_MIN_SIZE
-#define SMALLOC_MAX_SIZE        (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
 BUILD_ASSERT(SMALLOC_MIN_SIZE >= SLAB_MIN_SIZE);
 
 static struct slab smalloc_slabs[SMALLOC_BITS];
 static struct tcache *smalloc_tcaches[SMALLOC_BITS];
 static DEFINE_PERTHREAD(struct tcache_perthread, smalloc_pts[SMALLOC_BITS]);
 
+__thread bool smalloc_ready;
+
 /**
  * smalloc_size_to_idx - converts a size to a cache index
  * @size: the size of the item to allocate
@@ -104,6 +103,18 @@ void sfree(void *item)
 	preempt_enable();
 }
 
+/**
+ * smalloc_usable_size - gets the usable size of an item
+ * @item: an item allocated with smalloc()
+ *
+ * Returns the size of the item's size class, which may be larger than the
+ * size originally requested.
+ */
+size_t smalloc_usable_size(void *item)
+{
+	return addr_to_page(item)->snode->size;
+}
+
 /**
  * smalloc_init - initializes slab malloc
  *
@@ -140,5 +151,6 @@ int smalloc_init_thread(void)
 		tcache_init_perthread(smalloc_tcaches[i],
 				      &perthread_get(smalloc_pts[i]));
 
+	smalloc_ready = true;
 	return 0;
 }
@@ -30,13 +30,19 @@ static bool softirq_storage_pending(struct kthread *k)
 	return storage_available_completions(&k->storage_q);
 }
 
+static bool softirq_loopback_pending(struct kthread *k)
+{
+	return ACCESS_ONCE(k->loopbackq.head) != NULL;
+}
+
 /**
  * softirq_pending - is there a softirq pending?
  */
 bool softirq_pending(struct kthread *k)
 {
 	return softirq_iokernel_pending(k) || softirq_directpath_pending(k) ||
-	       softirq_timer_pending(k) || softirq_storage_pending(k);
+	       softirq_timer_pending(k) || softirq_storage_pending(k) ||
+	       softirq_loopback_pending(k);
 }
 
 /**
@@ -82,6 +88,13 @@ bool softirq_sched(struct kthread *k)
 		work_done = true;
 	}
 
+	/* check for loopback softirq work */
+	if (!k->loopback_busy && softirq_loopback_pending(k)) {
+		k->loopback_busy = true;
+		thread_ready_head_locked(k->loopback_softirq);
+		work_done = true;
+	}
+
 	return work_done;
 }
 
@@ -131,6 +144,13 @@ bool softirq_run(void)
 		work_done = true;
 	}
 
+	/* check for loopback softirq work */
+	if (!k->loopback_busy && softirq_loopback_pending(k)) {
+		k->loopback_busy = true;
+		thread_ready_head_locked(k->loopback_softirq);
+		work_done = true;
+	}
+
 	spin_unlock(&k->lock);
 	putk();
 
@@ -4,20 +4,30 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
 #include <base/time.h>
 #include <base/tcache.h>
 #include <base/thread.h>
+#include <base/hist.h>
 #include <runtime/thread.h>
+#include <runtime/timer.h>
 #include <runtime/udp.h>
 #include <runtime/tcp.h>
+#include <runtime/stat.h>
+#include <runtime/trace.h>
 
 #include "defs.h"
 
 /* port 40 is permanently reserved, so should be fine for now */
 #define STAT_PORT	40
+/* how often snapshots are published to shared memory */
+#define STAT_SHM_INTERVAL_US	(10 * ONE_MS)
+
+/* the SysV key of the shared memory export segment (0 if disabled) */
+mem_key_t cfg_stat_shm_key;
 
 static const char *stat_names[] = {
 	/* scheduler counters */
@@ -46,6 +56,24 @@ static const char *stat_names[] = {
 	"rx_tcp_out_of_order",
 	"rx_tcp_text_cycles",
 	"txq_overflow",
+	"rx_frags",
+	"rx_reassembled",
+	"rx_reassembly_fails",
+	"tx_frags",
+	"tcp_syncookies_sent",
+	"tcp_syncookies_ok",
+	"tx_tcp_acks",
+	"tcp_acks_coalesced",
+	"tcp_keepalive_probes",
+	"tcp_keepalive_timeouts",
+	"tcp_idle_compactions",
+	"trans_tbl_resizes",
+
+	/* storage counters */
+	"storage_cache_hits",
+	"storage_cache_misses",
+	"storage_cache_readahead",
+	"storage_cache_writebacks",
 
 	/* directpath counters */
 	"flow_steering_cycles",
@@ -60,9 +88,72 @@ static const char *tc_stat_names[] = {
 	"pool_free"
 };
 
+static const char *hist_names[] = {
+	"rq_wait_cycles",
+	"softirq_rx_batch",
+	"tcp_rtt_us",
+
+	/* base library histograms */
+	"tcache_slow_cycles",
+};
+
+#define NR_TC_STATS	ARRAY_SIZE(tc_stat_names)
+#define NR_COUNTERS	(STAT_NR + NR_TC_STATS)
+#define NR_HISTS	(HIST_NR + 1)
 
 /* must correspond exactly to STAT_* enum definitions in defs.h */
 BUILD_ASSERT(ARRAY_SIZE(stat_names) == STAT_NR);
+/* must correspond exactly to HIST_* enum definitions in defs.h */
+BUILD_ASSERT(ARRAY_SIZE(hist_names) == NR_HISTS);
+
+static void stat_gather(uint64_t *stats, struct hist *hists)
+{
+	int i, j, k;
+
+	memset(stats, 0, sizeof(uint64_t) * NR_COUNTERS);
+
+	/* gather stats from each kthread */
+	for (i = 0; i < nrks; i++) {
+		for (j = 0; j < STAT_NR; j++)
+			stats[j] += ks[i]->stats[j];
+	}
+
+	for_each_thread(i) {
+		stats[STAT_NR + 0] += perthread_get_remote(mag_free, i);
+		stats[STAT_NR + 1] += perthread_get_remote(mag_alloc, i);
+		stats[STAT_NR + 2] += perthread_get_remote(pool_alloc, i);
+		stats[STAT_NR + 3] += perthread_get_remote(pool_free, i);
+	}
+
+	if (!hists)
+		return;
+
+	memset(hists, 0, sizeof(struct hist) * NR_HISTS);
+	for (i = 0; i < nrks; i++) {
+		for (j = 0; j < HIST_NR; j++) {
+			for (k = 0; k < HIST_BUCKETS; k++)
+				hists[j].buckets[k] += ks[i]->hists[j].buckets[k];
+		}
+	}
+
+	for_each_thread(i) {
+		struct hist *h = &perthread_get_remote(tcache_slow_hist, i);
+		for (k = 0; k < HIST_BUCKETS; k++)
+			hists[HIST_NR].buckets[k] += h->buckets[k];
+	}
+}
+
+static void stat_fill_hdr(struct stat_snapshot_hdr *hdr)
+{
+	hdr->magic = STAT_SNAPSHOT_MAGIC;
+	hdr->version = STAT_SNAPSHOT_VERSION;
+	hdr->nr_counters = NR_COUNTERS;
+	hdr->nr_hists = NR_HISTS;
+	hdr->nr_buckets = HIST_BUCKETS;
+	hdr->names_len = 0;
+	hdr->cycles_per_us = cycles_per_us;
+	hdr->tsc = rdtsc();
+}
 
 static int append_stat(char **pos, char *end, const char *name, uint64_t val)
 {
@@ -77,25 +168,11 @@ static int append_stat(char **pos, char *end, const char *name, uint64_t val)
 
 static ssize_t stat_write_buf(char *buf, size_t len)
 {
-	uint64_t stats[STAT_NR], tc_stats[4];
+	uint64_t stats[NR_COUNTERS];
 	char *pos = buf, *end = buf + len;
-	int i, j, ret;
-
-	memset(stats, 0, sizeof(stats));
-	memset(tc_stats, 0, sizeof(tc_stats));
-
-	/* gather stats from each kthread */
-	for (i = 0; i < nrks; i++) {
-		for (j = 0; j < STAT_NR; j++)
-			stats[j] += ks[i]->stats[j];
-	}
+	int j, ret;
 
-	for_each_thread(i) {
-		tc_stats[0] += perthread_get_remote(mag_free, i);
-		tc_stats[1] += perthread_get_remote(mag_alloc, i);
-		tc_stats[2] += perthread_get_remote(pool_alloc, i);
-		tc_stats[3] += perthread_get_remote(pool_free, i);
-	}
+	stat_gather(stats, NULL);
 
 	/* write out the stats to the buffer */
 	for (j = 0; j < STAT_NR; j++) {
@@ -104,8 +181,8 @@ static ssize_t stat_write_buf(char *buf, size_t len)
 			return ret;
 	}
 
-	for (j = 0; j < ARRAY_SIZE(tc_stats); j++) {
-		ret = append_stat(&pos, end, tc_stat_names[j], tc_stats[j]);
+	for (j = 0; j < NR_TC_STATS; j++) {
+		ret = append_stat(&pos, end, tc_stat_names[j], stats[STAT_NR + j]);
 		if (ret)
 			return ret;
 	}
@@ -123,21 +200,128 @@ static ssize_t stat_write_buf(char *buf, size_t len)
 	return pos - buf;
 }
 
+static ssize_t stat_write_names(char *buf, size_t len)
+{
+	char *pos = buf, *end = buf + len;
+	int j, ret;
+
+	for (j = 0; j < NR_COUNTERS + NR_HISTS; j++) {
+		if (j < STAT_NR)
+			ret = snprintf(pos, end - pos, "%s,", stat_names[j]);
+		else if (j < NR_COUNTERS)
+			ret = snprintf(pos, end - pos, "%s,",
+				       tc_stat_names[j - STAT_NR]);
+		else
+			ret = snprintf(pos, end - pos, "%s,",
+				       hist_names[j - NR_COUNTERS]);
+		if (ret < 0)
+			return -EINVAL;
+		if (ret >= end - pos)
+			return -E2BIG;
+		pos += ret;
+	}
+
+	pos[-1] = '\0'; /* clip off last ',' */
+	return pos - buf;
+}
+
+static ssize_t stat_write_binary(char *buf, size_t len)
+{
+	struct stat_snapshot_hdr *hdr = (struct stat_snapshot_hdr *)buf;
+	struct stat_hist_range *r;
+	struct hist hists[NR_HISTS];
+	char *pos = buf, *end = buf + len;
+	int i, first, last;
+
+	if (len < sizeof(*hdr) + sizeof(uint64_t) * NR_COUNTERS)
+		return -E2BIG;
+
+	stat_fill_hdr(hdr);
+	hdr->seq = 0;
+	pos += sizeof(*hdr);
+	stat_gather((uint64_t *)pos, hists);
+	pos += sizeof(uint64_t) * NR_COUNTERS;
+
+	/* only encode the range of non-zero buckets of each histogram */
+	for (i = 0; i < NR_HISTS; i++) {
+		for (first = 0; first < HIST_BUCKETS; first++) {
+			if (hists[i].buckets[first])
+				break;
+		}
+		for (last = HIST_BUCKETS; last > first; last--) {
+			if (hists[i].buckets[last - 1])
+				break;
+		}
+
+		if (end - pos < sizeof(*r) + sizeof(uint64_t) * (last - first))
+			return -E2BIG;
+		r = (struct stat_hist_range *)pos;
+		r->first = first;
+		r->count = last - first;
+		pos += sizeof(*r);
+		memcpy(pos, &hists[i].buckets[first],
+		       sizeof(uint64_t) * (last - first));
+		pos += sizeof(uint64_t) * (last - first);
+	}
+
+	return pos - buf;
+}
+
+static ssize_t stat_trace_cmd(char *cmd, char *buf, size_t len)
+{
+	char path[64];
+	int ret;
+
+	strtok(cmd, "\r\n");
+	if (!strcmp(cmd, "traceon")) {
+		ret = sched_trace_start();
+	} else if (!strcmp(cmd, "traceoff")) {
+		sched_trace_stop();
+		ret = 0;
+	} else if (!strcmp(cmd, "tracedump")) {
+		/* never take a path from the network, it could be anywhere */
+		snprintf(path, sizeof(path), "/tmp/sched_trace.%d", getpid());
+		ret = sched_trace_dump(path);
+	} else {
+		ret = -EINVAL;
+	}
+
+	ret = snprintf(buf, len, "%d", ret);
+	if (ret >= len)
+		return -E2BIG;
+	return ret + 1;
+}
+
+static ssize_t stat_handle_cmd(const char *cmd, size_t cmd_len,
+			       char *buf, size_t len)
+{
+	if (cmd_len >= 5 && !strncmp(cmd, "statb", 5))
+		return stat_write_binary(buf, len);
+	if (cmd_len >= 5 && !strncmp(cmd, "statn", 5))
+		return stat_write_names(buf, len);
+	return stat_write_buf(buf, len);
+}
+
 static void stat_tcp_worker(void *arg)
 {
 	struct {
 		size_t resp_size;
 		char buf[65535];
 	} resp;
+	char cmd[32];
 	ssize_t ret, len, done;
 	tcpconn_t *c = arg;
 
 	while (true) {
-		ret = tcp_read(c, resp.buf, sizeof(resp.buf));
+		ret = tcp_read(c, cmd, sizeof(cmd) - 1);
 		if (ret <= 0)
 			goto done;
 
-		len = stat_write_buf(resp.buf, sizeof(resp.buf));
+		cmd[ret] = '\0';
+		if (!strncmp(cmd, "trace", 5))
+			len = stat_trace_cmd(cmd, resp.buf, sizeof(resp.buf));
+		else
+			len = stat_handle_cmd(cmd, ret, resp.buf, sizeof(resp.buf));
 		if (len < 0) {
 			WARN();
 			continue;
@@ -171,6 +355,7 @@ static void stat_tcp_server(void *arg)
 
 	laddr.ip = 0;
 	laddr.port = STAT_PORT;
+	laddr.family = NETADDR_IPV4;
 
 	ret = tcp_listen(laddr, 4096, &q);
 	BUG_ON(ret);
@@ -194,6 +379,7 @@ static void stat_worker_udp(void *arg)
 
 	laddr.ip = 0;
 	laddr.port = STAT_PORT;
+	laddr.family = NETADDR_IPV4;
 
 	ret = udp_listen(laddr, &c);
 	if (ret) {
@@ -208,7 +394,7 @@ static void stat_worker_udp(void *arg)
 		if (strncmp(buf, "stat", cmd_len) != 0)
 			continue;
 
-		len = stat_write_buf(buf, payload_size);
+		len = stat_handle_cmd(buf, ret, buf, payload_size);
 		if (len < 0) {
 			log_err("stat: couldn't generate stat buffer");
 			continue;
@@ -220,6 +406,58 @@ static void stat_worker_udp(void *arg)
 	}
 }
 
+static void stat_shm_publisher(void *arg)
+{
+	struct stat_snapshot_hdr *hdr = arg;
+	uint64_t *stats = (uint64_t *)(hdr + 1);
+	struct hist *hists = (struct hist *)(stats + NR_COUNTERS);
+	uint64_t tmp_stats[NR_COUNTERS];
+	struct hist tmp_hists[NR_HISTS];
+
+	while (true) {
+		stat_gather(tmp_stats, tmp_hists);
+
+		/* readers retry while @seq is odd or changed during the copy */
+		store_release(&hdr->seq, hdr->seq + 1);
+		hdr->tsc = rdtsc();
+		memcpy(stats, tmp_stats, sizeof(tmp_stats));
+		memcpy(hists, tmp_hists, sizeof(tmp_hists));
+		store_release(&hdr->seq, hdr->seq + 1);
+
+		timer_sleep(STAT_SHM_INTERVAL_US);
+	}
+}
+
+static int stat_shm_init(void)
+{
+	struct stat_snapshot_hdr *hdr;
+	char names[4096];
+	ssize_t names_len;
+	size_t len;
+
+	names_len = stat_write_names(names, sizeof(names));
+	if (names_len < 0)
+		return names_len;
+	names_len++; /* include the NUL terminator */
+
+	len = sizeof(*hdr) + sizeof(uint64_t) * NR_COUNTERS +
+	      sizeof(struct hist) * NR_HISTS + names_len;
+	hdr = mem_map_shm(cfg_stat_shm_key, NULL, align_up(len, PGSIZE_4KB),
+			  PGSIZE_4KB, false);
+	if (hdr == MAP_FAILED) {
+		log_err("stat: couldn't map shared memory key %x",
+			cfg_stat_shm_key);
+		return -ENOMEM;
+	}
+
+	memset(hdr, 0, len);
+	stat_fill_hdr(hdr);
+	hdr->names_len = names_len;
+	memcpy((char *)hdr + len - names_len, names, names_len);
+
+	return thread_spawn(stat_shm_publisher, hdr);
+}
+
 /**
  * stat_init_late - starts the stat responder thread
  *
@@ -229,6 +467,12 @@ int stat_init_late(void)
 {
 	int ret;
 
+	if (cfg_stat_shm_key) {
+		ret = stat_shm_init();
+		if (ret)
+			return ret;
+	}
+
 	ret = thread_spawn(stat_tcp_server, NULL);
 	if (ret)
 		return ret;
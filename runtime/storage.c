@@ -2,8 +2,13 @@
  * storage.c
  */
 
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/log.h>
 #include <runtime/storage.h>
 
+#include "defs.h"
 
 uint32_t block_size;
 uint64_t num_blocks;
@@ -11,7 +16,6 @@ uint64_t num_blocks;
 #ifdef DIRECT_STORAGE
 #include <stdio.h>
 #include <base/hash.h>
-#include <base/log.h>
 #include <base/mempool.h>
 #include <runtime/sync.h>
 
@@ -21,8 +25,6 @@ struct iovec;
 #include <spdk/nvme.h>
 #include <spdk/env.h>
 
-#include "defs.h"
-
 unsigned long storage_device_latency_us = 100;
 bool cfg_storage_enabled;
 
@@ -101,13 +103,8 @@ static void attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
 
 }
 
-/**
- * storage_write - write a payload to the nvme device
- *                 expects lba_count*storage_block_size() bytes to be allocated in the buffer
- *
- * returns -ENOMEM if no available memory, and -EIO if the write operation failed
- */
-int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+/* writes through a DMA-able bounce buffer */
+static int storage_spdk_write(const void *payload, uint64_t lba, uint32_t lba_count)
 {
 	int rc;
 	struct kthread *k;
@@ -165,13 +162,8 @@ done_np:
 	return rc;
 }
 
-/**
- * storage_read - read a payload from the nvme device
- *                expects lba_count*storage_block_size() bytes to be allocated in the buffer
- *
- * returns -ENOMEM if no available memory, and -EIO if the write operation failed
- */
-int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+/* reads through a DMA-able bounce buffer */
+static int storage_spdk_read(void *dest, uint64_t lba, uint32_t lba_count)
 {
 	int rc;
 	struct kthread *k;
@@ -226,6 +218,109 @@ done_np:
 	return rc;
 }
 
+static void storage_spdk_complete(void *arg,
+				  const struct spdk_nvme_cpl *completion)
+{
+	struct storage_req *req = arg;
+
+	storage_complete(req, spdk_nvme_cpl_is_error(completion) ? -EIO : 0);
+}
+
+static void storage_spdk_reset_sgl(void *arg, uint32_t offset)
+{
+	struct storage_req *req = arg;
+
+	req->sge_idx = 0;
+	while (offset >= req->iov[req->sge_idx].iov_len) {
+		offset -= req->iov[req->sge_idx].iov_len;
+		req->sge_idx++;
+	}
+	req->sge_off = offset;
+}
+
+static int storage_spdk_next_sge(void *arg, void **address, uint32_t *length)
+{
+	struct storage_req *req = arg;
+	const struct iovec *iov = &req->iov[req->sge_idx++];
+
+	*address = (unsigned char *)iov->iov_base + req->sge_off;
+	*length = iov->iov_len - req->sge_off;
+	req->sge_off = 0;
+	return 0;
+}
+
+static int storage_spdk_submit_one(struct storage_q *q,
+				   struct storage_req *req)
+{
+	void *buf = req->iov[0].iov_base;
+
+	if (req->iovcnt == 1 && req->op == STORAGE_OP_READ) {
+		return spdk_nvme_ns_cmd_read(spdk_namespace, q->spdk_qp_handle,
+					     buf, req->lba, req->lba_count,
+					     storage_spdk_complete, req, 0);
+	} else if (req->iovcnt == 1) {
+		return spdk_nvme_ns_cmd_write(spdk_namespace, q->spdk_qp_handle,
+					      buf, req->lba, req->lba_count,
+					      storage_spdk_complete, req, 0);
+	} else if (req->op == STORAGE_OP_READ) {
+		return spdk_nvme_ns_cmd_readv(spdk_namespace, q->spdk_qp_handle,
+					      req->lba, req->lba_count,
+					      storage_spdk_complete, req, 0,
+					      storage_spdk_reset_sgl,
+					      storage_spdk_next_sge);
+	}
+
+	return spdk_nvme_ns_cmd_writev(spdk_namespace, q->spdk_qp_handle,
+				       req->lba, req->lba_count,
+				       storage_spdk_complete, req, 0,
+				       storage_spdk_reset_sgl,
+				       storage_spdk_next_sge);
+}
+
+/* submits a batch of requests to this kthread's queue pair */
+static int storage_spdk_submit(struct storage_req **reqs, int nr)
+{
+	struct kthread *k;
+	struct storage_q *q;
+	int i;
+
+	if (!cfg_storage_enabled)
+		return -ENODEV;
+
+	k = getk();
+	q = &k->storage_q;
+	spin_lock(&q->lock);
+	for (i = 0; i < nr; i++) {
+		if (unlikely(storage_spdk_submit_one(q, reqs[i]) != 0))
+			break;
+	}
+	q->outstanding_reqs += i;
+	spin_unlock(&q->lock);
+	putk();
+
+	return i > 0 ? i : -EIO;
+}
+
+static void *storage_spdk_buf_alloc(size_t len)
+{
+	if (!cfg_storage_enabled)
+		return NULL;
+	return spdk_zmalloc(len, PGSIZE_4KB, NULL, SPDK_ENV_SOCKET_ID_ANY,
+			    SPDK_MALLOC_DMA);
+}
+
+static void storage_spdk_buf_free(void *buf)
+{
+	spdk_free(buf);
+}
+
+static int storage_spdk_buf_register(void *buf, size_t len)
+{
+	if (!cfg_storage_enabled)
+		return -ENODEV;
+	return spdk_mem_register(buf, len);
+}
+
 static int storage_softirq_one(struct storage_q *q)
 {
 	int ret;
@@ -248,11 +343,13 @@ void storage_softirq(void *arg)
 
 	while (true) {
 		preempt_disable();
+		trace_sched(TRACE_SOFTIRQ_START, TRACE_SOFTIRQ_STORAGE, NULL);
 		do {
 			spin_lock(&q->lock);
 			ret = storage_softirq_one(q);
 			spin_unlock(&q->lock);
 		} while (!preempt_needed() && ret > 0);
+		trace_sched(TRACE_SOFTIRQ_END, TRACE_SOFTIRQ_STORAGE, NULL);
 		k->storage_busy = false;
 		thread_park_and_preempt_enable();
 	}
@@ -351,11 +448,7 @@ int storage_init_thread(void)
 	return 0;
 }
 
-/**
- * storage_init - initializes storage
- *
- */
-int storage_init(void)
+static int storage_spdk_init(void)
 {
 	int shm_id, rc;
 	struct spdk_env_opts opts;
@@ -409,17 +502,36 @@ int storage_init(void)
 }
 
 #else
-int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+
+static int storage_spdk_write(const void *payload, uint64_t lba,
+			      uint32_t lba_count)
 {
 	return -ENODEV;
 }
 
-int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+static int storage_spdk_read(void *dest, uint64_t lba, uint32_t lba_count)
 {
 	return -ENODEV;
 }
 
-int storage_init(void)
+static int storage_spdk_submit(struct storage_req **reqs, int nr)
+{
+	return -ENODEV;
+}
+
+static void *storage_spdk_buf_alloc(size_t len)
+{
+	return NULL;
+}
+
+static void storage_spdk_buf_free(void *buf) {}
+
+static int storage_spdk_buf_register(void *buf, size_t len)
+{
+	return -ENODEV;
+}
+
+static int storage_spdk_init(void)
 {
 	return 0;
 }
@@ -429,4 +541,306 @@ int storage_init_thread(void)
 	return 0;
 }
 
-#endif
+#endif /* DIRECT_STORAGE */
+
+
+/*
+ * Asynchronous requests
+ *
+ * The request is handed to the backend (the in-memory device, if configured,
+ * otherwise SPDK), which calls storage_complete() once it finishes.
+ */
+
+/**
+ * storage_complete - finishes a request (called by backends)
+ * @req: the request
+ * @ret: 0 if successful, otherwise < 0
+ */
+void storage_complete(struct storage_req *req, int ret)
+{
+	storage_queue_t *sq = req->sq;
+	storage_cb_t cb = req->cb;
+	thread_t *th = NULL;
+
+	req->ret = ret;
+
+	spin_lock_np(&sq->lock);
+	sq->nr_outstanding--;
+	if (!cb) {
+		sq->nr_polled--;
+		list_add_tail(&sq->completed, &req->link);
+		sq->nr_completed++;
+		if (sq->waiter && sq->nr_completed >= sq->wait_min) {
+			th = sq->waiter;
+			sq->waiter = NULL;
+		}
+	}
+	spin_unlock_np(&sq->lock);
+
+	/* @req may already be collected, so only the callback can touch it */
+	if (th)
+		thread_ready(th);
+	if (cb)
+		cb(req);
+}
+
+static bool storage_req_valid(struct storage_req *req)
+{
+	size_t len = 0;
+	int i;
+
+	if (unlikely(req->op != STORAGE_OP_READ && req->op != STORAGE_OP_WRITE))
+		return false;
+	if (unlikely(req->iovcnt <= 0 || req->lba_count == 0))
+		return false;
+	if (unlikely(req->lba >= num_blocks ||
+		     req->lba_count > num_blocks - req->lba))
+		return false;
+
+	for (i = 0; i < req->iovcnt; i++)
+		len += req->iov[i].iov_len;
+	return len == (size_t)req->lba_count * block_size;
+}
+
+static void storage_queue_account(storage_queue_t *sq,
+				  struct storage_req **reqs, int nr, int sign)
+{
+	int i, polled = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!reqs[i]->cb)
+			polled++;
+	}
+
+	spin_lock_np(&sq->lock);
+	sq->nr_outstanding += sign * nr;
+	sq->nr_polled += sign * polled;
+	spin_unlock_np(&sq->lock);
+}
+
+/**
+ * storage_queue_init - initializes a storage queue
+ * @sq: the storage queue
+ */
+void storage_queue_init(storage_queue_t *sq)
+{
+	spin_lock_init(&sq->lock);
+	list_head_init(&sq->completed);
+	sq->nr_completed = 0;
+	sq->nr_outstanding = 0;
+	sq->nr_polled = 0;
+	sq->wait_min = 0;
+	sq->waiter = NULL;
+}
+
+/**
+ * storage_submit - submits a batch of requests
+ * @sq: the storage queue that collects the completions
+ * @reqs: the requests
+ * @nr: the number of requests
+ *
+ * The requests and their buffers must not be touched until they complete.
+ *
+ * Returns the number of requests submitted (submission stops at the first one
+ * that fails), or < 0 if none were.
+ */
+int storage_submit(storage_queue_t *sq, struct storage_req **reqs, int nr)
+{
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		if (unlikely(!storage_req_valid(reqs[i])))
+			break;
+		reqs[i]->sq = sq;
+	}
+	if (unlikely(i == 0))
+		return nr > 0 ? -EINVAL : 0;
+	nr = i;
+
+	/* completions can arrive before the backend returns */
+	storage_queue_account(sq, reqs, nr, 1);
+	if (storage_mem_enabled())
+		ret = storage_mem_submit(reqs, nr);
+	else
+		ret = storage_spdk_submit(reqs, nr);
+	if (unlikely(ret < nr))
+		storage_queue_account(sq, reqs + MAX(ret, 0),
+				      nr - MAX(ret, 0), -1);
+
+	return ret;
+}
+
+static int storage_queue_pop(storage_queue_t *sq, struct storage_req **reqs,
+			     int max)
+{
+	struct storage_req *req;
+	int n = 0;
+
+	assert_spin_lock_held(&sq->lock);
+
+	while (n < max) {
+		req = list_pop(&sq->completed, struct storage_req, link);
+		if (!req)
+			break;
+		reqs[n++] = req;
+	}
+	sq->nr_completed -= n;
+	return n;
+}
+
+/**
+ * storage_poll - collects completed requests without blocking
+ * @sq: the storage queue
+ * @reqs: an array to store the completed requests
+ * @max: the size of the array
+ *
+ * Returns the number of completed requests.
+ */
+int storage_poll(storage_queue_t *sq, struct storage_req **reqs, int max)
+{
+	int n;
+
+	if (!ACCESS_ONCE(sq->nr_completed))
+		return 0;
+
+	spin_lock_np(&sq->lock);
+	n = storage_queue_pop(sq, reqs, max);
+	spin_unlock_np(&sq->lock);
+	return n;
+}
+
+/**
+ * storage_wait - collects completed requests, blocking until enough finish
+ * @sq: the storage queue
+ * @reqs: an array to store the completed requests
+ * @min: the number of requests to wait for
+ * @max: the size of the array
+ *
+ * Only one thread may wait on a queue at a time. Returns early if fewer than
+ * @min requests (without callbacks) are outstanding.
+ *
+ * Returns the number of completed requests.
+ */
+int storage_wait(storage_queue_t *sq, struct storage_req **reqs,
+		 int min, int max)
+{
+	int n;
+
+	min = MIN(min, max);
+
+	spin_lock_np(&sq->lock);
+	while (sq->nr_completed < min &&
+	       sq->nr_completed + sq->nr_polled >= min) {
+		sq->wait_min = min;
+		sq->waiter = thread_self();
+		thread_park_and_unlock_np(&sq->lock);
+		spin_lock_np(&sq->lock);
+	}
+	n = storage_queue_pop(sq, reqs, max);
+	spin_unlock_np(&sq->lock);
+	return n;
+}
+
+/**
+ * storage_buf_alloc - allocates a buffer that can be used for direct I/O
+ * @len: the length in bytes
+ *
+ * Returns a buffer, or NULL if out of memory or there is no storage device.
+ */
+void *storage_buf_alloc(size_t len)
+{
+	if (storage_mem_enabled())
+		return aligned_alloc(PGSIZE_4KB, align_up(len, PGSIZE_4KB));
+	return storage_spdk_buf_alloc(len);
+}
+
+/**
+ * storage_buf_free - frees a buffer from storage_buf_alloc()
+ * @buf: the buffer
+ */
+void storage_buf_free(void *buf)
+{
+	if (storage_mem_enabled())
+		free(buf);
+	else
+		storage_spdk_buf_free(buf);
+}
+
+/**
+ * storage_buf_register - allows existing memory to be used for direct I/O
+ * @buf: the start of the memory (2MB aligned)
+ * @len: the length in bytes (a multiple of 2MB)
+ *
+ * Returns 0 if successful.
+ */
+int storage_buf_register(void *buf, size_t len)
+{
+	if (storage_mem_enabled())
+		return 0;
+	return storage_spdk_buf_register(buf, len);
+}
+
+/* the synchronous API on top of the asynchronous one */
+static int storage_rw_sync(int op, void *buf, uint64_t lba,
+			   uint32_t lba_count)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = (size_t)lba_count * block_size,
+	};
+	struct storage_req req = {
+		.op = op,
+		.lba = lba,
+		.lba_count = lba_count,
+		.iov = &iov,
+		.iovcnt = 1,
+	};
+	struct storage_req *reqp = &req;
+	storage_queue_t sq;
+	int ret;
+
+	storage_queue_init(&sq);
+	ret = storage_submit(&sq, &reqp, 1);
+	if (unlikely(ret < 0))
+		return ret;
+	storage_wait(&sq, &reqp, 1, 1);
+	return req.ret;
+}
+
+/**
+ * storage_write - write a payload to the nvme device
+ *                 expects lba_count*storage_block_size() bytes to be allocated in the buffer
+ *
+ * returns -ENOMEM if no available memory, and -EIO if the write operation failed
+ */
+int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+{
+	if (storage_mem_enabled())
+		return storage_rw_sync(STORAGE_OP_WRITE, (void *)payload, lba,
+				       lba_count);
+	return storage_spdk_write(payload, lba, lba_count);
+}
+
+/**
+ * storage_read - read a payload from the nvme device
+ *                expects lba_count*storage_block_size() bytes to be allocated in the buffer
+ *
+ * returns -ENOMEM if no available memory, and -EIO if the write operation failed
+ */
+int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+{
+	if (storage_mem_enabled())
+		return storage_rw_sync(STORAGE_OP_READ, dest, lba, lba_count);
+	return storage_spdk_read(dest, lba, lba_count);
+}
+
+/**
+ * storage_init - initializes storage
+ *
+ */
+int storage_init(void)
+{
+	if (storage_mem_enabled())
+		return storage_mem_init();
+	return storage_spdk_init();
+}
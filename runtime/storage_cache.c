@@ -0,0 +1,676 @@
+/*
+ * storage_cache.c - a block cache with read-ahead and write-back
+ *
+ * When "storage_cache_mb" is set, storage_cache_read() and
+ * storage_cache_write() keep recently used blocks in memory (on the runtime's
+ * NUMA node). The cache is split into shards, each a hash table of
+ * storage_block_size() frames with CLOCK eviction. Runs of
+ * CACHE_GROUP_BLOCKS adjacent blocks map to the same shard, so that adjacent
+ * dirty blocks can be written back together.
+ *
+ * Lookups don't take the shard lock. Each frame has a sequence count that is
+ * odd while its contents change, and a reader treats the block as missing
+ * (taking the locked path) if the count moved while it copied the data.
+ *
+ * A miss reads everything from the first missing block to the end of the
+ * request in one command. If the miss continues a sequential stream, the read
+ * is extended ahead of the request, up to "storage_cache_readahead" blocks.
+ *
+ * Writes only dirty the cache ("storage_cache_writeback", the default). Dirty
+ * blocks are written back in runs of adjacent blocks, every
+ * "storage_cache_flush_us", when half a shard is dirty, or by
+ * storage_cache_flush(). Otherwise, writes go to the device and update any
+ * cached copies.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/atomic.h>
+#include <base/hash.h>
+#include <base/log.h>
+#include <base/mem.h>
+#include <runtime/storage.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+#define CACHE_SHARDS		64
+#define CACHE_GROUP_SHIFT	6
+#define CACHE_GROUP_BLOCKS	(1 << CACHE_GROUP_SHIFT)
+#define CACHE_RA_STREAMS	16
+#define CACHE_NIL		UINT32_MAX
+#define CACHE_LBA_NONE		UINT64_MAX
+
+unsigned long cfg_storage_cache_mb;
+unsigned int cfg_storage_cache_readahead = 256;
+bool cfg_storage_cache_writeback = true;
+unsigned long cfg_storage_cache_flush_us = 100 * ONE_MS;
+
+struct cache_block {
+	uint64_t		lba;
+	uint32_t		seq;	/* odd while the frame is changing */
+	uint32_t		next;	/* the next frame in the hash chain */
+	bool			referenced;
+	bool			dirty;
+};
+
+struct cache_shard {
+	spinlock_t		lock;
+	unsigned int		hand;
+	unsigned int		nr_dirty;
+	mutex_t			flush_lock; /* orders writes to the device */
+	uint32_t		*buckets;
+	struct cache_block	*blocks;
+	unsigned char		*data;
+} __aligned(CACHE_LINE_SIZE);
+
+/* a sequential stream of misses */
+struct cache_ra_stream {
+	uint64_t		next;
+	unsigned int		window;
+};
+
+/* a dirty block being written back */
+struct cache_wb {
+	uint64_t		lba;
+	uint32_t		idx;
+	uint32_t		seq;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static unsigned int blocks_per_shard;
+static unsigned int bucket_mask;
+
+/* incremented whenever a write-back finishes */
+static atomic_t wb_gen;
+
+static DEFINE_SPINLOCK(ra_lock);
+static struct cache_ra_stream ra_streams[CACHE_RA_STREAMS];
+static unsigned int ra_victim;
+
+static inline struct cache_shard *cache_shard_of(uint64_t lba)
+{
+	uint32_t hash = hash_crc32c_one(0, lba >> CACHE_GROUP_SHIFT);
+
+	return &shards[hash % CACHE_SHARDS];
+}
+
+static inline uint32_t *cache_bucket(struct cache_shard *s, uint64_t lba)
+{
+	return &s->buckets[hash_crc32c_one(1, lba) & bucket_mask];
+}
+
+static inline unsigned char *cache_data(struct cache_shard *s, uint32_t idx)
+{
+	return s->data + (size_t)idx * block_size;
+}
+
+static inline void cache_stat_add(int counter, uint64_t val)
+{
+	preempt_disable();
+	myk()->stats[counter] += val;
+	preempt_enable();
+}
+
+/* copies a cached block without taking the lock */
+static bool cache_read_fast(struct cache_shard *s, uint64_t lba, void *dst)
+{
+	struct cache_block *b;
+	uint32_t idx, seq;
+	unsigned int n;
+
+	idx = ACCESS_ONCE(*cache_bucket(s, lba));
+	for (n = 0; idx != CACHE_NIL && n < blocks_per_shard; n++) {
+		b = &s->blocks[idx];
+		seq = ACCESS_ONCE(b->seq);
+		rmb();
+		if (ACCESS_ONCE(b->lba) == lba) {
+			if (seq & 1)
+				return false;
+			memcpy(dst, cache_data(s, idx), block_size);
+			rmb();
+			if (ACCESS_ONCE(b->seq) != seq)
+				return false;
+			if (!ACCESS_ONCE(b->referenced))
+				ACCESS_ONCE(b->referenced) = true;
+			return true;
+		}
+
+		/* a frame that was reused can lead onto another chain */
+		idx = ACCESS_ONCE(b->next);
+	}
+
+	return false;
+}
+
+static uint32_t cache_find(struct cache_shard *s, uint64_t lba)
+{
+	uint32_t idx;
+
+	assert_spin_lock_held(&s->lock);
+
+	for (idx = *cache_bucket(s, lba); idx != CACHE_NIL;
+	     idx = s->blocks[idx].next) {
+		if (s->blocks[idx].lba == lba)
+			return idx;
+	}
+
+	return CACHE_NIL;
+}
+
+static void cache_link(struct cache_shard *s, uint32_t idx)
+{
+	struct cache_block *b = &s->blocks[idx];
+	uint32_t *bucket = cache_bucket(s, b->lba);
+
+	b->next = *bucket;
+	wmb();
+	ACCESS_ONCE(*bucket) = idx;
+}
+
+static void cache_unlink(struct cache_shard *s, uint32_t idx)
+{
+	uint32_t *pos = cache_bucket(s, s->blocks[idx].lba);
+
+	while (*pos != idx)
+		pos = &s->blocks[*pos].next;
+	ACCESS_ONCE(*pos) = s->blocks[idx].next;
+}
+
+/* changes a frame's contents, fencing out lock-free readers */
+static void cache_store(struct cache_shard *s, uint32_t idx, uint64_t lba,
+			const void *src)
+{
+	struct cache_block *b = &s->blocks[idx];
+
+	ACCESS_ONCE(b->seq) = b->seq + 1;
+	wmb();
+	ACCESS_ONCE(b->lba) = lba;
+	memcpy(cache_data(s, idx), src, block_size);
+	wmb();
+	ACCESS_ONCE(b->seq) = b->seq + 1;
+}
+
+/* finds a clean frame to reuse with CLOCK, or returns CACHE_NIL */
+static uint32_t cache_evict(struct cache_shard *s)
+{
+	struct cache_block *b;
+	unsigned int n;
+	uint32_t idx;
+
+	assert_spin_lock_held(&s->lock);
+
+	for (n = 0; n < 2 * blocks_per_shard; n++) {
+		idx = s->hand;
+		s->hand = (s->hand + 1) % blocks_per_shard;
+		b = &s->blocks[idx];
+
+		if (b->dirty)
+			continue;
+		if (b->referenced) {
+			b->referenced = false;
+			continue;
+		}
+
+		if (b->lba != CACHE_LBA_NONE)
+			cache_unlink(s, idx);
+		return idx;
+	}
+
+	return CACHE_NIL;
+}
+
+/* caches a block unless a write-back finished since @gen (lock held) */
+static void cache_insert(struct cache_shard *s, uint64_t lba, const void *src,
+			 void *dst, int gen)
+{
+	uint32_t idx = cache_find(s, lba);
+
+	/* a cached copy is at least as new as what the device returned */
+	if (idx != CACHE_NIL) {
+		if (dst)
+			memcpy(dst, cache_data(s, idx), block_size);
+		s->blocks[idx].referenced = true;
+		return;
+	}
+
+	if (dst && dst != src)
+		memcpy(dst, src, block_size);
+	if (atomic_read(&wb_gen) != gen)
+		return;
+
+	idx = cache_evict(s);
+	if (idx == CACHE_NIL)
+		return;
+	cache_store(s, idx, lba, src);
+	s->blocks[idx].referenced = dst != NULL;
+	cache_link(s, idx);
+}
+
+/* returns how many blocks to read past a miss */
+static uint32_t cache_readahead(uint64_t lba, uint32_t lba_count)
+{
+	struct cache_ra_stream *st = NULL;
+	uint32_t ra = 0;
+	int i;
+
+	if (!cfg_storage_cache_readahead)
+		return 0;
+
+	spin_lock_np(&ra_lock);
+	for (i = 0; i < CACHE_RA_STREAMS; i++) {
+		if (ra_streams[i].next == lba) {
+			st = &ra_streams[i];
+			break;
+		}
+	}
+
+	if (st) {
+		st->window = MIN(MAX(st->window * 2, lba_count),
+				 cfg_storage_cache_readahead);
+		ra = st->window;
+	} else {
+		st = &ra_streams[ra_victim++ % CACHE_RA_STREAMS];
+		st->window = 0;
+	}
+	st->next = lba + lba_count + ra;
+	spin_unlock_np(&ra_lock);
+
+	return MIN(ra, num_blocks - (lba + lba_count));
+}
+
+/* reads the rest of a request (and any read-ahead) from the device */
+static int cache_fill(unsigned char *dst, uint64_t lba, uint32_t lba_count)
+{
+	struct cache_shard *s = NULL, *next;
+	unsigned char *buf = dst;
+	uint32_t i, ra, len;
+	int gen, ret;
+
+	ra = cache_readahead(lba, lba_count);
+	len = lba_count + ra;
+	if (ra) {
+		buf = malloc((size_t)len * block_size);
+		if (unlikely(!buf))
+			return -ENOMEM;
+	}
+
+	gen = atomic_read(&wb_gen);
+	ret = storage_read(buf, lba, len);
+	if (unlikely(ret))
+		goto out;
+
+	for (i = 0; i < len; i++) {
+		next = cache_shard_of(lba + i);
+		if (next != s) {
+			if (s)
+				spin_unlock_np(&s->lock);
+			s = next;
+			spin_lock_np(&s->lock);
+		}
+		cache_insert(s, lba + i, buf + (size_t)i * block_size,
+			     i < lba_count ? dst + (size_t)i * block_size : NULL,
+			     gen);
+	}
+	spin_unlock_np(&s->lock);
+
+	cache_stat_add(STAT_STORAGE_CACHE_READAHEAD, ra);
+
+out:
+	if (buf != dst)
+		free(buf);
+	return ret;
+}
+
+static int cache_wb_cmp(const void *a, const void *b)
+{
+	const struct cache_wb *wa = a, *wb = b;
+
+	return wa->lba < wb->lba ? -1 : wa->lba > wb->lba;
+}
+
+/* writes back a shard's dirty blocks, coalescing adjacent ones */
+static int cache_flush_shard(struct cache_shard *s)
+{
+	struct cache_wb *wb;
+	unsigned char *buf;
+	unsigned int i, start, nr, nr_written = 0, nr_writes = 0;
+	struct cache_block *b;
+	int ret = 0;
+
+	mutex_lock(&s->flush_lock);
+
+	/* dirty blocks can't be evicted or cleaned while we hold flush_lock */
+	nr = ACCESS_ONCE(s->nr_dirty);
+	if (!nr)
+		goto out;
+	wb = malloc(nr * sizeof(*wb));
+	buf = malloc((size_t)nr * block_size);
+	if (unlikely(!wb || !buf)) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	nr = 0;
+	spin_lock_np(&s->lock);
+	for (i = 0; i < blocks_per_shard && nr < s->nr_dirty; i++) {
+		if (!s->blocks[i].dirty)
+			continue;
+		wb[nr].lba = s->blocks[i].lba;
+		wb[nr++].idx = i;
+	}
+	spin_unlock_np(&s->lock);
+
+	qsort(wb, nr, sizeof(*wb), cache_wb_cmp);
+
+	spin_lock_np(&s->lock);
+	for (i = 0; i < nr; i++) {
+		wb[i].seq = s->blocks[wb[i].idx].seq;
+		memcpy(buf + (size_t)i * block_size, cache_data(s, wb[i].idx),
+		       block_size);
+	}
+	spin_unlock_np(&s->lock);
+
+	for (start = 0; start < nr; start = i) {
+		for (i = start + 1; i < nr; i++) {
+			if (wb[i].lba != wb[i - 1].lba + 1)
+				break;
+		}
+		ret = storage_write(buf + (size_t)start * block_size,
+				    wb[start].lba, i - start);
+		if (unlikely(ret))
+			break;
+		nr_written = i;
+		nr_writes++;
+	}
+
+	/* blocks written again in the meantime stay dirty */
+	spin_lock_np(&s->lock);
+	for (i = 0; i < nr_written; i++) {
+		b = &s->blocks[wb[i].idx];
+		if (b->seq == wb[i].seq) {
+			b->dirty = false;
+			s->nr_dirty--;
+		}
+	}
+	STAT(STORAGE_CACHE_WRITEBACKS) += nr_writes;
+	spin_unlock_np(&s->lock);
+	atomic_inc(&wb_gen);
+
+out_free:
+	free(buf);
+	free(wb);
+out:
+	mutex_unlock(&s->flush_lock);
+	return ret;
+}
+
+/* writes to the device, then updates any cached copies */
+static int cache_write_through(struct cache_shard *s, const unsigned char *src,
+			       uint64_t lba, uint32_t lba_count)
+{
+	struct cache_block *b;
+	uint32_t i, idx;
+	int ret;
+
+	mutex_lock(&s->flush_lock);
+	ret = storage_write(src, lba, lba_count);
+	if (unlikely(ret))
+		goto out;
+
+	/* reads that began before the write mustn't cache what they got */
+	atomic_inc(&wb_gen);
+
+	spin_lock_np(&s->lock);
+	for (i = 0; i < lba_count; i++) {
+		idx = cache_find(s, lba + i);
+		if (idx == CACHE_NIL)
+			continue;
+		b = &s->blocks[idx];
+		cache_store(s, idx, lba + i, src + (size_t)i * block_size);
+		if (b->dirty) {
+			b->dirty = false;
+			s->nr_dirty--;
+		}
+	}
+	spin_unlock_np(&s->lock);
+
+out:
+	mutex_unlock(&s->flush_lock);
+	return ret;
+}
+
+/* writes blocks that all belong to one shard */
+static int cache_write_seg(struct cache_shard *s, const unsigned char *src,
+			   uint64_t lba, uint32_t lba_count)
+{
+	struct cache_block *b;
+	uint32_t i, idx;
+	bool full;
+	int ret;
+
+	if (!cfg_storage_cache_writeback)
+		return cache_write_through(s, src, lba, lba_count);
+
+	spin_lock_np(&s->lock);
+	for (i = 0; i < lba_count; i++) {
+		idx = cache_find(s, lba + i);
+		if (idx == CACHE_NIL) {
+			idx = cache_evict(s);
+			if (idx == CACHE_NIL)
+				break;
+			cache_store(s, idx, lba + i,
+				    src + (size_t)i * block_size);
+			cache_link(s, idx);
+		} else {
+			cache_store(s, idx, lba + i,
+				    src + (size_t)i * block_size);
+		}
+
+		b = &s->blocks[idx];
+		b->referenced = true;
+		if (!b->dirty) {
+			b->dirty = true;
+			s->nr_dirty++;
+		}
+	}
+	full = s->nr_dirty > blocks_per_shard / 2;
+	spin_unlock_np(&s->lock);
+
+	if (!full && i == lba_count)
+		return 0;
+
+	ret = cache_flush_shard(s);
+	if (unlikely(ret) || i == lba_count)
+		return ret;
+
+	/* every frame was dirty */
+	return cache_write_through(s, src + (size_t)i * block_size, lba + i,
+				   lba_count - i);
+}
+
+static bool cache_range_valid(uint64_t lba, uint32_t lba_count)
+{
+	return lba < num_blocks && lba_count <= num_blocks - lba;
+}
+
+/**
+ * storage_cache_read - reads blocks through the block cache
+ * @dest: a buffer of lba_count * storage_block_size() bytes
+ * @lba: the first block
+ * @lba_count: the number of blocks
+ *
+ * Same as storage_read() if the cache is disabled.
+ *
+ * Returns 0 if successful, otherwise < 0.
+ */
+int storage_cache_read(void *dest, uint64_t lba, uint32_t lba_count)
+{
+	unsigned char *dst = dest;
+	uint32_t i;
+
+	if (!storage_cache_enabled())
+		return storage_read(dest, lba, lba_count);
+	if (unlikely(!cache_range_valid(lba, lba_count)))
+		return -EINVAL;
+
+	for (i = 0; i < lba_count; i++) {
+		if (!cache_read_fast(cache_shard_of(lba + i), lba + i,
+				     dst + (size_t)i * block_size))
+			break;
+	}
+	cache_stat_add(STAT_STORAGE_CACHE_HITS, i);
+	if (i == lba_count)
+		return 0;
+
+	cache_stat_add(STAT_STORAGE_CACHE_MISSES, 1);
+	return cache_fill(dst + (size_t)i * block_size, lba + i, lba_count - i);
+}
+
+/**
+ * storage_cache_write - writes blocks through the block cache
+ * @src: a buffer of lba_count * storage_block_size() bytes
+ * @lba: the first block
+ * @lba_count: the number of blocks
+ *
+ * Same as storage_write() if the cache is disabled. With write-back, the data
+ * may only reach the device after storage_cache_flush().
+ *
+ * Returns 0 if successful, otherwise < 0.
+ */
+int storage_cache_write(const void *src, uint64_t lba, uint32_t lba_count)
+{
+	const unsigned char *pos = src;
+	uint32_t n;
+	int ret;
+
+	if (!storage_cache_enabled())
+		return storage_write(src, lba, lba_count);
+	if (unlikely(!cache_range_valid(lba, lba_count)))
+		return -EINVAL;
+
+	while (lba_count) {
+		n = CACHE_GROUP_BLOCKS - (lba & (CACHE_GROUP_BLOCKS - 1));
+		n = MIN(n, lba_count);
+		ret = cache_write_seg(cache_shard_of(lba), pos, lba, n);
+		if (unlikely(ret))
+			return ret;
+		pos += (size_t)n * block_size;
+		lba += n;
+		lba_count -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * storage_cache_flush - writes all dirty blocks back to the device
+ *
+ * Returns 0 if successful, otherwise < 0.
+ */
+int storage_cache_flush(void)
+{
+	int i, ret;
+
+	if (!storage_cache_enabled())
+		return 0;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (!ACCESS_ONCE(shards[i].nr_dirty))
+			continue;
+		ret = cache_flush_shard(&shards[i]);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+static void storage_cache_flusher(void *arg)
+{
+	int ret;
+
+	while (true) {
+		timer_sleep(cfg_storage_cache_flush_us);
+		ret = storage_cache_flush();
+		if (unlikely(ret))
+			log_warn_ratelimited("storage: write-back failed %d",
+					     ret);
+	}
+}
+
+/**
+ * storage_cache_init - allocates the block cache
+ */
+int storage_cache_init(void)
+{
+	size_t len = cfg_storage_cache_mb * MB;
+	unsigned int nr_buckets = 1;
+	unsigned char *data;
+	struct cache_shard *s;
+	unsigned int i, j;
+
+	if (!storage_cache_enabled())
+		return 0;
+	if (!block_size) {
+		log_err("storage: storage_cache_mb requires a storage device");
+		return -ENODEV;
+	}
+
+	blocks_per_shard = len / block_size / CACHE_SHARDS;
+	if (blocks_per_shard < CACHE_GROUP_BLOCKS) {
+		log_err("storage: storage_cache_mb is too small");
+		return -EINVAL;
+	}
+	while (nr_buckets < blocks_per_shard)
+		nr_buckets <<= 1;
+	bucket_mask = nr_buckets - 1;
+
+	data = mem_map_anom(NULL, len, PGSIZE_2MB, preferred_socket);
+	if (data == MAP_FAILED)
+		data = mem_map_anom(NULL, len, PGSIZE_4KB, preferred_socket);
+	if (data == MAP_FAILED)
+		return -ENOMEM;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		s = &shards[i];
+		spin_lock_init(&s->lock);
+		mutex_init(&s->flush_lock);
+		s->data = data + (size_t)i * blocks_per_shard * block_size;
+		s->buckets = malloc(nr_buckets * sizeof(*s->buckets));
+		s->blocks = malloc(blocks_per_shard * sizeof(*s->blocks));
+		if (!s->buckets || !s->blocks)
+			return -ENOMEM;
+
+		for (j = 0; j < nr_buckets; j++)
+			s->buckets[j] = CACHE_NIL;
+		for (j = 0; j < blocks_per_shard; j++) {
+			s->blocks[j] = (struct cache_block){
+				.lba = CACHE_LBA_NONE,
+				.next = CACHE_NIL,
+			};
+		}
+	}
+
+	for (i = 0; i < CACHE_RA_STREAMS; i++)
+		ra_streams[i].next = CACHE_LBA_NONE;
+
+	log_info("storage: %u-way block cache of %u blocks per shard",
+		 CACHE_SHARDS, blocks_per_shard);
+	return 0;
+}
+
+/**
+ * storage_cache_init_late - starts writing back dirty blocks in the background
+ */
+int storage_cache_init_late(void)
+{
+	if (!storage_cache_enabled() || !cfg_storage_cache_writeback ||
+	    !cfg_storage_cache_flush_us)
+		return 0;
+
+	return thread_spawn(storage_cache_flusher, NULL);
+}
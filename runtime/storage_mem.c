@@ -0,0 +1,99 @@
+/*
+ * storage_mem.c - an in-memory stand-in for an NVMe device
+ *
+ * Enabled with "storage_mem_mb", it serves the storage API from anonymous
+ * memory so that storage code can be tested and benchmarked on machines
+ * without an SSD. Each request completes "storage_mem_latency_us" after it is
+ * submitted (from a timer, like an interrupt from a real device), or
+ * immediately if that is zero.
+ */
+
+#include <string.h>
+
+#include <base/log.h>
+#include <base/mem.h>
+#include <runtime/storage.h>
+#include <runtime/timer.h>
+
+#include "defs.h"
+
+unsigned long cfg_storage_mem_mb;
+unsigned long cfg_storage_mem_latency_us = 10;
+unsigned int cfg_storage_mem_block_size = 512;
+
+static unsigned char *storage_mem;
+
+static void storage_mem_copy(struct storage_req *req)
+{
+	unsigned char *pos = storage_mem + req->lba * block_size;
+	const struct iovec *iov;
+	int i;
+
+	for (i = 0; i < req->iovcnt; i++) {
+		iov = &req->iov[i];
+		if (req->op == STORAGE_OP_READ)
+			memcpy(iov->iov_base, pos, iov->iov_len);
+		else
+			memcpy(pos, iov->iov_base, iov->iov_len);
+		pos += iov->iov_len;
+	}
+}
+
+static void storage_mem_timer(unsigned long arg)
+{
+	struct storage_req *req = (struct storage_req *)arg;
+
+	storage_mem_copy(req);
+	storage_complete(req, 0);
+}
+
+/**
+ * storage_mem_submit - starts a batch of (already validated) requests
+ * @reqs: the requests
+ * @nr: the number of requests
+ *
+ * Returns the number of requests submitted.
+ */
+int storage_mem_submit(struct storage_req **reqs, int nr)
+{
+	uint64_t deadline = microtime() + cfg_storage_mem_latency_us;
+	struct storage_req *req;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		req = reqs[i];
+		if (!cfg_storage_mem_latency_us) {
+			storage_mem_copy(req);
+			storage_complete(req, 0);
+			continue;
+		}
+
+		timer_init(&req->timer, storage_mem_timer, (unsigned long)req);
+		timer_start(&req->timer, deadline);
+	}
+
+	return nr;
+}
+
+/**
+ * storage_mem_init - allocates the in-memory device
+ */
+int storage_mem_init(void)
+{
+	size_t len = cfg_storage_mem_mb * MB;
+
+	storage_mem = mem_map_anom(NULL, len, PGSIZE_2MB, 0);
+	if (storage_mem == MAP_FAILED)
+		storage_mem = mem_map_anom(NULL, len, PGSIZE_4KB, 0);
+	if (storage_mem == MAP_FAILED) {
+		log_err("storage: couldn't allocate %lu MB for the in-memory "
+			"device", cfg_storage_mem_mb);
+		return -ENOMEM;
+	}
+
+	block_size = cfg_storage_mem_block_size;
+	num_blocks = len / block_size;
+	log_info("storage: in-memory device with %lu blocks of %u bytes",
+		 num_blocks, block_size);
+	return 0;
+}
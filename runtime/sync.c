@@ -12,41 +12,141 @@
 
 /*
  * Mutex support
+ *
+ * Contended mutexes first spin, but only while the owner is running on
+ * another kthread, since it will likely release the lock soon. Otherwise the
+ * caller parks. Unlocking wakes the oldest waiter but releases the lock, so
+ * that running threads can take it without waiting for the woken thread to
+ * be scheduled (avoiding lock convoys). If the oldest waiter has been waiting
+ * longer than the fairness bound, ownership is handed off to it directly.
  */
 
 #define WAITER_FLAG (1 << 31)
 
+/* the maximum time to spin on a running owner before parking */
+uint64_t cfg_mutex_spin_us = 5;
+/* the maximum time a waiter can be bypassed before it gets a handoff */
+uint64_t cfg_mutex_handoff_us = 50;
+
+struct mutex_waiter {
+	struct list_node	link;
+	thread_t		*th;
+	uint64_t		start_tsc;
+	bool			woken;
+	bool			handoff;
+};
+
+static bool owner_running(thread_t *owner)
+{
+	/*
+	 * The owner can exit while we're spinning. Threads are never returned
+	 * to the OS, so a stale read only affects how long we spin.
+	 */
+	return owner && load_acquire(&owner->thread_running);
+}
+
+static bool mutex_spin(mutex_t *m, thread_t *myth)
+{
+	uint64_t start_tsc = rdtsc();
+	thread_t *owner;
+	int held;
+
+	while (true) {
+		held = atomic_read(&m->held);
+		if (!(held & MUTEX_LOCKED)) {
+			if (atomic_cmpxchg(&m->held, held, held | MUTEX_LOCKED)) {
+				m->owner = myth;
+				return true;
+			}
+			continue;
+		}
+
+		/* the owner field is briefly NULL after a fast path acquire */
+		owner = ACCESS_ONCE(m->owner);
+		if (owner && !owner_running(owner))
+			return false;
+		if (rdtsc() - start_tsc >= cycles_per_us * cfg_mutex_spin_us ||
+		    preempt_needed())
+			return false;
+		cpu_relax();
+	}
+}
+
 void __mutex_lock(mutex_t *m)
 {
-	thread_t *myth;
+	struct mutex_waiter w;
+	thread_t *myth = thread_self();
+	int held;
+
+	if (cfg_mutex_spin_us && mutex_spin(m, myth))
+		return;
+
+	w.th = myth;
+	w.start_tsc = rdtsc();
+	w.woken = false;
+	w.handoff = false;
 
 	spin_lock_np(&m->waiter_lock);
+	while (true) {
+		held = atomic_read(&m->held);
 
-	/* did we race with mutex_unlock? */
-	if (atomic_fetch_and_or(&m->held, WAITER_FLAG) == 0) {
-		atomic_write(&m->held, 1);
-		spin_unlock_np(&m->waiter_lock);
-		return;
-	}
+		/* did we race with mutex_unlock? */
+		if (!(held & MUTEX_LOCKED)) {
+			if (!atomic_cmpxchg(&m->held, held, held | MUTEX_LOCKED))
+				continue;
+			m->owner = myth;
+			spin_unlock_np(&m->waiter_lock);
+			return;
+		}
 
-	myth = thread_self();
-	list_add_tail(&m->waiters, &myth->link);
-	thread_park_and_unlock_np(&m->waiter_lock);
-}
+		if (!atomic_cmpxchg(&m->held, held, held | WAITER_FLAG))
+			continue;
 
+		/* a waiter that lost a race keeps its place at the head */
+		if (w.woken)
+			list_add(&m->waiters, &w.link);
+		else
+			list_add_tail(&m->waiters, &w.link);
+		thread_park_and_unlock_np(&m->waiter_lock);
+
+		/* the lock was handed to us directly */
+		if (w.handoff)
+			return;
+
+		if (cfg_mutex_spin_us && mutex_spin(m, myth))
+			return;
+
+		spin_lock_np(&m->waiter_lock);
+	}
+}
 
 void __mutex_unlock(mutex_t *m)
 {
+	struct mutex_waiter *w;
 	thread_t *waketh;
 
 	spin_lock_np(&m->waiter_lock);
 
-	waketh = list_pop(&m->waiters, thread_t, link);
-	if (!waketh) {
+	w = list_pop(&m->waiters, struct mutex_waiter, link);
+	if (!w) {
 		atomic_write(&m->held, 0);
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+
+	waketh = w->th;
+	if (rdtsc() - w->start_tsc >= cycles_per_us * cfg_mutex_handoff_us) {
+		/* the waiter has been bypassed for too long, hand off */
+		w->handoff = true;
+		m->owner = waketh;
+		if (list_empty(&m->waiters))
+			atomic_write(&m->held, MUTEX_LOCKED);
+	} else {
+		/* release the lock and let the waiter compete for it */
+		w->woken = true;
+		atomic_write(&m->held,
+			     list_empty(&m->waiters) ? 0 : WAITER_FLAG);
+	}
 	spin_unlock_np(&m->waiter_lock);
 	thread_ready(waketh);
 }
@@ -60,10 +160,16 @@ void mutex_init(mutex_t *m)
 	atomic_write(&m->held, 0);
 	spin_lock_init(&m->waiter_lock);
 	list_head_init(&m->waiters);
+	m->owner = NULL;
 }
 
 /*
  * Read-write mutex support
+ *
+ * New readers queue behind waiting writers, so a steady stream of readers
+ * can't starve writers. When a writer releases the lock, all queued readers
+ * are admitted together as a batch; when the last reader of a batch releases
+ * the lock, the next writer is admitted.
  */
 
 /**
@@ -77,6 +183,29 @@ void rwmutex_init(rwmutex_t *m)
 	list_head_init(&m->write_waiters);
 	m->count = 0;
 	m->read_waiter_count = 0;
+	m->writer = NULL;
+}
+
+static bool rwmutex_can_rdlock(rwmutex_t *m)
+{
+	return m->count >= 0 && list_empty(&m->write_waiters);
+}
+
+static void rwmutex_spin(rwmutex_t *m, bool write)
+{
+	uint64_t start_tsc = rdtsc();
+	int count;
+
+	/* only a write holder is tracked, so only spin on a running writer */
+	while (rdtsc() - start_tsc < cycles_per_us * cfg_mutex_spin_us &&
+	       !preempt_needed()) {
+		count = ACCESS_ONCE(m->count);
+		if (write ? count == 0 : count >= 0)
+			return;
+		if (count > 0 || !owner_running(ACCESS_ONCE(m->writer)))
+			return;
+		cpu_relax();
+	}
 }
 
 /**
@@ -88,12 +217,24 @@ void rwmutex_rdlock(rwmutex_t *m)
 	thread_t *myth;
 
 	spin_lock_np(&m->waiter_lock);
-	myth = thread_self();
-	if (m->count >= 0) {
+	if (rwmutex_can_rdlock(m)) {
 		m->count++;
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+
+	if (cfg_mutex_spin_us && m->count < 0) {
+		spin_unlock_np(&m->waiter_lock);
+		rwmutex_spin(m, false);
+		spin_lock_np(&m->waiter_lock);
+		if (rwmutex_can_rdlock(m)) {
+			m->count++;
+			spin_unlock_np(&m->waiter_lock);
+			return;
+		}
+	}
+
+	myth = thread_self();
 	m->read_waiter_count++;
 	list_add_tail(&m->read_waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
@@ -108,7 +249,7 @@ void rwmutex_rdlock(rwmutex_t *m)
 bool rwmutex_try_rdlock(rwmutex_t *m)
 {
 	spin_lock_np(&m->waiter_lock);
-	if (m->count >= 0) {
+	if (rwmutex_can_rdlock(m)) {
 		m->count++;
 		spin_unlock_np(&m->waiter_lock);
 		return true;
@@ -123,15 +264,28 @@ bool rwmutex_try_rdlock(rwmutex_t *m)
  */
 void rwmutex_wrlock(rwmutex_t *m)
 {
-	thread_t *myth;
+	thread_t *myth = thread_self();
 
 	spin_lock_np(&m->waiter_lock);
-	myth = thread_self();
 	if (m->count == 0) {
 		m->count = -1;
+		m->writer = myth;
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+
+	if (cfg_mutex_spin_us && m->count < 0) {
+		spin_unlock_np(&m->waiter_lock);
+		rwmutex_spin(m, true);
+		spin_lock_np(&m->waiter_lock);
+		if (m->count == 0) {
+			m->count = -1;
+			m->writer = myth;
+			spin_unlock_np(&m->waiter_lock);
+			return;
+		}
+	}
+
 	list_add_tail(&m->write_waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
 }
@@ -147,6 +301,7 @@ bool rwmutex_try_wrlock(rwmutex_t *m)
 	spin_lock_np(&m->waiter_lock);
 	if (m->count == 0) {
 		m->count = -1;
+		m->writer = thread_self();
 		spin_unlock_np(&m->waiter_lock);
 		return true;
 	}
@@ -162,16 +317,27 @@ void rwmutex_unlock(rwmutex_t *m)
 {
 	thread_t *th;
 	struct list_head tmp;
+	bool was_writer;
 	list_head_init(&tmp);
 
 	spin_lock_np(&m->waiter_lock);
 	assert(m->count != 0);
-	if (m->count < 0)
+	was_writer = m->count < 0;
+	if (was_writer) {
 		m->count = 0;
-	else
+		m->writer = NULL;
+	} else {
 		m->count--;
+	}
 
-	if (m->count == 0 && m->read_waiter_count > 0) {
+	if (m->count != 0) {
+		spin_unlock_np(&m->waiter_lock);
+		return;
+	}
+
+	/* after a writer, admit the whole batch of waiting readers */
+	if (m->read_waiter_count > 0 &&
+	    (was_writer || list_empty(&m->write_waiters))) {
 		m->count = m->read_waiter_count;
 		m->read_waiter_count = 0;
 		list_append_list(&tmp, &m->read_waiters);
@@ -185,20 +351,15 @@ void rwmutex_unlock(rwmutex_t *m)
 		return;
 	}
 
-	if (m->count == 0) {
-		th = list_pop(&m->write_waiters, thread_t, link);
-		if (!th) {
-			spin_unlock_np(&m->waiter_lock);
-			return;
-		}
-		m->count = -1;
+	th = list_pop(&m->write_waiters, thread_t, link);
+	if (!th) {
 		spin_unlock_np(&m->waiter_lock);
-		thread_ready(th);
 		return;
 	}
-
+	m->count = -1;
+	m->writer = th;
 	spin_unlock_np(&m->waiter_lock);
-
+	thread_ready(th);
 }
 
 /*
@@ -288,7 +288,9 @@ static void timer_softirq(void *arg)
 
 	while (true) {
 		preempt_disable();
+		trace_sched(TRACE_SOFTIRQ_START, TRACE_SOFTIRQ_TIMER, NULL);
 		timer_softirq_one(k);
+		trace_sched(TRACE_SOFTIRQ_END, TRACE_SOFTIRQ_TIMER, NULL);
 		k->timer_busy = false;
 		thread_park_and_preempt_enable();
 	}
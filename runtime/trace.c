@@ -0,0 +1,181 @@
+/*
+ * trace.c - per-kthread scheduler event tracing
+ *
+ * Each kthread owns a ring of events that only it writes to, so recording an
+ * event is just a timestamp and two stores. Rings wrap around, keeping only the
+ * most recent events. Dumps should be taken after tracing is stopped, otherwise
+ * events recorded during the dump may be torn.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/trace.h>
+
+#include "defs.h"
+
+struct trace_ring {
+	uint64_t		head;
+	struct trace_event	*events;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct trace_ring trace_rings[NCPU];
+
+/* the number of events per ring (a power of two, 0 if disabled) */
+unsigned int cfg_trace_events;
+/* true if events are currently being recorded */
+bool trace_enabled;
+
+/**
+ * __trace_sched - records a scheduler event in the local kthread's ring
+ * @type: the event type (TRACE_*)
+ * @arg: an event-specific argument
+ * @th: the uthread involved in the event, if any
+ *
+ * Safe to call from any context, including signal handlers.
+ */
+void __trace_sched(unsigned int type, unsigned int arg, thread_t *th)
+{
+	struct trace_ring *r;
+	struct trace_event *e;
+	uint64_t head;
+
+	/* never yield here, since this may run inside a signal handler */
+	preempt_disable();
+	r = &trace_rings[myk()->kthread_idx];
+
+	/* claim the slot first in case a signal handler records an event */
+	head = r->head;
+	ACCESS_ONCE(r->head) = head + 1;
+	barrier();
+
+	e = &r->events[head & (cfg_trace_events - 1)];
+	e->tsc = rdtsc();
+	e->data = type | ((arg & 0xff) << 8) | ((uint64_t)th << 16);
+	preempt_enable_nocheck();
+}
+
+/**
+ * sched_trace_start - begins recording scheduler events
+ *
+ * Previously recorded events are discarded.
+ *
+ * Returns 0 if successful, or -ENOENT if tracing was not configured.
+ */
+int sched_trace_start(void)
+{
+	int i;
+
+	if (!cfg_trace_events)
+		return -ENOENT;
+
+	sched_trace_stop();
+	for (i = 0; i < maxks; i++)
+		ACCESS_ONCE(trace_rings[i].head) = 0;
+	store_release(&trace_enabled, true);
+	return 0;
+}
+
+/**
+ * sched_trace_stop - stops recording scheduler events
+ *
+ * Events may still be recorded by other kthreads for a short time after this
+ * returns.
+ */
+void sched_trace_stop(void)
+{
+	store_release(&trace_enabled, false);
+}
+
+/**
+ * sched_trace_dump - writes the recorded scheduler events to a file
+ * @path: the path of the file to create
+ *
+ * The file must not already exist, and @path must not end in a symlink, so a
+ * dump in a shared directory like /tmp can't be redirected elsewhere.
+ *
+ * Returns 0 if successful.
+ */
+int sched_trace_dump(const char *path)
+{
+	struct trace_file_hdr hdr;
+	struct trace_ring_hdr rhdr;
+	struct trace_ring *r;
+	uint64_t head, start;
+	FILE *f;
+	int fd, i, ret = 0;
+
+	if (!cfg_trace_events)
+		return -ENOENT;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd < 0)
+		return -errno;
+	f = fdopen(fd, "w");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	hdr.magic = TRACE_FILE_MAGIC;
+	hdr.version = TRACE_FILE_VERSION;
+	hdr.nr_rings = maxks;
+	hdr.pad = 0;
+	hdr.cycles_per_us = cycles_per_us;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		ret = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < maxks; i++) {
+		r = &trace_rings[i];
+		head = load_acquire(&r->head);
+		start = head > cfg_trace_events ? head - cfg_trace_events : 0;
+
+		rhdr.kthread_idx = i;
+		rhdr.nr_events = head - start;
+		rhdr.dropped = start;
+		if (fwrite(&rhdr, sizeof(rhdr), 1, f) != 1) {
+			ret = -EIO;
+			goto out;
+		}
+
+		for (; start < head; start++) {
+			if (fwrite(&r->events[start & (cfg_trace_events - 1)],
+				   sizeof(struct trace_event), 1, f) != 1) {
+				ret = -EIO;
+				goto out;
+			}
+		}
+	}
+
+out:
+	fclose(f);
+	return ret;
+}
+
+/**
+ * trace_init - allocates the scheduler event rings
+ *
+ * Returns 0 if successful.
+ */
+int trace_init(void)
+{
+	int i;
+
+	if (!cfg_trace_events)
+		return 0;
+
+	for (i = 0; i < maxks; i++) {
+		trace_rings[i].events = aligned_alloc(CACHE_LINE_SIZE,
+			sizeof(struct trace_event) * cfg_trace_events);
+		if (!trace_rings[i].events)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
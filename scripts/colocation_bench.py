@@ -0,0 +1,390 @@
+#!/usr/bin/env python3
+#
+# colocation_bench.py - measures how well a core allocation policy colocates
+# latency-critical (LC) and best-effort (BE) work
+#
+# Runs the netbench server as an LC runtime next to a BE antagonist, on one
+# host with the iokernel in vnic mode, and sweeps the load that a netbench
+# client offers. For every policy, antagonist and load, prints one CSV line:
+#   commit,policy,be,offered_rps,achieved_rps,steady,p50_us,p99_us,p999_us,
+#   be_ops_per_sec,lc_cores,be_cores,efficiency
+# lc_cores and be_cores are the CPU time the server and the antagonist used
+# per second, and efficiency is the fraction of the application cores (those
+# given to the iokernel, less its own) they kept busy between them.
+#
+# Antagonists:
+#   none              the LC server alone, as a baseline
+#   stream[:kernel]   apps/stream with Copy, Scale, Add or Triad (default);
+#                     ops are the floating point operations it reports
+#   streamcluster     apps/streamcluster on random points; ops are points
+#   synthetic:<spec>  apps/netbench/stress_shm running a synthetic worker,
+#                     e.g. synthetic:stridedmem:3200:64; ops are work calls
+#
+# Run as root from a built tree, after scripts/setup_machine.sh, e.g.
+#   colocation_bench.py --policies simple,ias --be none,stream,streamcluster
+
+import argparse
+import ctypes
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+NETBENCH = os.path.join(ROOT, "apps/netbench/netbench")
+
+SERVER_IP = "10.99.0.1"
+CLIENT_IP = "10.99.0.2"
+BE_IP = "10.99.0.3"
+
+# the shared memory counters of stream and stress_shm, one per cache line
+BE_SHM_KEY = 0x123
+CACHELINE = 64
+IPC_RMID = 0
+SHM_RDONLY = 0o10000
+
+SAMPLE_S = 0.05
+# the client keeps running for up to loadgen's drain_us after measuring
+DRAIN_S = 0.1
+STREAMCLUSTER_CHUNK = 20000
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.shmat.restype = ctypes.c_void_p
+libc.shmat.argtypes = [ctypes.c_int, ctypes.c_void_p, ctypes.c_int]
+
+
+def parse_cores(s):
+    cores = []
+    for part in s.split(","):
+        lo, _, hi = part.partition("-")
+        cores.extend(range(int(lo), int(hi or lo) + 1))
+    return cores
+
+
+def write_config(path, ip, kthreads, guaranteed, priority):
+    with open(path, "w") as f:
+        f.write("host_addr %s\n" % ip)
+        f.write("host_netmask 255.255.255.0\n")
+        f.write("host_gateway 10.99.0.254\n")
+        f.write("runtime_kthreads %d\n" % kthreads)
+        f.write("runtime_guaranteed_kthreads %d\n" % guaranteed)
+        f.write("runtime_spinning_kthreads 0\n")
+        f.write("runtime_priority %s\n" % priority)
+
+
+def cpu_seconds(pid):
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+    except OSError:
+        return 0.0
+    # utime and stime, summed over all of the process's threads
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def remove_shm(key):
+    shmid = libc.shmget(key, 0, 0)
+    if shmid >= 0:
+        libc.shmctl(shmid, IPC_RMID, None)
+
+
+class Process:
+    def __init__(self, tmp, name, cmd, stderr=None):
+        self.log = open(os.path.join(tmp, name + ".log"), "w")
+        self.proc = subprocess.Popen(cmd, stdout=self.log,
+                                     stderr=stderr or self.log,
+                                     universal_newlines=True)
+        self.pid = self.proc.pid
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+        self.proc.wait()
+        self.log.close()
+
+
+class Antagonist:
+    """A BE runtime that counts the work it has done."""
+
+    name = "none"
+
+    def __init__(self, threads):
+        self.threads = threads
+        self.proc = None
+
+    def start(self, tmp, config):
+        pass
+
+    def ops(self):
+        return 0
+
+    def pid(self):
+        return self.proc.pid if self.proc else None
+
+    def stop(self):
+        if self.proc:
+            self.proc.stop()
+
+
+class ShmAntagonist(Antagonist):
+    ctype = ctypes.c_uint64
+
+    def __init__(self, threads):
+        super().__init__(threads)
+        self.counters = None
+
+    def start(self, tmp, config):
+        remove_shm(BE_SHM_KEY)
+        self.proc = Process(tmp, "be", self.command(config))
+        # the antagonist creates the counters once its runtime is up
+        for _ in range(100):
+            shmid = libc.shmget(BE_SHM_KEY, 0, 0)
+            if shmid >= 0:
+                break
+            time.sleep(0.1)
+        else:
+            sys.exit("%s didn't start, see %s" % (self.name,
+                                                  self.proc.log.name))
+        addr = libc.shmat(shmid, None, SHM_RDONLY)
+        if addr in (None, ctypes.c_void_p(-1).value):
+            sys.exit("couldn't attach to the counters of %s" % self.name)
+        stride = CACHELINE // ctypes.sizeof(self.ctype)
+        self.counters = (self.ctype * (stride * self.threads)).from_address(
+            addr)
+        self.stride = stride
+
+    def ops(self):
+        return sum(self.counters[i * self.stride]
+                   for i in range(self.threads))
+
+
+class Stream(ShmAntagonist):
+    ctype = ctypes.c_double
+
+    def __init__(self, threads, kernel="Triad", n=2000000):
+        super().__init__(threads)
+        self.name = "stream:" + kernel
+        self.kernel = kernel
+        self.n = n
+
+    def command(self, config):
+        return [os.path.join(ROOT, "apps/stream/stream"), config, str(self.n),
+                str(self.threads), self.kernel]
+
+
+class Synthetic(ShmAntagonist):
+    def __init__(self, threads, spec, n=1000):
+        super().__init__(threads)
+        self.name = "synthetic:" + spec
+        self.spec = spec
+        self.n = n
+
+    def command(self, config):
+        return [os.path.join(ROOT, "apps/netbench/stress_shm"), config,
+                str(self.threads), str(self.n), self.spec]
+
+
+class StreamCluster(Antagonist):
+    name = "streamcluster"
+
+    def start(self, tmp, config):
+        self.points = 0
+        cmd = [os.path.join(ROOT, "apps/streamcluster/streamcluster"), config,
+               "10", "20", "128", "1000000", str(STREAMCLUSTER_CHUNK), "5000",
+               "none", os.path.join(tmp, "streamcluster.out"),
+               str(self.threads)]
+        self.proc = Process(tmp, "be", cmd, stderr=subprocess.PIPE)
+        threading.Thread(target=self.read_progress, daemon=True).start()
+
+    def read_progress(self):
+        # a line is printed as each chunk of points is clustered
+        for line in self.proc.proc.stderr:
+            if "Points per second" in line:
+                self.points += STREAMCLUSTER_CHUNK
+
+    def ops(self):
+        return self.points
+
+
+def make_antagonist(spec, threads):
+    kind, _, arg = spec.partition(":")
+    if kind == "none":
+        return Antagonist(threads)
+    if kind == "stream":
+        return Stream(threads, arg or "Triad")
+    if kind == "streamcluster":
+        return StreamCluster(threads)
+    if kind == "synthetic" and arg:
+        return Synthetic(threads, arg)
+    sys.exit("unknown antagonist: %s" % spec)
+
+
+class Sampler(threading.Thread):
+    """Samples BE progress and CPU usage until stopped."""
+
+    def __init__(self, server, be):
+        super().__init__(daemon=True)
+        self.server = server
+        self.be = be
+        self.samples = []
+        self.done = threading.Event()
+
+    def sample(self):
+        be_pid = self.be.pid()
+        self.samples.append((time.monotonic(), self.be.ops(),
+                             cpu_seconds(self.server.pid),
+                             cpu_seconds(be_pid) if be_pid else 0.0))
+
+    def run(self):
+        while not self.done.is_set():
+            self.sample()
+            self.done.wait(SAMPLE_S)
+
+    def stop(self):
+        self.done.set()
+        self.join()
+        self.sample()
+
+    def rates(self, start, end):
+        """Returns BE ops/s and LC and BE cores over [start, end]."""
+        inside = [s for s in self.samples if start <= s[0] <= end]
+        if len(inside) < 2:
+            inside = self.samples
+        first, last = inside[0], inside[-1]
+        secs = last[0] - first[0]
+        if secs <= 0:
+            return 0.0, 0.0, 0.0
+        return ((last[1] - first[1]) / secs, (last[2] - first[2]) / secs,
+                (last[3] - first[3]) / secs)
+
+
+def start_iokernel(tmp, policy, cores, extra):
+    iok = Process(tmp, "iokernel-" + policy,
+                  [os.path.join(ROOT, "iokernel/iokerneld"), policy, "vnic",
+                   cores] + extra)
+    for _ in range(30):
+        with open(iok.log.name) as f:
+            if "running dataplane" in f.read():
+                return iok
+        time.sleep(1)
+    iok.stop()
+    with open(iok.log.name) as f:
+        sys.stderr.write(f.read())
+    sys.exit("iokernel failed to start")
+
+
+def run_load(tmp, args, server, be, rate):
+    results = os.path.join(tmp, "loadgen.json")
+    if os.path.exists(results):
+        os.remove(results)
+    env = dict(os.environ, LOADGEN_JSON=results)
+    cmd = [NETBENCH, os.path.join(tmp, "client.config"), "client",
+           str(args.client_threads), SERVER_IP, args.service,
+           "%d:%d" % (rate, args.duration_us)]
+
+    sampler = Sampler(server, be)
+    sampler.start()
+    with open(os.path.join(tmp, "client.log"), "a") as log:
+        ret = subprocess.call(cmd, stdout=log, stderr=log, env=env)
+    end = time.monotonic() - DRAIN_S
+    sampler.stop()
+
+    if ret != 0 or not os.path.exists(results):
+        print("client failed at %d rps, see %s" % (rate, log.name),
+              file=sys.stderr)
+        return None
+    with open(results) as f:
+        r = json.loads(f.read().splitlines()[-1])
+
+    be_ops, lc_cores, be_cores = sampler.rates(end - args.duration_us / 1e6,
+                                               end)
+    return r, be_ops, lc_cores, be_cores
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Sweeps LC load against BE antagonists under iokernel "
+        "core allocation policies.")
+    parser.add_argument("--policies", default="simple",
+                        help="comma-separated iokernel policies: simple, "
+                        "numa or ias (default simple)")
+    parser.add_argument("--cores", default="0-7",
+                        help="the cores the iokernel may use (default 0-7)")
+    parser.add_argument("--iokernel-args", default="",
+                        help="more iokerneld arguments, e.g. \"noht\"")
+    parser.add_argument("--be", default="none,stream",
+                        help="comma-separated antagonists (default "
+                        "none,stream)")
+    parser.add_argument("--be-threads", type=int, default=4)
+    parser.add_argument("--lc-threads", type=int, default=4)
+    parser.add_argument("--lc-guaranteed", type=int, default=0,
+                        help="kthreads the server always keeps (default 0)")
+    parser.add_argument("--client-threads", type=int, default=2)
+    parser.add_argument("--service", default="10",
+                        help="netbench service time, a mean in us or a "
+                        "distribution (default 10)")
+    parser.add_argument("--loads", default="50000,100000,200000,300000",
+                        help="comma-separated offered loads, in requests "
+                        "per second")
+    parser.add_argument("--duration-us", type=int, default=2000000)
+    args = parser.parse_args()
+
+    cores = parse_cores(args.cores)
+    app_cores = max(len(cores) - 1, 1)
+    loads = [int(x) for x in args.loads.split(",")]
+    antagonists = args.be.split(",")
+    commit = subprocess.check_output(
+        ["git", "-C", ROOT, "rev-parse", "--short", "HEAD"],
+        universal_newlines=True).strip()
+
+    tmp = tempfile.mkdtemp(prefix="colocation.")
+    write_config(os.path.join(tmp, "server.config"), SERVER_IP,
+                 args.lc_threads, args.lc_guaranteed, "lc")
+    write_config(os.path.join(tmp, "client.config"), CLIENT_IP,
+                 args.client_threads, args.client_threads, "lc")
+    write_config(os.path.join(tmp, "be.config"), BE_IP, args.be_threads, 0,
+                 "be")
+    print("logs are in %s" % tmp, file=sys.stderr)
+
+    print("commit,policy,be,offered_rps,achieved_rps,steady,p50_us,p99_us,"
+          "p999_us,be_ops_per_sec,lc_cores,be_cores,efficiency", flush=True)
+
+    for policy in args.policies.split(","):
+        iok = start_iokernel(tmp, policy, args.cores,
+                             args.iokernel_args.split())
+        try:
+            for spec in antagonists:
+                server = Process(tmp, "server", [NETBENCH, os.path.join(
+                    tmp, "server.config"), "server"])
+                be = make_antagonist(spec, args.be_threads)
+                try:
+                    time.sleep(2)
+                    be.start(tmp, os.path.join(tmp, "be.config"))
+                    time.sleep(2)
+                    for rate in loads:
+                        res = run_load(tmp, args, server, be, rate)
+                        if res is None:
+                            continue
+                        r, be_ops, lc_cores, be_cores = res
+                        lat = r["latency_us"]
+                        print("%s,%s,%s,%d,%.1f,%s,%.2f,%.2f,%.2f,%.1f,%.3f,"
+                              "%.3f,%.3f" %
+                              (commit, policy, be.name, rate,
+                               r["achieved_rps"],
+                               "true" if r["steady"] else "false",
+                               lat["p50"], lat["p99"], lat["p999"], be_ops,
+                               lc_cores, be_cores,
+                               (lc_cores + be_cores) / app_cores),
+                              flush=True)
+                finally:
+                    be.stop()
+                    server.stop()
+        finally:
+            iok.stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,152 @@
+#!/bin/bash
+# Benchmarks the network stack without a NIC: an iokernel in vnic mode
+# switches packets between a client and a server runtime on this host.
+# With DATAPATH=xdp, the runtimes instead exchange packets over a veth pair
+# through AF_XDP sockets (requires CONFIG_DIRECTPATH_XDP=y).
+#
+# Runs netbench_udp (through its built-in sweep of request rates), netbench2
+# (TCP, at fixed request rates) and tbench, then prints one CSV line per
+# result, to be compared across commits:
+#   commit,benchmark,metric,value
+# mpps counts the packets exchanged in both directions, and latencies are in
+# microseconds. Benchmarks are labeled with the datapath when it is xdp.
+#
+# Run as root from a built tree, after scripts/setup_machine.sh.
+#   CORES     the cores the iokernel may use (default 0-7)
+#   THREADS   client threads (default 2)
+#   RATES     offered TCP requests per second (default "100000 200000 400000")
+#   DATAPATH  iokernel or xdp (default iokernel)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BENCH=$ROOT/apps/bench
+CORES=${CORES:-0-7}
+THREADS=${THREADS:-2}
+RATES=${RATES:-"100000 200000 400000"}
+DATAPATH=${DATAPATH:-iokernel}
+SERVER_IP=10.99.0.1
+CLIENT_IP=10.99.0.2
+SERVER_IF=shveth0
+CLIENT_IF=shveth1
+
+case $DATAPATH in
+iokernel) SUFFIX= SPINKS=0 ;;
+# AF_XDP needs a polling kthread
+xdp) SUFFIX=/xdp SPINKS=1 ;;
+*) echo "unknown datapath $DATAPATH" >&2; exit 1 ;;
+esac
+
+COMMIT=$(git -C "$ROOT" rev-parse --short HEAD)
+TMP=$(mktemp -d)
+PIDS=()
+
+cleanup() {
+	for pid in "${PIDS[@]}"; do
+		kill "$pid" 2> /dev/null || true
+	done
+	wait 2> /dev/null || true
+	if [ "$DATAPATH" = xdp ]; then
+		ip link del $SERVER_IF 2> /dev/null || true
+	fi
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+write_config() {
+	cat > "$1" <<EOF
+host_addr $2
+host_netmask 255.255.255.0
+host_gateway 10.99.0.254
+runtime_kthreads $THREADS
+runtime_guaranteed_kthreads $THREADS
+runtime_spinning_kthreads $SPINKS
+runtime_priority lc
+EOF
+	# the runtime takes over its end of the veth, and its MAC address
+	if [ "$DATAPATH" = xdp ]; then
+		cat >> "$1" <<EOF
+host_mac $(cat /sys/class/net/$3/address)
+enable_directpath
+directpath_xdp_ifname $3
+EOF
+	fi
+}
+
+start_server() {
+	"$@" > "$TMP/server.log" 2>&1 &
+	SERVER_PID=$!
+	PIDS+=($SERVER_PID)
+	sleep 2
+}
+
+stop_server() {
+	kill "$SERVER_PID" 2> /dev/null || true
+	wait "$SERVER_PID" 2> /dev/null || true
+}
+
+if [ "$DATAPATH" = xdp ]; then
+	ip link add $SERVER_IF type veth peer name $CLIENT_IF
+	ip link set $SERVER_IF up
+	ip link set $CLIENT_IF up
+fi
+
+write_config "$TMP/server.config" $SERVER_IP $SERVER_IF
+write_config "$TMP/client.config" $CLIENT_IP $CLIENT_IF
+
+"$ROOT/iokernel/iokerneld" simple vnic "$CORES" > "$TMP/iokernel.log" 2>&1 &
+PIDS+=($!)
+for i in $(seq 30); do
+	grep -q "running dataplane" "$TMP/iokernel.log" && break
+	sleep 1
+done
+if ! grep -q "running dataplane" "$TMP/iokernel.log"; then
+	cat "$TMP/iokernel.log" >&2
+	echo "iokernel failed to start" >&2
+	exit 1
+fi
+
+echo "commit,benchmark,metric,value"
+
+# UDP echo: one packet each way per request.
+# "t: T batch: B rps: R n: N min: .. mean: M 90%: .. 99%: .. 99.9%: ..
+#  99.99%: .. max: .. offered: O"
+start_server "$BENCH/netbench_udp" "$TMP/server.config" server
+"$BENCH/netbench_udp" "$TMP/client.config" client "$THREADS" $SERVER_IP \
+	100000 0 2>> "$TMP/client.log" | grep "^t: " |
+awk -v c="$COMMIT" -v s="$SUFFIX" '{
+	b = "netbench_udp@" $24 s
+	printf "%s,%s,mpps,%.4f\n", c, b, 2 * $6 / 1e6
+	printf "%s,%s,mean_us,%s\n", c, b, $12
+	printf "%s,%s,p90_us,%s\n", c, b, $14
+	printf "%s,%s,p99_us,%s\n", c, b, $16
+	printf "%s,%s,p999_us,%s\n", c, b, $18
+}'
+stop_server
+
+# TCP RPCs: the request, the response, and any pure ACKs.
+# "threads,offered,rps,cpu,samples,min,mean,p90,p99,p999,p9999,max,
+#  client_acks_per_req,server_acks_per_req"
+start_server "$BENCH/netbench2" "$TMP/server.config" server
+ARGS=()
+for rate in $RATES; do
+	ARGS+=("$rate:2000000")
+done
+"$BENCH/netbench2" "$TMP/client.config" client "$THREADS" $SERVER_IP 1 \
+	"${ARGS[@]}" 2>> "$TMP/client.log" | grep -E "^[0-9]+," |
+awk -F, -v c="$COMMIT" -v s="$SUFFIX" '{
+	b = sprintf("netbench2@%d%s", $2, s)
+	printf "%s,%s,mpps,%.4f\n", c, b, $3 * (2 + $13 + $14) / 1e6
+	printf "%s,%s,mean_us,%s\n", c, b, $7
+	printf "%s,%s,p90_us,%s\n", c, b, $8
+	printf "%s,%s,p99_us,%s\n", c, b, $9
+	printf "%s,%s,p999_us,%s\n", c, b, $10
+}'
+stop_server
+
+# Threading primitives: "test 'NAME' took N us."
+"$BENCH/tbench" "$TMP/client.config" 2>> "$TMP/client.log" |
+awk -v c="$COMMIT" '/^test / {
+	gsub("\047", "", $2)
+	printf "%s,tbench_%s,total_us,%s\n", c, $2, $4
+}'
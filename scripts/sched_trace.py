@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+# sched_trace.py - analyzes runtime scheduler traces
+#
+# Converts a dump produced by sched_trace_dump() (or the stat server's
+# "tracedump" command) into a Chrome/Perfetto JSON trace and prints a breakdown
+# of the scheduling delay of every uthread wakeup (READY -> RUN).
+#
+# Usage: sched_trace.py <dump> [-o trace.json]
+
+import argparse
+import json
+import struct
+import sys
+from collections import defaultdict
+
+TRACE_FILE_MAGIC = 0x45435254
+TRACE_FILE_VERSION = 1
+
+FILE_HDR = struct.Struct("<IIIIQ")
+RING_HDR = struct.Struct("<IIQ")
+EVENT = struct.Struct("<QQ")
+
+(READY, RUN, STEAL, PARK, WAKE, PREEMPT,
+ SOFTIRQ_START, SOFTIRQ_END) = range(8)
+
+EVENT_NAMES = ["ready", "run", "steal", "park", "wake", "preempt",
+               "softirq_start", "softirq_end"]
+SOFTIRQ_NAMES = ["iokernel", "directpath", "timer", "storage", "loopback"]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, version, nr_rings, _, cycles_per_us = FILE_HDR.unpack_from(data, 0)
+    if magic != TRACE_FILE_MAGIC or version != TRACE_FILE_VERSION:
+        sys.exit("%s: not a scheduler trace" % path)
+
+    # each event is (tsc, kthread, type, arg, thread)
+    events = []
+    off = FILE_HDR.size
+    for _ in range(nr_rings):
+        kidx, nr_events, dropped = RING_HDR.unpack_from(data, off)
+        off += RING_HDR.size
+        if dropped:
+            print("kthread %d: %d events were overwritten" % (kidx, dropped),
+                  file=sys.stderr)
+        for _ in range(nr_events):
+            tsc, d = EVENT.unpack_from(data, off)
+            off += EVENT.size
+            events.append((tsc, kidx, d & 0xff, (d >> 8) & 0xff, d >> 16))
+
+    events.sort()
+    return cycles_per_us, events
+
+
+def to_chrome(events, cycles_per_us, base):
+    us = lambda tsc: (tsc - base) / cycles_per_us
+    out = []
+    running = {}
+    parked = {}
+
+    def end_run(k, tsc):
+        if k in running:
+            th, start = running.pop(k)
+            out.append({"name": "uthread %#x" % th, "ph": "X", "pid": 0,
+                        "tid": k, "ts": us(start), "dur": us(tsc) - us(start)})
+
+    for tsc, k, typ, arg, th in events:
+        if typ == RUN:
+            end_run(k, tsc)
+            running[k] = (th, tsc)
+        elif typ == PARK:
+            end_run(k, tsc)
+            parked[k] = tsc
+        elif typ == WAKE and k in parked:
+            start = parked.pop(k)
+            out.append({"name": "parked", "ph": "X", "pid": 0, "tid": k,
+                        "ts": us(start), "dur": us(tsc) - us(start)})
+        elif typ in (SOFTIRQ_START, SOFTIRQ_END):
+            out.append({"name": "softirq " + SOFTIRQ_NAMES[arg],
+                        "ph": "B" if typ == SOFTIRQ_START else "E",
+                        "pid": 0, "tid": k, "ts": us(tsc)})
+        else:
+            args = {"thread": "%#x" % th}
+            if typ == STEAL:
+                args["victim"] = arg
+            out.append({"name": EVENT_NAMES[typ], "ph": "i", "s": "t",
+                        "pid": 0, "tid": k, "ts": us(tsc), "args": args})
+
+    for k in sorted({e[1] for e in events}):
+        out.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": k,
+                    "args": {"name": "kthread %d" % k}})
+    return out
+
+
+def overlap(intervals, start, end):
+    total = 0
+    for s, e in intervals:
+        if e > start and s < end:
+            total += min(e, end) - max(s, start)
+    return total
+
+
+def breakdown(events, cycles_per_us):
+    # collect per-kthread parked and softirq intervals
+    parked = defaultdict(list)
+    softirq = defaultdict(list)
+    park_start = {}
+    softirq_start = {}
+    for tsc, k, typ, arg, th in events:
+        if typ == PARK:
+            park_start[k] = tsc
+        elif typ == WAKE and k in park_start:
+            parked[k].append((park_start.pop(k), tsc))
+        elif typ == SOFTIRQ_START:
+            softirq_start[k] = tsc
+        elif typ == SOFTIRQ_END and k in softirq_start:
+            softirq[k].append((softirq_start.pop(k), tsc))
+
+    # match each wakeup with the next time the uthread ran
+    pending = {}
+    stolen = set()
+    samples = []
+    for tsc, k, typ, arg, th in events:
+        if typ == READY:
+            pending[th] = (tsc, k)
+            stolen.discard(th)
+        elif typ == STEAL and th in pending:
+            stolen.add(th)
+        elif typ == RUN and th in pending:
+            ready_tsc, ready_k = pending.pop(th)
+            total = tsc - ready_tsc
+            park = overlap(parked[ready_k], ready_tsc, tsc)
+            sirq = overlap(softirq[k], ready_tsc, tsc)
+            queue = max(total - park - sirq, 0)
+            samples.append((total, park, sirq, queue, th in stolen))
+            stolen.discard(th)
+
+    if not samples:
+        print("no wakeups found")
+        return
+
+    def pct(vals, p):
+        vals = sorted(vals)
+        return vals[min(int(len(vals) * p / 100), len(vals) - 1)]
+
+    print("%d wakeups, %.1f%% stolen" %
+          (len(samples), 100.0 * sum(s[4] for s in samples) / len(samples)))
+    print("%-10s %10s %10s %10s %10s %10s" %
+          ("delay(us)", "mean", "p50", "p90", "p99", "p99.9"))
+    names = ["total", "parked", "softirq", "queued"]
+    for i, name in enumerate(names):
+        vals = [s[i] / cycles_per_us for s in samples]
+        print("%-10s %10.2f %10.2f %10.2f %10.2f %10.2f" %
+              (name, sum(vals) / len(vals), pct(vals, 50), pct(vals, 90),
+               pct(vals, 99), pct(vals, 99.9)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("dump")
+    parser.add_argument("-o", "--output",
+                        help="write a Chrome/Perfetto JSON trace")
+    args = parser.parse_args()
+
+    cycles_per_us, events = load(args.dump)
+    if not events:
+        sys.exit("trace is empty")
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"traceEvents": to_chrome(events, cycles_per_us,
+                                                events[0][0]),
+                       "displayTimeUnit": "ns"}, f)
+
+    breakdown(events, cycles_per_us)
+
+
+if __name__ == "__main__":
+    main()
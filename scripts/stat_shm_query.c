@@ -0,0 +1,148 @@
+/*
+ * stat_shm_query.c - reads runtime stats published to shared memory
+ *
+ * Build with: gcc -O2 -I../inc -o stat_shm_query stat_shm_query.c
+ * Usage: stat_shm_query <stat_shm_key> [interval_ms]
+ */
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/hist.h>
+#include <runtime/stat.h>
+
+static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+static uint64_t hist_percentile(const uint64_t *buckets, int nr_buckets,
+				uint64_t total, double pct)
+{
+	uint64_t target = (uint64_t)(total * pct / 100.0), sum = 0;
+	int i;
+
+	for (i = 0; i < nr_buckets; i++) {
+		sum += buckets[i];
+		if (sum > target)
+			return hist_bucket_min(i);
+	}
+
+	return hist_bucket_min(nr_buckets - 1);
+}
+
+static void snapshot(const struct stat_snapshot_hdr *hdr, void *buf,
+		     size_t len)
+{
+	uint64_t seq;
+
+	/* retry until a consistent snapshot is copied */
+	do {
+		while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(buf, hdr, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static void print_snapshot(const struct stat_snapshot_hdr *hdr,
+			   char **names)
+{
+	const uint64_t *stats = (const uint64_t *)(hdr + 1);
+	const uint64_t *h = stats + hdr->nr_counters;
+	uint64_t total;
+	int i, j;
+
+	for (i = 0; i < hdr->nr_counters; i++)
+		printf("%s:%lu\n", names[i], stats[i]);
+
+	for (i = 0; i < hdr->nr_hists; i++, h += hdr->nr_buckets) {
+		total = 0;
+		for (j = 0; j < hdr->nr_buckets; j++)
+			total += h[j];
+
+		printf("%s: count %lu", names[hdr->nr_counters + i], total);
+		if (total) {
+			for (j = 0; j < sizeof(percentiles) / sizeof(*percentiles);
+			     j++) {
+				printf(" p%g %lu", percentiles[j],
+				       hist_percentile(h, hdr->nr_buckets,
+						       total, percentiles[j]));
+			}
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat_snapshot_hdr *hdr, *copy;
+	struct shmid_ds ds;
+	char **names, *tok, *saveptr;
+	int shmid, interval_ms = 0, i;
+	key_t key;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <stat_shm_key> [interval_ms]\n",
+			argv[0]);
+		return -EINVAL;
+	}
+
+	key = strtol(argv[1], NULL, 0);
+	if (argc > 2)
+		interval_ms = atoi(argv[2]);
+
+	shmid = shmget(key, 0, 0);
+	if (shmid == -1 || shmctl(shmid, IPC_STAT, &ds) == -1) {
+		fprintf(stderr, "couldn't find shm key %s: %s\n", argv[1],
+			strerror(errno));
+		return -errno;
+	}
+
+	hdr = shmat(shmid, NULL, SHM_RDONLY);
+	if (hdr == (void *)-1) {
+		fprintf(stderr, "couldn't attach shm: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	if (hdr->magic != STAT_SNAPSHOT_MAGIC ||
+	    hdr->version != STAT_SNAPSHOT_VERSION) {
+		fprintf(stderr, "unsupported snapshot format\n");
+		return -EINVAL;
+	}
+
+	copy = malloc(ds.shm_segsz);
+	names = calloc(hdr->nr_counters + hdr->nr_hists, sizeof(*names));
+	if (!copy || !names)
+		return -ENOMEM;
+
+	/* names are written once at startup and never change */
+	snapshot(hdr, copy, ds.shm_segsz);
+	tok = (char *)copy + sizeof(*copy) +
+	      sizeof(uint64_t) * (copy->nr_counters +
+				  copy->nr_hists * copy->nr_buckets);
+	tok = strtok_r(tok, ",", &saveptr);
+	for (i = 0; i < copy->nr_counters + copy->nr_hists && tok; i++) {
+		names[i] = strdup(tok);
+		tok = strtok_r(NULL, ",", &saveptr);
+	}
+	if (i != copy->nr_counters + copy->nr_hists) {
+		fprintf(stderr, "snapshot names are truncated\n");
+		return -EINVAL;
+	}
+
+	while (true) {
+		snapshot(hdr, copy, ds.shm_segsz);
+		print_snapshot(copy, names);
+		if (!interval_ms)
+			break;
+		printf("\n");
+		usleep(interval_ms * 1000);
+	}
+
+	return 0;
+}
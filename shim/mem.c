@@ -4,6 +4,276 @@
 
 #include <runtime/preempt.h>
 
+#ifdef SHIM_SMALLOC
+
+/*
+ * Routes heap allocations to the runtime's per-kthread magazine allocator
+ * (smalloc), avoiding glibc arena locks. Allocations made before the runtime
+ * is initialized, or that are too large for smalloc, still go to glibc, which
+ * is configured to serve large sizes with mmap. Frees are dispatched based on
+ * whether the address is inside the runtime's page memory.
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+
+#include <base/page.h>
+#include <runtime/smalloc.h>
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static size_t (*real_malloc_usable_size)(void *);
+
+static void *dummy_calloc(size_t a, size_t b) { return NULL; }
+
+static void shim_mem_resolve(void)
+{
+	// Ensure that dlsym's call to calloc doesn't loop infinitely
+	real_calloc = dummy_calloc;
+	barrier();
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+}
+
+static void __attribute__((constructor)) shim_mem_init(void)
+{
+	if (!real_calloc)
+		shim_mem_resolve();
+
+	/* ensure allocations too large for smalloc are never cached by glibc */
+	mallopt(M_MMAP_THRESHOLD, SMALLOC_MAX_SIZE);
+}
+
+static inline bool shim_smalloc_ok(size_t size)
+{
+	return likely(size <= SMALLOC_MAX_SIZE && smalloc_ready);
+}
+
+static void *shim_malloc(size_t size)
+{
+	void *ptr;
+
+	if (shim_smalloc_ok(size)) {
+		ptr = smalloc(size ? size : 1);
+		if (likely(ptr))
+			return ptr;
+	}
+
+	if (unlikely(!real_calloc))
+		shim_mem_resolve();
+	preempt_disable();
+	ptr = real_malloc(size);
+	preempt_enable();
+	return ptr;
+}
+
+static void shim_free(void *ptr)
+{
+	if (is_page_addr(ptr)) {
+		sfree(ptr);
+		return;
+	}
+
+	if (!ptr)
+		return;
+	if (unlikely(!real_calloc))
+		shim_mem_resolve();
+	preempt_disable();
+	real_free(ptr);
+	preempt_enable();
+}
+
+static void *shim_memalign(size_t align, size_t size)
+{
+	void *ptr;
+
+	/* smalloc items are naturally aligned to their power-of-two size */
+	if (shim_smalloc_ok(MAX(size, align))) {
+		ptr = smalloc(MAX(MAX(size, align), 1));
+		if (likely(ptr))
+			return ptr;
+	}
+
+	if (unlikely(!real_calloc))
+		shim_mem_resolve();
+	preempt_disable();
+	ptr = real_memalign(align, size);
+	preempt_enable();
+	return ptr;
+}
+
+void *malloc(size_t size)
+{
+	return shim_malloc(size);
+}
+
+void free(void *ptr)
+{
+	shim_free(ptr);
+}
+
+void cfree(void *ptr)
+{
+	shim_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	void *ptr;
+
+	if (unlikely(__builtin_mul_overflow(nmemb, size, &total))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (shim_smalloc_ok(total)) {
+		ptr = smalloc(total ? total : 1);
+		if (likely(ptr)) {
+			memset(ptr, 0, total);
+			return ptr;
+		}
+	}
+
+	if (unlikely(!real_calloc))
+		shim_mem_resolve();
+	preempt_disable();
+	ptr = real_calloc(nmemb, size);
+	preempt_enable();
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	size_t old_size;
+	void *newptr;
+
+	if (!ptr)
+		return shim_malloc(size);
+	if (!size) {
+		shim_free(ptr);
+		return NULL;
+	}
+
+	if (is_page_addr(ptr)) {
+		old_size = smalloc_usable_size(ptr);
+		if (size <= old_size && size > old_size / 2)
+			return ptr;
+	} else {
+		if (unlikely(!real_calloc))
+			shim_mem_resolve();
+		if (!shim_smalloc_ok(size)) {
+			preempt_disable();
+			newptr = real_realloc(ptr, size);
+			preempt_enable();
+			return newptr;
+		}
+		old_size = real_malloc_usable_size(ptr);
+	}
+
+	newptr = shim_malloc(size);
+	if (unlikely(!newptr))
+		return NULL;
+	memcpy(newptr, ptr, MIN(old_size, size));
+	shim_free(ptr);
+	return newptr;
+}
+
+void *memalign(size_t align, size_t size)
+{
+	return shim_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return shim_memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	if (align < sizeof(void *) || (align & (align - 1)))
+		return EINVAL;
+
+	ptr = shim_memalign(align, size);
+	if (unlikely(!ptr))
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	return shim_memalign(PGSIZE_4KB, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return shim_memalign(PGSIZE_4KB, align_up(size, PGSIZE_4KB));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if (is_page_addr(ptr))
+		return smalloc_usable_size(ptr);
+	if (!ptr)
+		return 0;
+	if (unlikely(!real_calloc))
+		shim_mem_resolve();
+	return real_malloc_usable_size(ptr);
+}
+
+void __libc_free(void *ptr)
+{
+	shim_free(ptr);
+}
+
+void *__libc_realloc(void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+void *__libc_calloc(size_t nmemb, size_t size)
+{
+	return calloc(nmemb, size);
+}
+
+void __libc_cfree(void *ptr)
+{
+	shim_free(ptr);
+}
+
+void *__libc_memalign(size_t align, size_t size)
+{
+	return shim_memalign(align, size);
+}
+
+void *__libc_valloc(size_t size)
+{
+	return valloc(size);
+}
+
+void *__libc_pvalloc(size_t size)
+{
+	return pvalloc(size);
+}
+
+int __posix_memalign(void **memptr, size_t align, size_t size)
+{
+	return posix_memalign(memptr, align, size);
+}
+
+#else /* SHIM_SMALLOC */
+
 #define HOOK3(fnname, retType, argType1, argType2, argType3)                   \
 	retType fnname(argType1 __a1, argType2 __a2, argType3 __a3)            \
 	{                                                                      \
@@ -90,3 +360,5 @@ void *calloc(size_t a, size_t b)
 	preempt_enable();
 	return ptr;
 }
+
+#endif /* SHIM_SMALLOC */
@@ -43,6 +43,7 @@ static void client_worker(void *arg)
 	/* local IP + ephemeral port */
 	laddr.ip = 0;
 	laddr.port = 0;
+	laddr.family = NETADDR_IPV4;
 
 	memset(buf, 0xAB, payload_len);
 
@@ -138,6 +139,7 @@ static void do_server(void *arg)
 
 	laddr.ip = 0;
 	laddr.port = NETPERF_PORT;
+	laddr.family = NETADDR_IPV4;
 
 	ret = tcp_listen(laddr, 4096, &q);
 	BUG_ON(ret);
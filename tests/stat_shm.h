@@ -0,0 +1,123 @@
+/*
+ * stat_shm.h - reads runtime stats from tests
+ *
+ * Tests that check counters read the snapshots the runtime publishes to shared
+ * memory (see inc/runtime/stat.h), the same way external monitoring would.
+ * The config file must set "stat_shm_key".
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/log.h>
+#include <runtime/stat.h>
+#include <runtime/timer.h>
+
+/* how long to wait for the runtime to publish a new snapshot */
+#define STAT_SHM_WAIT_US	(5 * ONE_MS)
+
+static const struct stat_snapshot_hdr *stat_shm_hdr;
+static const char *stat_shm_names;
+
+/**
+ * cfg_lookup - finds the value of an option in a config file
+ * @path: the config file
+ * @name: the option
+ * @val: a buffer to store its value
+ * @len: the size of @val
+ *
+ * Returns 0 if successful, otherwise -ENOENT.
+ */
+static inline int cfg_lookup(const char *path, const char *name, char *val,
+			     size_t len)
+{
+	char line[256], key[64], fmt[32];
+	FILE *f;
+	int ret = -ENOENT;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	snprintf(fmt, sizeof(fmt), "%%63s %%%zus", len - 1);
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, fmt, key, val) == 2 && !strcmp(key, name)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/**
+ * stat_shm_attach - attaches to the stats published by this runtime
+ * @cfgpath: the runtime's config file
+ */
+static inline void stat_shm_attach(const char *cfgpath)
+{
+	const struct stat_snapshot_hdr *hdr;
+	char val[32];
+	int shmid;
+
+	if (cfg_lookup(cfgpath, "stat_shm_key", val, sizeof(val)))
+		panic("the config file must set stat_shm_key");
+
+	shmid = shmget(strtol(val, NULL, 0), 0, 0);
+	BUG_ON(shmid == -1);
+	hdr = shmat(shmid, NULL, SHM_RDONLY);
+	BUG_ON(hdr == (void *)-1);
+	BUG_ON(hdr->magic != STAT_SNAPSHOT_MAGIC);
+
+	stat_shm_hdr = hdr;
+	stat_shm_names = (const char *)(hdr + 1) +
+		sizeof(uint64_t) * (hdr->nr_counters +
+				    hdr->nr_hists * hdr->nr_buckets);
+}
+
+/**
+ * stat_shm_read - reads a counter, counting everything up to now
+ * @name: the name of the counter (as reported by the stat server)
+ *
+ * Waits for the runtime to publish a snapshot taken after the call.
+ */
+static inline uint64_t stat_shm_read(const char *name)
+{
+	const uint64_t *stats = (const uint64_t *)(stat_shm_hdr + 1);
+	const char *pos = stat_shm_names;
+	size_t len = strlen(name);
+	uint64_t seq, val;
+	int i;
+
+	for (i = 0; i < stat_shm_hdr->nr_counters; i++) {
+		if (!strncmp(pos, name, len) && (pos[len] == ',' || !pos[len]))
+			break;
+		pos = strchr(pos, ',');
+		BUG_ON(!pos);
+		pos++;
+	}
+	if (i == stat_shm_hdr->nr_counters)
+		panic("no stat named %s", name);
+
+	/* a snapshot that started after now has been completely published */
+	seq = (load_acquire(&stat_shm_hdr->seq) | 1) + 3;
+	while ((long)(load_acquire(&stat_shm_hdr->seq) - seq) < 0)
+		timer_sleep(STAT_SHM_WAIT_US);
+
+	do {
+		while ((seq = load_acquire(&stat_shm_hdr->seq)) & 1)
+			cpu_relax();
+		val = ACCESS_ONCE(stats[i]);
+		mb();
+	} while (ACCESS_ONCE(stat_shm_hdr->seq) != seq);
+
+	return val;
+}
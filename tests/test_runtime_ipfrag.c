@@ -0,0 +1,366 @@
+/*
+ * test_runtime_ipfrag.c - tests IP fragmentation and reassembly over loopback
+ *
+ * Loopback only ever delivers fragments in order, so the reassembly table is
+ * also driven directly with crafted fragments: out of order, duplicated,
+ * overlapping, abandoned, and enough of them to hit the table's caps. Every
+ * crafted fragment counts its release, so a leak or a double free fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/atomic.h>
+#include <base/hash.h>
+#include <base/stddef.h>
+#include <base/log.h>
+#include <net/ip.h>
+#include <net/mbuf.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#define TEST_PORT	8200
+
+/* these must match runtime/net/ipfrag.c */
+#define IPFRAG_TIMEOUT		(100 * ONE_MS)
+#define IPFRAG_MAX_DATAGRAMS	64
+#define IPFRAG_MAX_MEM		(2 * 1024 * 1024)
+
+/* crafted fragments, from addresses no real packet uses */
+#define FRAG_SADDR	MAKE_IP_ADDR(192, 0, 2, 1)
+#define FRAG_DADDR	MAKE_IP_ADDR(192, 0, 2, 2)
+#define FRAG_BUF_LEN	2048
+#define FRAG_MBUF_LEN	(align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
+#define FRAG_MEM	(FRAG_BUF_LEN + FRAG_MBUF_LEN)
+
+/* the runtime's reassembly entry point */
+extern struct mbuf *ipfrag_reassemble(struct mbuf *m,
+				      const struct ip_hdr *iphdr);
+
+static const size_t sizes[] = {
+	1, 1000, 1472, 1473, 1480, 2961, 9000, 32768, UDP_MAX_DATAGRAM_SIZE,
+};
+
+static void fill(unsigned char *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char)(i * 31 + seed);
+}
+
+static void check(udpconn_t *in, unsigned char *rbuf, size_t len,
+		  unsigned int seed, struct netaddr expected)
+{
+	static unsigned char expect[UDP_MAX_DATAGRAM_SIZE];
+	struct netaddr raddr;
+	ssize_t ret;
+
+	ret = udp_read_from(in, rbuf, UDP_MAX_DATAGRAM_SIZE, &raddr);
+	if (ret != len)
+		panic("expected %ld bytes, got %ld", len, ret);
+	if (raddr.ip != expected.ip || raddr.port != expected.port)
+		panic("wrong source address");
+
+	fill(expect, len, seed);
+	if (memcmp(rbuf, expect, len) != 0)
+		panic("datagram of %ld bytes was corrupted", len);
+}
+
+static atomic_t frags_outstanding;
+
+static void frag_release(struct mbuf *m)
+{
+	atomic_dec(&frags_outstanding);
+	sfree(m);
+}
+
+static void frag_hdr(struct ip_hdr *iphdr, uint16_t id, unsigned int off,
+		     bool more)
+{
+	memset(iphdr, 0, sizeof(*iphdr));
+	iphdr->version = IPVERSION;
+	iphdr->header_len = 5;
+	iphdr->ttl = 64;
+	iphdr->proto = IPPROTO_UDP;
+	iphdr->id = hton16(id);
+	iphdr->off = hton16(off / 8 | (more ? IP_MF : 0));
+	iphdr->saddr = hton32(FRAG_SADDR);
+	iphdr->daddr = hton32(FRAG_DADDR);
+}
+
+/* the content of a crafted datagram depends only on the byte's offset */
+static unsigned char frag_byte(uint16_t id, unsigned int off)
+{
+	return (unsigned char)(off * 7 + id);
+}
+
+/* feeds the fragment [@off, @off + @len) of datagram @id to reassembly */
+static struct mbuf *frag_send(uint16_t id, unsigned int off, unsigned int len,
+			      bool more)
+{
+	struct ip_hdr iphdr;
+	unsigned char *data;
+	struct mbuf *m;
+	unsigned int i;
+
+	BUG_ON(len > FRAG_BUF_LEN);
+	m = smalloc(FRAG_MEM);
+	BUG_ON(!m);
+	mbuf_init(m, (unsigned char *)m + FRAG_MBUF_LEN, FRAG_BUF_LEN, 0);
+	data = mbuf_put(m, len);
+	for (i = 0; i < len; i++)
+		data[i] = frag_byte(id, off + i);
+	m->release = frag_release;
+	atomic_inc(&frags_outstanding);
+
+	frag_hdr(&iphdr, id, off, more);
+	return ipfrag_reassemble(m, &iphdr);
+}
+
+/* checks a reassembled datagram of @len bytes, then frees it */
+static void frag_check(struct mbuf *m, uint16_t id, unsigned int len)
+{
+	static unsigned char buf[UDP_MAX_DATAGRAM_SIZE];
+	unsigned int i;
+
+	if (!m)
+		panic("datagram %d wasn't reassembled", id);
+	if (mbuf_chain_length(m) != len)
+		panic("datagram %d has %d bytes, expected %d", id,
+		      mbuf_chain_length(m), len);
+	mbuf_chain_copy(m, buf, len);
+	for (i = 0; i < len; i++) {
+		if (buf[i] != frag_byte(id, i))
+			panic("datagram %d corrupted at byte %d", id, i);
+	}
+	mbuf_free(m);
+}
+
+static void frags_expect_outstanding(int nr)
+{
+	if (atomic_read(&frags_outstanding) != nr)
+		panic("%d crafted fragments outstanding, expected %d",
+		      atomic_read(&frags_outstanding), nr);
+}
+
+/* waits until every incomplete datagram has expired */
+static void frags_wait_expired(void)
+{
+	timer_sleep(3 * IPFRAG_TIMEOUT);
+	frags_expect_outstanding(0);
+}
+
+/* picks datagram IDs, starting at @id, that all land in the same shard */
+static void frag_ids_same_shard(uint16_t id, uint16_t *ids, int nr)
+{
+	struct ip_hdr iphdr;
+	uint32_t shard = UINT_MAX, hash;
+	int i = 0;
+
+	/* mirrors ipfrag_get_shard() */
+	for (; i < nr; id++) {
+		frag_hdr(&iphdr, id, 0, true);
+		hash = hash_crc32c_two(iphdr.id |
+				       ((uint32_t)iphdr.proto << 16),
+				       iphdr.saddr, iphdr.daddr);
+		if (shard == UINT_MAX)
+			shard = hash % maxks;
+		if (hash % maxks == shard)
+			ids[i++] = id;
+	}
+}
+
+static void test_frag_order(void)
+{
+	/* last first, then the middle, then the first */
+	BUG_ON(frag_send(1, 2048, 1000, false));
+	BUG_ON(frag_send(1, 1024, 1024, true));
+	frag_check(frag_send(1, 0, 1024, true), 1, 3048);
+
+	/* first, last, middle */
+	BUG_ON(frag_send(2, 0, 1024, true));
+	BUG_ON(frag_send(2, 2048, 8, false));
+	frag_check(frag_send(2, 1024, 1024, true), 2, 2056);
+	frags_expect_outstanding(0);
+	log_info("out-of-order fragments ok");
+}
+
+static void test_frag_duplicate(void)
+{
+	/* a duplicate discards the datagram (RFC 5722) */
+	BUG_ON(frag_send(3, 0, 1024, true));
+	BUG_ON(frag_send(3, 0, 1024, true));
+	frags_expect_outstanding(0);
+
+	/* a retransmission can then start it over */
+	BUG_ON(frag_send(3, 0, 1024, true));
+	frag_check(frag_send(3, 1024, 100, false), 3, 1124);
+
+	/* so does a duplicate of the last fragment */
+	BUG_ON(frag_send(4, 1024, 100, false));
+	BUG_ON(frag_send(4, 1024, 100, false));
+	frags_expect_outstanding(0);
+	log_info("duplicate fragments ok");
+}
+
+static void test_frag_overlap(void)
+{
+	/* overlapping the next fragment */
+	BUG_ON(frag_send(5, 512, 1024, true));
+	BUG_ON(frag_send(5, 0, 1024, true));
+	frags_expect_outstanding(0);
+
+	/* overlapping the previous fragment */
+	BUG_ON(frag_send(6, 0, 1024, true));
+	BUG_ON(frag_send(6, 1016, 8, true));
+	frags_expect_outstanding(0);
+
+	/* past the end given by the last fragment */
+	BUG_ON(frag_send(7, 1024, 8, false));
+	BUG_ON(frag_send(7, 1032, 8, true));
+	frags_expect_outstanding(0);
+
+	/* two last fragments that disagree on the length */
+	BUG_ON(frag_send(8, 1024, 8, false));
+	BUG_ON(frag_send(8, 2048, 8, false));
+	frags_expect_outstanding(0);
+	log_info("overlapping fragments ok");
+}
+
+static void test_frag_timeout(void)
+{
+	BUG_ON(frag_send(9, 0, 1024, true));
+	BUG_ON(frag_send(10, 1024, 8, false));
+	frags_expect_outstanding(2);
+	frags_wait_expired();
+
+	/* the rest of an expired datagram starts a new one */
+	BUG_ON(frag_send(9, 1024, 8, false));
+	frags_expect_outstanding(1);
+	frags_wait_expired();
+	log_info("fragment timeout ok");
+}
+
+static void test_frag_max_datagrams(void)
+{
+	uint16_t ids[IPFRAG_MAX_DATAGRAMS + 1];
+	int i;
+
+	frag_ids_same_shard(100, ids, ARRAY_SIZE(ids));
+	for (i = 0; i < IPFRAG_MAX_DATAGRAMS; i++)
+		BUG_ON(frag_send(ids[i], 0, 8, true));
+	frags_expect_outstanding(IPFRAG_MAX_DATAGRAMS);
+
+	/* one more evicts the oldest */
+	BUG_ON(frag_send(ids[IPFRAG_MAX_DATAGRAMS], 0, 8, true));
+	frags_expect_outstanding(IPFRAG_MAX_DATAGRAMS);
+	frag_check(frag_send(ids[1], 8, 8, false), ids[1], 16);
+	frags_expect_outstanding(IPFRAG_MAX_DATAGRAMS - 1);
+
+	/* so the rest of the oldest starts over, and can't complete it */
+	BUG_ON(frag_send(ids[0], 8, 8, false));
+	frags_expect_outstanding(IPFRAG_MAX_DATAGRAMS);
+
+	frags_wait_expired();
+	log_info("datagram cap ok");
+}
+
+static void test_frag_max_mem(void)
+{
+	uint16_t ids[2];
+	int i, nr = IPFRAG_MAX_MEM / FRAG_MEM;
+
+	frag_ids_same_shard(1000, ids, ARRAY_SIZE(ids));
+
+	/* a datagram that outgrows the cap is discarded */
+	for (i = 0; i < nr; i++)
+		BUG_ON(frag_send(ids[0], i * 8, 8, true));
+	frags_expect_outstanding(nr);
+	BUG_ON(frag_send(ids[0], nr * 8, 8, true));
+	frags_expect_outstanding(0);
+
+	/* a new datagram evicts old ones to make room */
+	for (i = 0; i < nr; i++)
+		BUG_ON(frag_send(ids[0], i * 8, 8, true));
+	BUG_ON(frag_send(ids[1], 0, 8, true));
+	frags_expect_outstanding(1);
+	frag_check(frag_send(ids[1], 8, 8, false), ids[1], 16);
+	frags_expect_outstanding(0);
+	log_info("memory cap ok");
+}
+
+static void main_handler(void *arg)
+{
+	static unsigned char sbuf[UDP_MAX_DATAGRAM_SIZE];
+	static unsigned char rbuf[UDP_MAX_DATAGRAM_SIZE];
+	struct netaddr laddr;
+	udpconn_t *in, *out;
+	ssize_t ret;
+	int i;
+
+	BUG_ON(udp_listen((struct netaddr){0, TEST_PORT}, &in));
+	laddr = udp_local_addr(in);
+	BUG_ON(udp_dial((struct netaddr){0, 0}, laddr, &out));
+
+	/* sockets: writes up to the largest possible datagram */
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		fill(sbuf, sizes[i], i);
+		ret = udp_write(out, sbuf, sizes[i]);
+		if (ret != sizes[i])
+			panic("udp_write(%ld) failed, ret = %ld", sizes[i], ret);
+		check(in, rbuf, sizes[i], i, udp_local_addr(out));
+	}
+	log_info("fragmented socket writes ok");
+
+	/* connectionless sends */
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		fill(sbuf, sizes[i], i + 100);
+		ret = udp_send(sbuf, sizes[i], udp_local_addr(out), laddr);
+		if (ret != sizes[i])
+			panic("udp_send(%ld) failed, ret = %ld", sizes[i], ret);
+		check(in, rbuf, sizes[i], i + 100, udp_local_addr(out));
+	}
+	log_info("fragmented sends ok");
+
+	/* too large */
+	ret = udp_write(out, sbuf, UDP_MAX_DATAGRAM_SIZE + 1);
+	BUG_ON(ret != -EMSGSIZE);
+
+	udp_close(out);
+	udp_shutdown(in);
+	udp_close(in);
+
+	/* start from an empty table, without other datagrams in the shards */
+	frags_wait_expired();
+	test_frag_order();
+	test_frag_duplicate();
+	test_frag_overlap();
+	test_frag_timeout();
+	test_frag_max_datagrams();
+	test_frag_max_mem();
+
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * test_runtime_ipv6.c - tests UDP and TCP over IPv6 loopback
+ *
+ * The config file must set "host_addr6".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/udp.h>
+
+#define TEST_PORT	8300
+#define TEST_LEN	4096
+
+static const uint8_t any_addr6[16];
+static struct netaddr host_addr6;
+
+static void test_parse(void)
+{
+	char str[NETADDR_STR_LEN];
+	struct netaddr addr;
+
+	BUG_ON(str_to_netaddr("[fd00::1]:80", &addr));
+	BUG_ON(!netaddr_is_ipv6(&addr) || addr.port != 80);
+	BUG_ON(addr.ip6[0] != 0xfd || addr.ip6[15] != 0x01);
+	BUG_ON(strcmp(netaddr_to_str(addr, str), "[fd00::1]:80") != 0);
+
+	BUG_ON(str_to_netaddr("fd00::2", &addr));
+	BUG_ON(!netaddr_is_ipv6(&addr) || addr.port != 0);
+
+	BUG_ON(str_to_netaddr("10.0.0.1:5", &addr));
+	BUG_ON(netaddr_is_ipv6(&addr) || addr.ip != MAKE_IP_ADDR(10, 0, 0, 1));
+	BUG_ON(strcmp(netaddr_to_str(addr, str), "10.0.0.1:5") != 0);
+
+	BUG_ON(str_to_netaddr("[fd00::1", &addr) == 0);
+	log_info("address parsing ok");
+}
+
+static void test_udp(void)
+{
+	static unsigned char sbuf[TEST_LEN], rbuf[TEST_LEN];
+	struct netaddr laddr, raddr, oaddr;
+	struct netaddr v4addr = {MAKE_IP_ADDR(10, 0, 0, 1), 9};
+	udpconn_t *in, *out;
+	ssize_t ret;
+	int i;
+
+	BUG_ON(udp_listen(netaddr_ipv6(any_addr6, TEST_PORT), &in));
+	laddr = udp_local_addr(in);
+	BUG_ON(!netaddr_is_ipv6(&laddr));
+	host_addr6 = laddr;
+
+	/* an unspecified local address takes the remote's family */
+	BUG_ON(udp_dial((struct netaddr){0, 0}, laddr, &out));
+	oaddr = udp_local_addr(out);
+	BUG_ON(!netaddr_is_ipv6(&oaddr));
+
+	for (i = 0; i < 16; i++) {
+		memset(sbuf, i, TEST_LEN);
+		ret = udp_write(out, sbuf, i * 64 + 1);
+		if (ret != i * 64 + 1)
+			panic("udp_write failed, ret = %ld", ret);
+		ret = udp_read_from(in, rbuf, TEST_LEN, &raddr);
+		if (ret != i * 64 + 1)
+			panic("udp_read_from failed, ret = %ld", ret);
+		BUG_ON(!netaddr_equal(&raddr, &oaddr));
+		BUG_ON(memcmp(sbuf, rbuf, ret) != 0);
+	}
+
+	/* IPv6 datagrams are never fragmented and families can't be mixed */
+	BUG_ON(udp_write(out, sbuf, UDP_MAX_DATAGRAM_SIZE) != -EMSGSIZE);
+	BUG_ON(udp_write_to(in, sbuf, 1, &v4addr) != -EINVAL);
+
+	udp_close(out);
+	udp_shutdown(in);
+	udp_close(in);
+	log_info("udp over ipv6 ok");
+}
+
+static void tcp_client(void *arg)
+{
+	static unsigned char buf[TEST_LEN];
+	struct netaddr *raddr = arg;
+	tcpconn_t *c;
+	ssize_t ret;
+
+	BUG_ON(tcp_dial((struct netaddr){0, 0}, *raddr, &c));
+	memset(buf, 0x5a, TEST_LEN);
+	ret = tcp_write(c, buf, TEST_LEN);
+	if (ret != TEST_LEN)
+		panic("tcp_write failed, ret = %ld", ret);
+	BUG_ON(tcp_shutdown(c, SHUT_WR));
+	BUG_ON(tcp_read(c, buf, TEST_LEN) != 0);
+	tcp_close(c);
+}
+
+static void test_tcp(void)
+{
+	static unsigned char buf[TEST_LEN];
+	struct netaddr raddr;
+	tcpqueue_t *q;
+	tcpconn_t *c;
+	size_t total = 0;
+	ssize_t ret;
+	int i;
+
+	BUG_ON(tcp_listen(netaddr_ipv6(any_addr6, TEST_PORT), 16, &q));
+	BUG_ON(thread_spawn(tcp_client, &host_addr6));
+
+	BUG_ON(tcp_accept(q, &c));
+	raddr = tcp_remote_addr(c);
+	BUG_ON(!netaddr_is_ipv6(&raddr));
+
+	while ((ret = tcp_read(c, buf, TEST_LEN)) > 0) {
+		for (i = 0; i < ret; i++)
+			BUG_ON(buf[i] != 0x5a);
+		total += ret;
+	}
+	BUG_ON(ret < 0 || total != TEST_LEN);
+
+	tcp_close(c);
+	tcp_qshutdown(q);
+	tcp_qclose(q);
+	log_info("tcp over ipv6 ok");
+}
+
+static void main_handler(void *arg)
+{
+	test_parse();
+	test_udp();
+	test_tcp();
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -10,6 +11,12 @@
 #define ITERS   500000
 #define NCORES	4
 
+/* contention benchmark parameters */
+#define BENCH_THREADS	32
+#define BENCH_ACQUIRES	20000
+#define BENCH_CS_CYCLES	100
+#define BENCH_WRITE_PCT	10
+
 struct bucket {
 	mutex_t lock;
 	condvar_t cv;
@@ -63,6 +70,107 @@ static void work_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+static mutex_t bench_lock;
+static rwmutex_t bench_rwlock;
+static uint64_t bench_counter;
+static uint64_t bench_lat[BENCH_THREADS * BENCH_ACQUIRES];
+
+static void bench_delay(uint64_t cycles)
+{
+	uint64_t start = rdtsc();
+
+	while (rdtsc() - start < cycles)
+		cpu_relax();
+}
+
+static void bench_mutex_handler(void *arg)
+{
+	waitgroup_t *wg = (waitgroup_t *)arg;
+	uint64_t *lat;
+	uint64_t start;
+	int i, idx;
+
+	mutex_lock(&next_bucket_lock);
+	idx = next_bucket++;
+	mutex_unlock(&next_bucket_lock);
+	lat = &bench_lat[idx * BENCH_ACQUIRES];
+
+	for (i = 0; i < BENCH_ACQUIRES; i++) {
+		start = rdtsc();
+		mutex_lock(&bench_lock);
+		lat[i] = rdtsc() - start;
+		bench_counter++;
+		bench_delay(BENCH_CS_CYCLES);
+		mutex_unlock(&bench_lock);
+		bench_delay(BENCH_CS_CYCLES);
+	}
+
+	waitgroup_done(wg);
+}
+
+static void bench_rwmutex_handler(void *arg)
+{
+	waitgroup_t *wg = (waitgroup_t *)arg;
+	unsigned int seed;
+	uint64_t *lat;
+	uint64_t start;
+	int i, idx;
+
+	mutex_lock(&next_bucket_lock);
+	idx = next_bucket++;
+	mutex_unlock(&next_bucket_lock);
+	lat = &bench_lat[idx * BENCH_ACQUIRES];
+	seed = idx;
+
+	for (i = 0; i < BENCH_ACQUIRES; i++) {
+		start = rdtsc();
+		if (rand_r(&seed) % 100 < BENCH_WRITE_PCT) {
+			rwmutex_wrlock(&bench_rwlock);
+			lat[i] = rdtsc() - start;
+		} else {
+			rwmutex_rdlock(&bench_rwlock);
+			lat[i] = rdtsc() - start;
+		}
+		bench_delay(BENCH_CS_CYCLES);
+		rwmutex_unlock(&bench_rwlock);
+		bench_delay(BENCH_CS_CYCLES);
+	}
+
+	waitgroup_done(wg);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run_contention_bench(const char *name, thread_fn_t fn)
+{
+	waitgroup_t wg;
+	uint64_t start_us, elapsed_us, p50, p99;
+	int i, ret, n = BENCH_THREADS * BENCH_ACQUIRES;
+
+	next_bucket = 0;
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, BENCH_THREADS);
+	start_us = microtime();
+	for (i = 0; i < BENCH_THREADS; i++) {
+		ret = thread_spawn(fn, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+	elapsed_us = microtime() - start_us;
+
+	qsort(bench_lat, n, sizeof(uint64_t), cmp_u64);
+	p50 = bench_lat[n / 2];
+	p99 = bench_lat[n * 99 / 100];
+	log_info("%s: %f acquires / second, p50 %f us, p99 %f us", name,
+		 (double)n / (elapsed_us * 0.000001),
+		 (double)p50 / cycles_per_us, (double)p99 / cycles_per_us);
+}
+
 static void main_handler(void *arg)
 {
 	waitgroup_t wg;
@@ -134,6 +242,13 @@ static void main_handler(void *arg)
 
 	waitgroup_wait(&wg);
 	log_info("%f messages / second", messages_per_second);
+
+	/* measure throughput and acquisition latency under contention */
+	mutex_init(&bench_lock);
+	rwmutex_init(&bench_rwlock);
+	run_contention_bench("mutex", bench_mutex_handler);
+	run_contention_bench("rwmutex", bench_rwmutex_handler);
+	BUG_ON(bench_counter != BENCH_THREADS * BENCH_ACQUIRES);
 }
 
 int main(int argc, char *argv[])
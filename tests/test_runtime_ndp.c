@@ -0,0 +1,286 @@
+/*
+ * test_runtime_ndp.c - tests the IPv6 neighbor cache
+ *
+ * Feeds crafted neighbor solicitations and advertisements to the runtime and
+ * checks what the neighbor cache learns from them. The neighbors don't exist,
+ * so solicitations sent on their behalf go unanswered, and the test waits for
+ * one of them to give up (several seconds). Every crafted message counts its
+ * release, so a leak or a double free fails.
+ *
+ * The config file must set "host_addr6".
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/atomic.h>
+#include <base/stddef.h>
+#include <base/log.h>
+#include <net/ethernet.h>
+#include <net/ipv6.h>
+#include <net/mbuf.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+/* these must match runtime/net/ndp.c */
+#define NDP_RETRIES		3
+#define NDP_RETRY_TIME		ONE_SECOND
+
+#define MSG_BUF_LEN	128
+#define MSG_MBUF_LEN	(align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
+
+/* the runtime's neighbor discovery entry points */
+extern void net_rx_ndp(struct mbuf *m, const struct ip6_hdr *ip6hdr,
+		       uint16_t len);
+extern int ndp_lookup(const uint8_t *daddr, struct eth_addr *dhost_out,
+		      struct mbuf *m);
+
+static const uint8_t any_addr6[IP6_ADDR_LEN];
+static uint8_t host_addr6[IP6_ADDR_LEN];
+static atomic_t msgs_outstanding;
+
+static void msg_release(struct mbuf *m)
+{
+	atomic_dec(&msgs_outstanding);
+	sfree(m);
+}
+
+static struct mbuf *msg_alloc(void)
+{
+	struct mbuf *m;
+
+	m = smalloc(MSG_MBUF_LEN + MSG_BUF_LEN);
+	BUG_ON(!m);
+	mbuf_init(m, (unsigned char *)m + MSG_MBUF_LEN, MSG_BUF_LEN, 0);
+	m->release = msg_release;
+	atomic_inc(&msgs_outstanding);
+	return m;
+}
+
+static void msgs_expect_outstanding(int nr)
+{
+	if (atomic_read(&msgs_outstanding) != nr)
+		panic("%d crafted messages outstanding, expected %d",
+		      atomic_read(&msgs_outstanding), nr);
+}
+
+/* a neighbor on our subnet, numbered by @n */
+static void neigh_addr(uint8_t *addr, uint8_t n)
+{
+	memcpy(addr, host_addr6, IP6_ADDR_LEN);
+	addr[14] = host_addr6[14] ^ 0x5a;
+	addr[15] = n;
+}
+
+static struct eth_addr neigh_mac(uint8_t n, uint8_t gen)
+{
+	struct eth_addr eth = {{0x02, 0x00, 0x00, 0x5a, gen, n}};
+	return eth;
+}
+
+/*
+ * Delivers a solicitation (if @type is ND_NEIGHBOR_SOLICIT) or an
+ * advertisement about @target from @saddr, with a link-layer address option
+ * carrying @eth unless it is NULL.
+ */
+static void ndp_deliver(uint8_t type, const uint8_t *saddr,
+			const uint8_t *target, const struct eth_addr *eth,
+			uint8_t hop_limit)
+{
+	struct nd_neighbor_msg *msg;
+	struct nd_opt_lladdr *opt;
+	struct ip6_hdr ip6hdr;
+	struct mbuf *m = msg_alloc();
+
+	msg = mbuf_put_hdr(m, *msg);
+	msg->hdr.type = type;
+	msg->hdr.code = 0;
+	msg->hdr.chksum = 0;
+	msg->flags = type == ND_NEIGHBOR_ADVERT ?
+		     hton32(ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE) : 0;
+	memcpy(msg->target, target, IP6_ADDR_LEN);
+	if (eth) {
+		opt = mbuf_put_hdr(m, *opt);
+		opt->hdr.type = type == ND_NEIGHBOR_SOLICIT ?
+				ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+		opt->hdr.len = 1;
+		opt->addr = *eth;
+	}
+
+	memset(&ip6hdr, 0, sizeof(ip6hdr));
+	ip6hdr.vtc_flow = hton32(IP6_VTC_FLOW(0, 0));
+	ip6hdr.payload_len = hton16(mbuf_length(m));
+	ip6hdr.nexthdr = IPPROTO_ICMPV6;
+	ip6hdr.hop_limit = hop_limit;
+	memcpy(ip6hdr.saddr, saddr, IP6_ADDR_LEN);
+	if (type == ND_NEIGHBOR_SOLICIT)
+		ip6_solicited_node(target, ip6hdr.daddr);
+	else
+		memcpy(ip6hdr.daddr, host_addr6, IP6_ADDR_LEN);
+
+	net_rx_ndp(m, &ip6hdr, mbuf_length(m));
+	msgs_expect_outstanding(0);
+}
+
+/* the neighbor that answers for @target sends an advertisement */
+static void ndp_advertise(const uint8_t *target, struct eth_addr eth,
+			  uint8_t hop_limit)
+{
+	ndp_deliver(ND_NEIGHBOR_ADVERT, target, target, &eth, hop_limit);
+}
+
+static void expect_resolved(const uint8_t *addr, struct eth_addr eth)
+{
+	struct eth_addr dhost;
+	int ret;
+
+	ret = ndp_lookup(addr, &dhost, NULL);
+	if (ret)
+		panic("neighbor wasn't resolved, ret = %d", ret);
+	if (memcmp(&dhost, &eth, sizeof(eth)) != 0)
+		panic("neighbor resolved to the wrong MAC address");
+}
+
+static void expect_unresolved(const uint8_t *addr)
+{
+	struct eth_addr dhost;
+	int ret;
+
+	ret = ndp_lookup(addr, &dhost, NULL);
+	if (ret != -EINPROGRESS)
+		panic("neighbor was resolved, ret = %d", ret);
+}
+
+static void test_advert(void)
+{
+	uint8_t addr[IP6_ADDR_LEN];
+
+	/* a lookup starts probing, and an advertisement resolves it */
+	neigh_addr(addr, 1);
+	expect_unresolved(addr);
+	expect_unresolved(addr);
+	ndp_advertise(addr, neigh_mac(1, 0), IP6_NDP_HOP_LIMIT);
+	expect_resolved(addr, neigh_mac(1, 0));
+
+	/* a later advertisement overrides the address */
+	ndp_advertise(addr, neigh_mac(1, 1), IP6_NDP_HOP_LIMIT);
+	expect_resolved(addr, neigh_mac(1, 1));
+
+	/* advertisements for neighbors we didn't ask about are ignored */
+	neigh_addr(addr, 2);
+	ndp_advertise(addr, neigh_mac(2, 0), IP6_NDP_HOP_LIMIT);
+	expect_unresolved(addr);
+	log_info("neighbor advertisements ok");
+}
+
+static void test_invalid_advert(void)
+{
+	struct eth_addr mcast = {{0x33, 0x33, 0x00, 0x00, 0x00, 0x01}};
+	uint8_t addr[IP6_ADDR_LEN];
+
+	neigh_addr(addr, 3);
+	expect_unresolved(addr);
+
+	/* from off-link (routers decrement the hop limit) */
+	ndp_advertise(addr, neigh_mac(3, 0), 64);
+	expect_unresolved(addr);
+
+	/* with a multicast link-layer address */
+	ndp_advertise(addr, mcast, IP6_NDP_HOP_LIMIT);
+	expect_unresolved(addr);
+
+	/* without a link-layer address */
+	ndp_deliver(ND_NEIGHBOR_ADVERT, addr, addr, NULL, IP6_NDP_HOP_LIMIT);
+	expect_unresolved(addr);
+
+	/* a valid one still works afterward */
+	ndp_advertise(addr, neigh_mac(3, 0), IP6_NDP_HOP_LIMIT);
+	expect_resolved(addr, neigh_mac(3, 0));
+	log_info("invalid neighbor advertisements ignored");
+}
+
+static void test_solicit(void)
+{
+	uint8_t addr[IP6_ADDR_LEN], other[IP6_ADDR_LEN];
+	struct eth_addr eth;
+
+	/* a solicitation for our address teaches us the sender's */
+	neigh_addr(addr, 4);
+	eth = neigh_mac(4, 0);
+	ndp_deliver(ND_NEIGHBOR_SOLICIT, addr, host_addr6, &eth,
+		    IP6_NDP_HOP_LIMIT);
+	expect_resolved(addr, eth);
+
+	/* but not one for another host */
+	neigh_addr(addr, 5);
+	neigh_addr(other, 6);
+	eth = neigh_mac(5, 0);
+	ndp_deliver(ND_NEIGHBOR_SOLICIT, addr, other, &eth, IP6_NDP_HOP_LIMIT);
+	expect_unresolved(addr);
+
+	/* duplicate address detection probes (from ::) are only logged */
+	ndp_deliver(ND_NEIGHBOR_SOLICIT, any_addr6, host_addr6, &eth,
+		    IP6_NDP_HOP_LIMIT);
+	log_info("neighbor solicitations ok");
+}
+
+static void test_unreachable(void)
+{
+	uint8_t addr[IP6_ADDR_LEN];
+	struct eth_addr dhost;
+	struct mbuf *m;
+	int ret;
+
+	/* packets wait for the neighbor to answer */
+	neigh_addr(addr, 7);
+	m = msg_alloc();
+	ret = ndp_lookup(addr, &dhost, m);
+	if (ret != -EINPROGRESS)
+		panic("neighbor was resolved, ret = %d", ret);
+	msgs_expect_outstanding(1);
+
+	/* and are dropped when it never does */
+	timer_sleep((NDP_RETRIES + 3) * NDP_RETRY_TIME);
+	msgs_expect_outstanding(0);
+	log_info("unreachable neighbors dropped");
+}
+
+static void main_handler(void *arg)
+{
+	struct netaddr laddr;
+	udpconn_t *u;
+
+	/* find our own address */
+	BUG_ON(udp_listen(netaddr_ipv6(any_addr6, 0), &u));
+	laddr = udp_local_addr(u);
+	BUG_ON(!netaddr_is_ipv6(&laddr));
+	memcpy(host_addr6, laddr.ip6, IP6_ADDR_LEN);
+	udp_close(u);
+
+	test_advert();
+	test_invalid_advert();
+	test_solicit();
+	test_unreachable();
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * test_runtime_percore_listen.c - tests per-core TCP listen queues
+ *
+ * Each accepter reports the shard it accepted from and the kthread it ran on.
+ * With "enable_directpath" in the config, flows are dialed with
+ * tcp_dial_affinity() and must be accepted from the shard of the kthread they
+ * were steered to. The iokernel datapath doesn't expose flow affinity (flows
+ * go to whichever kthread runs the softirq), so then only exactly-once
+ * delivery is checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/udp.h>
+
+#include "stat_shm.h"
+
+#define TEST_PORT	8600
+#define NR_CONNS	64
+
+struct reply {
+	uint32_t	val;
+	uint32_t	shard;
+	uint32_t	kthread;
+};
+
+static const char *cfg_path;
+static tcpqueue_t *q;
+static atomic_t accepted;
+static waitgroup_t accepters;
+
+static void accepter(void *arg)
+{
+	unsigned int idx = (uintptr_t)arg;
+	struct reply r;
+	tcpconn_t *c;
+	int ret;
+
+	while (true) {
+		ret = tcp_accept_percore(q, idx, &c);
+		if (ret == -EPIPE)
+			break;
+		BUG_ON(ret);
+
+		r.shard = idx;
+		r.kthread = get_current_affinity();
+		BUG_ON(tcp_read(c, &r.val, sizeof(r.val)) != sizeof(r.val));
+		BUG_ON(tcp_write(c, &r, sizeof(r)) != sizeof(r));
+		tcp_close(c);
+		atomic_inc(&accepted);
+	}
+
+	waitgroup_done(&accepters);
+}
+
+static void main_handler(void *arg)
+{
+	struct netaddr laddr;
+	unsigned int i, nr = runtime_max_cores(), nr_local = 0;
+	struct reply r;
+	udpconn_t *u;
+	tcpconn_t *c;
+	uint32_t val;
+	char buf[32];
+	bool steered;
+
+	steered = !cfg_lookup(cfg_path, "enable_directpath", buf, sizeof(buf));
+
+	/* find our own address */
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &u));
+	laddr = udp_local_addr(u);
+	laddr.port = TEST_PORT;
+	udp_close(u);
+
+	BUG_ON(tcp_listen_percore(laddr, NR_CONNS, &q));
+	BUG_ON(tcp_accept_percore(q, nr, &c) != -EINVAL);
+	waitgroup_init(&accepters);
+	waitgroup_add(&accepters, nr);
+	for (i = 0; i < nr; i++)
+		BUG_ON(thread_spawn(accepter, (void *)(uintptr_t)i));
+
+	/*
+	 * Every connection must reach exactly one per-core accepter, the one
+	 * for the kthread its flow is steered to.
+	 */
+	for (i = 0; i < NR_CONNS; i++) {
+		if (steered)
+			BUG_ON(tcp_dial_affinity(i % nr, laddr, &c));
+		else
+			BUG_ON(tcp_dial((struct netaddr){0, 0}, laddr, &c));
+		val = i;
+		BUG_ON(tcp_write(c, &val, sizeof(val)) != sizeof(val));
+		BUG_ON(tcp_read(c, &r, sizeof(r)) != sizeof(r));
+		BUG_ON(r.val != i);
+		if (steered && r.shard != i % nr)
+			panic("flow steered to kthread %d accepted on shard %d",
+			      i % nr, r.shard);
+		if (r.kthread == r.shard)
+			nr_local++;
+		tcp_close(c);
+	}
+	log_info("%d connections accepted by %d per-core accepters (%d on "
+		 "their own kthread)", NR_CONNS, nr, nr_local);
+
+	/* shutting down must wake every accepter */
+	tcp_qshutdown(q);
+	waitgroup_wait(&accepters);
+	BUG_ON(atomic_read(&accepted) != NR_CONNS);
+	tcp_qclose(q);
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	cfg_path = argv[1];
+	ret = runtime_init(cfg_path, main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
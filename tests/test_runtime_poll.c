@@ -0,0 +1,344 @@
+/*
+ * test_runtime_poll.c - tests edge-triggered event polling, on bare triggers
+ * and on loopback TCP and UDP sockets
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/poll.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#define NTRIGGERS	1024
+#define NFIRERS		8
+#define NROUNDS		1000
+
+#define TEST_PORT	8800
+#define EVENT_TIMEOUT	ONE_SECOND
+
+static poll_waiter_t waiter;
+static poll_trigger_t triggers[NTRIGGERS];
+static unsigned int reported[NTRIGGERS];
+static waitgroup_t wg;
+
+/* waits for @events on the socket armed with @data, failing on any other */
+static void expect_events(unsigned long data, unsigned int events)
+{
+	struct poll_event evs[8];
+	unsigned int seen = 0;
+	uint64_t deadline = microtime() + EVENT_TIMEOUT;
+	int i, n;
+
+	while ((seen & events) != events) {
+		n = poll_wait_events(&waiter, evs, ARRAY_SIZE(evs), false);
+		for (i = 0; i < n; i++) {
+			if (evs[i].data != data || (evs[i].events & ~events))
+				panic("unexpected events %x on %ld (expected "
+				      "%x on %ld)", evs[i].events, evs[i].data,
+				      events, data);
+			seen |= evs[i].events;
+		}
+		if (n > 0)
+			continue;
+		if (microtime() > deadline)
+			panic("timed out waiting for events %x on %ld (got %x)",
+			      events, data, seen);
+		timer_sleep(10);
+	}
+}
+
+/* checks that nothing fired, after giving in-flight packets time to land */
+static void expect_no_events(void)
+{
+	struct poll_event ev;
+
+	timer_sleep(10 * ONE_MS);
+	if (poll_wait_events(&waiter, &ev, 1, false) != 0)
+		panic("unexpected events %x on %ld", ev.events, ev.data);
+}
+
+/* finds our own address */
+static struct netaddr local_addr(void)
+{
+	struct netaddr laddr;
+	udpconn_t *u;
+
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &u));
+	laddr = udp_local_addr(u);
+	laddr.port = TEST_PORT;
+	udp_close(u);
+	return laddr;
+}
+
+static void test_edge(void)
+{
+	struct poll_event evs[4];
+	int n;
+
+	poll_trigger_init(&triggers[0]);
+	poll_trigger_init(&triggers[1]);
+	poll_arm_events(&waiter, &triggers[0], POLLEV_ALL, 0);
+	poll_arm_events(&waiter, &triggers[1], POLLEV_IN, 1);
+
+	/* events accumulate on a trigger until it is reported */
+	poll_trigger_events(&triggers[0], POLLEV_IN);
+	poll_trigger_events(&triggers[0], POLLEV_OUT);
+	/* events outside the mask are ignored */
+	poll_trigger_events(&triggers[1], POLLEV_OUT);
+
+	n = poll_wait_events(&waiter, evs, ARRAY_SIZE(evs), false);
+	BUG_ON(n != 1);
+	BUG_ON(evs[0].data != 0);
+	BUG_ON(evs[0].events != (POLLEV_IN | POLLEV_OUT));
+
+	/* nothing new has fired */
+	n = poll_wait_events(&waiter, evs, ARRAY_SIZE(evs), false);
+	BUG_ON(n != 0);
+
+	/* a disarmed trigger never fires */
+	poll_trigger_events(&triggers[1], POLLEV_IN);
+	poll_disarm(&triggers[1]);
+	n = poll_wait_events(&waiter, evs, ARRAY_SIZE(evs), false);
+	BUG_ON(n != 0);
+
+	poll_disarm(&triggers[0]);
+	log_info("edge-triggered semantics ok");
+}
+
+static void fire_once(void *arg)
+{
+	timer_sleep(1000);
+	poll_trigger_events(&triggers[0], POLLEV_IN);
+}
+
+static void test_block(void)
+{
+	struct poll_event ev;
+	uint64_t start;
+	int n;
+
+	poll_trigger_init(&triggers[0]);
+	poll_arm_events(&waiter, &triggers[0], POLLEV_IN, 42);
+	BUG_ON(thread_spawn(fire_once, NULL));
+
+	start = microtime();
+	n = poll_wait_events(&waiter, &ev, 1, true);
+	BUG_ON(n != 1 || ev.data != 42);
+	log_info("blocking wait woke after %ld us", microtime() - start);
+
+	poll_disarm(&triggers[0]);
+}
+
+static void firer(void *arg)
+{
+	long idx = (long)arg;
+	int i, j;
+
+	for (i = 0; i < NROUNDS; i++) {
+		for (j = idx; j < NTRIGGERS; j += NFIRERS)
+			poll_trigger_events(&triggers[j], POLLEV_IN);
+		thread_yield();
+	}
+
+	waitgroup_done(&wg);
+}
+
+static void test_many(void)
+{
+	struct poll_event evs[64];
+	uint64_t start, events = 0, waits = 0;
+	bool done;
+	int i, n;
+
+	for (i = 0; i < NTRIGGERS; i++) {
+		poll_trigger_init(&triggers[i]);
+		poll_arm_events(&waiter, &triggers[i], POLLEV_IN, i);
+	}
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, NFIRERS);
+	start = microtime();
+	for (i = 0; i < NFIRERS; i++)
+		BUG_ON(thread_spawn(firer, (void *)(long)i));
+
+	/* one thread consumes the events of every trigger */
+	while (true) {
+		/* once the firers are done, one more pass collects the rest */
+		done = ACCESS_ONCE(wg.cnt) == 0;
+		n = poll_wait_events(&waiter, evs, ARRAY_SIZE(evs), false);
+		if (n == 0) {
+			if (done)
+				break;
+			thread_yield();
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			BUG_ON(evs[i].data >= NTRIGGERS);
+			BUG_ON(evs[i].events != POLLEV_IN);
+			reported[evs[i].data]++;
+		}
+		events += n;
+		waits++;
+	}
+	waitgroup_wait(&wg);
+
+	log_info("%ld events in %ld batches from %d triggers in %ld us",
+		 events, waits, NTRIGGERS, microtime() - start);
+
+	/*
+	 * Firings coalesce until reported, but every trigger fired in the last
+	 * round, and none can be reported more often than it fired.
+	 */
+	for (i = 0; i < NTRIGGERS; i++) {
+		if (reported[i] < 1 || reported[i] > NROUNDS)
+			panic("trigger %d reported %d times in %d rounds", i,
+			      reported[i], NROUNDS);
+	}
+	BUG_ON(events < NTRIGGERS || events > (uint64_t)NTRIGGERS * NROUNDS);
+
+	for (i = 0; i < NTRIGGERS; i++)
+		poll_disarm(&triggers[i]);
+}
+
+static void test_udp(struct netaddr laddr)
+{
+	udpconn_t *in, *out;
+	char buf[64];
+
+	BUG_ON(udp_listen(laddr, &in));
+	BUG_ON(udp_dial((struct netaddr){0, 0}, laddr, &out));
+	udp_set_nonblocking(in, true);
+
+	/* arming reports the current state: nothing to read, room to write */
+	udp_poll_arm(in, &waiter, POLLEV_IN | POLLEV_HUP, 1);
+	expect_no_events();
+	udp_poll_arm(out, &waiter, POLLEV_OUT, 2);
+	expect_events(2, POLLEV_OUT);
+	BUG_ON(udp_read(in, buf, sizeof(buf)) != -EAGAIN);
+
+	/* a datagram arrives */
+	BUG_ON(udp_write(out, "a", 1) != 1);
+	expect_events(1, POLLEV_IN);
+	BUG_ON(udp_read(in, buf, sizeof(buf)) != 1);
+	BUG_ON(udp_read(in, buf, sizeof(buf)) != -EAGAIN);
+	expect_no_events();
+
+	/* and another, after the last was drained */
+	BUG_ON(udp_write(out, "b", 1) != 1);
+	expect_events(1, POLLEV_IN);
+	BUG_ON(udp_read(in, buf, sizeof(buf)) != 1);
+
+	udp_shutdown(in);
+	expect_events(1, POLLEV_HUP);
+	expect_no_events();
+
+	udp_close(in);
+	udp_close(out);
+	log_info("UDP socket events ok");
+}
+
+static void test_tcp(struct netaddr laddr)
+{
+	static char buf[64 * 1024];
+	tcpqueue_t *q;
+	tcpconn_t *in, *out, *c;
+	ssize_t ret;
+	size_t n;
+
+	BUG_ON(tcp_listen(laddr, 1, &q));
+	tcp_qset_nonblocking(q, true);
+	tcp_qpoll_arm(q, &waiter, POLLEV_IN | POLLEV_HUP, 10);
+	expect_no_events();
+	BUG_ON(tcp_accept(q, &c) != -EAGAIN);
+
+	/* a connection becomes ready to accept */
+	BUG_ON(tcp_dial((struct netaddr){0, 0}, laddr, &out));
+	expect_events(10, POLLEV_IN);
+	BUG_ON(tcp_accept(q, &in));
+	BUG_ON(tcp_accept(q, &c) != -EAGAIN);
+
+	/* an established connection is writable right away */
+	tcp_set_nonblocking(in, true);
+	tcp_set_nonblocking(out, true);
+	tcp_poll_arm(in, &waiter, POLLEV_IN | POLLEV_HUP, 11);
+	expect_no_events();
+	tcp_poll_arm(out, &waiter, POLLEV_OUT, 12);
+	expect_events(12, POLLEV_OUT);
+	BUG_ON(tcp_read(in, buf, sizeof(buf)) != -EAGAIN);
+
+	/* data arrives */
+	BUG_ON(tcp_write(out, "a", 1) != 1);
+	expect_events(11, POLLEV_IN);
+	BUG_ON(tcp_read(in, buf, sizeof(buf)) != 1);
+	BUG_ON(tcp_read(in, buf, sizeof(buf)) != -EAGAIN);
+	expect_no_events();
+
+	/* fill the window, then writable again once the reader drains it */
+	for (n = 0; (ret = tcp_write(out, buf, sizeof(buf))) > 0; n += ret)
+		;
+	BUG_ON(ret != -EAGAIN);
+	tcp_poll_disarm(in);
+	while (n > 0) {
+		ret = tcp_read(in, buf, sizeof(buf));
+		if (ret == -EAGAIN) {
+			timer_sleep(10);
+			continue;
+		}
+		BUG_ON(ret <= 0);
+		n -= ret;
+	}
+	expect_events(12, POLLEV_OUT);
+	tcp_poll_arm(in, &waiter, POLLEV_IN | POLLEV_HUP, 11);
+	expect_no_events();
+
+	/* the peer closes its side */
+	BUG_ON(tcp_shutdown(out, SHUT_WR));
+	expect_events(11, POLLEV_IN | POLLEV_HUP);
+	BUG_ON(tcp_read(in, buf, sizeof(buf)) != 0);
+
+	/* the listener shuts down */
+	tcp_qshutdown(q);
+	expect_events(10, POLLEV_HUP);
+	expect_no_events();
+
+	tcp_close(in);
+	tcp_close(out);
+	tcp_qclose(q);
+	log_info("TCP socket events ok");
+}
+
+static void main_handler(void *arg)
+{
+	poll_init(&waiter);
+	test_edge();
+	test_block();
+	test_many();
+	test_udp(local_addr());
+	test_tcp(local_addr());
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -17,6 +17,11 @@
 #define FIRST_VAL	0x1000000
 #define SECOND_VAL	0x2000000
 
+/* churn benchmark parameters */
+#define CHURN_THREADS	64
+#define CHURN_FREES	100000
+#define SYNC_ITERS	1000
+
 static waitgroup_t release_wg;
 
 struct test_obj {
@@ -33,6 +38,88 @@ static void test_release(struct rcu_head *head)
 	waitgroup_done(&release_wg);
 }
 
+struct churn_obj {
+	uint64_t	free_tsc;
+	struct rcu_head	rcu;
+};
+
+static waitgroup_t churn_release_wg;
+static uint64_t churn_lat_sum;
+static uint64_t churn_lat_max;
+
+static void churn_release(struct rcu_head *head)
+{
+	struct churn_obj *o = container_of(head, struct churn_obj, rcu);
+	uint64_t lat = rdtsc() - o->free_tsc;
+
+	/* callbacks for a kthread run serially, but not across kthreads */
+	__atomic_fetch_add(&churn_lat_sum, lat, __ATOMIC_RELAXED);
+	if (lat > ACCESS_ONCE(churn_lat_max))
+		ACCESS_ONCE(churn_lat_max) = lat;
+	free(o);
+	waitgroup_done(&churn_release_wg);
+}
+
+static void churn_handler(void *arg)
+{
+	struct churn_obj *o;
+	int i;
+
+	for (i = 0; i < CHURN_FREES; i++) {
+		o = malloc(sizeof(*o));
+		BUG_ON(!o);
+		o->free_tsc = rdtsc();
+		rcu_free(&o->rcu, churn_release);
+		if (i % 64 == 0)
+			thread_yield();
+	}
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+static void churn_bench(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us, free_us, release_us, n;
+	int i, ret;
+
+	log_info("testing rcu_free() churn with %d threads...", CHURN_THREADS);
+
+	n = (uint64_t)CHURN_THREADS * CHURN_FREES;
+	waitgroup_init(&churn_release_wg);
+	waitgroup_add(&churn_release_wg, n);
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, CHURN_THREADS);
+
+	start_us = microtime();
+	for (i = 0; i < CHURN_THREADS; i++) {
+		ret = thread_spawn(churn_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+	free_us = microtime() - start_us;
+	waitgroup_wait(&churn_release_wg);
+	release_us = microtime() - start_us;
+
+	log_info("%f frees / second, all released after %ld us",
+		 (double)n / (free_us * 0.000001), release_us);
+	log_info("reclaim latency: mean %f us, max %f us",
+		 (double)churn_lat_sum / n / cycles_per_us,
+		 (double)churn_lat_max / cycles_per_us);
+}
+
+static void sync_bench(const char *name, void (*sync_fn)(void))
+{
+	uint64_t start_us;
+	int i;
+
+	start_us = microtime();
+	for (i = 0; i < SYNC_ITERS; i++)
+		sync_fn();
+	log_info("%s: %f us per call", name,
+		 (double)(microtime() - start_us) / SYNC_ITERS);
+}
+
 static void read_handler(void *arg)
 {
 	bool ptr_swapped = false;
@@ -111,6 +198,30 @@ static void main_handler(void *arg)
 	free(o);
 	waitgroup_wait(&wg);
 	log_info("readers finished.");
+
+	free(o2);
+	o = malloc(sizeof(*o));
+	BUG_ON(!o);
+	o->foo = FIRST_VAL;
+	RCU_INIT_POINTER(test_ptr, o);
+
+	/* test synchronize_rcu_expedited() */
+	log_info("testing synchronize_rcu_expedited()...");
+	spawn_rcu_readers(&wg, NTHREADS);
+	o2 = malloc(sizeof(*o));
+	o2->foo = SECOND_VAL;
+	rcu_assign_pointer(test_ptr, o2);
+	synchronize_rcu_expedited();
+	o->foo = FIRST_VAL;
+	free(o);
+	waitgroup_wait(&wg);
+	log_info("readers finished.");
+	free(o2);
+
+	/* measure grace period costs */
+	churn_bench();
+	sync_bench("synchronize_rcu()", synchronize_rcu);
+	sync_bench("synchronize_rcu_expedited()", synchronize_rcu_expedited);
 }
 
 int main(int argc, char *argv[])
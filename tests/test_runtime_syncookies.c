@@ -0,0 +1,111 @@
+/*
+ * test_runtime_syncookies.c - tests TCP listeners under backlog overflow
+ *
+ * Many clients connect over loopback to a listener with a backlog of one, so
+ * all but the first handshake complete through SYN cookies (set
+ * "tcp_syncookies 2" in the config file to use cookies for every handshake).
+ * The clients send before being accepted, and their retransmissions finish
+ * the handshake once the backlog has room again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#define TEST_PORT	8500
+#define NR_CLIENTS	8
+
+static struct netaddr listen_addr;
+static waitgroup_t wg;
+
+static void client(void *arg)
+{
+	uint32_t id = (uintptr_t)arg, buf;
+	tcpconn_t *c;
+	ssize_t ret;
+
+	ret = tcp_dial((struct netaddr){0, 0}, listen_addr, &c);
+	if (ret)
+		panic("client %d: tcp_dial failed, ret = %ld", id, ret);
+	ret = tcp_write(c, &id, sizeof(id));
+	BUG_ON(ret != sizeof(id));
+	ret = tcp_read(c, &buf, sizeof(buf));
+	if (ret != sizeof(buf) || buf != ~id)
+		panic("client %d: bad echo, ret = %ld", id, ret);
+	tcp_close(c);
+	waitgroup_done(&wg);
+}
+
+static void main_handler(void *arg)
+{
+	bool seen[NR_CLIENTS] = {false};
+	udpconn_t *u;
+	tcpqueue_t *q;
+	tcpconn_t *c;
+	uint32_t id;
+	ssize_t ret;
+	int i;
+
+	/* find our own address */
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &u));
+	listen_addr = udp_local_addr(u);
+	listen_addr.port = TEST_PORT;
+	udp_close(u);
+
+	BUG_ON(tcp_listen(listen_addr, 1, &q));
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, NR_CLIENTS);
+	for (i = 0; i < NR_CLIENTS; i++)
+		BUG_ON(thread_spawn(client, (void *)(uintptr_t)i));
+
+	/* let every handshake overflow the backlog before accepting */
+	timer_sleep(50 * ONE_MS);
+
+	for (i = 0; i < NR_CLIENTS; i++) {
+		BUG_ON(tcp_accept(q, &c));
+		ret = tcp_read(c, &id, sizeof(id));
+		if (ret != sizeof(id) || id >= NR_CLIENTS || seen[id])
+			panic("bad client id, ret = %ld", ret);
+		seen[id] = true;
+		id = ~id;
+		BUG_ON(tcp_write(c, &id, sizeof(id)) != sizeof(id));
+		tcp_close(c);
+	}
+	waitgroup_wait(&wg);
+	log_info("%d connections accepted past a backlog of 1", NR_CLIENTS);
+
+	/* a nonblocking accept on an empty queue must not sleep */
+	tcp_qset_nonblocking(q, true);
+	BUG_ON(tcp_accept(q, &c) != -EAGAIN);
+
+	tcp_qshutdown(q);
+	BUG_ON(tcp_accept(q, &c) != -EPIPE);
+	tcp_qclose(q);
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
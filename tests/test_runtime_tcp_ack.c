@@ -0,0 +1,154 @@
+/*
+ * test_runtime_tcp_ack.c - tests the policy for acknowledging TCP data
+ *
+ * Runs paced request/response exchanges over a loopback connection and counts
+ * the pure ACKs sent (both ends live in this runtime, so both are counted).
+ * With the default policy, responses and the next requests carry the ACKs and
+ * almost none are sent on their own. With quick-ACKs enabled, every request
+ * and response arrives after an idle period and is ACKed immediately.
+ *
+ * Usage: test_runtime_tcp_ack <config> <quick-ACK config>
+ *
+ * Each config runs in its own runtime, one after the other. Both must set
+ * "stat_shm_key" and keep the default "tcp_ack_delay_us". The quick-ACK
+ * config must also set "tcp_quickack_idle_us 1000", and the other must not
+ * set it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#include "stat_shm.h"
+
+#define TEST_PORT	8900
+#define NR_REQS		50
+#define REQ_GAP		(2 * ONE_MS)
+#define ACK_SETTLE	(20 * ONE_MS)
+#define NR_CONFIGS	2
+
+static const char *cfg_path;
+
+static void echo_worker(void *arg)
+{
+	tcpconn_t *c = arg;
+	uint64_t val;
+
+	while (tcp_read(c, &val, sizeof(val)) == sizeof(val)) {
+		if (tcp_write(c, &val, sizeof(val)) != sizeof(val))
+			break;
+	}
+	tcp_close(c);
+}
+
+/* sends paced requests, returning the pure ACKs sent per request */
+static double run_requests(tcpconn_t *c)
+{
+	uint64_t acks, coalesced, val;
+	int i;
+
+	/* settle the handshake and any ACK still held for the last run */
+	timer_sleep(ACK_SETTLE);
+	acks = stat_shm_read("tx_tcp_acks");
+	coalesced = stat_shm_read("tcp_acks_coalesced");
+
+	for (i = 0; i < NR_REQS; i++) {
+		timer_sleep(REQ_GAP);
+		val = i;
+		BUG_ON(tcp_write(c, &val, sizeof(val)) != sizeof(val));
+		BUG_ON(tcp_read(c, &val, sizeof(val)) != sizeof(val));
+		BUG_ON(val != i);
+	}
+
+	acks = stat_shm_read("tx_tcp_acks") - acks;
+	coalesced = stat_shm_read("tcp_acks_coalesced") - coalesced;
+	log_info("%lu ACKs (%lu coalesced) for %d requests", acks, coalesced,
+		 NR_REQS);
+	return (double)acks / NR_REQS;
+}
+
+static void main_handler(void *arg)
+{
+	struct netaddr laddr;
+	tcpqueue_t *q;
+	tcpconn_t *in, *out;
+	udpconn_t *u;
+	double per_req;
+	bool quickack = (long)arg;
+	char val[32];
+
+	if (quickack != (!cfg_lookup(cfg_path, "tcp_quickack_idle_us", val,
+				     sizeof(val)) && strtoul(val, NULL, 0) > 0))
+		panic("only the second config may set tcp_quickack_idle_us");
+	stat_shm_attach(cfg_path);
+
+	/* find our own address */
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &u));
+	laddr = udp_local_addr(u);
+	laddr.port = TEST_PORT;
+	udp_close(u);
+
+	BUG_ON(tcp_listen(laddr, 1, &q));
+	BUG_ON(tcp_dial((struct netaddr){0, 0}, laddr, &out));
+	BUG_ON(tcp_accept(q, &in));
+	BUG_ON(thread_spawn(echo_worker, in));
+
+	per_req = run_requests(out);
+	if (!quickack) {
+		/* the default policy piggybacks ACKs on the data going back */
+		if (per_req > 0.1)
+			panic("%.2f ACKs per request by default, expected ~0",
+			      per_req);
+	} else {
+		/* quick-ACKs acknowledge the request and response separately */
+		if (per_req < 1.9 || per_req > 2.1)
+			panic("%.2f ACKs per request with quick-ACKs, "
+			      "expected 2", per_req);
+	}
+
+	tcp_close(out);
+	tcp_qshutdown(q);
+	tcp_qclose(q);
+	log_info("%s ACK policy passed", quickack ? "quick" : "default");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, pid, ret, status;
+
+	if (argc < 1 + NR_CONFIGS) {
+		printf("args must be the default and quick-ACK config files\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < NR_CONFIGS; i++) {
+		pid = fork();
+		BUG_ON(pid == -1);
+
+		if (pid == 0) {
+			cfg_path = argv[1 + i];
+			ret = runtime_init(cfg_path, main_handler,
+					   (void *)(long)i);
+			BUG_ON(ret < 0);
+			return 0;
+		}
+
+		BUG_ON(waitpid(pid, &status, 0) != pid);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("runtime for %s failed\n", argv[1 + i]);
+			return -EIO;
+		}
+	}
+
+	log_info("all tests passed");
+	return 0;
+}
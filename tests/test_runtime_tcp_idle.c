@@ -0,0 +1,261 @@
+/*
+ * test_runtime_tcp_idle.c - tests keepalive and compaction of idle TCP
+ * connections
+ *
+ * A connection sits idle with unread data, and with the tail of a write held
+ * back for coalescing, for longer than the compaction period (see
+ * "tcp_idle_compact_us"). Compaction must transmit the held tail, and the
+ * unread data must still read back intact. Both ends have keepalive enabled,
+ * and the connection must survive being probed. Then a peer in another runtime
+ * exits without closing its connection, and reads must fail with ETIMEDOUT
+ * once its keepalive probes go unanswered.
+ *
+ * Usage: test_runtime_tcp_idle <config> <peer config>
+ *
+ * The config must set "stat_shm_key", and "tcp_keepalive_idle_us 100000" and
+ * "tcp_keepalive_intvl_us 20000" so that probes are sent while the test
+ * sleeps. The peer config must set a different "host_addr".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/net.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#include "stat_shm.h"
+
+#define TEST_PORT	8700
+#define PEER_PORT	8701
+#define NR_SEGS		64
+#define IDLE_TIME	(1500 * ONE_MS)
+#define SETTLE_TIME	(20 * ONE_MS)
+#define PEER_LINGER	(50 * ONE_MS)
+#define DIAL_TRIES	50
+
+static const char *cfg_path, *peer_cfg_path;
+static unsigned char big_buf[256 * 1024];
+
+static struct netaddr local_addr(uint16_t port)
+{
+	struct netaddr laddr;
+	udpconn_t *u;
+
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &u));
+	laddr = udp_local_addr(u);
+	laddr.port = port;
+	udp_close(u);
+	return laddr;
+}
+
+/* reads until the connection would block, returning the bytes read */
+static size_t drain(tcpconn_t *c)
+{
+	size_t n = 0;
+	ssize_t ret;
+
+	tcp_set_nonblocking(c, true);
+	while ((ret = tcp_read(c, big_buf, sizeof(big_buf))) > 0)
+		n += ret;
+	BUG_ON(ret != -EAGAIN);
+	tcp_set_nonblocking(c, false);
+	return n;
+}
+
+static void test_compaction(void)
+{
+	uint64_t compactions, probes, timeouts, idle_us;
+	struct netaddr laddr = local_addr(TEST_PORT);
+	uint32_t vals[NR_SEGS], val;
+	struct iovec iov;
+	tcpqueue_t *q;
+	tcpconn_t *in, *out;
+	size_t n, written;
+	ssize_t ret;
+	char buf[32];
+	int i;
+
+	if (cfg_lookup(cfg_path, "tcp_keepalive_idle_us", buf, sizeof(buf)))
+		panic("the config file must set tcp_keepalive_idle_us");
+	idle_us = strtoul(buf, NULL, 0);
+	BUG_ON(idle_us == 0 || idle_us > IDLE_TIME / 2);
+
+	compactions = stat_shm_read("tcp_idle_compactions");
+	probes = stat_shm_read("tcp_keepalive_probes");
+	timeouts = stat_shm_read("tcp_keepalive_timeouts");
+
+	BUG_ON(tcp_listen(laddr, 1, &q));
+	BUG_ON(tcp_dial((struct netaddr){0, 0}, laddr, &out));
+	BUG_ON(tcp_accept(q, &in));
+	tcp_set_keepalive(in, true);
+	tcp_set_keepalive(out, true);
+
+	/* queue up many small segments that won't be read for a while */
+	for (i = 0; i < NR_SEGS; i++) {
+		val = i;
+		BUG_ON(tcp_write(out, &val, sizeof(val)) != sizeof(val));
+	}
+
+	/*
+	 * A vectored write cut short by the window keeps its last partial
+	 * segment back (the window is odd, so never a multiple of the MSS).
+	 */
+	iov.iov_base = big_buf;
+	iov.iov_len = sizeof(big_buf);
+	ret = tcp_writev(in, &iov, 1);
+	BUG_ON(ret <= 0 || ret == sizeof(big_buf));
+	written = ret;
+	timer_sleep(SETTLE_TIME);
+	n = drain(out);
+	if (n >= written)
+		panic("no partial segment held back (%zu of %zu bytes)", n,
+		      written);
+
+	/* window updates and keepalives don't keep the connection busy */
+	timer_sleep(IDLE_TIME);
+
+	n += drain(out);
+	if (n != written)
+		panic("held back data not sent by compaction (%zu of %zu bytes)",
+		      n, written);
+	log_info("compaction sent the held back segment");
+
+	for (n = 0; n < sizeof(vals); n += ret) {
+		ret = tcp_read(in, (char *)vals + n, sizeof(vals) - n);
+		BUG_ON(ret <= 0);
+	}
+	for (i = 0; i < NR_SEGS; i++) {
+		if (vals[i] != i)
+			panic("bad data after compaction at %d", i);
+	}
+	log_info("unread data survived idle compaction");
+
+	compactions = stat_shm_read("tcp_idle_compactions") - compactions;
+	probes = stat_shm_read("tcp_keepalive_probes") - probes;
+	timeouts = stat_shm_read("tcp_keepalive_timeouts") - timeouts;
+	log_info("%lu compactions, %lu keepalive probes, %lu timeouts",
+		 compactions, probes, timeouts);
+	if (compactions < 2)
+		panic("expected both ends to be compacted");
+	/* each answered probe resets the idle time of both ends */
+	if (probes < IDLE_TIME / idle_us / 2)
+		panic("expected at least %lu keepalive probes",
+		      IDLE_TIME / idle_us / 2);
+	if (timeouts)
+		panic("keepalive timed out a live connection");
+
+	/* the probed connection must still work both ways */
+	val = ~0;
+	BUG_ON(tcp_write(in, &val, sizeof(val)) != sizeof(val));
+	BUG_ON(tcp_read(out, &val, sizeof(val)) != sizeof(val));
+	BUG_ON(val != ~0);
+
+	tcp_close(in);
+	tcp_close(out);
+	tcp_qshutdown(q);
+	tcp_qclose(q);
+}
+
+static void test_dead_peer(void)
+{
+	struct netaddr raddr;
+	uint64_t timeouts;
+	tcpconn_t *c;
+	ssize_t ret;
+	char buf[32];
+	int i;
+
+	if (cfg_lookup(peer_cfg_path, "host_addr", buf, sizeof(buf)))
+		panic("the peer config file must set host_addr");
+	BUG_ON(str_to_netaddr(buf, &raddr));
+	raddr.port = PEER_PORT;
+
+	timeouts = stat_shm_read("tcp_keepalive_timeouts");
+
+	/* the peer runtime may still be starting up */
+	for (i = 0; i < DIAL_TRIES; i++) {
+		if (!tcp_dial((struct netaddr){0, 0}, raddr, &c))
+			break;
+		timer_sleep(100 * ONE_MS);
+	}
+	if (i == DIAL_TRIES)
+		panic("couldn't connect to the peer");
+	tcp_set_keepalive(c, true);
+
+	buf[0] = 'x';
+	BUG_ON(tcp_write(c, buf, 1) != 1);
+	BUG_ON(tcp_read(c, buf, 1) != 1);
+	BUG_ON(buf[0] != 'x');
+
+	/* the peer exits now, so nothing answers the probes */
+	ret = tcp_read(c, buf, 1);
+	if (ret != -ETIMEDOUT)
+		panic("read from a dead peer returned %ld, expected -ETIMEDOUT",
+		      ret);
+	if (stat_shm_read("tcp_keepalive_timeouts") == timeouts)
+		panic("keepalive timeout not counted");
+	log_info("read from a dead peer timed out");
+
+	tcp_close(c);
+}
+
+static void main_handler(void *arg)
+{
+	stat_shm_attach(cfg_path);
+	test_compaction();
+	test_dead_peer();
+	log_info("all tests passed");
+}
+
+/* echoes one byte, then exits without closing the connection */
+static void peer_handler(void *arg)
+{
+	tcpqueue_t *q;
+	tcpconn_t *c;
+	char val;
+
+	BUG_ON(tcp_listen(local_addr(PEER_PORT), 1, &q));
+	BUG_ON(tcp_accept(q, &c));
+	BUG_ON(tcp_read(c, &val, 1) != 1);
+	BUG_ON(tcp_write(c, &val, 1) != 1);
+
+	/* let the ACKs go out */
+	timer_sleep(PEER_LINGER);
+	log_info("peer exiting");
+}
+
+int main(int argc, char *argv[])
+{
+	int pid, ret;
+
+	if (argc < 3) {
+		printf("args must be config file and peer config file\n");
+		return -EINVAL;
+	}
+	cfg_path = argv[1];
+	peer_cfg_path = argv[2];
+
+	pid = fork();
+	BUG_ON(pid == -1);
+	if (pid == 0) {
+		ret = runtime_init(peer_cfg_path, peer_handler, NULL);
+		BUG_ON(ret < 0);
+		return 0;
+	}
+	sleep(1);
+
+	ret = runtime_init(cfg_path, main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
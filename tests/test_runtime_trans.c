@@ -0,0 +1,174 @@
+/*
+ * test_runtime_trans.c - tests the transport match table and port allocation
+ *
+ * Adds enough connections to make the match table grow, while another thread
+ * keeps looking up the connections added so far, until the resize has been
+ * published (the config must set "stat_shm_key" to count resizes).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#include "stat_shm.h"
+
+#define TEST_PORT	8400
+#define NR_EPHEMERAL	16384
+#define NR_LISTENERS	4
+#define NR_PER_LISTENER	6000
+#define CHECK_STRIDE	97
+#define RESIZE_WAIT	(5 * ONE_SECOND)
+
+static udpconn_t *exhaust[NR_EPHEMERAL];
+static udpconn_t *conns[NR_LISTENERS][NR_PER_LISTENER];
+
+static const char *cfg_path;
+static udpconn_t *in[NR_LISTENERS];
+static atomic_t nr_added;
+static bool checks_done;
+static waitgroup_t checker_wg;
+static long nr_checks;
+
+static void check_pair(udpconn_t *in, udpconn_t *out, uint32_t val)
+{
+	struct netaddr laddr = udp_local_addr(out), raddr;
+	uint32_t buf;
+	ssize_t ret;
+
+	/* out -> listener */
+	ret = udp_write(out, &val, sizeof(val));
+	BUG_ON(ret != sizeof(val));
+	ret = udp_read_from(in, &buf, sizeof(buf), &raddr);
+	BUG_ON(ret != sizeof(buf) || buf != val);
+	BUG_ON(!netaddr_equal(&raddr, &laddr));
+
+	/* listener -> out, which needs a 5-tuple match */
+	ret = udp_write_to(in, &val, sizeof(val), &laddr);
+	BUG_ON(ret != sizeof(val));
+	ret = udp_read(out, &buf, sizeof(buf));
+	BUG_ON(ret != sizeof(buf) || buf != val);
+}
+
+/* looks up the connections added so far until told to stop */
+static void checker(void *arg)
+{
+	int i, n, start = 0;
+
+	while (!load_acquire(&checks_done)) {
+		n = atomic_read(&nr_added);
+		for (i = start; i < n; i += CHECK_STRIDE) {
+			check_pair(in[i % NR_LISTENERS],
+				   conns[i % NR_LISTENERS][i / NR_LISTENERS], i);
+			nr_checks++;
+		}
+		start = (start + 1) % CHECK_STRIDE;
+		thread_yield();
+	}
+
+	waitgroup_done(&checker_wg);
+}
+
+static void main_handler(void *arg)
+{
+	struct netaddr raddr;
+	uint64_t resizes;
+	udpconn_t *c;
+	int i, j, ret;
+
+	stat_shm_attach(cfg_path);
+	resizes = stat_shm_read("trans_tbl_resizes");
+
+	for (i = 0; i < NR_LISTENERS; i++)
+		BUG_ON(udp_listen((struct netaddr){0, TEST_PORT + i}, &in[i]));
+
+	/* use up every ephemeral port towards one destination */
+	raddr = udp_local_addr(in[0]);
+	for (i = 0; i < NR_EPHEMERAL; i++) {
+		ret = udp_dial((struct netaddr){0, 0}, raddr, &exhaust[i]);
+		if (ret)
+			panic("dial %d failed, ret = %d", i, ret);
+	}
+	ret = udp_dial((struct netaddr){0, 0}, raddr, &c);
+	BUG_ON(ret != -EADDRNOTAVAIL);
+	log_info("ephemeral port exhaustion ok");
+
+	/* add enough entries to grow the table while checking lookups */
+	waitgroup_init(&checker_wg);
+	waitgroup_add(&checker_wg, 1);
+	BUG_ON(thread_spawn(checker, NULL));
+	for (i = 0; i < NR_PER_LISTENER; i++) {
+		for (j = 0; j < NR_LISTENERS; j++) {
+			raddr = udp_local_addr(in[j]);
+			BUG_ON(udp_dial((struct netaddr){0, 0}, raddr,
+					&conns[j][i]));
+			atomic_inc(&nr_added);
+		}
+	}
+
+	/* keep checking until the background resize has been published */
+	for (i = 0; i < RESIZE_WAIT / ONE_MS; i++) {
+		if (stat_shm_read("trans_tbl_resizes") != resizes)
+			break;
+		timer_sleep(ONE_MS);
+	}
+	store_release(&checks_done, true);
+	waitgroup_wait(&checker_wg);
+	resizes = stat_shm_read("trans_tbl_resizes") - resizes;
+	log_info("%lu resizes, %ld lookups checked while resizing", resizes,
+		 nr_checks);
+	if (resizes == 0)
+		panic("the match table didn't grow");
+
+	/* then check everything in the grown table */
+	for (i = 0; i < NR_PER_LISTENER; i++) {
+		for (j = 0; j < NR_LISTENERS; j++)
+			check_pair(in[j], conns[j][i], i * NR_LISTENERS + j);
+	}
+	for (i = 0; i < NR_EPHEMERAL; i += 64)
+		check_pair(in[0], exhaust[i], i);
+	log_info("lookups after growing the table ok");
+
+	/* removed entries must free their ports */
+	for (i = 0; i < NR_EPHEMERAL; i++)
+		udp_close(exhaust[i]);
+	raddr = udp_local_addr(in[0]);
+	BUG_ON(udp_dial((struct netaddr){0, 0}, raddr, &c));
+	check_pair(in[0], c, 1);
+	udp_close(c);
+
+	for (i = 0; i < NR_PER_LISTENER; i++) {
+		for (j = 0; j < NR_LISTENERS; j++)
+			udp_close(conns[j][i]);
+	}
+	for (i = 0; i < NR_LISTENERS; i++) {
+		udp_shutdown(in[i]);
+		udp_close(in[i]);
+	}
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	cfg_path = argv[1];
+	ret = runtime_init(cfg_path, main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
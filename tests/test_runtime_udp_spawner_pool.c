@@ -0,0 +1,179 @@
+/*
+ * test_runtime_udp_spawner_pool.c - tests UDP spawners backed by a handler pool
+ *
+ * Datagrams arrive while every handler is blocked: only @max_inflight of them
+ * may be admitted, the rest must be dropped, and no more handlers than the
+ * pool holds may be running (the others wait in the backlog). Then many more
+ * datagrams are handled one after the other, and they must all be handled by
+ * the pool's own threads rather than a new thread each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+
+#define TEST_PORT	9000
+#define WORKERS		1
+#define NR_EXTRA	16
+#define NR_SEQ		256
+#define WAIT_TRIES	1000
+
+static mutex_t lock;
+static condvar_t cv;
+static bool gate_open;
+static int running, handled;
+static thread_t *handlers[NR_SEQ];
+
+static void handler(struct udp_spawn_data *d)
+{
+	mutex_lock(&lock);
+	running++;
+	while (!gate_open)
+		condvar_wait(&cv, &lock);
+	if (handled < NR_SEQ)
+		handlers[handled] = thread_self();
+	handled++;
+	running--;
+	condvar_broadcast(&cv);
+	mutex_unlock(&lock);
+
+	udp_spawn_data_release(d->release_data);
+}
+
+/* waits until @nr datagrams have been accepted or rejected */
+static void wait_arrived(udpspawner_t *s, uint64_t nr,
+			 struct udp_spawner_stats *st)
+{
+	int i;
+
+	for (i = 0; i < WAIT_TRIES; i++) {
+		udp_spawner_get_stats(s, st);
+		if (st->queued + st->dropped >= nr)
+			return;
+		timer_sleep(ONE_MS);
+	}
+	panic("only %lu of %lu datagrams arrived", st->queued + st->dropped,
+	      nr);
+}
+
+/* waits until @nr datagrams have been handled */
+static void wait_handled(int nr)
+{
+	mutex_lock(&lock);
+	while (handled < nr)
+		condvar_wait(&cv, &lock);
+	mutex_unlock(&lock);
+}
+
+static void main_handler(void *arg)
+{
+	int nr_handlers = WORKERS * runtime_max_cores();
+	int max_inflight = nr_handlers + NR_EXTRA;
+	struct udp_spawner_stats st;
+	struct netaddr laddr;
+	udpspawner_t *s;
+	udpconn_t *c;
+	int i, j, nr_threads, nr_running;
+
+	mutex_init(&lock);
+	condvar_init(&cv);
+
+	/* find our own address */
+	BUG_ON(udp_listen((struct netaddr){0, 0}, &c));
+	laddr = udp_local_addr(c);
+	laddr.port = TEST_PORT;
+	udp_close(c);
+
+	BUG_ON(udp_create_spawner_pool(laddr, handler, WORKERS, max_inflight,
+				       NULL, &s));
+	BUG_ON(udp_dial((struct netaddr){0, 0}, laddr, &c));
+
+	/* with every handler blocked, only max_inflight may be admitted */
+	for (i = 0; i < max_inflight + NR_EXTRA; i++)
+		BUG_ON(udp_write(c, &i, sizeof(i)) != sizeof(i));
+	wait_arrived(s, max_inflight + NR_EXTRA, &st);
+	timer_sleep(10 * ONE_MS);
+
+	mutex_lock(&lock);
+	nr_running = running;
+	mutex_unlock(&lock);
+	udp_spawner_get_stats(s, &st);
+	log_info("queued %lu dropped %lu backlog %lu inflight %lu running %d",
+		 st.queued, st.dropped, st.backlog, st.inflight, nr_running);
+	if (st.queued != max_inflight || st.dropped != NR_EXTRA)
+		panic("expected %d datagrams admitted and %d dropped",
+		      max_inflight, NR_EXTRA);
+	if (st.inflight != max_inflight)
+		panic("expected %d datagrams in flight", max_inflight);
+	if (nr_running == 0 || nr_running > nr_handlers)
+		panic("%d handlers running, the pool has %d", nr_running,
+		      nr_handlers);
+	if (st.backlog != max_inflight - nr_running)
+		panic("datagrams not waiting in the backlog");
+
+	mutex_lock(&lock);
+	gate_open = true;
+	condvar_broadcast(&cv);
+	mutex_unlock(&lock);
+	wait_handled(max_inflight);
+	for (i = 0; i < WAIT_TRIES; i++) {
+		udp_spawner_get_stats(s, &st);
+		if (st.inflight == 0)
+			break;
+		timer_sleep(ONE_MS);
+	}
+	if (st.inflight != 0 || st.served != max_inflight)
+		panic("%lu datagrams still in flight", st.inflight);
+	log_info("in-flight datagrams were bounded");
+
+	/* many datagrams in a row must reuse the same few handlers */
+	mutex_lock(&lock);
+	handled = 0;
+	mutex_unlock(&lock);
+	for (i = 0; i < NR_SEQ; i++) {
+		BUG_ON(udp_write(c, &i, sizeof(i)) != sizeof(i));
+		wait_handled(i + 1);
+	}
+
+	nr_threads = 0;
+	for (i = 0; i < NR_SEQ; i++) {
+		for (j = 0; j < i; j++) {
+			if (handlers[j] == handlers[i])
+				break;
+		}
+		if (j == i)
+			nr_threads++;
+	}
+	log_info("%d datagrams handled by %d threads", NR_SEQ, nr_threads);
+	if (nr_threads > nr_handlers)
+		panic("expected at most %d handler threads", nr_handlers);
+
+	udp_close(c);
+	udp_destroy_spawner(s);
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * test_storage_cache.c - tests the storage block cache
+ *
+ * Needs a storage device and the cache enabled, e.g. "storage_mem_mb 256" and
+ * "storage_cache_mb 16" in the config file. Concurrent writers cover more
+ * blocks than fit in the cache, so blocks are evicted and written back, and
+ * everything must read back intact, through the cache and from the device.
+ * Run it with "storage_cache_writeback" set to 0 and to 1.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/atomic.h>
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/storage.h>
+
+#define WORKERS		16
+#define RUN_BLOCKS	8
+
+static uint64_t nr_test_blocks;
+static uint32_t generation;
+
+/* tags every block with its address and the test generation */
+static void fill(unsigned char *buf, uint64_t lba, uint32_t lba_count)
+{
+	uint32_t i;
+
+	for (i = 0; i < lba_count; i++) {
+		memset(buf + i * storage_block_size(), generation,
+		       storage_block_size());
+		*(uint64_t *)(buf + i * storage_block_size()) = lba + i;
+	}
+}
+
+static void check(unsigned char *buf, uint64_t lba, uint32_t lba_count)
+{
+	uint32_t i;
+	unsigned char *blk;
+
+	for (i = 0; i < lba_count; i++) {
+		blk = buf + i * storage_block_size();
+		if (*(uint64_t *)blk != lba + i ||
+		    blk[storage_block_size() - 1] != (unsigned char)generation)
+			panic("bad data in block %lu", lba + i);
+	}
+}
+
+static void write_worker(void *arg)
+{
+	static atomic_t thread_counter;
+	waitgroup_t *wg = arg;
+	unsigned char *buf;
+	uint64_t lba;
+	int tid;
+
+	buf = malloc(RUN_BLOCKS * storage_block_size());
+	BUG_ON(!buf);
+	tid = atomic_fetch_and_add(&thread_counter, 1);
+
+	/* runs from different workers interleave, so write-backs span writers */
+	for (lba = tid * RUN_BLOCKS; lba < nr_test_blocks;
+	     lba += WORKERS * RUN_BLOCKS) {
+		fill(buf, lba, RUN_BLOCKS);
+		BUG_ON(storage_cache_write(buf, lba, RUN_BLOCKS));
+	}
+
+	free(buf);
+	waitgroup_done(wg);
+}
+
+struct race {
+	waitgroup_t	*wg;
+	uint64_t	lba;
+};
+
+static void race_reader(void *arg)
+{
+	struct race *r = arg;
+	unsigned char *buf;
+
+	buf = malloc(storage_block_size());
+	BUG_ON(!buf);
+	BUG_ON(storage_cache_read(buf, r->lba, 1));
+	free(buf);
+	waitgroup_done(r->wg);
+}
+
+static void race_writer(void *arg)
+{
+	struct race *r = arg;
+	unsigned char *buf;
+
+	buf = malloc(storage_block_size());
+	BUG_ON(!buf);
+	fill(buf, r->lba, 1);
+	BUG_ON(storage_cache_write(buf, r->lba, 1));
+	free(buf);
+	waitgroup_done(r->wg);
+}
+
+/* reads each block while it's being written, then checks for the new data */
+static void run_races(void)
+{
+	struct race races[WORKERS];
+	unsigned char *buf;
+	waitgroup_t wg;
+	uint64_t lba;
+	int i;
+
+	buf = malloc(WORKERS * storage_block_size());
+	BUG_ON(!buf);
+
+	for (lba = 0; lba < nr_test_blocks; lba += WORKERS) {
+		waitgroup_init(&wg);
+		waitgroup_add(&wg, 2 * WORKERS);
+		for (i = 0; i < WORKERS; i++) {
+			races[i].wg = &wg;
+			races[i].lba = lba + i;
+			BUG_ON(thread_spawn(race_reader, &races[i]));
+			BUG_ON(thread_spawn(race_writer, &races[i]));
+		}
+		waitgroup_wait(&wg);
+
+		BUG_ON(storage_cache_read(buf, lba, WORKERS));
+		check(buf, lba, WORKERS);
+	}
+
+	free(buf);
+}
+
+static void run_writers(void)
+{
+	waitgroup_t wg;
+	int i;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, WORKERS);
+	for (i = 0; i < WORKERS; i++)
+		BUG_ON(thread_spawn(write_worker, &wg));
+	waitgroup_wait(&wg);
+}
+
+/* reads everything back sequentially, in requests of @lba_count blocks */
+static void scan(int (*read_fn)(void *, uint64_t, uint32_t),
+		 uint32_t lba_count)
+{
+	unsigned char *buf;
+	uint64_t lba;
+
+	buf = malloc(lba_count * storage_block_size());
+	BUG_ON(!buf);
+
+	for (lba = 0; lba < nr_test_blocks; lba += lba_count) {
+		BUG_ON(read_fn(buf, lba, lba_count));
+		check(buf, lba, lba_count);
+	}
+
+	free(buf);
+}
+
+static void main_handler(void *arg)
+{
+	unsigned char *buf;
+
+	/* four times the cache (at most), in whole runs */
+	nr_test_blocks = MIN(storage_num_blocks(), 64 * MB /
+			     storage_block_size());
+	nr_test_blocks -= nr_test_blocks % (WORKERS * RUN_BLOCKS);
+	BUG_ON(nr_test_blocks == 0);
+
+	generation = 1;
+	run_writers();
+	scan(storage_cache_read, RUN_BLOCKS);
+	scan(storage_cache_read, 1);
+	log_info("read back %lu blocks through the cache", nr_test_blocks);
+
+	BUG_ON(storage_cache_flush());
+	scan(storage_read, RUN_BLOCKS);
+	log_info("read back %lu blocks from the device", nr_test_blocks);
+
+	/* overwrite cached blocks, and make sure reads see the new data */
+	generation = 2;
+	run_writers();
+	scan(storage_cache_read, 2 * RUN_BLOCKS);
+	BUG_ON(storage_cache_flush());
+	scan(storage_read, RUN_BLOCKS);
+
+	/* a block written while it's cached is never read stale */
+	buf = malloc(storage_block_size());
+	BUG_ON(!buf);
+	generation = 3;
+	fill(buf, 0, 1);
+	BUG_ON(storage_cache_write(buf, 0, 1));
+	memset(buf, 0, storage_block_size());
+	BUG_ON(storage_cache_read(buf, 0, 1));
+	check(buf, 0, 1);
+	free(buf);
+
+	/* a read that races a write never leaves stale data in the cache */
+	generation = 4;
+	run_races();
+	BUG_ON(storage_cache_flush());
+	scan(storage_read, RUN_BLOCKS);
+	log_info("no stale blocks after racing reads and writes");
+
+	log_info("all tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -1,5 +1,9 @@
 /*
  * test_storage_iops.c - tests write IOPS for storage device using shenango runtime
+ *
+ * Also measures the asynchronous API, keeping QUEUE_DEPTH requests in flight
+ * per worker while writing and then reading back (and checking) each block.
+ * Set "storage_mem_mb" in the config file to run without an NVMe device.
  */
 
 #include <stdio.h>
@@ -17,6 +21,18 @@
 
 #define WORKERS		100
 #define N		100000
+#define IO_BLOCKS	8
+
+#define ASYNC_WORKERS	8
+#define QUEUE_DEPTH	32
+
+/* wraps around smaller devices */
+static uint64_t io_lba(int tid, int i)
+{
+	uint64_t nr_ios = storage_num_blocks() / IO_BLOCKS;
+
+	return IO_BLOCKS * (((uint64_t)tid * N + i) % nr_ios);
+}
 
 static void work_handler(void *arg)
 {
@@ -26,40 +42,149 @@ static void work_handler(void *arg)
 	char *p;
 
 
-	p = malloc(4096);
+	p = malloc(IO_BLOCKS * storage_block_size());
 	BUG_ON(!p);
 
 	tid = atomic_fetch_and_add(&thread_counter, 1);
 
 	for (i = 0; i < N; i++)
-		BUG_ON(storage_write(p, 8 * (tid * N + i), 8));
+		BUG_ON(storage_write(p, io_lba(tid, i), IO_BLOCKS));
 
+	free(p);
 	waitgroup_done(wg_parent);
 }
 
-static void main_handler(void *arg)
+/* tags every block with its address */
+static void io_fill(struct storage_req *req)
+{
+	unsigned char *buf = req->iov->iov_base;
+	uint32_t i;
+
+	for (i = 0; i < req->lba_count; i++)
+		*(uint64_t *)(buf + i * storage_block_size()) = req->lba + i;
+}
+
+static void io_check(struct storage_req *req)
+{
+	unsigned char *buf = req->iov->iov_base;
+	uint32_t i;
+
+	for (i = 0; i < req->lba_count; i++) {
+		if (*(uint64_t *)(buf + i * storage_block_size()) !=
+		    req->lba + i)
+			panic("bad data read back from block %lu",
+			      req->lba + i);
+	}
+}
+
+static void io_prepare(struct storage_req *req, int op, int tid, int i)
+{
+	req->op = op;
+	req->lba = io_lba(tid, i);
+	if (op == STORAGE_OP_WRITE)
+		io_fill(req);
+}
+
+static void async_pass(storage_queue_t *sq, struct storage_req *reqs,
+		       int op, int tid)
+{
+	struct storage_req *batch[QUEUE_DEPTH], *done[QUEUE_DEPTH];
+	int i, n, issued = 0, completed = 0;
+
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		io_prepare(&reqs[i], op, tid, issued++);
+		batch[i] = &reqs[i];
+	}
+	BUG_ON(storage_submit(sq, batch, QUEUE_DEPTH) != QUEUE_DEPTH);
+
+	while (completed < N) {
+		n = storage_wait(sq, done, 1, QUEUE_DEPTH);
+		BUG_ON(n <= 0);
+		completed += n;
+
+		for (i = 0; i < n; i++) {
+			BUG_ON(done[i]->ret);
+			if (op == STORAGE_OP_READ)
+				io_check(done[i]);
+		}
+
+		/* resubmit the completed requests as one batch */
+		n = MIN(n, N - issued);
+		for (i = 0; i < n; i++)
+			io_prepare(done[i], op, tid, issued++);
+		if (n > 0)
+			BUG_ON(storage_submit(sq, done, n) != n);
+	}
+}
+
+static void async_handler(void *arg)
+{
+	static atomic_t thread_counter;
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	struct storage_req reqs[QUEUE_DEPTH];
+	struct iovec iov[QUEUE_DEPTH];
+	size_t io_size = IO_BLOCKS * storage_block_size();
+	storage_queue_t sq;
+	unsigned char *p;
+	int i, tid;
+
+	p = storage_buf_alloc(QUEUE_DEPTH * io_size);
+	BUG_ON(!p);
+
+	tid = atomic_fetch_and_add(&thread_counter, 1);
+	storage_queue_init(&sq);
+
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		iov[i].iov_base = p + i * io_size;
+		iov[i].iov_len = io_size;
+		reqs[i] = (struct storage_req){
+			.lba_count = IO_BLOCKS,
+			.iov = &iov[i],
+			.iovcnt = 1,
+		};
+	}
+
+	async_pass(&sq, reqs, STORAGE_OP_WRITE, tid);
+	async_pass(&sq, reqs, STORAGE_OP_READ, tid);
+	BUG_ON(storage_queue_outstanding(&sq));
+
+	storage_buf_free(p);
+	waitgroup_done(wg_parent);
+}
+
+static double run_workers(thread_fn_t fn, int nr)
 {
 	waitgroup_t wg;
-	double iops;
 	uint64_t start_us;
 	int i, ret;
 
-	log_info("started main_handler() thread");
-
-	BUG_ON(8 * (N + 1) * WORKERS > storage_num_blocks());
-
 	waitgroup_init(&wg);
-	waitgroup_add(&wg, WORKERS);
+	waitgroup_add(&wg, nr);
 	start_us = microtime();
-	for (i = 0; i < WORKERS; i++) {
-		ret = thread_spawn(work_handler, &wg);
+	for (i = 0; i < nr; i++) {
+		ret = thread_spawn(fn, &wg);
 		BUG_ON(ret);
 	}
 
 	waitgroup_wait(&wg);
-	iops = (double)(WORKERS * N) /
-		((microtime() - start_us) * 0.000001);
-	log_info("handled %f IOPS", iops);
+	return (microtime() - start_us) * 0.000001;
+}
+
+static void main_handler(void *arg)
+{
+	double secs;
+
+	log_info("started main_handler() thread");
+
+	BUG_ON(storage_num_blocks() < IO_BLOCKS);
+
+	secs = run_workers(work_handler, WORKERS);
+	log_info("handled %f IOPS", (double)(WORKERS * N) / secs);
+
+	/* every block is written and then read */
+	secs = run_workers(async_handler, ASYNC_WORKERS);
+	log_info("handled %f IOPS (async, queue depth %d per thread)",
+		 (double)(2 * ASYNC_WORKERS * N) / secs, QUEUE_DEPTH);
 }
 
 int main(int argc, char *argv[])